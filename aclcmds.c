@@ -46,13 +46,19 @@
 #include <grp.h>
 #include <ftw.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include "acltool.h"
 #include "range.h"
+#include "gacl_batch.h"
+#include "outbuf.h"
 
 
 static size_t w_c = 0;
 
+/* Raw blob pre-checks (see acl_peek()) */
+static const GACL_BLOB_PRED nontrivial_pred = { GACL_BLOB_P_NONTRIVIAL, 0, NULL };
+
 
 int
 _acl_filter_file(gacl_t ap) {
@@ -60,7 +66,7 @@ _acl_filter_file(gacl_t ap) {
   int i;
   
 
-  for (i = 0; gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
+  for (i = 0; _gacl_get_entry(ap, i, &ae) == 1; i++) {
     gacl_flagset_t fs;
     int fi;
 
@@ -96,6 +102,12 @@ walker_strip(const char *path,
   int tf;
   
 
+  /* Most objects only have trivial ACLs - no need to decode those */
+  if (acl_peek(path, sp, &nontrivial_pred) == GACL_BLOB_FALSE) {
+    acl_stats.skipped++;
+    return 0;
+  }
+  
   rc = get_acl(path, sp, &ap);
   if (rc < 0)
     return error(1, errno, "%s: Getting ACL", path);
@@ -111,6 +123,7 @@ walker_strip(const char *path,
   }
 
   if (tf) {
+    acl_stats.skipped++;
     gacl_free(ap);
     return 0;
   }
@@ -135,18 +148,46 @@ walker_delete(const char *path,
 	      size_t level,
 	      void *vp) {
   int rc;
+  gacl_t ap, ta;
   
-  
-  if (S_ISLNK(sp->st_mode)) {
-    rc = gacl_delete_link_np(path, GACL_TYPE_NFS4);
-    if (errno == ENOTSUP) /* Solaris does not support ACLs on symbolic links */
+
+  /* Nothing to do if the ACL already is what deleting it would leave behind */
+  if (!config.f_force) {
+    rc = get_acl(path, sp, &ap);
+    if (rc < 0)
+      return error(1, errno, "%s: Getting ACL", path);
+    if (rc == 0)
+      return 0;
+
+    ta = _gacl_from_mode(sp->st_mode);
+    if (!ta) {
+      int s_errno = errno;
+      
+      gacl_free(ap);
+      return error(1, s_errno, "%s: Internal Error (_gacl_from_mode)", path);
+    }
+    
+    rc = acl_unchanged(ta, ap, sp);
+    gacl_free(ta);
+    gacl_free(ap);
+    if (rc)
       return 0;
-  } else
-    rc = gacl_delete_file_np(path, GACL_TYPE_NFS4);
+  }
+
+  rc = 0;
+  if (!config.f_noupdate) {
+    if (S_ISLNK(sp->st_mode)) {
+      rc = gacl_delete_link_np(path, GACL_TYPE_NFS4);
+      if (rc < 0 && errno == ENOTSUP) /* Solaris does not support ACLs on symbolic links */
+	return 0;
+    } else
+      rc = gacl_delete_file_np(path, GACL_TYPE_NFS4);
+  }
   
   if (rc < 0)
     return error(1, errno, "%s: Deleting ACL", path);
 
+  acl_stats.writes++;
   if (config.f_verbose)
     printf("%s: ACL Deleted%s\n", path, (config.f_noupdate ? " (NOT)" : ""));
   
@@ -161,22 +202,21 @@ walker_sort(const char *path,
 	    size_t level,
 	    void *vp) {
   int rc;
-  gacl_t ap, na;
+  gacl_t ap;
 
 
+  if (acl_memo_lookup(path, sp) > 0)
+    return 0;
+  
   rc = get_acl(path, sp, &ap);
   if (rc < 0)
     return error(1, errno, "%s: Getting ACL", path);
   if (rc == 0)
     return 0;
   
-  na = gacl_sort(ap);
-  if (!na)
-    return error(1, errno, "%s: Sorting ACL", path);
-
-  rc = set_acl(path, sp, na, ap);
+  /* set_acl() does the sorting (config.f_sort), and compares it exactly */
+  rc = set_acl(path, sp, ap, ap);
 
-  gacl_free(na);
   gacl_free(ap);
 
   if (rc < 0)
@@ -215,9 +255,40 @@ walker_touch(const char *path,
 typedef struct {
   gacl_t da;
   gacl_t fa;
+  ACL_TEMPLATE *dt;
+  ACL_TEMPLATE *ft;
 } DACL;
 
 
+/* Normalize and encode the directory & file ACLs once for the whole walk */
+static int
+_dacl_prepare(DACL *a) {
+  a->dt = acl_template_create(a->da, S_IFDIR);
+  if (!a->dt)
+    return -1;
+  
+  a->ft = acl_template_create(a->fa, S_IFREG);
+  if (!a->ft) {
+    acl_template_free(a->dt);
+    a->dt = NULL;
+    return -1;
+  }
+  
+  return 0;
+}
+
+
+static void
+_dacl_free(DACL *a) {
+  if (a->da)
+    gacl_free(a->da);
+  if (a->fa)
+    gacl_free(a->fa);
+  acl_template_free(a->dt);
+  acl_template_free(a->ft);
+}
+
+
 static int
 walker_set(const char *path,
 	   const struct stat *sp,
@@ -226,12 +297,25 @@ walker_set(const char *path,
 	   void *vp) {
   int rc;
   DACL *a = (DACL *) vp;
+  gacl_t oap = NULL;
 
   
+  /* Fetch the current ACL so set_acl() can skip no-op writes */
+  if (!config.f_force) {
+    rc = get_acl(path, sp, &oap);
+    if (rc < 0)
+      return error(1, errno, "%s: Getting ACL", path);
+    if (rc == 0)
+      return 0;
+  }
+  
   if (S_ISDIR(sp->st_mode))
-    rc = set_acl(path, sp, a->da, NULL);
+    rc = set_acl_template(path, sp, a->dt, oap);
   else
-    rc = set_acl(path, sp, a->fa, NULL);
+    rc = set_acl_template(path, sp, a->ft, oap);
+
+  if (oap)
+    gacl_free(oap);
   
   if (rc < 0)
     return 1;
@@ -242,6 +326,12 @@ walker_set(const char *path,
 
 
 
+typedef struct {
+  gacl_t map;
+  GACL_BATCH batch;
+  GACL_BLOB_PRED pred;
+} FINDCTX;
+
 /* XXX: Change to use ACECR */
 static int
 walker_find(const char *path,
@@ -249,41 +339,165 @@ walker_find(const char *path,
 	    size_t base,
 	    size_t level,
 	    void *vp) {
-  gacl_t ap, map = (gacl_t) vp;
-  int i, j, rc;
-  gacl_entry_t ae, mae;
+  FINDCTX *fc = (FINDCTX *) vp;
+  gacl_t ap;
+  int rc;
 
 
+  switch (acl_peek(path, sp, &fc->pred)) {
+  case GACL_BLOB_FALSE:
+    return 0;
+
+  case GACL_BLOB_TRUE:
+    if (config.f_verbose)
+      break;
+    acl_peek_clear();
+    puts(path);
+    w_c++;
+    return 0;
+  }
+  
   rc = get_acl(path, sp, &ap);
   if (rc < 0)
     return error(1, errno, "%s: Getting ACL", path);
   if (rc == 0)
     return 0;
 
-  for (i = 0; gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
-    for (j = 0; gacl_get_entry(map, j == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &mae) == 1; j++) {
-      int rc;
-      
-      rc = gacl_entry_match(ae, mae);
-      if (rc < 0)
-	return -1;
+  gacl_batch_clear(&fc->batch);
+  if (gacl_batch_add(&fc->batch, ap) < 0) {
+    gacl_free(ap);
+    return -1;
+  }
 
-      if (rc > 0) {
-	/* Found a match */
-	if (config.f_verbose)
-	  print_acl(stdout, ap, path, sp, 0);
-	else
-	  puts(path);
-	
-	w_c++;
-	return 0;
-      }
-    }
+  if (gacl_batch_match_any(&fc->batch, fc->map, 0)) {
+    /* Found a match */
+    if (config.f_verbose)
+      print_acl(stdout, ap, path, sp, 0);
+    else
+      puts(path);
+    
+    w_c++;
   }
 
+  gacl_free(ap);
   return 0;
 }
 
+static int list_nontrivial = 0;
+static int list_delta = 0;
+
+
+/*
+ * --delta: one slot per tree level for the last directory seen there - the
+ * ACLs its children would inherit and the ACL of the child seen last.
+ */
+typedef struct delta_dir {
+  char *path;
+  gacl_t da;     /* Inherited by subdirectories */
+  gacl_t fa;     /* Inherited by other objects */
+  gacl_t prev;   /* Previous sibling */
+} DELTA_DIR;
+
+static DELTA_DIR *delta_v = NULL;
+static size_t delta_size = 0;
+
+
+static void
+_delta_dir_clear(DELTA_DIR *dp) {
+  free(dp->path);
+  if (dp->da)
+    gacl_free(dp->da);
+  if (dp->fa)
+    gacl_free(dp->fa);
+  if (dp->prev)
+    gacl_free(dp->prev);
+  memset(dp, 0, sizeof(*dp));
+}
+
+static void
+_delta_free(void) {
+  size_t i;
+
+  for (i = 0; i < delta_size; i++)
+    _delta_dir_clear(&delta_v[i]);
+  free(delta_v);
+  delta_v = NULL;
+  delta_size = 0;
+}
+
+
+/* Is 'path' directly below the directory in 'dp'? */
+static int
+_delta_is_child(DELTA_DIR *dp,
+		const char *path) {
+  size_t len;
+
+  if (!dp->path)
+    return 0;
+  len = strlen(dp->path);
+  return strncmp(path, dp->path, len) == 0 && path[len] == '/' && !strchr(path+len+1, '/');
+}
+
+
+/*
+ * Returns 1 if the object's ACL should be listed - at the top, and below that
+ * when it neither is what it would have inherited from its parent nor the
+ * same as the previous sibling's (canonically compared, see gacl_equiv_np()).
+ */
+static int
+_delta_check(const char *path,
+	     const struct stat *sp,
+	     size_t level,
+	     gacl_t ap) {
+  DELTA_DIR *pp = NULL;
+  int show = 1, eflags = S_ISDIR(sp->st_mode) ? 0 : GACL_EQUIV_F_NODIR;
+
+  
+  if (level >= delta_size) {
+    size_t nsize = level + 16;
+    DELTA_DIR *nv = realloc(delta_v, nsize * sizeof(nv[0]));
+
+    if (!nv)
+      return -1;
+    memset(nv + delta_size, 0, (nsize - delta_size) * sizeof(nv[0]));
+    delta_v = nv;
+    delta_size = nsize;
+  }
+  
+  if (level > 0 && _delta_is_child(&delta_v[level-1], path))
+    pp = &delta_v[level-1];
+
+  if (pp && ap) {
+    gacl_t ia = S_ISDIR(sp->st_mode) ? pp->da : pp->fa;
+    
+    if ((ia && gacl_equiv_np(ap, ia, eflags) == 1) ||
+	(pp->prev && gacl_equiv_np(ap, pp->prev, eflags) == 1))
+      show = 0;
+  }
+
+  if (pp) {
+    if (pp->prev)
+      gacl_free(pp->prev);
+    pp->prev = ap ? gacl_dup(ap) : NULL;
+  }
+
+  if (S_ISDIR(sp->st_mode)) {
+    DELTA_DIR *dp = &delta_v[level];
+
+    _delta_dir_clear(dp);
+    dp->path = strdup(path);
+    if (!dp->path)
+      return -1;
+    if (ap) {
+      dp->da = gacl_inherit_np(ap, 1);
+      dp->fa = gacl_inherit_np(ap, 0);
+    }
+  }
+
+  return show;
+}
+
+
 static int
 walker_print(const char *path,
 	     const struct stat *sp,
@@ -298,10 +512,32 @@ walker_print(const char *path,
   
   fp = stdout;
 
+  if (list_nontrivial && acl_peek(path, sp, &nontrivial_pred) == GACL_BLOB_FALSE)
+    return 0;
+  
   rc = get_acl(path, sp, &ap);
+  if (rc >= 0 && list_nontrivial) {
+    int tf = 0;
+
+    /* The pre-check can't tell for objects without raw ACLs */
+    if (rc == 0 || (gacl_is_trivial_np(ap, &tf) == 0 && tf)) {
+      if (ap)
+	gacl_free(ap);
+      return 0;
+    }
+  }
   if (rc < 0)
     return error(1, errno, "%s: Getting ACL", path);
 
+  if (list_delta) {
+    rc = _delta_check(path, sp, level, ap);
+    if (rc <= 0) {
+      if (ap)
+	gacl_free(ap);
+      return rc < 0 ? error(1, errno, "%s: Comparing ACL", path) : 0;
+    }
+  }
+  
   ++*np;
   print_acl(fp, ap, path, sp, np ? *np : 0);
 
@@ -315,11 +551,49 @@ walker_print(const char *path,
 
 
 
+static int
+listopt_handler(const char *name,
+		const char *vs,
+		unsigned int type,
+		const void *svp,
+		void *dvp,
+		const char *a0) {
+  if (strcmp(name, "delta") == 0)
+    list_delta = 1;
+  else
+    list_nontrivial = 1;
+  return 0;
+}
+
+static OPTION list_options[] =
+  {
+   { "nontrivial", 'T', OPTS_TYPE_NONE, listopt_handler, NULL, "Only list non-trivial ACLs" },
+   { "delta",      'c', OPTS_TYPE_NONE, listopt_handler, NULL, "Only list ACLs that differ from the inherited or previous one" },
+   { NULL,         0,   0,              NULL,            NULL, NULL },
+  };
+
+
 int
 list_cmd(int argc,
 	    char **argv) {
-  int n = 0;
-  return aclcmd_foreach(argc-1, argv+1, walker_print, &n);
+  int n = 0, rc;
+
+  _delta_free();
+  
+  /* Only print_acl() writes to stdout here, so it may be batched */
+  if (config.f_async)
+    outbuf_mode(stdout, OUTBUF_ASYNC);
+  else if (config.output || !isatty(fileno(stdout)))
+    outbuf_mode(stdout, OUTBUF_BATCH);
+  
+  rc = aclcmd_foreach(argc-1, argv+1, walker_print, &n);
+  list_nontrivial = 0;
+  list_delta = 0;
+  _delta_free();
+
+  if (outbuf_mode(stdout, OUTBUF_SYNC) < 0 && rc == 0)
+    return error(1, errno, "Writing output");
+  return rc;
 }
 
 int
@@ -408,17 +682,32 @@ copy_cmd(int argc,
  
   _acl_filter_file(a.fa);
 
+  a.dt = a.ft = NULL;
+  if (_dacl_prepare(&a) < 0) {
+    int ec = errno;
+
+    _dacl_free(&a);
+    return error(1, ec, "%s: Normalizing ACL", argv[1]);
+  }
+  
   rc = aclcmd_foreach(argc-2, argv+2, walker_set, (void *) &a);
   
-  gacl_free(a.da);
-  gacl_free(a.fa);
+  _dacl_free(&a);
   return rc;
 }
 
 int
 sort_cmd(int argc,
 	 char **argv) {
-  return aclcmd_foreach(argc-1, argv+1, walker_sort, NULL);
+  int rc;
+
+  
+  config.f_sort = 1;
+  acl_memo_begin("sort-access");
+  rc = aclcmd_foreach(argc-1, argv+1, walker_sort, NULL);
+  acl_memo_end();
+  
+  return rc;
 }
 
 int
@@ -465,10 +754,17 @@ set_cmd(int argc,
   
   _acl_filter_file(a.fa);
 
+  a.dt = a.ft = NULL;
+  if (_dacl_prepare(&a) < 0) {
+    int ec = errno;
+
+    _dacl_free(&a);
+    return error(1, ec, "%s: Invalid ACL", argv[1]);
+  }
+
   rc = aclcmd_foreach(argc-2, argv+2, walker_set, (void *) &a);
 
-  gacl_free(a.da);
-  gacl_free(a.fa);
+  _dacl_free(&a);
 
   return rc;
 }
@@ -485,6 +781,9 @@ typedef struct {
   } v[MAXRENAMELIST];
 } RENAMELIST;
 
+/* The renames as a raw blob patch program */
+static GACL_BLOB_PATCH rename_patch;
+
 static int
 walker_rename(const char *path,
 	      const struct stat *sp,
@@ -493,18 +792,24 @@ walker_rename(const char *path,
 	      void *vp) {
   int rc, i, j;
   RENAMELIST *r = (RENAMELIST *) vp;
-  gacl_t ap;
+  gacl_t ap, oap = NULL;
   gacl_entry_t ae;
   int f_updated = 0;
 
   
+  if (acl_memo_lookup(path, sp) > 0)
+    return 0;
+
+  if (rename_patch.n > 0 && set_acl_patched(path, sp, &rename_patch) >= 0)
+    return 0;
+  
   rc = get_acl(path, sp, &ap);
   if (rc < 0)
     return error(1, errno, "%s: Getting ACL", path);
   if (rc == 0)
     return 0;
 
-  for (i = 0; gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
+  for (i = 0; _gacl_get_entry(ap, i, &ae) == 1; i++) {
     gacl_tag_t tt;
     uid_t *oip = NULL;
     
@@ -514,6 +819,9 @@ walker_rename(const char *path,
     
     for (j = 0; j < r->c; j++) {
       if (tt == r->v[j].type && oip && *oip == r->v[j].old) {
+	/* Keep the original around for the no-op check in set_acl() */
+	if (!oap && !(oap = gacl_dup(ap)))
+	  return error(1, errno, "%s: Internal Error (gacl_dup)", path);
 	gacl_free(oip);
 	gacl_set_qualifier(ae, &r->v[j].new);
 	oip = gacl_get_qualifier(ae);
@@ -526,11 +834,17 @@ walker_rename(const char *path,
   }
   
   if (f_updated) {
-    rc = set_acl(path, sp, ap, NULL);
+    rc = set_acl(path, sp, ap, oap);
     if (rc < 0)
       return error(1, errno, "%s: Setting ACL", path);
+  } else {
+    acl_memo_unchanged(path);
+    acl_stats.skipped++;
   }
   
+  if (oap)
+    gacl_free(oap);
+  gacl_free(ap);
   return 0;
 }
 
@@ -539,11 +853,13 @@ int
 str2renamelist(char *str,
 	       RENAMELIST *r) {
   char *s1, *s2;
-  struct passwd *p_old, *p_new;
-  struct group *g_old, *g_new;
+  int u_old, g_old, u_new, g_new;
+  uid_t uid_old, uid_new;
+  gid_t gid_old, gid_new;
   
   r->c = 0;
 
+  /* Names go through the id cache (and --identity-map) like everywhere else */
   str = strtok(str, ",");
   while (str) {
     s1 = s2 = NULL;
@@ -559,16 +875,20 @@ str2renamelist(char *str,
       if (strcmp(str, "g") == 0 ||
 	  strcmp(str, "group") == 0) {
 	
-	g_old = getgrnam(s1);
+	g_old = gacl_name_to_gid_np(s1, &gid_old);
+	if (g_old < 0)
+	  return -1;
 	if (g_old)
-	  r->v[r->c].old = g_old->gr_gid;
+	  r->v[r->c].old = gid_old;
 	else if (sscanf(s1, "%d", &r->v[r->c].old) != 1)
 	  return -1;
 	
-	g_new = getgrnam(s2);
+	g_new = gacl_name_to_gid_np(s2, &gid_new);
+	if (g_new < 0)
+	  return -1;
 	if (g_new)
-	  r->v[r->c].new = g_new->gr_gid;
-	else if (sscanf(s1, "%d", &r->v[r->c].new) != 1)
+	  r->v[r->c].new = gid_new;
+	else if (sscanf(s2, "%d", &r->v[r->c].new) != 1)
 	  return -1;
 	
 	r->v[r->c++].type = GACL_TAG_TYPE_GROUP;
@@ -576,16 +896,20 @@ str2renamelist(char *str,
       } else if (strcmp(str, "u") == 0 ||
 		 strcmp(str, "user") == 0) {
 	
-	p_old = getpwnam(s1);
-	if (p_old)
-	  r->v[r->c].old = p_old->pw_uid;
+	u_old = gacl_name_to_uid_np(s1, &uid_old);
+	if (u_old < 0)
+	  return -1;
+	if (u_old)
+	  r->v[r->c].old = uid_old;
 	else if (sscanf(s1, "%d", &r->v[r->c].old) != 1)
 	  return -1;
 	
-        p_new = getpwnam(s2);
-	if (!p_new)
-	  r->v[r->c].new = p_new->pw_uid;
-	else if (sscanf(s1, "%d", &r->v[r->c].new) != 1)
+	u_new = gacl_name_to_uid_np(s2, &uid_new);
+	if (u_new < 0)
+	  return -1;
+	if (u_new)
+	  r->v[r->c].new = uid_new;
+	else if (sscanf(s2, "%d", &r->v[r->c].new) != 1)
 	  return -1;
 	
 	r->v[r->c++].type = GACL_TAG_TYPE_USER;
@@ -595,35 +919,35 @@ str2renamelist(char *str,
       s1 = str;
       uid_t id;
       
-      p_old = getpwnam(s1);
-      g_old = getgrnam(s1);
-      if (p_old && g_old)
+      u_old = gacl_name_to_uid_np(s1, &uid_old);
+      g_old = gacl_name_to_gid_np(s1, &gid_old);
+      if (u_old < 0 || g_old < 0 || (u_old && g_old))
 	return -1;
-      if (!p_old && !g_old) {
+      if (!u_old && !g_old) {
 	if (sscanf(s1, "%d", &id) == 1)
 	  r->v[r->c].old = id;
 	else
 	  return -1;
       } else
-	r->v[r->c].old = (p_old ? p_old->pw_uid : g_old->gr_gid);
+	r->v[r->c].old = (u_old ? uid_old : gid_old);
       
-      p_new = getpwnam(s2);
-      g_new = getgrnam(s2);
-      if (p_new && g_new)
+      u_new = gacl_name_to_uid_np(s2, &uid_new);
+      g_new = gacl_name_to_gid_np(s2, &gid_new);
+      if (u_new < 0 || g_new < 0 || (u_new && g_new))
 	return -1;
-      if (!p_new && !g_new) {
-	if ((p_old || g_old) && sscanf(s2, "%d", &id) == 1)
+      if (!u_new && !g_new) {
+	if ((u_old || g_old) && sscanf(s2, "%d", &id) == 1)
 	  r->v[r->c].new = id;
 	else
 	  return -1;
-      } else
-      
-      if ((p_old && g_new) || (g_old && p_new))
-	return -1;
+      } else {
+	if ((u_old && g_new) || (g_old && u_new))
+	  return -1;
       
-      r->v[r->c].new = (p_new ? p_new->pw_uid : g_new->gr_gid);
+	r->v[r->c].new = (u_new ? uid_new : gid_new);
+      }
       
-      r->v[r->c++].type = p_old ? GACL_TAG_TYPE_USER : GACL_TAG_TYPE_GROUP;
+      r->v[r->c++].type = u_old ? GACL_TAG_TYPE_USER : GACL_TAG_TYPE_GROUP;
     }
     
     str = strtok(NULL, ",");
@@ -635,18 +959,40 @@ str2renamelist(char *str,
 int
 rename_cmd(int argc,
 	   char **argv) {
-  int rc;
+  int rc, i;
   RENAMELIST r;
 
   
   if (argc < 2)
     return error(1, 0, "Missing required arguments (<acl> <path>)");
   
+  memset(&r, 0, sizeof(r));
   if (str2renamelist(argv[1], &r) < 0)
     return error(1, 0, "%s: Invalid renamelist", argv[1]);
 
+  acl_memo_begin("rename-access");
+  acl_memo_add(&r.v[0], r.c * sizeof(r.v[0]));
+  
+  /* A forced write of an unchanged ACL needs the normal path */
+  gacl_blob_patch_init(&rename_patch);
+  for (i = 0; !config.f_force && i < r.c; i++) {
+    GACL_BLOB_OP op;
+
+    memset(&op, 0, sizeof(op));
+    op.op = GACL_BLOB_OP_RENAME;
+    op.tag = r.v[i].type;
+    op.id = r.v[i].old;
+    op.new_id = r.v[i].new;
+    if (gacl_blob_patch_add(&rename_patch, &op) < 0) {
+      gacl_blob_patch_free(&rename_patch);
+      break;
+    }
+  }
+  
   rc = aclcmd_foreach(argc-2, argv+2, walker_rename, (void *) &r);
+  acl_memo_end();
 
+  gacl_blob_patch_free(&rename_patch);
   return rc;
 }
 
@@ -654,145 +1000,29 @@ rename_cmd(int argc,
 int
 find_cmd(int argc,
 	 char **argv) {
-  gacl_t ap;
+  FINDCTX fc;
+  int rc;
 
 
   if (argc < 2)
     return error(1, 0, "Missing required arguments (<acl> <path>)");
 
-  ap = gacl_from_text(argv[1]);
-
-  return aclcmd_foreach(argc-2, argv+2, walker_find, (void *) ap);
-}
-
-
-
-
-static int
-walker_inherit(const char *path,
-	   const struct stat *sp,
-	   size_t base,
-	   size_t level,
-	   void *vp) {
-  DACL *a = (DACL *) vp;
-  gacl_t ap = NULL;
-
-
-  if (!a) {
-    errno = EINVAL;
-    return -1;
-  }
+  fc.map = gacl_from_text(argv[1]);
+  if (!fc.map)
+    return error(1, errno, "%s: Invalid ACL", argv[1]);
   
-  if (!a->da) {
-    gacl_entry_t ep;
-    int p, rc;
-    
-    rc = get_acl(path, sp, &ap);
-    if (rc < 0)
-      return error(1, errno, "%s: Getting ACL", path);
-    if (rc == 0)
-      return 0;
-
-    a->da = gacl_dup(ap);
-    if (!a->da)
-      goto Fail;
-    
-    for (p = GACL_FIRST_ENTRY; gacl_get_entry(a->da, p, &ep) == 1; p = GACL_NEXT_ENTRY) {
-      gacl_flagset_t fs;
-
-      if (gacl_get_flagset_np(ep, &fs) < 0)
-	goto Fail;
-
-      if (S_ISDIR(sp->st_mode)) {
-	gacl_add_flag_np(fs, GACL_FLAG_FILE_INHERIT);
-	gacl_add_flag_np(fs, GACL_FLAG_DIRECTORY_INHERIT);
-      }
-      gacl_delete_flag_np(fs, GACL_FLAG_NO_PROPAGATE_INHERIT);
-      
-      if (gacl_set_flagset_np(ep, fs) < 0)
-	goto Fail;
-    }
-
-    /* Update the ACL with FILE & DIR INHERIT (if a directory) */
-    if (set_acl(path, sp, a->da, ap) < 0)
-      return error(1, errno, "%s: Setting ACL", path);
-    
-    for (p = GACL_FIRST_ENTRY; gacl_get_entry(a->da, p, &ep) == 1; p = GACL_NEXT_ENTRY) {
-      gacl_flagset_t fs;
-
-      if (gacl_get_flagset_np(ep, &fs) < 0)
-	goto Fail;
-
-      gacl_delete_flag_np(fs, GACL_FLAG_INHERIT_ONLY);
-      gacl_add_flag_np(fs, GACL_FLAG_INHERITED);
-      
-      if (gacl_set_flagset_np(ep, fs) < 0)
-	goto Fail;
-    }
-
-    a->fa = gacl_dup(a->da);
-    if (!a->fa)
-      goto Fail;
-    
-    if (_acl_filter_file(a->fa) < 0)
-      goto Fail;
-    
-    return 0;
-  } else {
-    int rc;
-    gacl_t oap;
-    
-    rc = get_acl(path, sp, &oap);
-    if (rc < 0)
-      return error(1, errno, "%s: Getting ACL", path);
-    if (rc == 0)
-      return 0;
-    
-    if (S_ISDIR(sp->st_mode))
-      rc = set_acl(path, sp, a->da, oap);
-    else
-      rc = set_acl(path, sp, a->fa, oap);
-    if (rc < 0)
-      return error(1, errno, "%s: Setting ACL", path);
-    
-    gacl_free(oap);
-    return 0;
+  if (gacl_blob_pred_init(&fc.pred, GACL_BLOB_P_MATCH, fc.map) < 0) {
+    gacl_free(fc.map);
+    return error(1, errno, "%s: Compiling ACL", argv[1]);
   }
-
-  return 0;
   
- Fail:
-  if (a && a->da)
-    gacl_free(a->da);
-  if (ap)
-    gacl_free(ap);
-  return -1;
-}
-
-
-int
-inherit_cmd(int argc,
-	    char **argv) {
-  int i, rc = 0;
-
+  gacl_batch_init(&fc.batch);
   
-  w_c = 0;
-
-  for (i = 1; i < argc; i++) {
-    DACL a;
-    
-    a.da = NULL;
-    a.fa = NULL;
-
-    rc = ft_foreach(argv[i], walker_inherit, (void *) &a,
-		    config.f_recurse ? -1 : config.max_depth, config.f_filetype);
-    
-    if (a.da)
-      gacl_free(a.da);
-    if (a.fa)
-      gacl_free(a.fa);
-  }
+  rc = aclcmd_foreach(argc-2, argv+2, walker_find, (void *) &fc);
 
+  gacl_batch_free(&fc.batch);
+  gacl_blob_pred_free(&fc.pred);
+  gacl_free(fc.map);
   return rc;
 }
 
@@ -815,10 +1045,19 @@ check_cmd(int argc,
 }
 
 extern COMMAND edit_command;
+extern COMMAND bench_command;
+extern COMMAND identity_snapshot_command;
+extern COMMAND inventory_command;
+extern COMMAND dump_command;
+extern COMMAND restore_command;
+extern COMMAND index_command;
+extern COMMAND query_command;
+extern COMMAND access_command;
+extern COMMAND inherit_command;
 
 
 COMMAND list_command =
-  { "list-access", 	list_cmd,	NULL, "<path>+",		"List ACL(s)" };
+  { "list-access", 	list_cmd,	list_options, "<path>+",	"List ACL(s)" };
 
 COMMAND set_command =
   { "set-access",  	set_cmd,	NULL, "<acl> <path>+",		"Set ACL(s)" };
@@ -850,8 +1089,6 @@ COMMAND find_command =
 COMMAND rename_command =
   { "rename-access",    rename_cmd,     NULL, "<change> <path>+", 	"Rename ACL entries" };
 
-COMMAND inherit_command =
-  { "inherit-access",   inherit_cmd,	NULL, "<path>+",		"Propage ACL(s) inheritance" };
 
 
 COMMAND *acl_commands[] =
@@ -870,5 +1107,13 @@ COMMAND *acl_commands[] =
    &find_command,
    &rename_command,
    &inherit_command,
+   &inventory_command,
+   &dump_command,
+   &restore_command,
+   &index_command,
+   &query_command,
+   &access_command,
+   &bench_command,
+   &identity_snapshot_command,
    NULL,
   };
@@ -57,6 +57,8 @@
 #endif
 
 #include "acltool.h"
+#include "idcache.h"
+#include "outbuf.h"
 
 #if HAVE_LIBSMBCLIENT
 #include "smb.h"
@@ -272,6 +274,76 @@ set_no_update(const char *name,
   return 0;
 }
 
+int
+set_validate_only(const char *name,
+		  const char *value,
+		  unsigned int type,
+		  const void *svp,
+		  void *dvp,
+		  const char *a0) {
+  config.f_validate = 1;
+  config.f_noupdate = 1;
+  return 0;
+}
+
+int
+set_identity_map(const char *name,
+		 const char *value,
+		 unsigned int type,
+		 const void *svp,
+		 void *dvp,
+		 const char *a0) {
+  if (idcache_map_load(value) < 0) {
+    fprintf(stderr, "%s: Error: %s: Loading identity map: %s\n", argv0, value, strerror(errno));
+    return -1;
+  }
+  
+  return 0;
+}
+
+/* Set while a command runs - a per-command --output takes effect at once */
+static int cmd_active = 0;
+
+int
+set_output(const char *name,
+	   const char *value,
+	   unsigned int type,
+	   const void *svp,
+	   void *dvp,
+	   const char *a0) {
+  config.output = s_dup(value);
+  
+  if (cmd_active && outbuf_output(stdout, config.output) < 0) {
+    fprintf(stderr, "%s: Error: %s: Opening output: %s\n", argv0, value, strerror(errno));
+    return -1;
+  }
+  
+  return 0;
+}
+
+int
+set_async_output(const char *name,
+		 const char *value,
+		 unsigned int type,
+		 const void *svp,
+		 void *dvp,
+		 const char *a0) {
+  config.f_async = 1;
+  return 0;
+}
+
+int
+set_id_cache_ttl(const char *name,
+		 const char *value,
+		 unsigned int type,
+		 const void *svp,
+		 void *dvp,
+		 const char *a0) {
+  config.id_cache_ttl = * (int *) svp;
+  idcache_set_ttl(config.id_cache_ttl);
+  return 0;
+}
+
 int
 set_no_prefix(const char *name,
               const char *value,
@@ -318,6 +390,11 @@ OPTION global_options[] =
 #endif
    { "no-update", 	'n', OPTS_TYPE_NONE,               set_no_update, NULL, "Disable modification" },
    { "no-prefix", 	'N', OPTS_TYPE_NONE,               set_no_prefix, NULL, "Do not prefix filenames" }, 
+   { "validate-only", 	'V', OPTS_TYPE_NONE,               set_validate_only, NULL, "Check all ACLs that would be written, but write none" },
+   { "async-output", 	'A', OPTS_TYPE_NONE,               set_async_output, NULL, "Write listings from a separate thread" },
+   { "output",    	'o', OPTS_TYPE_STR,                set_output,    NULL, "Write listings to a file (compressed if *.gz or *.zst)" },
+   { "identity-map", 	'M', OPTS_TYPE_STR,                set_identity_map, NULL, "Resolve users/groups using an identity map instead of NSS" },
+   { "id-cache-ttl", 	'I', OPTS_TYPE_UINT,               set_id_cache_ttl, NULL, "Seconds to cache user/group lookups (0 = forever)" },
    { NULL,        	-1,  0,                            NULL,          NULL, NULL },
   };
 
@@ -383,6 +460,13 @@ config_cmd(int argc,
     printf("  Print Level:        %d\n", config.f_print);
     printf("  Update:             %s\n", config.f_noupdate ? "No" : "Yes");
     printf("  Prefix:             %s\n", config.f_noprefix ? "No" : "Yes");
+    printf("  Validate Only:      %s\n", config.f_validate ? "Yes" : "No");
+    printf("  Async Output:       %s\n", config.f_async ? "Yes" : "No");
+    printf("  Output:             %s\n", config.output ? config.output : "-");
+    if (config.id_cache_ttl)
+      printf("  ID Cache TTL:       %us\n", config.id_cache_ttl);
+    else
+      printf("  ID Cache TTL:       No Limit\n");
     printf("  Style:              %s\n", style2str(config.f_style));
   } else {
     int i;
@@ -423,7 +507,7 @@ help_cmd(int argc,
     puts("  If invoked without a command the tool will enter an interactive mode.");
     puts("  All commands take the same options and they can also be used in the interactive mode.");
     putchar('\n');
-    puts("  ACL styles supported: default, csv, brief, verbose, samba, icacls, solaris, primos");
+    puts("  ACL styles supported: default, csv, brief, verbose, samba, icacls, solaris, primos, json");
     putchar('\n');
     puts("  You may access environment variables using ${NAME}.");
 
@@ -560,10 +644,41 @@ int
 run_cmd(int argc,
 	char **argv) {
   int rc;
+  IDCACHE_STATS s0, s1;
   
 
   config = default_config;
+  /* Also closes an output file left open by an aborted command */
+  if (outbuf_output(stdout, config.output) < 0)
+    return error(1, errno, "%s: Opening output", config.output);
+  idcache_set_ttl(config.id_cache_ttl);
+  idcache_get_stats(&s0);
+  acl_memo_disable();
+  acl_stats_reset();
+  
+  cmd_active = 1;
   rc = cmd_run(&commands, argc, argv);
+  cmd_active = 0;
+  
+  if (config.output && outbuf_output(stdout, NULL) < 0 && rc == 0)
+    rc = error(1, errno, "%s: Writing output", config.output);
+  if (config.f_verbose) {
+    acl_stats_print(stdout);
+    
+    idcache_get_stats(&s1);
+    if (s1.lookups > s0.lookups) {
+      s1.lookups   -= s0.lookups;
+      s1.hits      -= s0.hits;
+      s1.negative  -= s0.negative;
+      s1.misses    -= s0.misses;
+      s1.expired   -= s0.expired;
+      s1.evictions -= s0.evictions;
+      idcache_print_stats(&s1, stdout);
+    }
+  }
+  if (rc == 0 && acl_stats.invalid > 0)
+    return error(1, 0, "%lu invalid ACL%s found",
+		 acl_stats.invalid, acl_stats.invalid == 1 ? "" : "s");
   if (rc > 0)
     error(rc, errno, "%s", argv[0]);
   return rc;
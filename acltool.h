@@ -39,6 +39,7 @@
 
 #include "vfs.h"
 #include "gacl.h"
+#include "gacl_blob.h"
 #include "argv.h"
 #include "commands.h"
 #include "aclcmds.h"
@@ -63,10 +64,14 @@ typedef struct config {
   int f_relaxed;
   int f_noupdate;
   int f_noprefix;
+  int f_validate;
+  int f_async;
   mode_t f_filetype;
   GACL_STYLE f_style;
   
   int max_depth;
+  unsigned int id_cache_ttl;
+  char *output;
 } CONFIG;
 
 
@@ -0,0 +1,302 @@
+/*
+ * blobcache.c - Bounded LRU cache of raw ACL blobs
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "blobcache.h"
+
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+/* FNV-1a - pass h = 0 to start a new hash */
+uint64_t
+blob_hash(uint64_t h,
+	  const void *buf,
+	  size_t len) {
+  const unsigned char *cp = (const unsigned char *) buf;
+
+  
+  if (!h)
+    h = FNV_OFFSET_BASIS;
+  
+  while (len-- > 0) {
+    h ^= *cp++;
+    h *= FNV_PRIME;
+  }
+
+  return h;
+}
+
+
+static uint64_t
+_blobcache_key(const void *ibuf,
+	       size_t ilen,
+	       mode_t ftype,
+	       uint64_t fingerprint) {
+  uint64_t h;
+
+  
+  h = blob_hash(0, &fingerprint, sizeof(fingerprint));
+  h = blob_hash(h, &ftype, sizeof(ftype));
+  return blob_hash(h, ibuf, ilen);
+}
+
+
+BLOBCACHE *
+blobcache_create(size_t maxentries,
+		 size_t maxbytes) {
+  BLOBCACHE *cp;
+
+  
+  cp = malloc(sizeof(*cp));
+  if (!cp)
+    return NULL;
+  
+  memset(cp, 0, sizeof(*cp));
+  cp->maxentries = maxentries ? maxentries : BLOBCACHE_DEFAULT_ENTRIES;
+  cp->maxbytes = maxbytes ? maxbytes : BLOBCACHE_DEFAULT_BYTES;
+
+  /* Power of two, at least twice the number of entries */
+  for (cp->hsize = 64; cp->hsize < cp->maxentries*2; cp->hsize <<= 1)
+    ;
+  
+  cp->htab = calloc(cp->hsize, sizeof(cp->htab[0]));
+  if (!cp->htab) {
+    free(cp);
+    return NULL;
+  }
+
+  return cp;
+}
+
+
+static void
+_blobcache_unlink(BLOBCACHE *cp,
+		  BLOBCACHE_ENTRY *ep) {
+  if (ep->prev)
+    ep->prev->next = ep->next;
+  else
+    cp->head = ep->next;
+  
+  if (ep->next)
+    ep->next->prev = ep->prev;
+  else
+    cp->tail = ep->prev;
+
+  ep->prev = ep->next = NULL;
+}
+
+
+static void
+_blobcache_link_head(BLOBCACHE *cp,
+		     BLOBCACHE_ENTRY *ep) {
+  ep->prev = NULL;
+  ep->next = cp->head;
+  if (cp->head)
+    cp->head->prev = ep;
+  else
+    cp->tail = ep;
+  cp->head = ep;
+}
+
+
+static void
+_blobcache_remove(BLOBCACHE *cp,
+		  BLOBCACHE_ENTRY *ep) {
+  BLOBCACHE_ENTRY **hpp;
+
+  
+  for (hpp = &cp->htab[ep->hash & (cp->hsize-1)]; *hpp; hpp = &(*hpp)->hnext)
+    if (*hpp == ep) {
+      *hpp = ep->hnext;
+      break;
+    }
+  
+  _blobcache_unlink(cp, ep);
+  
+  cp->entries--;
+  cp->bytes -= ep->ilen + ep->olen;
+  
+  free(ep->ibuf);
+  if (ep->obuf)
+    free(ep->obuf);
+  free(ep);
+}
+
+
+void
+blobcache_flush(BLOBCACHE *cp) {
+  while (cp->head)
+    _blobcache_remove(cp, cp->head);
+}
+
+
+void
+blobcache_destroy(BLOBCACHE *cp) {
+  if (!cp)
+    return;
+  
+  blobcache_flush(cp);
+  free(cp->htab);
+  free(cp);
+}
+
+
+BLOBCACHE_ENTRY *
+blobcache_lookup(BLOBCACHE *cp,
+		 const void *ibuf,
+		 size_t ilen,
+		 mode_t ftype,
+		 uint64_t fingerprint) {
+  BLOBCACHE_ENTRY *ep;
+  uint64_t h;
+
+
+  cp->stats.lookups++;
+  
+  h = _blobcache_key(ibuf, ilen, ftype, fingerprint);
+  for (ep = cp->htab[h & (cp->hsize-1)]; ep; ep = ep->hnext)
+    if (ep->hash == h &&
+	ep->fingerprint == fingerprint &&
+	ep->ftype == ftype &&
+	ep->ilen == ilen &&
+	memcmp(ep->ibuf, ibuf, ilen) == 0)
+      break;
+
+  if (!ep) {
+    cp->stats.misses++;
+    return NULL;
+  }
+
+  cp->stats.hits++;
+  if (!ep->obuf)
+    cp->stats.unchanged++;
+  
+  if (ep != cp->head) {
+    _blobcache_unlink(cp, ep);
+    _blobcache_link_head(cp, ep);
+  }
+  
+  return ep;
+}
+
+
+/* 
+ * Add an entry. obuf == NULL means "no change needed" for this input.
+ */
+int
+blobcache_insert(BLOBCACHE *cp,
+		 const void *ibuf,
+		 size_t ilen,
+		 mode_t ftype,
+		 uint64_t fingerprint,
+		 const void *obuf,
+		 size_t olen) {
+  BLOBCACHE_ENTRY *ep, **hpp;
+
+
+  if (!obuf)
+    olen = 0;
+  
+  /* Don't let a single huge ACL flush everything else */
+  if (ilen + olen > cp->maxbytes/4) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  ep = malloc(sizeof(*ep));
+  if (!ep)
+    return -1;
+  memset(ep, 0, sizeof(*ep));
+  
+  ep->ibuf = malloc(ilen ? ilen : 1);
+  if (!ep->ibuf) {
+    free(ep);
+    return -1;
+  }
+  memcpy(ep->ibuf, ibuf, ilen);
+  ep->ilen = ilen;
+
+  if (obuf) {
+    ep->obuf = malloc(olen ? olen : 1);
+    if (!ep->obuf) {
+      free(ep->ibuf);
+      free(ep);
+      return -1;
+    }
+    memcpy(ep->obuf, obuf, olen);
+    ep->olen = olen;
+  }
+
+  ep->ftype = ftype;
+  ep->fingerprint = fingerprint;
+  ep->hash = _blobcache_key(ibuf, ilen, ftype, fingerprint);
+
+  while (cp->tail &&
+	 (cp->entries >= cp->maxentries || cp->bytes + ilen + olen > cp->maxbytes)) {
+    _blobcache_remove(cp, cp->tail);
+    cp->stats.evictions++;
+  }
+
+  hpp = &cp->htab[ep->hash & (cp->hsize-1)];
+  ep->hnext = *hpp;
+  *hpp = ep;
+
+  _blobcache_link_head(cp, ep);
+  
+  cp->entries++;
+  cp->bytes += ilen + olen;
+  cp->stats.inserts++;
+  
+  return 0;
+}
+
+
+void
+blobcache_print_stats(BLOBCACHE_STATS *sp,
+		      FILE *fp) {
+  fprintf(fp, "ACL cache: %lu lookups, %lu hits (%.1f%%, %lu unchanged), %lu misses, %lu inserts, %lu evictions\n",
+	  sp->lookups,
+	  sp->hits,
+	  sp->lookups ? (100.0 * sp->hits) / sp->lookups : 0.0,
+	  sp->unchanged,
+	  sp->misses,
+	  sp->inserts,
+	  sp->evictions);
+}
@@ -0,0 +1,125 @@
+/*
+ * blobcache.h - Bounded LRU cache of raw ACL blobs
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BLOBCACHE_H
+#define BLOBCACHE_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Maps (raw input ACL blob, file type, command fingerprint) to the
+ * resulting raw output ACL blob - or to a "no change" verdict.
+ */
+
+#define BLOBCACHE_DEFAULT_ENTRIES   4096
+#define BLOBCACHE_DEFAULT_BYTES     (32*1024*1024)
+
+typedef struct blobcache_entry {
+  uint64_t hash;
+  uint64_t fingerprint;
+  mode_t ftype;
+  
+  void *ibuf;     /* Input blob */
+  size_t ilen;
+  void *obuf;     /* Output blob, NULL = no change */
+  size_t olen;
+
+  struct blobcache_entry *hnext;
+  struct blobcache_entry *prev;
+  struct blobcache_entry *next;
+} BLOBCACHE_ENTRY;
+
+typedef struct blobcache_stats {
+  unsigned long lookups;
+  unsigned long hits;
+  unsigned long unchanged;
+  unsigned long misses;
+  unsigned long inserts;
+  unsigned long evictions;
+} BLOBCACHE_STATS;
+
+typedef struct blobcache {
+  size_t hsize;
+  BLOBCACHE_ENTRY **htab;
+
+  /* LRU list, head = most recently used */
+  BLOBCACHE_ENTRY *head;
+  BLOBCACHE_ENTRY *tail;
+
+  size_t maxentries;
+  size_t maxbytes;
+  size_t entries;
+  size_t bytes;
+
+  BLOBCACHE_STATS stats;
+} BLOBCACHE;
+
+
+extern uint64_t
+blob_hash(uint64_t h,
+	  const void *buf,
+	  size_t len);
+
+extern BLOBCACHE *
+blobcache_create(size_t maxentries,
+		 size_t maxbytes);
+
+extern void
+blobcache_destroy(BLOBCACHE *cp);
+
+extern void
+blobcache_flush(BLOBCACHE *cp);
+
+extern BLOBCACHE_ENTRY *
+blobcache_lookup(BLOBCACHE *cp,
+		 const void *ibuf,
+		 size_t ilen,
+		 mode_t ftype,
+		 uint64_t fingerprint);
+
+extern int
+blobcache_insert(BLOBCACHE *cp,
+		 const void *ibuf,
+		 size_t ilen,
+		 mode_t ftype,
+		 uint64_t fingerprint,
+		 const void *obuf,
+		 size_t olen);
+
+extern void
+blobcache_print_stats(BLOBCACHE_STATS *sp,
+		      FILE *fp);
+
+#endif
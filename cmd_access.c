@@ -0,0 +1,475 @@
+/*
+ * cmd_access.c - Effective access evaluation (access-check)
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pwd.h>
+#include <grp.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "acltool.h"
+#include "blobcache.h"
+#include "outbuf.h"
+
+
+/*
+ * Evaluates the NFSv4 ACLs for one user, like a server would: entries in
+ * order, the first allow or deny for each permission bit wins. owner@,
+ * group@, user: and group: entries apply via the user's uid and group
+ * list. Inherit-only entries are skipped. Implicit owner rights that some
+ * servers grant (WRITE_ACL, WRITE_ATTRIBUTES) are not included.
+ *
+ * The result only depends on the ACL and on whether the user owns the
+ * object and is a member of its group, so it is memoized on (raw ACL,
+ * owner match, group match) - objects sharing an ACL are not decoded
+ * again. Objects without an ACL are evaluated from their mode bits, by
+ * the POSIX rules.
+ */
+
+#define ACCESS_F_OWNER  0x01
+#define ACCESS_F_GROUP  0x02
+#define ACCESS_F_MODE   0x04  /* Memo key is the mode, not an ACL */
+
+#define ACCESS_MAXGROUPS 65536
+
+
+/* The user's group list - kept between commands */
+static struct access_user {
+  int f_valid;
+  uid_t uid;
+  gid_t *groups;      /* Sorted */
+  int ngroups;
+} access_user = { 0, 0, NULL, 0 };
+
+typedef struct access {
+  BLOBCACHE *memo;
+  OUTBUF *ob;
+  char *rbuf;
+  size_t rsize;
+  int f_filter;
+  GACL_PERMSET lacking;   /* List objects without all of these */
+  GACL_PERMSET beyond;    /* ... or with anything more than these */
+  unsigned long objects;
+  unsigned long listed;
+} ACCESS;
+
+
+static int access_filter = 0;
+static GACL_PERMSET access_lacking = 0;
+static GACL_PERMSET access_beyond = GACL_PERM_FULL_SET;
+
+
+static int
+_access_gid_cmp(const void *a,
+		const void *b) {
+  gid_t ga = * (const gid_t *) a;
+  gid_t gb = * (const gid_t *) b;
+
+  return ga < gb ? -1 : (ga > gb);
+}
+
+
+/*
+ * Look up a user (name or uid) and its groups, unless already done. The
+ * user is resolved through the id cache (and --identity-map) like the
+ * principals in ACLs are - only the group list comes from NSS.
+ */
+static int
+_access_user_load(const char *user) {
+  struct passwd *pp;
+  char name[256];
+  gid_t *groups = NULL, base;
+  uid_t uid;
+  char *end;
+  unsigned long v;
+  int i, j, n, rc, size = 64;
+  
+
+  v = strtoul(user, &end, 10);
+  if (*user && !*end) {
+    uid = (uid_t) v;
+    rc = gacl_uid_to_name_np(uid, name, sizeof(name));
+  } else {
+    rc = gacl_name_to_uid_np(user, &uid);
+    if (rc == 1 && gacl_uid_to_name_np(uid, name, sizeof(name)) != 1 &&
+	s_cpy(name, sizeof(name), user) < 0)
+      return -1;
+  }
+  if (rc < 0)
+    return -1;
+  if (rc == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (access_user.f_valid && access_user.uid == uid)
+    return 0;
+
+  /* getgrouplist() needs the primary group, if the user has a passwd entry */
+  pp = getpwuid(uid);
+  base = pp ? pp->pw_gid : (gid_t) -1;
+
+  for (;;) {
+    gid_t *ng = realloc(groups, size * sizeof(groups[0]));
+
+    if (!ng) {
+      free(groups);
+      return -1;
+    }
+    groups = ng;
+    
+    n = size;
+#ifdef __APPLE__
+    if (getgrouplist(name, (int) base, (int *) groups, &n) >= 0)
+#else
+    if (getgrouplist(name, base, groups, &n) >= 0)
+#endif
+      break;
+    
+    /* glibc returns the size needed, others don't */
+    size = (n > size ? n : size*2);
+    if (size > ACCESS_MAXGROUPS) {
+      free(groups);
+      errno = E2BIG;
+      return -1;
+    }
+  }
+
+  /* Drop the placeholder primary group */
+  for (i = j = 0; i < n; i++)
+    if (groups[i] != (gid_t) -1)
+      groups[j++] = groups[i];
+  n = j;
+  
+  qsort(groups, n, sizeof(groups[0]), _access_gid_cmp);
+  
+  free(access_user.groups);
+  access_user.f_valid = 1;
+  access_user.uid = uid;
+  access_user.groups = groups;
+  access_user.ngroups = n;
+  return 0;
+}
+
+
+static int
+_access_in_groups(gid_t gid) {
+  int lo = 0, hi = access_user.ngroups;
+
+  
+  while (lo < hi) {
+    int mid = lo + (hi-lo)/2;
+
+    if (access_user.groups[mid] == gid)
+      return 1;
+    if (access_user.groups[mid] < gid)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  
+  return 0;
+}
+
+
+/* The permissions granted, with whole permission sets accumulated per entry */
+static GACL_PERMSET
+_access_eval(GACL *ap,
+	     int f) {
+  GACL_PERMSET allow = 0, deny = 0;
+  GACL_ENTRY *ep;
+  int i, match;
+
+
+  for (i = 0; i < ap->ac; i++) {
+    ep = &ap->av[i];
+    
+    if (ep->flags & GACL_FLAG_INHERIT_ONLY)
+      continue;
+    if (ep->type != GACL_ENTRY_TYPE_ALLOW && ep->type != GACL_ENTRY_TYPE_DENY)
+      continue;
+    
+    switch (ep->tag.type) {
+    case GACL_TAG_TYPE_USER_OBJ:
+      match = (f & ACCESS_F_OWNER);
+      break;
+    case GACL_TAG_TYPE_GROUP_OBJ:
+      match = (f & ACCESS_F_GROUP);
+      break;
+    case GACL_TAG_TYPE_EVERYONE:
+      match = 1;
+      break;
+    case GACL_TAG_TYPE_USER:
+      match = (gacl_tag_ugid_np(&ep->tag) == access_user.uid);
+      break;
+    case GACL_TAG_TYPE_GROUP:
+      match = _access_in_groups(gacl_tag_ugid_np(&ep->tag));
+      break;
+    default:
+      match = 0;
+    }
+    if (!match)
+      continue;
+
+    if (ep->type == GACL_ENTRY_TYPE_ALLOW)
+      allow |= ep->perms & ~deny;
+    else
+      deny |= ep->perms & ~allow;
+  }
+
+  return allow;
+}
+
+
+/*
+ * Mode bits are not evaluated like an ACL: only one POSIX class applies,
+ * the owner's, else the group's, else other. _gacl_from_mode() gives the
+ * classes as owner@, group@ and everyone@, in that order.
+ */
+static int
+_access_mode(mode_t mode,
+	     int f,
+	     GACL_PERMSET *psp) {
+  gacl_t ap;
+
+  
+  ap = _gacl_from_mode(mode);
+  if (!ap)
+    return -1;
+  
+  *psp = ap->av[(f & ACCESS_F_OWNER) ? 0 : (f & ACCESS_F_GROUP) ? 1 : 2].perms;
+  gacl_free(ap);
+  return 0;
+}
+
+
+/* Effective permissions of the user on an object, memoized */
+static int
+_access_object(ACCESS *xp,
+	       const char *path,
+	       const struct stat *sp,
+	       GACL_PERMSET *psp) {
+  BLOBCACHE_ENTRY *cep;
+  const void *key;
+  size_t klen;
+  uint32_t mode;
+  gacl_t ap = NULL;
+  ssize_t len;
+  int f = 0, rc;
+
+  
+  if (sp->st_uid == access_user.uid)
+    f |= ACCESS_F_OWNER;
+  if (_access_in_groups(sp->st_gid))
+    f |= ACCESS_F_GROUP;
+  
+  len = get_acl_raw(path, sp, &xp->rbuf, &xp->rsize);
+  if (len >= 0) {
+    key = xp->rbuf;
+    klen = len;
+#ifdef ENODATA
+  } else if (errno == ENODATA) {
+    mode = sp->st_mode & 07777;
+    key = &mode;
+    klen = sizeof(mode);
+    f |= ACCESS_F_MODE;
+#endif
+  } else if (errno == ENOSYS) {
+    /* No raw ACLs here - evaluate every object */
+    rc = get_acl(path, sp, &ap);
+    if (rc < 0)
+      return -1;
+    if (rc > 0) {
+      *psp = _access_eval(ap, f);
+      gacl_free(ap);
+      return 0;
+    }
+    mode = sp->st_mode & 07777;
+    key = &mode;
+    klen = sizeof(mode);
+    f |= ACCESS_F_MODE;
+  } else
+    return -1;
+
+  cep = blobcache_lookup(xp->memo, key, klen, 0, f);
+  if (cep) {
+    memcpy(psp, cep->obuf, sizeof(*psp));
+    return 0;
+  }
+  
+  if (f & ACCESS_F_MODE) {
+    if (_access_mode(sp->st_mode, f, psp) < 0)
+      return -1;
+  } else {
+    ap = gacl_from_raw_np(key, klen);
+    if (!ap)
+      return -1;
+    *psp = _access_eval(ap, f);
+    gacl_free(ap);
+  }
+
+  (void) blobcache_insert(xp->memo, key, klen, 0, f, psp, sizeof(*psp));
+  return 0;
+}
+
+
+static int
+walker_access(const char *path,
+	      const struct stat *sp,
+	      size_t base,
+	      size_t level,
+	      void *vp) {
+  ACCESS *xp = (ACCESS *) vp;
+  GACL_ENTRY e;
+  char pbuf[64];
+  size_t len;
+
+  
+  if (_access_object(xp, path, sp, &e.perms) < 0)
+    return error(1, errno, "%s: Evaluating access", path);
+  xp->objects++;
+
+  if (xp->f_filter &&
+      (e.perms & xp->lacking) == xp->lacking &&
+      (e.perms & ~xp->beyond) == 0)
+    return 0;
+  
+  if (gacl_entry_permset_to_text(&e, pbuf, sizeof(pbuf), 0) < 0)
+    return error(1, errno, "%s: Converting permissions to text", path);
+
+  len = strlen(path);
+  outbuf_put(xp->ob, path, len);
+  outbuf_pad(xp->ob, ' ', (len < 24 ? 24-len : 0) + 2);
+  outbuf_puts(xp->ob, pbuf);
+  outbuf_putc(xp->ob, '\n');
+  if (outbuf_release(xp->ob) < 0)
+    return error(1, errno, "%s: Writing output", path);
+
+  xp->listed++;
+  return 0;
+}
+
+
+/* Permission sets are given like "rwx" or "modify_set" */
+static int
+accessopt_handler(const char *name,
+		  const char *vs,
+		  unsigned int type,
+		  const void *svp,
+		  void *dvp,
+		  const char *a0) {
+  char buf[1024];
+  GACL_ENTRY e;
+
+  
+  if (!vs ||
+      snprintf(buf, sizeof(buf), "%s:%s", GACL_TAG_TYPE_EVERYONE_TEXT, vs) >= sizeof(buf) ||
+      _gacl_entry_from_text(buf, &e, 0) < 0) {
+    fprintf(stderr, "%s: Error: %s: Invalid permissions\n", a0, vs ? vs : "");
+    return -1;
+  }
+
+  if (strcmp(name, "lacking") == 0)
+    access_lacking = e.perms;
+  else
+    access_beyond = e.perms;
+  access_filter = 1;
+  return 0;
+}
+
+static OPTION access_options[] =
+  {
+   { "lacking", 'l', OPTS_TYPE_STR, accessopt_handler, NULL, "Only list objects where any of these permissions are not granted" },
+   { "beyond",  'b', OPTS_TYPE_STR, accessopt_handler, NULL, "Only list objects where more than these permissions are granted" },
+   { NULL,      0,   0,             NULL,              NULL, NULL },
+  };
+
+
+static int
+access_cmd(int argc,
+	   char **argv) {
+  ACCESS x;
+  int rc, s_errno = 0;
+
+  
+  memset(&x, 0, sizeof(x));
+  x.f_filter = access_filter;
+  x.lacking = access_lacking;
+  x.beyond = access_beyond;
+  
+  access_filter = 0;
+  access_lacking = 0;
+  access_beyond = GACL_PERM_FULL_SET;
+  
+  if (argc < 3)
+    return error(1, 0, "Missing required <user> or <path> arguments");
+
+  if (_access_user_load(argv[1]) < 0)
+    return error(1, errno, "%s: Looking up user", argv[1]);
+
+  x.memo = blobcache_create(0, 0);
+  x.ob = outbuf_open(stdout);
+  if (!x.memo || !x.ob) {
+    if (x.memo)
+      blobcache_destroy(x.memo);
+    return error(1, errno, "Initializing");
+  }
+  
+  rc = aclcmd_foreach(argc-2, argv+2, walker_access, &x);
+  if (outbuf_flush(x.ob) < 0 && rc == 0)
+    s_errno = errno;
+
+  if (rc == 0 && config.f_verbose) {
+    printf("%lu objects, %lu listed (uid %u, %d groups)\n",
+	   x.objects, x.listed, (unsigned int) access_user.uid, access_user.ngroups);
+    blobcache_print_stats(&x.memo->stats, stdout);
+  }
+  
+  blobcache_destroy(x.memo);
+  free(x.rbuf);
+  
+  if (s_errno)
+    return error(1, s_errno, "Writing output");
+  return rc;
+}
+
+
+COMMAND access_command =
+  { "access-check", access_cmd, access_options, "<user> <path>+", "Show a user's effective access" };
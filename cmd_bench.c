@@ -0,0 +1,312 @@
+/*
+ * cmd_bench.c - ACL codec benchmark
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "acltool.h"
+
+
+/*
+ * Times the ACL codecs on synthetic ACLs of increasing size. The figures
+ * are per ACE, so a flat column means the operation scales linearly. The
+ * "text MB/s" column is the text formatter throughput.
+ */
+
+static int bench_sizes[] = { 3, 10, 30, 100, 300, 1000, 2000, 4000, 0 };
+
+#define BENCH_MIN_SECONDS 0.1
+
+
+static double
+_bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* owner@, group@, everyone@ and a shuffled mix of user:/group: allow/deny entries */
+static GACL *
+_bench_acl(int n) {
+  GACL *ap;
+  GACL_ENTRY *ep;
+  unsigned int seed = 4711;
+  int i, j;
+
+  
+  ap = gacl_init(n);
+  if (!ap)
+    return NULL;
+
+  for (i = 0; i < n; i++) {
+    if (gacl_create_entry_np(&ap, &ep, -1) < 0) {
+      gacl_free(ap);
+      return NULL;
+    }
+
+    switch (i) {
+    case 0:
+      ep->tag.type = GACL_TAG_TYPE_USER_OBJ;
+      ep->tag.ugid = -1;
+      strcpy(ep->tag.name, GACL_TAG_TYPE_USER_OBJ_TEXT);
+      break;
+    case 1:
+      ep->tag.type = GACL_TAG_TYPE_GROUP_OBJ;
+      ep->tag.ugid = -1;
+      strcpy(ep->tag.name, GACL_TAG_TYPE_GROUP_OBJ_TEXT);
+      break;
+    case 2:
+      ep->tag.type = GACL_TAG_TYPE_EVERYONE;
+      ep->tag.ugid = -1;
+      strcpy(ep->tag.name, GACL_TAG_TYPE_EVERYONE_TEXT);
+      break;
+    default:
+      ep->tag.type = (i & 1) ? GACL_TAG_TYPE_USER : GACL_TAG_TYPE_GROUP;
+      ep->tag.ugid = 100000+i;
+      snprintf(ep->tag.name, sizeof(ep->tag.name), "%u", (unsigned int) ep->tag.ugid);
+      break;
+    }
+    
+    ep->type = (i % 5 == 4) ? GACL_ENTRY_TYPE_DENY : GACL_ENTRY_TYPE_ALLOW;
+    ep->perms = GACL_PERM_READ_DATA|GACL_PERM_READ_ATTRIBUTES|GACL_PERM_READ_ACL|GACL_PERM_SYNCHRONIZE;
+    if (i % 3 == 0)
+      ep->perms |= GACL_PERM_WRITE_DATA|GACL_PERM_APPEND_DATA;
+    ep->flags = (i % 7 == 0) ? (GACL_FLAG_FILE_INHERIT|GACL_FLAG_DIRECTORY_INHERIT) : 0;
+  }
+
+  for (i = n-1; i > 0; i--) {
+    GACL_ENTRY t;
+    
+    seed = seed * 1103515245 + 12345;
+    j = (seed >> 8) % (i+1);
+    t = ap->av[i];
+    ap->av[i] = ap->av[j];
+    ap->av[j] = t;
+  }
+  
+  return ap;
+}
+
+
+/* Run 'op' until enough time has passed, return ns per ACE (or -1) */
+#define BENCH_OP_DECODE 1
+#define BENCH_OP_SORT   2
+#define BENCH_OP_MERGE  3
+#define BENCH_OP_TEXT   4
+#define BENCH_OP_ENCODE 5
+#define BENCH_OP_PARSE  6
+
+/* Parse compact text (as from gacl_to_text_np) into 'ap', which has room */
+static int
+_bench_parse(GACL *ap,
+	     const char *text) {
+  const char *cp, *ep;
+  int i;
+
+  
+  for (i = 0, cp = text; *cp && i < ap->ac; i++, cp = (*ep ? ep+1 : ep)) {
+    ep = strchr(cp, ',');
+    if (!ep)
+      ep = cp+strlen(cp);
+    if (_gacl_entry_from_span(cp, ep-cp, &ap->av[i], GACL_TEXT_RELAXED) < 0)
+      return -1;
+  }
+  
+  return 0;
+}
+
+static double
+_bench_run(int op,
+	   GACL *ap,
+	   GACL *rap,
+	   char *buf,
+	   size_t bufsize,
+	   ssize_t blen) {
+  double t0, t;
+  int rc;
+  long iter = 0;
+  void *rp;
+  ssize_t len;
+  
+  
+  t0 = _bench_now();
+  do {
+    rp = NULL;
+    len = 0;
+    rc = 0;
+    
+    switch (op) {
+    case BENCH_OP_DECODE:
+      rp = gacl_from_raw_np(buf, blen);
+      break;
+    case BENCH_OP_SORT:
+      rp = gacl_sort(ap);
+      break;
+    case BENCH_OP_MERGE:
+      rp = gacl_merge(ap);
+      break;
+    case BENCH_OP_TEXT:
+      rp = gacl_to_text_np(ap, NULL, 0);
+      break;
+    case BENCH_OP_ENCODE:
+      /* Change something so the encoder can't reuse its previous result */
+      rap->av[0].perms ^= GACL_PERM_WRITE_NAMED_ATTRS;
+      len = gacl_to_raw_np(rap, buf, bufsize);
+      break;
+    case BENCH_OP_PARSE:
+      rc = _bench_parse(rap, buf);
+      break;
+    }
+    if (rp)
+      gacl_free(rp);
+    else if ((op != BENCH_OP_ENCODE && op != BENCH_OP_PARSE) || len < 0 || rc < 0)
+      return -1;
+    
+    ++iter;
+    t = _bench_now()-t0;
+  } while (t < BENCH_MIN_SECONDS);
+
+  return t * 1e9 / iter / ap->ac;
+}
+
+
+static void
+_bench_print(double v) {
+  if (v < 0)
+    printf("  %9s", "-");
+  else
+    printf("  %9.1f", v);
+}
+
+
+/* Text output MB/s, given the output size and ns per ACE */
+static double
+_bench_mbps(ssize_t tlen,
+	    int n,
+	    double ns) {
+  if (tlen < 0 || ns <= 0)
+    return -1;
+
+  return tlen * 1e3 / (ns * n);
+}
+
+
+/* One row of figures for ACLs with 'n' entries */
+static int
+_bench_size(int n) {
+  GACL *ap, *rap;
+  char *buf, *tp;
+  size_t bufsize;
+  ssize_t blen, tlen;
+  double tns;
+  
+
+  ap = _bench_acl(n);
+  if (!ap)
+    return error(1, errno, "Creating test ACL");
+
+  /* Room for the longest possible who-strings */
+  bufsize = 4 + n * (16 + sizeof(ap->av[0].tag.name));
+  buf = malloc(bufsize);
+  if (!buf) {
+    gacl_free(ap);
+    return error(1, errno, "malloc(%lu)", (unsigned long) bufsize);
+  }
+
+  /* Encode the decoded copy - unresolved entries, like a read-modify-write */
+  rap = NULL;
+  blen = gacl_to_raw_np(ap, buf, bufsize);
+  if (blen >= 0)
+    rap = gacl_from_raw_np(buf, blen);
+
+  tlen = -1;
+  tp = gacl_to_text_np(ap, &tlen, 0);
+  if (tp)
+    gacl_free(tp);
+  
+  printf("%7d", n);
+  _bench_print(rap ? _bench_run(BENCH_OP_DECODE, ap, NULL, buf, bufsize, blen) : -1);
+  _bench_print(_bench_run(BENCH_OP_SORT, ap, NULL, NULL, 0, 0));
+  _bench_print(_bench_run(BENCH_OP_MERGE, ap, NULL, NULL, 0, 0));
+  _bench_print(tns = _bench_run(BENCH_OP_TEXT, ap, NULL, NULL, 0, 0));
+  _bench_print(rap ? _bench_run(BENCH_OP_ENCODE, ap, rap, buf, bufsize, 0) : -1);
+  _bench_print(_bench_mbps(tlen, n, tns));
+  
+  /* Parse once first, so the figure isn't all the (cold) NSS lookups */
+  tp = gacl_to_text_np(ap, NULL, GACL_TEXT_COMPACT);
+  _bench_print(rap && tp && _bench_parse(rap, tp) == 0 ? _bench_run(BENCH_OP_PARSE, ap, rap, tp, 0, 0) : -1);
+  if (tp)
+    gacl_free(tp);
+  putchar('\n');
+  fflush(stdout);
+
+  if (rap)
+    gacl_free(rap);
+  gacl_free(ap);
+  free(buf);
+  return 0;
+}
+
+
+static int
+bench_cmd(int argc,
+	  char **argv) {
+  int i, min = 3, max = 4000;
+  
+
+  if ((argc > 1 && (sscanf(argv[1], "%d", &min) != 1 || min < 3)) ||
+      (argc > 2 && (sscanf(argv[2], "%d", &max) != 1 || max < min)))
+    return error(1, 0, "Invalid size range (<min> >= 3, <max> >= <min>)");
+
+  printf("%7s  %9s  %9s  %9s  %9s  %9s  %9s  %9s\n",
+	 "ACEs", "decode", "sort", "merge", "text", "encode", "text", "parse");
+  printf("%7s  %9s  %9s  %9s  %9s  %9s  %9s  %9s\n",
+	 "", "ns/ACE", "ns/ACE", "ns/ACE", "ns/ACE", "ns/ACE", "MB/s", "ns/ACE");
+
+  for (i = 0; bench_sizes[i] && bench_sizes[i] < max; i++)
+    if (bench_sizes[i] >= min && _bench_size(bench_sizes[i]) < 0)
+      return 1;
+
+  return _bench_size(max) < 0 ? 1 : 0;
+}
+
+
+COMMAND bench_command =
+  { "benchmark",	bench_cmd,	NULL, "[<min-aces> [<max-aces>]]",	"Measure ACL codec scaling" };
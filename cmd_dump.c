@@ -0,0 +1,854 @@
+/*
+ * cmd_dump.c - Binary ACL dumps (dump-access & restore-access)
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "acltool.h"
+#include "blobcache.h"
+
+
+/*
+ * Dump file format (integers are unsigned LEB128 varints unless noted):
+ *
+ *   Header:  "ACLDUMP\n", version (byte), flags (byte), creation time
+ *
+ *   'A' id kind len data   - ACL dictionary entry, before its first use.
+ *                            Kind 'R' = raw system ACL, 'T' = compact text
+ *                            (where raw ACLs are unsupported)
+ *   'D'                    - Start of a directory chunk (the directory and
+ *                            the non-directories in it). Resets the path
+ *                            compression so chunks can be read on their own
+ *   'O' shared len suffix mode ctime [inode] acl
+ *                          - An object. The path is 'shared' bytes of the
+ *                            previous path + 'suffix'. 'acl' is a dictionary
+ *                            id, 0 for none. The inode number is present
+ *                            with DUMP_F_INODES
+ *   'E'                    - End of the records
+ *   'X' nchunks offsets... nacls offsets...
+ *                          - Index: chunk and dictionary entry offsets,
+ *                            delta-coded
+ *
+ *   Trailer: offset of 'X' (8 bytes, little-endian), "ACLDIDX\n"
+ *
+ * restore-access streams the records with memory only for the dictionary.
+ * With --part=K/N it only restores every N:th chunk, so N processes can
+ * share the work - using the index to seek if the dump is a regular file.
+ */
+
+#define DUMP_MAGIC          "ACLDUMP\n"
+#define DUMP_INDEX_MAGIC    "ACLDIDX\n"
+#define DUMP_VERSION        1
+
+#define DUMP_F_INODES       0x01
+
+#define DUMP_KIND_RAW       'R'
+#define DUMP_KIND_TEXT      'T'
+
+#define DUMP_HSIZE          4096
+
+
+typedef struct dump_acl {
+  uint64_t hash;
+  uint64_t id;
+  int kind;
+  size_t len;
+  struct dump_acl *next;
+  char data[1];
+} DUMP_ACL;
+
+typedef struct dump_offsets {
+  uint64_t *v;
+  size_t n;
+  size_t size;
+} DUMP_OFFSETS;
+
+typedef struct dump {
+  FILE *fp;
+  uint64_t off;
+  int flags;
+
+  DUMP_ACL *htab[DUMP_HSIZE];
+  uint64_t acls;
+  
+  char *path;            /* Previous path */
+  size_t plen;
+  size_t psize;
+
+  char *rbuf;            /* Raw ACL buffer */
+  size_t rsize;
+
+  DUMP_OFFSETS chunks;
+  DUMP_OFFSETS aclv;
+  unsigned long objects;
+} DUMP;
+
+
+static int dump_flags = 0;
+static unsigned int part_k = 0;
+static unsigned int part_n = 0;
+
+
+static int
+_dump_put(DUMP *dp,
+	  const void *buf,
+	  size_t len) {
+  if (len > 0 && fwrite(buf, 1, len, dp->fp) != len)
+    return -1;
+  
+  dp->off += len;
+  return 0;
+}
+
+static int
+_dump_putc(DUMP *dp,
+	   int c) {
+  unsigned char b = c;
+  
+  return _dump_put(dp, &b, 1);
+}
+
+static int
+_dump_putv(DUMP *dp,
+	   uint64_t v) {
+  unsigned char buf[10];
+  int n = 0;
+
+  do {
+    buf[n] = v & 0x7F;
+    v >>= 7;
+    if (v)
+      buf[n] |= 0x80;
+    n++;
+  } while (v);
+  
+  return _dump_put(dp, buf, n);
+}
+
+
+static int
+_dump_offsets_add(DUMP_OFFSETS *op,
+		  uint64_t off) {
+  if (op->n >= op->size) {
+    size_t nsize = op->size ? op->size * 2 : 1024;
+    uint64_t *nv = realloc(op->v, nsize * sizeof(nv[0]));
+
+    if (!nv)
+      return -1;
+    op->v = nv;
+    op->size = nsize;
+  }
+  
+  op->v[op->n++] = off;
+  return 0;
+}
+
+static int
+_dump_offsets_put(DUMP *dp,
+		  DUMP_OFFSETS *op) {
+  uint64_t prev = 0;
+  size_t i;
+  
+  if (_dump_putv(dp, op->n) < 0)
+    return -1;
+  for (i = 0; i < op->n; i++) {
+    if (_dump_putv(dp, op->v[i] - prev) < 0)
+      return -1;
+    prev = op->v[i];
+  }
+  
+  return 0;
+}
+
+
+/* Dictionary id for an ACL, writing an 'A' record the first time it is seen */
+static int
+_dump_acl_id(DUMP *dp,
+	     int kind,
+	     const char *data,
+	     size_t len,
+	     uint64_t *idp) {
+  DUMP_ACL *ap;
+  uint64_t h;
+  unsigned char k = kind;
+
+  
+  h = blob_hash(blob_hash(0, &k, 1), data, len);
+  for (ap = dp->htab[h % DUMP_HSIZE]; ap; ap = ap->next)
+    if (ap->hash == h && ap->kind == kind && ap->len == len && memcmp(ap->data, data, len) == 0) {
+      *idp = ap->id;
+      return 0;
+    }
+
+  ap = malloc(sizeof(*ap) + len);
+  if (!ap)
+    return -1;
+  
+  ap->hash = h;
+  ap->id = ++dp->acls;
+  ap->kind = kind;
+  ap->len = len;
+  memcpy(ap->data, data, len);
+  ap->next = dp->htab[h % DUMP_HSIZE];
+  dp->htab[h % DUMP_HSIZE] = ap;
+
+  if (_dump_offsets_add(&dp->aclv, dp->off) < 0 ||
+      _dump_putc(dp, 'A') < 0 ||
+      _dump_putv(dp, ap->id) < 0 ||
+      _dump_putc(dp, kind) < 0 ||
+      _dump_putv(dp, len) < 0 ||
+      _dump_put(dp, data, len) < 0)
+    return -1;
+
+  *idp = ap->id;
+  return 0;
+}
+
+
+/* The object's ACL as a dictionary id, 0 if it has none */
+static int
+_dump_get_acl(DUMP *dp,
+	      const char *path,
+	      const struct stat *sp,
+	      uint64_t *idp) {
+  ssize_t len;
+  gacl_t ap;
+  char *text;
+  int rc;
+
+  
+  *idp = 0;
+  len = get_acl_raw(path, sp, &dp->rbuf, &dp->rsize);
+  if (len >= 0)
+    return _dump_acl_id(dp, DUMP_KIND_RAW, dp->rbuf, len, idp);
+#ifdef ENODATA
+  if (errno == ENODATA)
+    return 0;
+#endif
+  if (errno != ENOSYS)
+    return -1;
+
+  rc = get_acl(path, sp, &ap);
+  if (rc <= 0)
+    return rc;
+
+  text = gacl_to_text_np(ap, &len, GACL_TEXT_COMPACT);
+  gacl_free(ap);
+  if (!text)
+    return -1;
+  
+  rc = _dump_acl_id(dp, DUMP_KIND_TEXT, text, len, idp);
+  gacl_free(text);
+  return rc;
+}
+
+
+static int
+walker_dump(const char *path,
+	    const struct stat *sp,
+	    size_t base,
+	    size_t level,
+	    void *vp) {
+  DUMP *dp = (DUMP *) vp;
+  size_t len, shared;
+  uint64_t id;
+
+  
+  if (_dump_get_acl(dp, path, sp, &id) < 0)
+    return error(1, errno, "%s: Getting ACL", path);
+
+  if (S_ISDIR(sp->st_mode) || level == 0) {
+    if (_dump_offsets_add(&dp->chunks, dp->off) < 0 || _dump_putc(dp, 'D') < 0)
+      goto Fail;
+    dp->plen = 0;
+  }
+  
+  len = strlen(path);
+  for (shared = 0; shared < dp->plen && shared < len && dp->path[shared] == path[shared]; shared++)
+    ;
+  
+  if (_dump_putc(dp, 'O') < 0 ||
+      _dump_putv(dp, shared) < 0 ||
+      _dump_putv(dp, len - shared) < 0 ||
+      _dump_put(dp, path + shared, len - shared) < 0 ||
+      _dump_putv(dp, sp->st_mode) < 0 ||
+      _dump_putv(dp, (uint64_t) sp->st_ctime) < 0 ||
+      ((dp->flags & DUMP_F_INODES) && _dump_putv(dp, sp->st_ino) < 0) ||
+      _dump_putv(dp, id) < 0)
+    goto Fail;
+  
+  if (len+1 > dp->psize) {
+    char *np = realloc(dp->path, len+1);
+    
+    if (!np)
+      goto Fail;
+    dp->path = np;
+    dp->psize = len+1;
+  }
+  memcpy(dp->path, path, len+1);
+  dp->plen = len;
+
+  dp->objects++;
+  return 0;
+
+ Fail:
+  return error(1, errno, "Writing dump");
+}
+
+
+static void
+_dump_free(DUMP *dp) {
+  DUMP_ACL *ap, *next;
+  int i;
+
+  
+  for (i = 0; i < DUMP_HSIZE; i++)
+    for (ap = dp->htab[i]; ap; ap = next) {
+      next = ap->next;
+      free(ap);
+    }
+  
+  free(dp->path);
+  free(dp->rbuf);
+  free(dp->chunks.v);
+  free(dp->aclv.v);
+  memset(dp, 0, sizeof(*dp));
+}
+
+
+static int
+dumpopt_inodes(const char *name,
+	       const char *vs,
+	       unsigned int type,
+	       const void *svp,
+	       void *dvp,
+	       const char *a0) {
+  dump_flags |= DUMP_F_INODES;
+  return 0;
+}
+
+static OPTION dump_options[] =
+  {
+   { "inodes", 'H', OPTS_TYPE_NONE, dumpopt_inodes, NULL, "Include inode numbers (lets restore skip unmodified objects)" },
+   { NULL,     0,   0,              NULL,           NULL, NULL },
+  };
+
+
+static int
+dump_cmd(int argc,
+	 char **argv) {
+  DUMP d;
+  unsigned char trailer[8];
+  uint64_t xoff;
+  int i, rc, f_stdout;
+
+  
+  if (argc < 3)
+    return error(1, 0, "Missing required <file> or <path> arguments");
+
+  memset(&d, 0, sizeof(d));
+  d.flags = dump_flags;
+  dump_flags = 0;
+  
+  f_stdout = (strcmp(argv[1], "-") == 0);
+  d.fp = f_stdout ? stdout : fopen(argv[1], "w");
+  if (!d.fp)
+    return error(1, errno, "%s: Creating dump", argv[1]);
+  if (f_stdout)
+    fflush(stdout);
+  else
+    setvbuf(d.fp, NULL, _IOFBF, 1024*1024);
+
+  if (_dump_put(&d, DUMP_MAGIC, 8) < 0 ||
+      _dump_putc(&d, DUMP_VERSION) < 0 ||
+      _dump_putc(&d, d.flags) < 0 ||
+      _dump_putv(&d, (uint64_t) time(NULL)) < 0) {
+    rc = -1;
+    goto End;
+  }
+  
+  rc = aclcmd_foreach(argc-2, argv+2, walker_dump, &d);
+  if (rc)
+    goto End;
+
+  xoff = d.off + 1;
+  for (i = 0; i < 8; i++)
+    trailer[i] = (xoff >> (8*i)) & 0xFF;
+  
+  if (_dump_putc(&d, 'E') < 0 ||
+      _dump_putc(&d, 'X') < 0 ||
+      _dump_offsets_put(&d, &d.chunks) < 0 ||
+      _dump_offsets_put(&d, &d.aclv) < 0 ||
+      _dump_put(&d, trailer, 8) < 0 ||
+      _dump_put(&d, DUMP_INDEX_MAGIC, 8) < 0)
+    rc = -1;
+
+ End:
+  if ((f_stdout ? fflush(d.fp) : fclose(d.fp)) != 0)
+    rc = -1;
+  if (rc < 0) {
+    _dump_free(&d);
+    return error(1, errno, "%s: Writing dump", argv[1]);
+  }
+
+  if (rc == 0 && config.f_verbose)
+    fprintf(f_stdout ? stderr : stdout, "%s: %lu objects, %lu distinct ACLs, %llu bytes\n",
+	    argv[1], d.objects, (unsigned long) d.acls, (unsigned long long) d.off);
+  
+  _dump_free(&d);
+  return rc;
+}
+
+
+/*
+ * Restore
+ */
+
+typedef struct restore_acl {
+  int kind;
+  size_t len;
+  char *data;
+} RESTORE_ACL;
+
+typedef struct restore {
+  FILE *fp;
+  const char *name;
+  int flags;
+  time_t created;
+
+  RESTORE_ACL *acls;
+  size_t nacls;
+
+  char *path;
+  size_t psize;
+  size_t plen;           /* Length of the previous path, 0 at a chunk start */
+  uint64_t chunk;        /* Current chunk number (1..) */
+
+  unsigned long objects;
+  unsigned long missing;
+} RESTORE;
+
+
+static int
+_restore_getv(RESTORE *rp,
+	      uint64_t *vp) {
+  uint64_t v = 0;
+  int c, shift = 0;
+
+  do {
+    c = getc(rp->fp);
+    if (c == EOF || shift > 63) {
+      errno = EINVAL;
+      return -1;
+    }
+    v |= (uint64_t) (c & 0x7F) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  *vp = v;
+  return 0;
+}
+
+static int
+_restore_get(RESTORE *rp,
+	     void *buf,
+	     size_t len) {
+  if (len > 0 && fread(buf, 1, len, rp->fp) != len) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+
+static int
+_restore_acl_record(RESTORE *rp) {
+  uint64_t id, len;
+  int kind;
+  char *data;
+
+  
+  if (_restore_getv(rp, &id) < 0 ||
+      (kind = getc(rp->fp)) == EOF ||
+      _restore_getv(rp, &len) < 0 ||
+      id == 0 || len > 16*1024*1024) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (id > rp->nacls) {
+    size_t nsize = id + 1024;
+    RESTORE_ACL *nv = realloc(rp->acls, nsize * sizeof(nv[0]));
+
+    if (!nv)
+      return -1;
+    memset(nv + rp->nacls, 0, (nsize - rp->nacls) * sizeof(nv[0]));
+    rp->acls = nv;
+    rp->nacls = nsize;
+  }
+
+  /* Text entries get a terminating NUL */
+  data = malloc(len+1);
+  if (!data)
+    return -1;
+  if (_restore_get(rp, data, len) < 0) {
+    free(data);
+    return -1;
+  }
+  data[len] = '\0';
+
+  free(rp->acls[id-1].data);
+  rp->acls[id-1].kind = kind;
+  rp->acls[id-1].len = len;
+  rp->acls[id-1].data = data;
+  return 0;
+}
+
+
+static int
+_restore_apply(RESTORE *rp,
+	       const char *path,
+	       const struct stat *sp,
+	       RESTORE_ACL *ap) {
+  gacl_t nap, oap = NULL;
+  int rc;
+  
+
+  if (ap->kind == DUMP_KIND_RAW) {
+    rc = set_acl_raw(path, sp, ap->data, ap->len);
+    if (rc >= 0)
+      return 0;
+    nap = gacl_from_raw_np(ap->data, ap->len);
+  } else
+    nap = gacl_from_text(ap->data);
+  if (!nap)
+    return error(1, errno, "%s: Decoding ACL from %s", path, rp->name);
+  
+  if (get_acl(path, sp, &oap) < 0)
+    oap = NULL;
+  
+  rc = set_acl(path, sp, nap, oap);
+  
+  if (oap)
+    gacl_free(oap);
+  gacl_free(nap);
+  return rc < 0 ? -1 : 0;
+}
+
+
+static int
+_restore_object(RESTORE *rp) {
+  uint64_t shared, len, mode, ctime, ino = 0, id;
+  struct stat sb;
+  
+
+  if (_restore_getv(rp, &shared) < 0 ||
+      _restore_getv(rp, &len) < 0 ||
+      shared > rp->plen || len > 64*1024)
+    goto Invalid;
+
+  if (shared+len+1 > rp->psize) {
+    size_t nsize = shared+len+1024;
+    char *np = realloc(rp->path, nsize);
+
+    if (!np)
+      return -1;
+    rp->path = np;
+    rp->psize = nsize;
+  }
+  
+  if (_restore_get(rp, rp->path + shared, len) < 0 ||
+      _restore_getv(rp, &mode) < 0 ||
+      _restore_getv(rp, &ctime) < 0 ||
+      ((rp->flags & DUMP_F_INODES) && _restore_getv(rp, &ino) < 0) ||
+      _restore_getv(rp, &id) < 0 ||
+      id > rp->nacls || (id > 0 && !rp->acls[id-1].data))
+    goto Invalid;
+  rp->path[shared+len] = '\0';
+  rp->plen = shared+len;
+
+  if (part_n && (rp->chunk - 1) % part_n != part_k)
+    return 0;
+  
+  rp->objects++;
+  if (id == 0)
+    return 0;
+  
+  if (vfs_lstat(rp->path, &sb) < 0) {
+    fprintf(stderr, "%s: Error: %s: %s\n", argv0, rp->path, strerror(errno));
+    rp->missing++;
+    return 0;
+  }
+
+  if ((sb.st_mode & S_IFMT) != (mode & S_IFMT)) {
+    fprintf(stderr, "%s: Error: %s: Object type has changed since the dump\n", argv0, rp->path);
+    rp->missing++;
+    return 0;
+  }
+
+  /* ctime would have changed with the ACL - if it was before the dump began */
+  if (!config.f_force && (rp->flags & DUMP_F_INODES) &&
+      sb.st_ino == ino && (uint64_t) sb.st_ctime == ctime && sb.st_ctime < rp->created) {
+    acl_stats.skipped++;
+    return 0;
+  }
+
+  return _restore_apply(rp, rp->path, &sb, &rp->acls[id-1]);
+
+ Invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+
+/* Process records until the end - or the next chunk if 'f_chunk' */
+static int
+_restore_records(RESTORE *rp,
+		 int f_chunk) {
+  int c;
+  
+
+  while ((c = getc(rp->fp)) != EOF) {
+    switch (c) {
+    case 'A':
+      if (_restore_acl_record(rp) < 0)
+	return -1;
+      break;
+
+    case 'D':
+      if (f_chunk && rp->chunk > 0)
+	return 0;
+      rp->chunk++;
+      rp->plen = 0;
+      break;
+
+    case 'O':
+      if (_restore_object(rp) < 0)
+	return -1;
+      break;
+
+    case 'E':
+      return 0;
+
+    default:
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+
+/* --part with a seekable dump: load the dictionary and go to our chunks only */
+static int
+_restore_indexed(RESTORE *rp) {
+  unsigned char trailer[16];
+  uint64_t xoff = 0, n, nchunks, off, i, *chunks = NULL;
+  int j;
+  
+
+  if (fseeko(rp->fp, -16, SEEK_END) < 0 ||
+      _restore_get(rp, trailer, 16) < 0 ||
+      memcmp(trailer+8, DUMP_INDEX_MAGIC, 8) != 0)
+    return -1;
+  
+  for (j = 7; j >= 0; j--)
+    xoff = (xoff << 8) | trailer[j];
+  
+  if (fseeko(rp->fp, xoff, SEEK_SET) < 0 ||
+      getc(rp->fp) != 'X' ||
+      _restore_getv(rp, &nchunks) < 0 || nchunks > xoff)
+    goto Invalid;
+
+  /* Every part_n:th chunk, starting with part_k */
+  chunks = calloc(nchunks / part_n + 1, sizeof(chunks[0]));
+  if (!chunks)
+    return -1;
+  
+  for (i = 0, off = 0; i < nchunks; i++) {
+    uint64_t d;
+    
+    if (_restore_getv(rp, &d) < 0)
+      goto Invalid;
+    off += d;
+    if (i % part_n == part_k)
+      chunks[i / part_n] = off;
+  }
+
+  /* The dictionary entries, remembering where to continue in the index */
+  if (_restore_getv(rp, &n) < 0)
+    goto Invalid;
+  for (i = 0, off = 0; i < n; i++) {
+    uint64_t d;
+    off_t here;
+    
+    if (_restore_getv(rp, &d) < 0)
+      goto Invalid;
+    off += d;
+    here = ftello(rp->fp);
+    if (fseeko(rp->fp, off, SEEK_SET) < 0 ||
+	getc(rp->fp) != 'A' ||
+	_restore_acl_record(rp) < 0 ||
+	fseeko(rp->fp, here, SEEK_SET) < 0)
+      goto Invalid;
+  }
+
+  for (i = part_k; i < nchunks; i += part_n) {
+    if (fseeko(rp->fp, chunks[i / part_n], SEEK_SET) < 0 ||
+	getc(rp->fp) != 'D')
+      goto Invalid;
+    rp->chunk = i+1;
+    rp->plen = 0;
+    if (_restore_records(rp, 1) < 0)
+      goto Invalid;
+  }
+
+  free(chunks);
+  return 0;
+
+ Invalid:
+  free(chunks);
+  errno = EINVAL;
+  return -1;
+}
+
+
+static void
+_restore_free(RESTORE *rp) {
+  size_t i;
+
+  
+  for (i = 0; i < rp->nacls; i++)
+    free(rp->acls[i].data);
+  free(rp->acls);
+  free(rp->path);
+}
+
+
+static int
+restoreopt_part(const char *name,
+		const char *vs,
+		unsigned int type,
+		const void *svp,
+		void *dvp,
+		const char *a0) {
+  char c;
+
+  
+  if (!vs || sscanf(vs, "%u/%u%c", &part_k, &part_n, &c) != 2 || part_n == 0 || part_k >= part_n) {
+    fprintf(stderr, "%s: Error: %s: Invalid part (expected K/N, 0 <= K < N)\n", a0, vs ? vs : "");
+    part_k = part_n = 0;
+    return -1;
+  }
+  
+  return 0;
+}
+
+static OPTION restore_options[] =
+  {
+   { "part", 'K', OPTS_TYPE_STR, restoreopt_part, NULL, "Only restore directory chunk K of every N (K/N)" },
+   { NULL,   0,   0,             NULL,            NULL, NULL },
+  };
+
+
+static int
+restore_cmd(int argc,
+	    char **argv) {
+  RESTORE r;
+  unsigned char hdr[10];
+  uint64_t created;
+  int rc;
+
+  
+  if (argc != 2)
+    return error(1, 0, "Expected a single <file> argument");
+
+  memset(&r, 0, sizeof(r));
+  r.name = argv[1];
+  r.fp = (strcmp(argv[1], "-") == 0) ? stdin : fopen(argv[1], "r");
+  if (!r.fp)
+    return error(1, errno, "%s: Opening dump", argv[1]);
+  
+  if (_restore_get(&r, hdr, 10) < 0 ||
+      memcmp(hdr, DUMP_MAGIC, 8) != 0 ||
+      hdr[8] != DUMP_VERSION ||
+      _restore_getv(&r, &created) < 0) {
+    rc = -1;
+    errno = EINVAL;
+    goto End;
+  }
+  r.flags = hdr[9];
+  r.created = (time_t) created;
+
+  /* Pipes are read in full (skipping other parts' objects) */
+  if (part_n > 1 && fseeko(r.fp, 0, SEEK_CUR) == 0)
+    rc = _restore_indexed(&r);
+  else
+    rc = _restore_records(&r, 0);
+
+ End:
+  if (r.fp != stdin)
+    fclose(r.fp);
+  part_k = part_n = 0;
+  
+  if (rc < 0) {
+    _restore_free(&r);
+    return error(1, errno, "%s: Reading dump", argv[1]);
+  }
+
+  if (config.f_verbose)
+    printf("%s: %lu objects restored, %lu missing or changed\n", argv[1], r.objects, r.missing);
+  
+  _restore_free(&r);
+  if (r.missing)
+    return error(1, 0, "%lu object%s missing or changed since the dump",
+		 r.missing, r.missing == 1 ? "" : "s");
+  return 0;
+}
+
+
+COMMAND dump_command =
+  { "dump-access", dump_cmd, dump_options, "<file|-> <path>+", "Save ACLs to a binary dump" };
+
+COMMAND restore_command =
+  { "restore-access", restore_cmd, restore_options, "<file|->", "Restore ACLs from a binary dump" };
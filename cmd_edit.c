@@ -48,6 +48,8 @@
 
 #include "acltool.h"
 #include "range.h"
+#include "buffer.h"
+#include "gacl_batch.h"
 
 
 
@@ -446,62 +448,19 @@ static int
 ace_match(gacl_entry_t oae,
 	  gacl_entry_t mae,
 	  int mflags) {
-  /* Matching ACE */
-  gacl_tag_t mtt;
-  gacl_entry_type_t met;
-  uid_t *mip;
-  gacl_permset_t mps;
-  gacl_flagset_t mfs;
-
-  /* Current ACE */
-  gacl_tag_t ott;
-  gacl_entry_type_t oet;
-  gacl_permset_t ops;
-  gacl_flagset_t ofs;
-  uid_t *oip;
-
-  
-  gacl_get_tag_type(mae, &mtt);
-  gacl_get_tag_type(oae, &ott);
-
-  if (ott != mtt)
-      return 0;
-  
-  gacl_get_entry_type_np(mae, &met);
-  mip = gacl_get_qualifier(mae);
-  
-  gacl_get_entry_type_np(oae, &oet);
-  oip = gacl_get_qualifier(oae);
-  
-
-  if ((ott == GACL_TAG_TYPE_USER || ott == GACL_TAG_TYPE_GROUP) && (!oip || !mip || *oip != *mip)) {
-    if (mip)
-      gacl_free(mip);
-    if (oip)
-      gacl_free(oip);
+  if (oae->tag.type != mae->tag.type)
     return 0;
-  }
 
-  if (mip)
-    gacl_free(mip);
-  if (oip)
-    gacl_free(oip);
-
-  /* Check the ACE type set */
-  if (met != oet)
+  if ((oae->tag.type == GACL_TAG_TYPE_USER || oae->tag.type == GACL_TAG_TYPE_GROUP) &&
+      gacl_tag_ugid_np(&oae->tag) != gacl_tag_ugid_np(&mae->tag))
     return 0;
-
-  if (gacl_get_permset(mae, &mps) < 0 ||
-      gacl_get_flagset_np(mae, &mfs) < 0)
-    return -1;
   
-  if (gacl_get_permset(oae, &ops) < 0 ||
-      gacl_get_flagset_np(oae, &ofs) < 0)
-    return -1;
-
+  /* Check the ACE type set */
+  if (oae->type != mae->type)
+    return 0;
 
   /* Check the flag set */
-  if (*mfs != *ofs)
+  if (oae->flags != mae->flags)
     return 0;
 
   switch (mflags) {
@@ -509,17 +468,17 @@ ace_match(gacl_entry_t oae,
     break;
     
   case '=':
-    if (*mps != *ops)
+    if (oae->perms != mae->perms)
       return 0;
     break;
 
   case '+':
-    if ((*ops & *mps) != *mps)
+    if ((oae->perms & mae->perms) != mae->perms)
       return 0;
     break;
     
   case '-':
-    if ((*ops & *mps) != 0)
+    if ((oae->perms & mae->perms) != 0)
       return 0;
     break;
   }
@@ -597,6 +556,9 @@ cmd_edit_crace(ACECR *cr,
   return cmd_edit_ace(oae, cr->change.ep);
   
 }
+/* Column-wise copy of the ACL being edited, for whole-ACL filtering */
+static GACL_BATCH edit_batch;
+
 RANGE *
 range_filter(RANGE *old, gacl_entry_t fae, int flags, gacl_t ap) {
   RANGE *new = NULL;
@@ -625,12 +587,27 @@ range_filter(RANGE *old, gacl_entry_t fae, int flags, gacl_t ap) {
 	break;
     }
   } else {
-    /* Scan whole ACL */
-    for (p = 0; gacl_get_entry(ap, p == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; p++) {
-      if (ace_match(ae, fae, flags) == 1) {
-	range_add(&new, p, p);
-      }
+    int phow;
+    
+    /* Scan whole ACL - same rules as ace_match() */
+    switch (flags) {
+    case '=':
+    case '+':
+    case '-':
+      phow = flags;
+      break;
+    default:
+      phow = GACL_BATCH_IGNORE;
     }
+    
+    gacl_batch_clear(&edit_batch);
+    if (gacl_batch_add(&edit_batch, ap) < 0)
+      return NULL;
+
+    if (gacl_batch_select(&edit_batch, fae, phow, GACL_BATCH_EQUAL) > 0)
+      for (p = 0; p < edit_batch.n; p++)
+	if (edit_batch.sel[p])
+	  range_add(&new, p, p);
   }
   
   return new;
@@ -682,7 +659,7 @@ range_filter_regex(RANGE *old,
     }
   } else {
     /* Scan whole ACL */
-    for (p = 0; gacl_get_entry(ap, p == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; p++) {
+    for (p = 0; _gacl_get_entry(ap, p, &ae) == 1; p++) {
       if (gacl_entry_to_text(ae, buf, sizeof(buf), GACL_TEXT_STANDARD) < 0)
 	continue;
 
@@ -707,6 +684,9 @@ range_filter_regex(RANGE *old,
 
 static SCRIPT *edit_script = NULL;
 
+/* Source text of the script, used as the fingerprint for the ACL cache */
+static BUFFER edit_script_text = { NULL, 0, 0 };
+
 static int
 script_add(SCRIPT **spp,
 	   ACECR *cr) {
@@ -768,6 +748,76 @@ script_free(SCRIPT **spp) {
     free(sp);
   }
   *spp = NULL;
+  
+  buf_clear(&edit_script_text);
+}
+
+
+/* Scripts that print things must see every object */
+static int
+script_is_pure(SCRIPT *sp) {
+  ACECR *cr;
+
+  
+  for (; sp; sp = sp->next)
+    for (cr = sp->cr; cr; cr = cr->next)
+      if (cr->cmd == 'p' || cr->cmd == 'n')
+	return 0;
+
+  return 1;
+}
+
+
+/* Simple changes and deletes can be done directly on the raw ACL */
+static GACL_BLOB_PATCH edit_patch;
+
+static int
+script_to_patch(SCRIPT *sp,
+		GACL_BLOB_PATCH *pp) {
+  ACECR *cr;
+  GACL_BLOB_OP op;
+  gacl_entry_t fep, cep;
+
+  
+  for (; sp; sp = sp->next)
+    for (cr = sp->cr; cr; cr = cr->next) {
+      fep = cr->filter.ep;
+      cep = cr->change.ep;
+      
+      if (!cr->filter.avail || !fep || cr->range || cr->filter.type != 0)
+	return -1;
+
+      memset(&op, 0, sizeof(op));
+      switch (cr->cmd) {
+      case 'S':
+	/* Only the permissions may change */
+	if (!cep || cep->tag.type != fep->tag.type || cep->type != fep->type ||
+	    cep->flags != fep->flags ||
+	    gacl_tag_ugid_np(&cep->tag) != gacl_tag_ugid_np(&fep->tag))
+	  return -1;
+	op.op = GACL_BLOB_OP_MASK;
+	op.perms = cep->perms;
+	break;
+	
+      case 'd':
+	op.op = GACL_BLOB_OP_DELETE;
+	break;
+	
+      default:
+	return -1;
+      }
+      
+      op.ftypes = cr->ftypes;
+      op.tag = fep->tag.type;
+      op.id = gacl_tag_ugid_np(&fep->tag);
+      op.type = fep->type;
+      op.flags = fep->flags;
+      
+      if (gacl_blob_patch_add(pp, &op) < 0)
+	return -1;
+    }
+
+  return 0;
 }
   
 
@@ -794,6 +844,12 @@ walker_edit(const char *path,
 
     error_return(rc, saved_error_env);
   }
+
+  if (acl_memo_lookup(path, sp) > 0)
+    error_return(0, saved_error_env);
+
+  if (edit_patch.n > 0 && set_acl_patched(path, sp, &edit_patch) >= 0)
+    error_return(0, saved_error_env);
   
   rc = get_acl(path, sp, &oap);  
   if (rc < 0)
@@ -934,9 +990,9 @@ walker_edit(const char *path,
 	    if (oep->tag.type > nep->tag.type)
 	      continue;
 	    if (oep->tag.type == GACL_TAG_TYPE_USER || oep->tag.type == GACL_TAG_TYPE_GROUP) {
-	      if (oep->tag.ugid < nep->tag.ugid)
+	      if (gacl_tag_ugid_np(&oep->tag) < gacl_tag_ugid_np(&nep->tag))
 		break;
-	      if (oep->tag.ugid > nep->tag.ugid)
+	      if (gacl_tag_ugid_np(&oep->tag) > gacl_tag_ugid_np(&nep->tag))
 		break;
 	    }
 	    if (oep->type > nep->type)
@@ -971,6 +1027,8 @@ walker_edit(const char *path,
 	    if (p >= nap->ac-1)
 	      break;
 	  }
+	  if (rc > 0)
+	    rc = 0;
 	} else {
 	  gacl_entry_t ae;
 
@@ -1045,6 +1103,8 @@ editopt_handler(const char *name,
   if (strncmp(name, "exec", 4) == 0) {
     if (acecr_from_text(&cr, vs) < 0)
       return -1;
+    buf_puts(&edit_script_text, vs);
+    buf_putc(&edit_script_text, '\n');
   } else {
     FILE *fp;
     char buf[LINE_MAX];
@@ -1068,6 +1128,8 @@ editopt_handler(const char *name,
 	error(1, 0, "%s: Invalid action at line %d", buf, n);
 	return -1;
       }
+      buf_puts(&edit_script_text, buf);
+      buf_putc(&edit_script_text, '\n');
     }
     if (fp != stdin)
       fclose(fp);
@@ -1104,6 +1166,8 @@ edit_cmd(int argc,
       error(1, 0, "%s: Invalid simple change request", argv[i]);
     if (script_add(&edit_script, cr) < 0)
       error(1, 0, "%s: Unable to add simple change request", argv[i]);
+    buf_puts(&edit_script_text, "S:");
+    buf_puts(&edit_script_text, argv[i]);
     ++i;
   }
   
@@ -1112,9 +1176,21 @@ edit_cmd(int argc,
     return 1;
   }
 
+  if (script_is_pure(edit_script)) {
+    acl_memo_begin("edit-access");
+    acl_memo_add(edit_script_text.buf, edit_script_text.len);
+  }
+
+  gacl_blob_patch_init(&edit_patch);
+  if (script_to_patch(edit_script, &edit_patch) < 0)
+    gacl_blob_patch_free(&edit_patch);
+  
   rc = aclcmd_foreach(argc-i, argv+i, walker_edit, edit_script);
+  acl_memo_end();
 
+  gacl_blob_patch_free(&edit_patch);
   script_free(&edit_script);
+  gacl_batch_free(&edit_batch);
   return rc;
 }
 
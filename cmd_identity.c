@@ -0,0 +1,70 @@
+/*
+ * cmd_identity.c - Identity map snapshots
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "acltool.h"
+#include "idcache.h"
+
+
+/*
+ * Dump the passwd/group databases into an identity map that later runs can
+ * use via --identity-map instead of asking NSS. Note that NSS backends may
+ * be configured not to enumerate everything (sssd "enumerate = false").
+ */
+static int
+identity_snapshot_cmd(int argc,
+		      char **argv) {
+  unsigned long nusers, ngroups;
+  
+
+  if (argc < 2)
+    return error(1, 0, "Missing required <file> argument");
+  
+  if (idcache_map_write(argv[1], argc > 2 ? argv[2] : NULL, &nusers, &ngroups) < 0)
+    return error(1, errno, "%s: Writing identity map", argv[1]);
+
+  if (config.f_verbose)
+    printf("%s: %lu users, %lu groups\n", argv[1], nusers, ngroups);
+  
+  return 0;
+}
+
+
+COMMAND identity_snapshot_command =
+  { "identity-snapshot", identity_snapshot_cmd, NULL, "<file> [<nfs4-domain>]", "Save users & groups to an identity map" };
@@ -0,0 +1,1292 @@
+/*
+ * cmd_index.c - Persistent ACL index (index-access & query-access)
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "acltool.h"
+#include "blobcache.h"
+#include "outbuf.h"
+
+
+/*
+ * ACL index files (see index-access).
+ *
+ * Maps paths to ACLs and principals to the ACLs (and so the paths) they
+ * appear in, so query-access can answer without walking the filesystem.
+ * Like identity maps the file is mmap()ed as is, in host byte order:
+ *
+ *   Header
+ *   Objects     sorted by path: path, ctime, inode, mode, ACL number
+ *   ACLs        canonical text and a range of object references
+ *   Principals  sorted by tag & id (name if unresolved), range of entries
+ *   Entries     one per ACE: ACL number, permissions, flags, type
+ *   References  object numbers (uint32), in path order for each ACL
+ *   Strings
+ *
+ * ACL numbers start at 1, 0 means no ACL. Rebuilding reuses the ACL of
+ * objects whose inode and ctime are unchanged since before the previous
+ * index was created, so only modified objects have their ACLs read.
+ */
+#define INDEX_MAGIC     "ACLINDEX"
+#define INDEX_VERSION   2
+#define INDEX_BYTEORDER 0x01020304
+
+typedef struct index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  int64_t created;
+  uint64_t nobjects;
+  uint64_t nacls;
+  uint64_t nprincipals;
+  uint64_t nentries;
+  uint64_t nrefs;
+  uint64_t strsize;
+} INDEX_HEADER;
+
+typedef struct index_object {
+  uint64_t path;      /* String offset */
+  int64_t ctime;
+  uint64_t ino;
+  uint32_t mode;
+  uint32_t acl;
+} INDEX_OBJECT;
+
+typedef struct index_acl {
+  uint64_t text;      /* String offset */
+  uint64_t refs;      /* First reference */
+  uint64_t nrefs;
+} INDEX_ACL;
+
+typedef struct index_principal {
+  uint64_t name;      /* String offset */
+  uint64_t entries;   /* First entry */
+  uint32_t nentries;
+  uint32_t tag;
+  uint32_t ugid;      /* (uint32_t) -1 if unresolved */
+  uint32_t pad;
+} INDEX_PRINCIPAL;
+
+typedef struct index_entry {
+  uint32_t acl;
+  uint32_t perms;
+  uint32_t flags;
+  uint32_t type;
+} INDEX_ENTRY;
+
+typedef struct index {
+  void *base;
+  size_t size;
+  const INDEX_HEADER *hp;
+  const INDEX_OBJECT *objects;
+  const INDEX_ACL *acls;
+  const INDEX_PRINCIPAL *principals;
+  const INDEX_ENTRY *entries;
+  const uint32_t *refs;
+  const char *strs;
+} INDEX;
+
+
+/* Check that everything in the index is within bounds */
+static int
+_index_check(const void *base,
+	     size_t size) {
+  const INDEX_HEADER *hp = (const INDEX_HEADER *) base;
+  const INDEX_OBJECT *op;
+  const INDEX_ACL *ap;
+  const INDEX_PRINCIPAL *pp;
+  const INDEX_ENTRY *ep;
+  const uint32_t *rp;
+  const char *strs;
+  uint64_t i, total;
+
+  
+  if (size < sizeof(*hp) ||
+      memcmp(hp->magic, INDEX_MAGIC, sizeof(hp->magic)) != 0 ||
+      hp->version != INDEX_VERSION ||
+      hp->byteorder != INDEX_BYTEORDER ||
+      hp->strsize == 0 ||
+      hp->nobjects > UINT32_MAX || hp->nacls >= UINT32_MAX ||
+      hp->nprincipals > size || hp->nentries > size || hp->nrefs > size)
+    return -1;
+
+  total = (sizeof(*hp) +
+	   hp->nobjects * sizeof(INDEX_OBJECT) +
+	   hp->nacls * sizeof(INDEX_ACL) +
+	   hp->nprincipals * sizeof(INDEX_PRINCIPAL) +
+	   hp->nentries * sizeof(INDEX_ENTRY) +
+	   hp->nrefs * sizeof(uint32_t) +
+	   hp->strsize);
+  if (total != size)
+    return -1;
+
+  strs = (const char *) base + size - hp->strsize;
+  if (strs[hp->strsize-1] != '\0')
+    return -1;
+
+  op = (const INDEX_OBJECT *) (hp+1);
+  for (i = 0; i < hp->nobjects; i++, op++)
+    if (op->path >= hp->strsize || op->acl > hp->nacls)
+      return -1;
+
+  ap = (const INDEX_ACL *) op;
+  for (i = 0; i < hp->nacls; i++, ap++)
+    if (ap->text >= hp->strsize || ap->refs > hp->nrefs || ap->nrefs > hp->nrefs - ap->refs)
+      return -1;
+  
+  pp = (const INDEX_PRINCIPAL *) ap;
+  for (i = 0; i < hp->nprincipals; i++, pp++)
+    if (pp->name >= hp->strsize || pp->entries > hp->nentries || pp->nentries > hp->nentries - pp->entries)
+      return -1;
+  
+  ep = (const INDEX_ENTRY *) pp;
+  for (i = 0; i < hp->nentries; i++, ep++)
+    if (ep->acl == 0 || ep->acl > hp->nacls)
+      return -1;
+
+  rp = (const uint32_t *) ep;
+  for (i = 0; i < hp->nrefs; i++, rp++)
+    if (*rp >= hp->nobjects)
+      return -1;
+  
+  return 0;
+}
+
+
+static int
+_index_load(INDEX *ip,
+	    const char *path) {
+  struct stat sb;
+  void *base;
+  int fd;
+
+  
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &sb) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return -1;
+
+  if (_index_check(base, sb.st_size) < 0) {
+    const INDEX_HEADER *hp = (const INDEX_HEADER *) base;
+    int ec;
+    
+    /* ESTALE: an index, but from another version of acltool */
+    ec = ((size_t) sb.st_size >= sizeof(*hp) &&
+	  memcmp(hp->magic, INDEX_MAGIC, sizeof(hp->magic)) == 0 &&
+	  hp->version != INDEX_VERSION) ? ESTALE : EINVAL;
+    munmap(base, sb.st_size);
+    errno = ec;
+    return -1;
+  }
+
+  ip->base = base;
+  ip->size = sb.st_size;
+  ip->hp = (const INDEX_HEADER *) base;
+  ip->objects = (const INDEX_OBJECT *) (ip->hp+1);
+  ip->acls = (const INDEX_ACL *) (ip->objects + ip->hp->nobjects);
+  ip->principals = (const INDEX_PRINCIPAL *) (ip->acls + ip->hp->nacls);
+  ip->entries = (const INDEX_ENTRY *) (ip->principals + ip->hp->nprincipals);
+  ip->refs = (const uint32_t *) (ip->entries + ip->hp->nentries);
+  ip->strs = (const char *) base + sb.st_size - ip->hp->strsize;
+  return 0;
+}
+
+
+static void
+_index_unload(INDEX *ip) {
+  if (ip->base)
+    munmap(ip->base, ip->size);
+  memset(ip, 0, sizeof(*ip));
+}
+
+
+/* First object with a path >= 'path' */
+static uint64_t
+_index_lower_bound(const INDEX *ip,
+		   const char *path) {
+  uint64_t lo = 0, hi = ip->hp->nobjects;
+
+  
+  while (lo < hi) {
+    uint64_t mid = lo + (hi-lo)/2;
+
+    if (strcmp(ip->strs + ip->objects[mid].path, path) < 0)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  
+  return lo;
+}
+
+
+/* "user:name", "group@" etc. Unresolvable ids are shown as numbers */
+static const char *
+_index_principal_name(GACL_TAG_TYPE tag,
+		      uid_t ugid,
+		      const char *name,
+		      char *buf,
+		      size_t bufsize) {
+  char nbuf[256];
+  const char *prefix;
+  int rc;
+  
+
+  switch (tag) {
+  case GACL_TAG_TYPE_USER_OBJ:
+    return GACL_TAG_TYPE_USER_OBJ_TEXT;
+  case GACL_TAG_TYPE_GROUP_OBJ:
+    return GACL_TAG_TYPE_GROUP_OBJ_TEXT;
+  case GACL_TAG_TYPE_EVERYONE:
+    return GACL_TAG_TYPE_EVERYONE_TEXT;
+  case GACL_TAG_TYPE_MASK:
+    return GACL_TAG_TYPE_MASK_TEXT;
+  case GACL_TAG_TYPE_OTHER:
+    return GACL_TAG_TYPE_OTHER_TEXT;
+  case GACL_TAG_TYPE_USER:
+    prefix = GACL_TAG_TYPE_USER_TEXT;
+    break;
+  case GACL_TAG_TYPE_GROUP:
+    prefix = GACL_TAG_TYPE_GROUP_TEXT;
+    break;
+  default:
+    return "?";
+  }
+
+  if (ugid == (uid_t) -1) {
+    snprintf(buf, bufsize, "%s%s", prefix, name);
+    return buf;
+  }
+  
+  rc = (tag == GACL_TAG_TYPE_USER ?
+	gacl_uid_to_name_np(ugid, nbuf, sizeof(nbuf)) :
+	gacl_gid_to_name_np(ugid, nbuf, sizeof(nbuf)));
+  if (rc == 1)
+    snprintf(buf, bufsize, "%s%s", prefix, nbuf);
+  else
+    snprintf(buf, bufsize, "%s%u", prefix, (unsigned int) ugid);
+  return buf;
+}
+
+
+/* Principal order: tag, id and - for unresolved ones - name */
+static int
+_index_principal_cmp(uint32_t at,
+		     uint32_t aid,
+		     const char *an,
+		     uint32_t bt,
+		     uint32_t bid,
+		     const char *bn) {
+  if (at != bt)
+    return at < bt ? -1 : 1;
+  if (aid != bid)
+    return aid < bid ? -1 : 1;
+  if (aid == (uint32_t) -1)
+    return strcmp(an, bn);
+  return 0;
+}
+
+
+/*
+ * Building
+ */
+
+typedef struct index_build_acl {
+  uint64_t hash;
+  uint64_t text;      /* String offset */
+  uint64_t nrefs;
+  uint32_t next;      /* Hash chain, 1.. */
+  int f_entries;      /* Entries added from a decoded ACL */
+} INDEX_BUILD_ACL;
+
+typedef struct index_build_entry {
+  uint32_t tag;
+  uint32_t ugid;
+  char *name;
+  INDEX_ENTRY e;
+} INDEX_BUILD_ENTRY;
+
+typedef struct index_build {
+  char *strs;
+  size_t strlen;
+  size_t strsize;
+  
+  INDEX_OBJECT *objects;
+  size_t nobjects;
+  size_t osize;
+  
+  INDEX_BUILD_ACL *acls;   /* acls[0] is unused */
+  size_t nacls;
+  size_t asize;
+  uint32_t *htab;
+  size_t hsize;
+
+  INDEX_BUILD_ENTRY *ev;   /* One per ACE of each distinct ACL */
+  size_t nev;
+  size_t evsize;
+
+  INDEX *old;
+  uint32_t *oldmap;        /* Old ACL number -> new */
+  unsigned long reused;
+} INDEX_BUILD;
+
+
+static int
+_index_add_str(INDEX_BUILD *bp,
+	       const char *str,
+	       size_t len,
+	       uint64_t *offp) {
+  if (bp->strlen + len+1 > bp->strsize) {
+    size_t nsize = bp->strsize ? bp->strsize*2 : 1024*1024;
+    char *nstrs;
+
+    while (bp->strlen + len+1 > nsize)
+      nsize *= 2;
+    nstrs = realloc(bp->strs, nsize);
+    if (!nstrs)
+      return -1;
+    bp->strs = nstrs;
+    bp->strsize = nsize;
+  }
+
+  memcpy(bp->strs + bp->strlen, str, len);
+  bp->strs[bp->strlen + len] = '\0';
+  *offp = bp->strlen;
+  bp->strlen += len+1;
+  return 0;
+}
+
+
+static int
+_index_grow(INDEX_BUILD *bp) {
+  size_t i, nsize = bp->hsize ? bp->hsize*2 : 4096;
+  uint32_t *nh;
+
+  
+  nh = calloc(nsize, sizeof(nh[0]));
+  if (!nh)
+    return -1;
+
+  for (i = 1; i <= bp->nacls; i++) {
+    INDEX_BUILD_ACL *ap = &bp->acls[i];
+    
+    ap->next = nh[ap->hash & (nsize-1)];
+    nh[ap->hash & (nsize-1)] = i;
+  }
+
+  free(bp->htab);
+  bp->htab = nh;
+  bp->hsize = nsize;
+  return 0;
+}
+
+
+/* ACL number for a canonical ACL text, adding it if new */
+static uint32_t
+_index_acl(INDEX_BUILD *bp,
+	   const char *text,
+	   size_t len) {
+  INDEX_BUILD_ACL *ap;
+  uint64_t h;
+  uint32_t i;
+
+  
+  h = blob_hash(0, text, len);
+  for (i = bp->hsize ? bp->htab[h & (bp->hsize-1)] : 0; i; i = bp->acls[i].next)
+    if (bp->acls[i].hash == h && strcmp(bp->strs + bp->acls[i].text, text) == 0)
+      return i;
+
+  if (bp->nacls+1 >= UINT32_MAX) {
+    errno = E2BIG;
+    return 0;
+  }
+  
+  if (bp->nacls+1 >= bp->asize) {
+    size_t nsize = bp->asize ? bp->asize*2 : 1024;
+    INDEX_BUILD_ACL *nv = realloc(bp->acls, nsize * sizeof(nv[0]));
+
+    if (!nv)
+      return 0;
+    bp->acls = nv;
+    bp->asize = nsize;
+  }
+
+  if (bp->nacls+1 > bp->hsize/2 && _index_grow(bp) < 0)
+    return 0;
+  
+  ap = &bp->acls[++bp->nacls];
+  ap->hash = h;
+  ap->nrefs = 0;
+  ap->f_entries = 0;
+  if (_index_add_str(bp, text, len, &ap->text) < 0) {
+    bp->nacls--;
+    return 0;
+  }
+  
+  ap->next = bp->htab[h & (bp->hsize-1)];
+  bp->htab[h & (bp->hsize-1)] = bp->nacls;
+  return bp->nacls;
+}
+
+
+/* The ACL from the previous index if the object is unchanged since then */
+static const char *
+_index_old_acl(INDEX_BUILD *bp,
+	       const char *path,
+	       const struct stat *sp,
+	       uint32_t *oldp) {
+  const INDEX_OBJECT *op;
+  uint64_t i;
+
+  
+  if (!bp->old || config.f_force)
+    return NULL;
+
+  i = _index_lower_bound(bp->old, path);
+  if (i >= bp->old->hp->nobjects)
+    return NULL;
+  
+  op = &bp->old->objects[i];
+  if (strcmp(bp->old->strs + op->path, path) != 0 ||
+      op->ino != (uint64_t) sp->st_ino ||
+      op->mode != (uint32_t) sp->st_mode ||
+      op->ctime != (int64_t) sp->st_ctime ||
+      op->ctime >= bp->old->hp->created)
+    return NULL;
+
+  *oldp = op->acl;
+  return op->acl ? bp->old->strs + bp->old->acls[op->acl-1].text : "";
+}
+
+
+static INDEX_BUILD_ENTRY *
+_index_new_entry(INDEX_BUILD *bp) {
+  if (bp->nev >= bp->evsize) {
+    size_t nsize = bp->evsize ? bp->evsize*2 : 1024;
+    INDEX_BUILD_ENTRY *nv = realloc(bp->ev, nsize * sizeof(nv[0]));
+    
+    if (!nv)
+      return NULL;
+    bp->ev = nv;
+    bp->evsize = nsize;
+  }
+  
+  return &bp->ev[bp->nev];
+}
+
+
+/*
+ * The principal key of an ACE. User and group ids come from the decoded
+ * tag, so NFSv4 who-strings like "alice@example.com" are resolved the
+ * same way everywhere - only really unresolvable principals keep a name.
+ */
+static uint32_t
+_index_tag_ugid(GACL_TAG *tp) {
+  if (tp->type != GACL_TAG_TYPE_USER && tp->type != GACL_TAG_TYPE_GROUP)
+    return (uint32_t) -1;
+  return (uint32_t) gacl_tag_ugid_np(tp);
+}
+
+
+/* Add the ACEs of a newly seen ACL, unless already done */
+static int
+_index_acl_entries(INDEX_BUILD *bp,
+		   uint32_t acl,
+		   gacl_t ap) {
+  INDEX_BUILD_ENTRY *bep;
+  GACL_ENTRY *ep;
+  char nbuf[512];
+  int i, rc;
+
+  
+  if (bp->acls[acl].f_entries)
+    return 0;
+  
+  for (i = 0; (rc = _gacl_get_entry(ap, i, &ep)) == 1; i++) {
+    bep = _index_new_entry(bp);
+    if (!bep)
+      return -1;
+    
+    bep->tag = ep->tag.type;
+    bep->ugid = _index_tag_ugid(&ep->tag);
+    bep->name = strdup(_index_principal_name(ep->tag.type, bep->ugid, ep->tag.name, nbuf, sizeof(nbuf)));
+    if (!bep->name)
+      return -1;
+    bep->e.acl = acl;
+    bep->e.perms = ep->perms;
+    bep->e.flags = ep->flags;
+    bep->e.type = ep->type;
+    bp->nev++;
+  }
+  if (rc < 0)
+    return -1;
+
+  bp->acls[acl].f_entries = 1;
+  return 0;
+}
+
+
+/*
+ * Canonical text of an ACL: "tag:perms:flags:type" per ACE, comma separated.
+ * Built field by field so the type is always there, unlike in compact text.
+ */
+static char *
+_index_acl_text(gacl_t ap) {
+  GACL_ENTRY *ep;
+  char *buf = NULL, *cp;
+  size_t len = 0, size = 0;
+  ssize_t n;
+  int i, rc, f;
+
+  
+  for (i = 0; (rc = _gacl_get_entry(ap, i, &ep)) == 1; i++) {
+    if (size - len < 1024) {
+      size = size ? size*2 : 4096;
+      cp = realloc(buf, size);
+      if (!cp)
+	goto Fail;
+      buf = cp;
+    }
+    if (i > 0)
+      buf[len++] = ',';
+    
+    /* Longer ACEs are rejected by _index_build_entries() anyway */
+    for (f = 0; f < 4; f++) {
+      if (len+2 >= size) {
+	errno = ERANGE;
+	goto Fail;
+      }
+      if (f > 0)
+	buf[len++] = ':';
+      switch (f) {
+      case 0:
+	n = gacl_entry_tag_to_text(ep, buf+len, size-len, GACL_TEXT_COMPACT);
+	break;
+      case 1:
+	n = gacl_entry_permset_to_text(ep, buf+len, size-len, GACL_TEXT_COMPACT);
+	break;
+      case 2:
+	n = gacl_entry_flagset_to_text(ep, buf+len, size-len, GACL_TEXT_COMPACT);
+	break;
+      default:
+	n = gacl_entry_type_to_text(ep, buf+len, size-len, GACL_TEXT_COMPACT);
+      }
+      if (n < 0)
+	goto Fail;
+      len += n;
+    }
+  }
+  if (rc < 0)
+    goto Fail;
+
+  if (!buf)
+    return strdup("");
+  return buf;
+
+ Fail:
+  free(buf);
+  return NULL;
+}
+
+
+static int
+walker_index(const char *path,
+	     const struct stat *sp,
+	     size_t base,
+	     size_t level,
+	     void *vp) {
+  INDEX_BUILD *bp = (INDEX_BUILD *) vp;
+  INDEX_OBJECT *op;
+  const char *text;
+  char *tbuf = NULL;
+  uint32_t old = 0, acl = 0;
+  gacl_t ap = NULL;
+  int rc;
+  
+
+  if (bp->nobjects >= UINT32_MAX)
+    return error(1, E2BIG, "%s: Indexing", path);
+  
+  if (bp->nobjects >= bp->osize) {
+    size_t nsize = bp->osize ? bp->osize*2 : 65536;
+    INDEX_OBJECT *nv = realloc(bp->objects, nsize * sizeof(nv[0]));
+
+    if (!nv)
+      return error(1, errno, "%s: Indexing", path);
+    bp->objects = nv;
+    bp->osize = nsize;
+  }
+
+  text = _index_old_acl(bp, path, sp, &old);
+  if (text) {
+    bp->reused++;
+    if (old)
+      acl = bp->oldmap[old];
+  } else {
+    rc = get_acl(path, sp, &ap);
+    if (rc < 0)
+      return error(1, errno, "%s: Getting ACL", path);
+    if (rc > 0) {
+      tbuf = _index_acl_text(ap);
+      if (!tbuf) {
+	gacl_free(ap);
+	return error(1, errno, "%s: Converting ACL to text", path);
+      }
+    }
+    text = tbuf;
+  }
+
+  if (text && *text && !acl) {
+    acl = _index_acl(bp, text, strlen(text));
+    if (!acl || (tbuf && _index_acl_entries(bp, acl, ap) < 0)) {
+      free(tbuf);
+      if (tbuf)
+	gacl_free(ap);
+      return error(1, errno, "%s: Indexing", path);
+    }
+    if (old)
+      bp->oldmap[old] = acl;
+  }
+  if (tbuf)
+    gacl_free(ap);
+  free(tbuf);
+
+  op = &bp->objects[bp->nobjects];
+  if (_index_add_str(bp, path, strlen(path), &op->path) < 0)
+    return error(1, errno, "%s: Indexing", path);
+  op->ctime = sp->st_ctime;
+  op->ino = sp->st_ino;
+  op->mode = sp->st_mode;
+  op->acl = acl;
+  
+  bp->nobjects++;
+  return 0;
+}
+
+
+static const char *index_sort_strs;
+
+static int
+_index_object_cmp(const void *a,
+		  const void *b) {
+  const INDEX_OBJECT *oa = (const INDEX_OBJECT *) a;
+  const INDEX_OBJECT *ob = (const INDEX_OBJECT *) b;
+
+  return strcmp(index_sort_strs + oa->path, index_sort_strs + ob->path);
+}
+
+
+static int
+_index_entry_cmp(const void *a,
+		 const void *b) {
+  const INDEX_BUILD_ENTRY *ea = (const INDEX_BUILD_ENTRY *) a;
+  const INDEX_BUILD_ENTRY *eb = (const INDEX_BUILD_ENTRY *) b;
+  int d;
+
+  d = _index_principal_cmp(ea->tag, ea->ugid, ea->name, eb->tag, eb->ugid, eb->name);
+  if (d)
+    return d;
+  return ea->e.acl < eb->e.acl ? -1 : (ea->e.acl > eb->e.acl);
+}
+
+
+/*
+ * All ACEs, sorted by principal. ACLs only seen in the previous index get
+ * theirs from it - they were decoded when that index was built.
+ */
+static INDEX_BUILD_ENTRY *
+_index_build_entries(INDEX_BUILD *bp,
+		     size_t *np) {
+  INDEX_BUILD_ENTRY *v, *bep;
+  const INDEX_PRINCIPAL *pp;
+  const INDEX_ENTRY *ep;
+  uint64_t i, j;
+  uint32_t acl;
+
+  
+  for (i = 0; bp->old && i < bp->old->hp->nprincipals; i++) {
+    pp = &bp->old->principals[i];
+    
+    for (j = pp->entries; j < pp->entries + pp->nentries; j++) {
+      ep = &bp->old->entries[j];
+      acl = bp->oldmap[ep->acl];
+      if (!acl || bp->acls[acl].f_entries)
+	continue;
+
+      bep = _index_new_entry(bp);
+      if (!bep)
+	return NULL;
+      bep->tag = pp->tag;
+      bep->ugid = pp->ugid;
+      bep->name = strdup(bp->old->strs + pp->name);
+      if (!bep->name)
+	return NULL;
+      bep->e = *ep;
+      bep->e.acl = acl;
+      bp->nev++;
+    }
+  }
+
+  qsort(bp->ev, bp->nev, sizeof(bp->ev[0]), _index_entry_cmp);
+  
+  v = bp->ev;
+  *np = bp->nev;
+  bp->ev = NULL;
+  bp->nev = bp->evsize = 0;
+  return v;
+}
+
+
+/*
+ * Write the index next to 'path' and rename it into place, so running
+ * queries keep their (old) mapping.
+ */
+static int
+_index_write(INDEX_BUILD *bp,
+	     const char *path,
+	     time_t created,
+	     INDEX_HEADER *hp) {
+  INDEX_BUILD_ENTRY *ev = NULL;
+  uint64_t *next = NULL;
+  uint32_t *refs = NULL;
+  char *tmp = NULL;
+  FILE *fp = NULL;
+  size_t i, j, n, ne = 0;
+  int fd, s_errno, f_tmp = 0;
+  mode_t um;
+
+
+  memset(hp, 0, sizeof(*hp));
+  
+  /* Path order, dropping duplicates (overlapping arguments) */
+  index_sort_strs = bp->strs;
+  qsort(bp->objects, bp->nobjects, sizeof(bp->objects[0]), _index_object_cmp);
+  for (i = j = 0; i < bp->nobjects; i++) {
+    if (j > 0 && strcmp(bp->strs + bp->objects[i].path, bp->strs + bp->objects[j-1].path) == 0)
+      continue;
+    bp->objects[j++] = bp->objects[i];
+  }
+  bp->nobjects = j;
+
+  for (i = 0; i < bp->nobjects; i++)
+    if (bp->objects[i].acl) {
+      bp->acls[bp->objects[i].acl].nrefs++;
+      hp->nrefs++;
+    }
+
+  ev = _index_build_entries(bp, &ne);
+  if (!ev && bp->nacls > 0)
+    goto Fail;
+
+  next = malloc((bp->nacls+1) * sizeof(next[0]));
+  refs = malloc((hp->nrefs+1) * sizeof(refs[0]));
+  if (!next || !refs)
+    goto Fail;
+  
+  /* A unique name next to the target, so concurrent runs don't collide */
+  tmp = s_dupcat(path, ".XXXXXX", NULL);
+  if (!tmp)
+    goto Fail;
+  
+  fd = mkstemp(tmp);
+  if (fd < 0)
+    goto Fail;
+  f_tmp = 1;
+
+  /* mkstemp() creates it 0600, give it the mode fopen() would have */
+  um = umask(0);
+  (void) umask(um);
+  if (fchmod(fd, 0666 & ~um) < 0 || !(fp = fdopen(fd, "w"))) {
+    s_errno = errno;
+    close(fd);
+    errno = s_errno;
+    goto Fail;
+  }
+  setvbuf(fp, NULL, _IOFBF, 1024*1024);
+
+  /* Header first as a placeholder, the principal count is known afterwards */
+  if (fwrite(hp, sizeof(*hp), 1, fp) != 1 ||
+      fwrite(bp->objects, sizeof(bp->objects[0]), bp->nobjects, fp) != bp->nobjects)
+    goto Fail;
+
+  for (i = 1, n = 0; i <= bp->nacls; i++) {
+    INDEX_ACL a;
+
+    a.text = bp->acls[i].text;
+    a.refs = n;
+    a.nrefs = bp->acls[i].nrefs;
+    next[i] = n;
+    n += a.nrefs;
+    if (fwrite(&a, sizeof(a), 1, fp) != 1)
+      goto Fail;
+  }
+
+  for (i = 0; i < ne; i = j) {
+    INDEX_PRINCIPAL p;
+
+    for (j = i+1; j < ne && _index_principal_cmp(ev[i].tag, ev[i].ugid, ev[i].name,
+						   ev[j].tag, ev[j].ugid, ev[j].name) == 0; j++)
+      ;
+    memset(&p, 0, sizeof(p));
+    if (_index_add_str(bp, ev[i].name, strlen(ev[i].name), &p.name) < 0)
+      goto Fail;
+    p.entries = i;
+    p.nentries = j-i;
+    p.tag = ev[i].tag;
+    p.ugid = ev[i].ugid;
+    if (fwrite(&p, sizeof(p), 1, fp) != 1)
+      goto Fail;
+    hp->nprincipals++;
+  }
+
+  for (i = 0; i < ne; i++)
+    if (fwrite(&ev[i].e, sizeof(ev[i].e), 1, fp) != 1)
+      goto Fail;
+  hp->nentries = ne;
+  
+  for (i = 0; i < bp->nobjects; i++)
+    if (bp->objects[i].acl)
+      refs[next[bp->objects[i].acl]++] = i;
+  if (fwrite(refs, sizeof(refs[0]), hp->nrefs, fp) != hp->nrefs)
+    goto Fail;
+  
+  if (fwrite(bp->strs, 1, bp->strlen, fp) != bp->strlen)
+    goto Fail;
+
+  memcpy(hp->magic, INDEX_MAGIC, sizeof(hp->magic));
+  hp->version = INDEX_VERSION;
+  hp->byteorder = INDEX_BYTEORDER;
+  hp->created = created;
+  hp->nobjects = bp->nobjects;
+  hp->nacls = bp->nacls;
+  hp->strsize = bp->strlen;
+  
+  if (fseek(fp, 0, SEEK_SET) < 0 ||
+      fwrite(hp, sizeof(*hp), 1, fp) != 1)
+    goto Fail;
+  
+  if (fclose(fp) != 0) {
+    fp = NULL;
+    goto Fail;
+  }
+  fp = NULL;
+  
+  if (rename(tmp, path) < 0)
+    goto Fail;
+
+  for (i = 0; i < ne; i++)
+    free(ev[i].name);
+  free(ev);
+  free(next);
+  free(refs);
+  free(tmp);
+  return 0;
+
+ Fail:
+  s_errno = errno;
+  if (fp)
+    fclose(fp);
+  if (f_tmp)
+    unlink(tmp);
+  for (i = 0; i < ne; i++)
+    free(ev[i].name);
+  free(ev);
+  free(next);
+  free(refs);
+  free(tmp);
+  errno = s_errno;
+  return -1;
+}
+
+
+static void
+_index_build_free(INDEX_BUILD *bp) {
+  free(bp->strs);
+  free(bp->objects);
+  free(bp->acls);
+  free(bp->htab);
+  free(bp->oldmap);
+  while (bp->nev > 0)
+    free(bp->ev[--bp->nev].name);
+  free(bp->ev);
+  memset(bp, 0, sizeof(*bp));
+}
+
+
+static int
+index_cmd(int argc,
+	  char **argv) {
+  INDEX_BUILD b;
+  INDEX_HEADER h;
+  INDEX old;
+  time_t created;
+  unsigned long reused;
+  int rc, s_errno = 0;
+
+  
+  if (argc < 3)
+    return error(1, 0, "Missing required <index> or <path> arguments");
+
+  memset(&b, 0, sizeof(b));
+  memset(&old, 0, sizeof(old));
+  
+  if (_index_load(&old, argv[1]) == 0) {
+    b.old = &old;
+    b.oldmap = calloc(old.hp->nacls+1, sizeof(b.oldmap[0]));
+    if (!b.oldmap) {
+      _index_unload(&old);
+      return error(1, errno, "%s: Loading index", argv[1]);
+    }
+  } else if (errno != ENOENT && errno != ESTALE) /* Else built from scratch */
+    return error(1, errno, "%s: Loading index", argv[1]);
+
+  /* Anything changed while walking gets a later ctime and is read next time */
+  created = time(NULL);
+  
+  rc = aclcmd_foreach(argc-2, argv+2, walker_index, &b);
+  if (rc == 0 && _index_write(&b, argv[1], created, &h) < 0) {
+    s_errno = errno;
+    rc = -1;
+  }
+
+  reused = b.reused;
+  _index_build_free(&b);
+  _index_unload(&old);
+  
+  if (s_errno)
+    return error(1, s_errno, "%s: Writing index", argv[1]);
+
+  if (rc == 0 && config.f_verbose)
+    printf("%s: %llu objects (%lu unchanged), %llu distinct ACLs, %llu principals\n",
+	   argv[1],
+	   (unsigned long long) h.nobjects, reused,
+	   (unsigned long long) h.nacls,
+	   (unsigned long long) h.nprincipals);
+  return rc;
+}
+
+
+/*
+ * Queries
+ */
+
+typedef struct query {
+  char *principal;
+  char *perms;
+  char *below;
+  size_t blen;
+  int f_deny;
+} QUERY;
+
+static QUERY query = { NULL, NULL, NULL, 0, 0 };
+
+
+static int
+queryopt_handler(const char *name,
+		 const char *vs,
+		 unsigned int type,
+		 const void *svp,
+		 void *dvp,
+		 const char *a0) {
+  char **sp = NULL;
+
+  
+  if (strcmp(name, "deny") == 0) {
+    query.f_deny = 1;
+    return 0;
+  }
+  
+  if (strcmp(name, "principal") == 0)
+    sp = &query.principal;
+  else if (strcmp(name, "perms") == 0)
+    sp = &query.perms;
+  else
+    sp = &query.below;
+
+  if (*sp)
+    free(*sp);
+  *sp = s_dup(vs);
+  return *sp ? 0 : -1;
+}
+
+static OPTION query_options[] =
+  {
+   { "principal", 'u', OPTS_TYPE_STR,  queryopt_handler, NULL, "Objects with entries for a principal (user:name, group:name, owner@...)" },
+   { "perms",     'a', OPTS_TYPE_STR,  queryopt_handler, NULL, "Objects with allow (or deny) entries for at least these permissions" },
+   { "deny",      'x', OPTS_TYPE_NONE, queryopt_handler, NULL, "Match deny instead of allow entries" },
+   { "below",     'b', OPTS_TYPE_STR,  queryopt_handler, NULL, "Objects at or below a path" },
+   { NULL,        0,   0,              NULL,             NULL, NULL },
+  };
+
+
+/* Path at or below qp->below (if set) and of a selected type */
+static int
+_query_object_match(const QUERY *qp,
+		    const INDEX *ip,
+		    const INDEX_OBJECT *op) {
+  const char *path = ip->strs + op->path;
+
+  
+  if (config.f_filetype && !(op->mode & config.f_filetype))
+    return 0;
+  if (!qp->below)
+    return 1;
+  
+  return (strncmp(path, qp->below, qp->blen) == 0 &&
+	  (path[qp->blen] == '\0' || path[qp->blen] == '/' || qp->below[qp->blen-1] == '/'));
+}
+
+
+static int
+_query_print(OUTBUF *ob,
+	     const INDEX *ip,
+	     const INDEX_OBJECT *op) {
+  const char *path = ip->strs + op->path;
+  size_t len = strlen(path);
+
+  
+  outbuf_put(ob, path, len);
+  if (config.f_verbose) {
+    outbuf_pad(ob, ' ', (len < 24 ? 24-len : 0) + 2);
+    outbuf_puts(ob, op->acl ? ip->strs + ip->acls[op->acl-1].text : "-");
+  }
+  outbuf_putc(ob, '\n');
+  return outbuf_release(ob);
+}
+
+
+static int
+_query_ref_cmp(const void *a,
+	       const void *b) {
+  uint32_t ra = * (const uint32_t *) a;
+  uint32_t rb = * (const uint32_t *) b;
+
+  return ra < rb ? -1 : (ra > rb);
+}
+
+
+/* Mark the ACLs with entries matching the principal/permission filter */
+static int
+_query_match_acls(const QUERY *qp,
+		  const INDEX *ip,
+		  char *match) {
+  const INDEX_PRINCIPAL *pp;
+  char spec[1024], nbuf[512];
+  const char *name;
+  GACL_ENTRY e;
+  uint64_t i, lo, hi;
+  uint32_t mask;
+
+  
+  if (snprintf(spec, sizeof(spec), "%s:%s",
+	       qp->principal ? qp->principal : GACL_TAG_TYPE_EVERYONE_TEXT,
+	       qp->perms ? qp->perms : "") >= sizeof(spec) ||
+      _gacl_entry_from_text(spec, &e, GACL_TEXT_RELAXED) < 0)
+    return error(1, errno ? errno : EINVAL, "%s: Invalid principal or permissions", spec);
+  mask = qp->perms ? e.perms : 0;
+
+  lo = 0;
+  hi = ip->hp->nentries;
+  if (qp->principal) {
+    uint64_t plo = 0, phi = ip->hp->nprincipals;
+
+    /* Resolved like the decoded ACEs were, see _index_tag_ugid() */
+    if (e.tag.ugid == (uid_t) -1)
+      e.tag.flags |= GACL_TAG_F_LAZY;
+    e.tag.ugid = _index_tag_ugid(&e.tag);
+    name = _index_principal_name(e.tag.type, e.tag.ugid, e.tag.name, nbuf, sizeof(nbuf));
+    while (plo < phi) {
+      uint64_t mid = plo + (phi-plo)/2;
+
+      pp = &ip->principals[mid];
+      if (_index_principal_cmp(pp->tag, pp->ugid, ip->strs + pp->name,
+			       e.tag.type, e.tag.ugid, name) < 0)
+	plo = mid+1;
+      else
+	phi = mid;
+    }
+    
+    pp = &ip->principals[plo];
+    if (plo >= ip->hp->nprincipals ||
+	_index_principal_cmp(pp->tag, pp->ugid, ip->strs + pp->name,
+			     e.tag.type, e.tag.ugid, name) != 0)
+      return 0;
+    
+    lo = pp->entries;
+    hi = lo + pp->nentries;
+  }
+
+  for (i = lo; i < hi; i++) {
+    const INDEX_ENTRY *ep = &ip->entries[i];
+
+    if ((ep->perms & mask) != mask)
+      continue;
+    if (qp->f_deny ? ep->type != GACL_ENTRY_TYPE_DENY : (mask && ep->type != GACL_ENTRY_TYPE_ALLOW))
+      continue;
+    match[ep->acl] = 1;
+  }
+  
+  return 0;
+}
+
+
+static int
+query_cmd(int argc,
+	  char **argv) {
+  QUERY q = query;
+  INDEX x;
+  OUTBUF *ob;
+  char *match = NULL;
+  uint32_t *v = NULL;
+  uint64_t i, j, n = 0;
+  int rc = 0, s_errno = 0;
+
+  
+  memset(&query, 0, sizeof(query));
+  
+  if (argc != 2 || _index_load(&x, argv[1]) < 0) {
+    s_errno = errno;
+    free(q.principal);
+    free(q.perms);
+    free(q.below);
+    if (argc != 2)
+      return error(1, 0, "Expected a single <index> argument");
+    if (s_errno == ESTALE)
+      return error(1, 0, "%s: Index from another version, rerun index-access", argv[1]);
+    return error(1, s_errno, "%s: Loading index", argv[1]);
+  }
+
+  if (q.below) {
+    q.blen = strlen(q.below);
+    while (q.blen > 1 && q.below[q.blen-1] == '/')
+      q.below[--q.blen] = '\0';
+  }
+  
+  ob = outbuf_open(stdout);
+  if (!ob) {
+    s_errno = errno;
+    goto Unload;
+  }
+  
+  if (!q.principal && !q.perms && !q.f_deny) {
+    /* Path queries only need the object range */
+    i = q.below ? _index_lower_bound(&x, q.below) : 0;
+    for (; i < x.hp->nobjects; i++) {
+      const INDEX_OBJECT *op = &x.objects[i];
+      
+      if (q.below && strncmp(x.strs + op->path, q.below, q.blen) != 0)
+	break;
+      if (_query_object_match(&q, &x, op) && _query_print(ob, &x, op) < 0) {
+	s_errno = errno;
+	goto Unload;
+      }
+    }
+  } else {
+    match = calloc(x.hp->nacls+1, 1);
+    if (!match) {
+      s_errno = errno;
+      goto Unload;
+    }
+    rc = _query_match_acls(&q, &x, match);
+
+    /* Collect the objects using the matching ACLs, in path order */
+    for (i = 1; i <= x.hp->nacls; i++)
+      if (match[i])
+	n += x.acls[i-1].nrefs;
+    v = malloc((n+1) * sizeof(v[0]));
+    if (!v) {
+      s_errno = errno;
+      goto Unload;
+    }
+
+    n = 0;
+    for (i = 1; i <= x.hp->nacls; i++)
+      if (match[i])
+	for (j = 0; j < x.acls[i-1].nrefs; j++) {
+	  uint32_t r = x.refs[x.acls[i-1].refs + j];
+
+	  if (_query_object_match(&q, &x, &x.objects[r]))
+	    v[n++] = r;
+	}
+    qsort(v, n, sizeof(v[0]), _query_ref_cmp);
+    
+    for (i = 0; i < n; i++)
+      if (_query_print(ob, &x, &x.objects[v[i]]) < 0) {
+	s_errno = errno;
+	goto Unload;
+      }
+  }
+
+  if (outbuf_flush(ob) < 0)
+    s_errno = errno;
+  
+ Unload:
+  _index_unload(&x);
+  free(match);
+  free(v);
+  free(q.principal);
+  free(q.perms);
+  free(q.below);
+
+  if (s_errno)
+    return error(1, s_errno, "%s: Querying index", argv[1]);
+  return rc;
+}
+
+
+COMMAND index_command =
+  { "index-access", index_cmd, NULL, "<index> <path>+", "Build or refresh an ACL index" };
+
+COMMAND query_command =
+  { "query-access", query_cmd, query_options, "<index>", "Look up objects in an ACL index" };
@@ -0,0 +1,1000 @@
+/*
+ * cmd_inherit.c - NFSv4 ACL inheritance propagation (inherit-access)
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "acltool.h"
+#include "blobcache.h"
+#include "vfs.h"
+
+
+/*
+ * Propagates the inheritable entries of the top directory's ACL (which is
+ * left as it is) down the tree, NFSv4 style: every object gets its own
+ * explicit entries followed by what it inherits from its parent's (new)
+ * ACL - so NO_PROPAGATE_INHERIT stops after one level and intermediate
+ * directories pass on their own inheritable entries too.
+ * ACLs that only mirror the mode bits (see gacl_equiv_np()) count as
+ * having no explicit entries.
+ *
+ * What a directory passes on (gacl_inherit_np() for subdirectories and for
+ * other objects) is derived once per distinct directory ACL, and the new
+ * ACL of a child is memoized on (child's raw ACL, file type and permission
+ * bits, parent ACL), so the common case is one read and a cache lookup per
+ * object.
+ *
+ * Directory ACLs are written after everything below them, so an aborted
+ * run leaves the unfinished directories looking unfinished. With --prune
+ * subtrees below directories whose ACL already is current are skipped -
+ * objects added to such a subtree later are not seen then. With -b objects
+ * that only have explicit entries are left alone and block propagation
+ * below them, like a protected ACL.
+ *
+ * Directories are queued as they are found and handled by a pool of
+ * threads. Those write raw ACLs directly - the generic set_acl() path
+ * (printing, validation, sorting/merging, non-raw file systems) is used
+ * single threaded.
+ */
+
+#define INHERIT_MAX_JOBS     64
+#define INHERIT_DEFAULT_JOBS 8
+#define INHERIT_SET_HSIZE    1024
+
+#define INHERIT_MIN_BUFSIZE  1024
+#define INHERIT_MAX_BUFSIZE  (64*1024*1024) /* Sanity limit only */
+
+
+/* What a directory passes on - shared by all directories with the same ACL */
+typedef struct inherit_set {
+  uint64_t hash;
+  char *raw;              /* The directory's ACL (NULL without raw ACLs) */
+  size_t rlen;
+  unsigned int id;        /* Memo fingerprint */
+  gacl_t da;              /* For subdirectories */
+  gacl_t fa;              /* For everything else */
+  struct inherit_set *next;
+} INHERIT_SET;
+
+/* A directory to descend into - its own ACL is written once that is done */
+typedef struct inherit_job {
+  char *path;
+  struct stat st;
+  size_t level;
+  INHERIT_SET *isp;       /* What it passes on (from its new ACL) */
+  unsigned int refs;      /* Reading it + unfinished subdirectories */
+
+  int f_update;           /* Pending write */
+  int f_changed;
+  char *raw;              /* New ACL */
+  size_t rlen;
+  gacl_t ap;              /* ... without raw ACLs */
+
+  struct inherit_job *parent;
+  struct inherit_job *next;
+} INHERIT_JOB;
+
+typedef struct inherit_buf {
+  char *buf;
+  size_t size;
+} INHERIT_BUF;
+
+typedef struct inherit {
+  pthread_mutex_t lock;
+  pthread_cond_t cv;
+
+  INHERIT_JOB *queue;     /* Directories waiting to be read (LIFO) */
+  int active;             /* Jobs being worked on */
+  int f_abort;
+
+  int f_raw;              /* Raw ACLs supported */
+  int f_setacl;           /* Write via set_acl() - single threaded */
+  int f_block;
+  int f_prune;
+  int maxlevel;
+
+  INHERIT_SET *stab[INHERIT_SET_HSIZE];
+  INHERIT_SET *sets;      /* Not shared (no raw ACLs) */
+  unsigned int nsets;
+  BLOBCACHE *memo;
+
+  /* First failure - reported once the workers are done */
+  char *epath;
+  const char *ewhat;
+  int eno;
+
+  unsigned long objects;
+  unsigned long dirs;
+  unsigned long pruned;
+  unsigned long blocked;
+} INHERIT;
+
+typedef struct inherit_worker {
+  INHERIT *ip;
+  pthread_t tid;
+  INHERIT_BUF rb;         /* Object's current ACL */
+  INHERIT_BUF ob;         /* Object's new ACL */
+} INHERIT_WORKER;
+
+
+static int inherit_block = 0;
+static int inherit_prune = 0;
+static int inherit_jobs = 0;
+
+
+
+static int
+_inherit_grow(INHERIT_BUF *bp,
+	      size_t size) {
+  char *nbuf;
+
+
+  if (size < INHERIT_MIN_BUFSIZE)
+    size = INHERIT_MIN_BUFSIZE;
+  if (size <= bp->size)
+    return 0;
+
+  nbuf = realloc(bp->buf, size);
+  if (!nbuf)
+    return -1;
+
+  bp->buf = nbuf;
+  bp->size = size;
+  return 0;
+}
+
+
+static ssize_t
+_inherit_read(const char *path,
+	      const struct stat *sp,
+	      INHERIT_BUF *bp) {
+  int flags = S_ISLNK(sp->st_mode) ? VFS_ACL_FLAG_NOFOLLOW : 0;
+  ssize_t len;
+
+
+  if (_inherit_grow(bp, INHERIT_MIN_BUFSIZE) < 0)
+    return -1;
+
+  for (;;) {
+    len = vfs_acl_get_raw(path, GACL_TYPE_NFS4, bp->buf, bp->size, flags);
+    if (len >= 0 || errno != ERANGE)
+      return len;
+
+    len = vfs_acl_get_raw(path, GACL_TYPE_NFS4, NULL, 0, flags);
+    if (len < 0)
+      return -1;
+
+    if (_inherit_grow(bp, len+1) < 0)
+      return -1;
+  }
+}
+
+
+static ssize_t
+_inherit_encode(gacl_t ap,
+		INHERIT_BUF *bp) {
+  ssize_t len;
+
+
+  if (_inherit_grow(bp, INHERIT_MIN_BUFSIZE) < 0)
+    return -1;
+
+  while ((len = gacl_to_raw_np(ap, bp->buf, bp->size)) < 0 && errno == ENOMEM) {
+    if (bp->size >= INHERIT_MAX_BUFSIZE ||
+	_inherit_grow(bp, bp->size*2) < 0)
+      return -1;
+  }
+
+  return len;
+}
+
+
+/* Remember the first failure and make the workers stop */
+static int
+_inherit_fail(INHERIT *ip,
+	      const char *path,
+	      const char *what) {
+  int s_errno = errno;
+
+
+  pthread_mutex_lock(&ip->lock);
+  if (!ip->epath) {
+    ip->epath = strdup(path);
+    ip->ewhat = what;
+    ip->eno = s_errno;
+  }
+  ip->f_abort = 1;
+  pthread_cond_broadcast(&ip->cv);
+  pthread_mutex_unlock(&ip->lock);
+
+  errno = s_errno;
+  return -1;
+}
+
+
+static void
+_inherit_set_free(INHERIT_SET *isp) {
+  if (isp->da)
+    gacl_free(isp->da);
+  if (isp->fa)
+    gacl_free(isp->fa);
+  free(isp->raw);
+  free(isp);
+}
+
+
+/*
+ * Get the inheritance set for a directory ACL - given as raw bytes (shared
+ * between directories) or, without raw ACL support, as 'ap' only.
+ */
+static INHERIT_SET *
+_inherit_set_get(INHERIT *ip,
+		 const void *raw,
+		 size_t rlen,
+		 gacl_t ap) {
+  INHERIT_SET *isp, *nsp;
+  uint64_t h = 0;
+  gacl_t dap = NULL;
+
+
+  if (raw) {
+    h = blob_hash(0, raw, rlen);
+
+    pthread_mutex_lock(&ip->lock);
+    for (isp = ip->stab[h % INHERIT_SET_HSIZE]; isp; isp = isp->next)
+      if (isp->hash == h && isp->rlen == rlen && memcmp(isp->raw, raw, rlen) == 0)
+	break;
+    pthread_mutex_unlock(&ip->lock);
+    if (isp)
+      return isp;
+  }
+
+  if (!ap) {
+    ap = dap = gacl_from_raw_np(raw, rlen);
+    if (!ap)
+      return NULL;
+  }
+
+  nsp = calloc(1, sizeof(*nsp));
+  if (!nsp)
+    goto Fail;
+
+  nsp->hash = h;
+  nsp->da = gacl_inherit_np(ap, 1);
+  nsp->fa = gacl_inherit_np(ap, 0);
+  if (!nsp->da || !nsp->fa)
+    goto Fail;
+
+  if (raw) {
+    nsp->raw = malloc(rlen ? rlen : 1);
+    if (!nsp->raw)
+      goto Fail;
+    memcpy(nsp->raw, raw, rlen);
+    nsp->rlen = rlen;
+  }
+
+  if (dap)
+    gacl_free(dap);
+
+  pthread_mutex_lock(&ip->lock);
+  if (raw) {
+    /* Someone else might have beaten us to it */
+    for (isp = ip->stab[h % INHERIT_SET_HSIZE]; isp; isp = isp->next)
+      if (isp->hash == h && isp->rlen == rlen && memcmp(isp->raw, raw, rlen) == 0)
+	break;
+    if (isp) {
+      pthread_mutex_unlock(&ip->lock);
+      _inherit_set_free(nsp);
+      return isp;
+    }
+    nsp->next = ip->stab[h % INHERIT_SET_HSIZE];
+    ip->stab[h % INHERIT_SET_HSIZE] = nsp;
+  } else {
+    nsp->next = ip->sets;
+    ip->sets = nsp;
+  }
+  nsp->id = ++ip->nsets;
+  pthread_mutex_unlock(&ip->lock);
+
+  return nsp;
+
+ Fail:
+  if (nsp)
+    _inherit_set_free(nsp);
+  if (dap)
+    gacl_free(dap);
+  return NULL;
+}
+
+
+/*
+ * The new ACL for an object below 'psp': its explicit (not inherited)
+ * entries followed by the ones it inherits. An ACL that only reflects the
+ * mode bits (as after a copy without ACLs) has no explicit entries. Blocked
+ * objects (-b) get a copy of their old ACL.
+ */
+static gacl_t
+_inherit_compute(INHERIT *ip,
+		 gacl_t oap,
+		 INHERIT_SET *psp,
+		 const struct stat *sp,
+		 int *blockedp) {
+  int f_dir = S_ISDIR(sp->st_mode);
+  gacl_t nap, iap = f_dir ? psp->da : psp->fa;
+  gacl_t map;
+  gacl_entry_t ep;
+  gacl_flagset_t fs;
+  int i, f_mode, f_inherited = 0;
+
+
+  map = _gacl_from_mode(sp->st_mode);
+  if (!map)
+    return NULL;
+  f_mode = gacl_equiv_np(oap, map, f_dir ? 0 : GACL_EQUIV_F_NODIR);
+  gacl_free(map);
+  if (f_mode < 0)
+    return NULL;
+
+  for (i = 0; !f_mode && _gacl_get_entry(oap, i, &ep) == 1; i++) {
+    if (gacl_get_flagset_np(ep, &fs) < 0)
+      return NULL;
+    if (gacl_get_flag_np(fs, GACL_FLAG_INHERITED) == 1)
+      f_inherited = 1;
+  }
+
+  *blockedp = 0;
+  if (ip->f_block && !f_mode && !f_inherited) {
+    *blockedp = 1;
+    return gacl_dup(oap);
+  }
+
+  nap = gacl_init(oap->ac + iap->ac);
+  if (!nap)
+    return NULL;
+  nap->type = oap->type;
+
+  for (i = 0; !f_mode && _gacl_get_entry(oap, i, &ep) == 1; i++) {
+    if (gacl_get_flagset_np(ep, &fs) < 0)
+      goto Fail;
+    if (gacl_get_flag_np(fs, GACL_FLAG_INHERITED) == 1)
+      continue;
+    if (gacl_add_entry_np(&nap, ep, -1) < 0)
+      goto Fail;
+  }
+
+  for (i = 0; _gacl_get_entry(iap, i, &ep) == 1; i++)
+    if (gacl_add_entry_np(&nap, ep, -1) < 0)
+      goto Fail;
+
+  return nap;
+
+ Fail:
+  gacl_free(nap);
+  return NULL;
+}
+
+
+static int
+_inherit_write(INHERIT *ip,
+	       const char *path,
+	       const struct stat *sp,
+	       const void *raw,
+	       size_t rlen) {
+  if (!config.f_noupdate &&
+      vfs_acl_set_raw(path, GACL_TYPE_NFS4, raw, rlen,
+		      S_ISLNK(sp->st_mode) ? VFS_ACL_FLAG_NOFOLLOW : 0) < 0)
+    return _inherit_fail(ip, path, "Setting ACL");
+
+  pthread_mutex_lock(&ip->lock);
+  acl_stats.writes++;
+  if (config.f_verbose)
+    printf("%s: ACL Updated%s\n", path, (config.f_noupdate ? " (NOT)" : ""));
+  pthread_mutex_unlock(&ip->lock);
+  return 1;
+}
+
+
+/*
+ * Write an object's new ACL - given as raw bytes, or as 'ap' without raw
+ * ACL support.
+ */
+static int
+_inherit_update(INHERIT *ip,
+		const char *path,
+		const struct stat *sp,
+		int f_changed,
+		const void *raw,
+		size_t rlen,
+		gacl_t ap) {
+  gacl_t nap;
+  int rc;
+
+
+  if (!f_changed && !config.f_force) {
+    pthread_mutex_lock(&ip->lock);
+    acl_stats.skipped++;
+    pthread_mutex_unlock(&ip->lock);
+    return 0;
+  }
+
+  if (!ip->f_setacl)
+    return _inherit_write(ip, path, sp, raw, rlen);
+
+  /* Generic path - single threaded so error() is fine here */
+  nap = ap ? ap : gacl_from_raw_np(raw, rlen);
+  if (!nap)
+    return _inherit_fail(ip, path, "Decoding ACL");
+
+  rc = set_acl(path, sp, nap, NULL);
+  if (nap != ap)
+    gacl_free(nap);
+  if (rc < 0)
+    return _inherit_fail(ip, path, "Setting ACL");
+  return rc;
+}
+
+
+static INHERIT_JOB *
+_inherit_job_new(const char *path,
+		 const struct stat *sp,
+		 INHERIT_SET *isp) {
+  INHERIT_JOB *jp;
+
+
+  jp = calloc(1, sizeof(*jp));
+  if (!jp)
+    return NULL;
+
+  jp->path = strdup(path);
+  if (!jp->path) {
+    free(jp);
+    return NULL;
+  }
+  jp->st = *sp;
+  jp->isp = isp;
+  jp->refs = 1;
+  return jp;
+}
+
+
+static void
+_inherit_job_free(INHERIT_JOB *jp) {
+  if (jp->ap)
+    gacl_free(jp->ap);
+  free(jp->raw);
+  free(jp->path);
+  free(jp);
+}
+
+
+/*
+ * Drop a reference to a directory job. The last one writes the
+ * directory's new ACL (unless aborted - a rerun must see it as not done)
+ * and passes on to the parent.
+ */
+static void
+_inherit_job_release(INHERIT *ip,
+		     INHERIT_JOB *jp) {
+  INHERIT_JOB *pp;
+  int f_last, f_abort;
+
+
+  while (jp) {
+    pthread_mutex_lock(&ip->lock);
+    f_last = (--jp->refs == 0);
+    f_abort = ip->f_abort;
+    pthread_mutex_unlock(&ip->lock);
+    if (!f_last)
+      return;
+
+    if (jp->f_update && !f_abort)
+      _inherit_update(ip, jp->path, &jp->st, jp->f_changed, jp->raw, jp->rlen, jp->ap);
+
+    pp = jp->parent;
+    _inherit_job_free(jp);
+    jp = pp;
+  }
+}
+
+
+/*
+ * Update one object below the directory with inheritance set 'psp'.
+ *
+ * Directories to descend into (if 'jpp' is given) are returned as a job
+ * in '*jpp' instead of being written - that happens when everything below
+ * them is done, so a directory with a current ACL has a finished subtree.
+ * With --prune such directories are not descended into again. Returns -1
+ * on failure (already recorded with _inherit_fail()).
+ */
+static int
+_inherit_object(INHERIT_WORKER *wp,
+		const char *path,
+		const struct stat *sp,
+		INHERIT_SET *psp,
+		INHERIT_JOB **jpp) {
+  INHERIT *ip = wp->ip;
+  INHERIT_JOB *jp;
+  INHERIT_SET *nsp;
+  gacl_t oap = NULL, nap = NULL;
+  ssize_t olen = -1, nlen = -1;
+  int f_dir = S_ISDIR(sp->st_mode);
+  int f_update = (!config.f_filetype || (sp->st_mode & config.f_filetype));
+  int f_changed = 0, f_hit = 0, f_blocked = 0, rc = -1;
+  mode_t ftype = (f_dir ? S_IFDIR : S_IFREG) | (sp->st_mode & 0777);
+  BLOBCACHE_ENTRY *bp;
+  const void *raw;
+
+
+  if (jpp)
+    *jpp = NULL;
+  else
+    f_dir = 0;
+
+  /* Only directories need to be looked at for their content */
+  if (!f_update && !f_dir)
+    return 0;
+
+  if (ip->f_raw) {
+    olen = _inherit_read(path, sp, &wp->rb);
+    if (olen < 0) {
+      if (S_ISLNK(sp->st_mode) && errno == ENOTSUP)
+	return 0;
+      return _inherit_fail(ip, path, "Getting ACL");
+    }
+
+    /* Blocked objects are never memoized */
+    pthread_mutex_lock(&ip->lock);
+    bp = blobcache_lookup(ip->memo, wp->rb.buf, olen, ftype, psp->id);
+    if (bp) {
+      f_hit = 1;
+      f_changed = (bp->obuf != NULL);
+      nlen = f_changed ? (ssize_t) bp->olen : olen;
+      if (f_changed) {
+	if (_inherit_grow(&wp->ob, nlen) == 0)
+	  memcpy(wp->ob.buf, bp->obuf, nlen);
+	else
+	  f_hit = -1;
+      }
+    }
+    pthread_mutex_unlock(&ip->lock);
+    if (f_hit < 0)
+      return _inherit_fail(ip, path, "Getting ACL");
+  }
+
+  if (!f_hit) {
+    if (ip->f_raw)
+      oap = gacl_from_raw_np(wp->rb.buf, olen);
+    else {
+      rc = get_acl(path, sp, &oap);
+      if (rc == 0)
+	return 0;
+      rc = -1;
+    }
+    if (!oap)
+      return _inherit_fail(ip, path, "Getting ACL");
+
+    nap = _inherit_compute(ip, oap, psp, sp, &f_blocked);
+    if (!nap) {
+      _inherit_fail(ip, path, "Inheriting ACL");
+      goto End;
+    }
+    f_changed = (gacl_match(nap, oap) != 1);
+
+    if (ip->f_raw) {
+      if (f_changed) {
+	nlen = _inherit_encode(nap, &wp->ob);
+	if (nlen < 0) {
+	  _inherit_fail(ip, path, "Encoding ACL");
+	  goto End;
+	}
+      } else
+	nlen = olen;
+
+      if (!f_blocked) {
+	pthread_mutex_lock(&ip->lock);
+	blobcache_insert(ip->memo, wp->rb.buf, olen, ftype, psp->id,
+			 f_changed ? wp->ob.buf : NULL, nlen);
+	pthread_mutex_unlock(&ip->lock);
+      }
+    }
+  }
+  raw = f_changed ? wp->ob.buf : wp->rb.buf;
+
+  pthread_mutex_lock(&ip->lock);
+  if (f_update)
+    ip->objects++;
+  if (f_blocked)
+    ip->blocked++;
+  if (f_dir && (f_blocked || (ip->f_prune && !config.f_force && f_update && !f_changed))) {
+    ip->pruned++;
+    f_dir = 0;
+  }
+  pthread_mutex_unlock(&ip->lock);
+
+  if (!f_dir) {
+    if (f_update && _inherit_update(ip, path, sp, f_changed, raw, nlen, nap) < 0)
+      goto End;
+    rc = 0;
+    goto End;
+  }
+
+  if (ip->f_raw)
+    nsp = _inherit_set_get(ip, raw, nlen, NULL);
+  else
+    nsp = _inherit_set_get(ip, NULL, 0, nap);
+  if (!nsp) {
+    _inherit_fail(ip, path, "Inheriting ACL");
+    goto End;
+  }
+
+  jp = _inherit_job_new(path, sp, nsp);
+  if (!jp) {
+    _inherit_fail(ip, path, "Queueing directory");
+    goto End;
+  }
+  jp->f_update = f_update;
+  jp->f_changed = f_changed;
+  if (ip->f_raw) {
+    jp->raw = malloc(nlen ? nlen : 1);
+    if (!jp->raw) {
+      _inherit_job_free(jp);
+      _inherit_fail(ip, path, "Queueing directory");
+      goto End;
+    }
+    memcpy(jp->raw, raw, nlen);
+    jp->rlen = nlen;
+  } else {
+    jp->ap = nap;
+    nap = NULL;
+  }
+  *jpp = jp;
+  rc = 0;
+
+ End:
+  if (nap)
+    gacl_free(nap);
+  if (oap)
+    gacl_free(oap);
+  return rc;
+}
+
+
+static void
+_inherit_push(INHERIT *ip,
+	      INHERIT_JOB *jp) {
+  pthread_mutex_lock(&ip->lock);
+  if (jp->parent)
+    jp->parent->refs++;
+  jp->next = ip->queue;
+  ip->queue = jp;
+  pthread_cond_signal(&ip->cv);
+  pthread_mutex_unlock(&ip->lock);
+}
+
+
+/* Update the content of one directory, queueing subdirectories */
+static int
+_inherit_dir(INHERIT_WORKER *wp,
+	     INHERIT_JOB *jp) {
+  INHERIT *ip = wp->ip;
+  VFS_DIR *dp;
+  struct dirent *dep;
+  struct stat sb;
+  int f_descend, rc = 0;
+
+
+  dp = vfs_opendir(jp->path);
+  if (!dp)
+    return _inherit_fail(ip, jp->path, "Opening directory");
+
+  pthread_mutex_lock(&ip->lock);
+  ip->dirs++;
+  pthread_mutex_unlock(&ip->lock);
+
+  f_descend = (ip->maxlevel < 0 || jp->level+1 < (size_t) ip->maxlevel);
+
+  while (!ip->f_abort && (dep = vfs_readdir(dp)) != NULL) {
+    INHERIT_JOB *cjp = NULL;
+    char *fpath;
+
+    if (strcmp(dep->d_name, ".") == 0 ||
+	strcmp(dep->d_name, "..") == 0)
+      continue;
+
+    fpath = s_dupcat(jp->path, "/", dep->d_name, NULL);
+    if (!fpath) {
+      rc = _inherit_fail(ip, jp->path, "Reading directory");
+      break;
+    }
+
+    if (vfs_lstat(fpath, &sb) < 0) {
+      rc = _inherit_fail(ip, fpath, "Getting attributes");
+      free(fpath);
+      break;
+    }
+
+    rc = _inherit_object(wp, fpath, &sb, jp->isp, f_descend ? &cjp : NULL);
+    free(fpath);
+    if (rc < 0)
+      break;
+
+    if (cjp) {
+      cjp->parent = jp;
+      cjp->level = jp->level+1;
+      _inherit_push(ip, cjp);
+    }
+  }
+
+  vfs_closedir(dp);
+  return rc;
+}
+
+
+static void *
+_inherit_worker(void *vp) {
+  INHERIT_WORKER *wp = (INHERIT_WORKER *) vp;
+  INHERIT *ip = wp->ip;
+  INHERIT_JOB *jp;
+
+
+  pthread_mutex_lock(&ip->lock);
+  for (;;) {
+    while (!ip->queue && ip->active > 0 && !ip->f_abort)
+      pthread_cond_wait(&ip->cv, &ip->lock);
+
+    if (!ip->queue || ip->f_abort)
+      break;
+
+    jp = ip->queue;
+    ip->queue = jp->next;
+    ip->active++;
+    pthread_mutex_unlock(&ip->lock);
+
+    _inherit_dir(wp, jp);
+    _inherit_job_release(ip, jp);
+
+    pthread_mutex_lock(&ip->lock);
+    ip->active--;
+    if (!ip->queue && ip->active == 0)
+      pthread_cond_broadcast(&ip->cv);
+  }
+  pthread_mutex_unlock(&ip->lock);
+
+  return NULL;
+}
+
+
+/*
+ * Get what the top directory passes on - its ACL is used as it is. Sets
+ * '*ispp' to NULL if there is nothing to propagate (not a directory).
+ */
+static int
+_inherit_root(INHERIT *ip,
+	      INHERIT_WORKER *wp,
+	      const char *path,
+	      const struct stat *sp,
+	      INHERIT_SET **ispp) {
+  gacl_t ap = NULL;
+  ssize_t len;
+  int rc;
+
+
+  *ispp = NULL;
+  if (!S_ISDIR(sp->st_mode))
+    return 0;
+
+  if (ip->f_raw) {
+    len = _inherit_read(path, sp, &wp->rb);
+    if (len < 0)
+      return _inherit_fail(ip, path, "Getting ACL");
+    *ispp = _inherit_set_get(ip, wp->rb.buf, len, NULL);
+  } else {
+    rc = get_acl(path, sp, &ap);
+    if (rc < 0)
+      return _inherit_fail(ip, path, "Getting ACL");
+    *ispp = _inherit_set_get(ip, NULL, 0, ap);
+    gacl_free(ap);
+  }
+  if (!*ispp)
+    return _inherit_fail(ip, path, "Inheriting ACL");
+
+  return 0;
+}
+
+
+static int
+inheritopt_handler(const char *name,
+		   const char *vs,
+		   unsigned int type,
+		   const void *svp,
+		   void *dvp,
+		   const char *a0) {
+  if (strcmp(name, "block") == 0)
+    inherit_block = 1;
+  else if (strcmp(name, "prune") == 0)
+    inherit_prune = 1;
+  else {
+    inherit_jobs = * (int *) svp;
+    if (inherit_jobs < 1 || inherit_jobs > INHERIT_MAX_JOBS) {
+      inherit_jobs = 0;
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static OPTION inherit_options[] =
+  {
+   { "block", 'b', OPTS_TYPE_NONE, inheritopt_handler, NULL, "Leave explicit-only ACLs alone and don't propagate past them" },
+   { "prune", 'u', OPTS_TYPE_NONE, inheritopt_handler, NULL, "Skip subtrees below directories whose ACL is already current" },
+   { "jobs",  'j', OPTS_TYPE_UINT, inheritopt_handler, NULL, "Number of directories to process in parallel" },
+   { NULL,    0,   0,              NULL,               NULL, NULL },
+  };
+
+
+static int
+inherit_cmd(int argc,
+	    char **argv) {
+  INHERIT x;
+  INHERIT_WORKER *wv;
+  INHERIT_SET *isp;
+  INHERIT_JOB *jp;
+  struct stat sb;
+  int i, j, njobs, nworkers, maxworkers = 1, f_generic;
+
+
+  memset(&x, 0, sizeof(x));
+  x.f_block = inherit_block;
+  x.f_prune = inherit_prune;
+  x.maxlevel = config.f_recurse ? -1 : config.max_depth;
+  njobs = inherit_jobs;
+
+  inherit_block = 0;
+  inherit_prune = 0;
+  inherit_jobs = 0;
+
+  if (njobs == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    njobs = (n < 1 ? 1 : (n > INHERIT_DEFAULT_JOBS ? INHERIT_DEFAULT_JOBS : (int) n));
+  }
+
+  /* set_acl() uses shared state and error() can't be called from a thread */
+  f_generic = (config.f_print || config.f_validate || config.f_sort || config.f_merge);
+
+  wv = calloc(njobs, sizeof(*wv));
+  x.memo = blobcache_create(0, 0);
+  if (!wv || !x.memo) {
+    free(wv);
+    if (x.memo)
+      blobcache_destroy(x.memo);
+    return error(1, errno, "Initializing");
+  }
+  pthread_mutex_init(&x.lock, NULL);
+  pthread_cond_init(&x.cv, NULL);
+  for (j = 0; j < njobs; j++)
+    wv[j].ip = &x;
+
+  for (i = 1; i < argc && !x.epath; i++) {
+    if (vfs_lstat(argv[i], &sb) < 0) {
+      _inherit_fail(&x, argv[i], "Getting attributes");
+      break;
+    }
+
+    /* Raw ACLs (and threads) only for local file systems */
+    x.f_raw = (vfs_acl_get_raw(argv[i], GACL_TYPE_NFS4, NULL, 0,
+			       S_ISLNK(sb.st_mode) ? VFS_ACL_FLAG_NOFOLLOW : 0) >= 0 ||
+	       errno != ENOSYS);
+    x.f_setacl = (f_generic || !x.f_raw);
+    nworkers = (x.f_setacl ? 1 : njobs);
+
+    if (_inherit_root(&x, &wv[0], argv[i], &sb, &isp) < 0)
+      break;
+    if (!isp || x.maxlevel == 0)
+      continue;
+
+    jp = _inherit_job_new(argv[i], &sb, isp);
+    if (!jp) {
+      _inherit_fail(&x, argv[i], "Queueing directory");
+      break;
+    }
+    _inherit_push(&x, jp);
+
+    for (j = 1; j < nworkers; j++)
+      if (pthread_create(&wv[j].tid, NULL, _inherit_worker, &wv[j]) != 0)
+	break;
+    nworkers = j;
+    if (nworkers > maxworkers)
+      maxworkers = nworkers;
+
+    _inherit_worker(&wv[0]);
+
+    for (j = 1; j < nworkers; j++)
+      pthread_join(wv[j].tid, NULL);
+
+    /* Drop what's left after a failure - without writing anything */
+    while ((jp = x.queue) != NULL) {
+      x.queue = jp->next;
+      _inherit_job_release(&x, jp);
+    }
+  }
+
+  if (!x.epath && config.f_verbose) {
+    printf("%lu objects in %lu directories, %lu subtrees skipped, %lu blocked, %u distinct inherited ACLs (%d jobs)\n",
+	   x.objects, x.dirs, x.pruned, x.blocked, x.nsets, maxworkers);
+    blobcache_print_stats(&x.memo->stats, stdout);
+  }
+
+  for (j = 0; j < njobs; j++) {
+    free(wv[j].rb.buf);
+    free(wv[j].ob.buf);
+  }
+  free(wv);
+
+  for (j = 0; j < INHERIT_SET_HSIZE; j++)
+    while ((isp = x.stab[j]) != NULL) {
+      x.stab[j] = isp->next;
+      _inherit_set_free(isp);
+    }
+  while ((isp = x.sets) != NULL) {
+    x.sets = isp->next;
+    _inherit_set_free(isp);
+  }
+  blobcache_destroy(x.memo);
+  pthread_cond_destroy(&x.cv);
+  pthread_mutex_destroy(&x.lock);
+
+  if (x.epath) {
+    char ebuf[2048];
+
+    snprintf(ebuf, sizeof(ebuf), "%s: %s", x.epath, x.ewhat);
+    free(x.epath);
+    return error(1, x.eno, "%s", ebuf);
+  }
+  return 0;
+}
+
+
+COMMAND inherit_command =
+  { "inherit-access",   inherit_cmd,	inherit_options, "<path>+",		"Propagate ACL inheritance" };
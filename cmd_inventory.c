@@ -0,0 +1,626 @@
+/*
+ * cmd_inventory.c - ACL inventory reports
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "acltool.h"
+#include "blobcache.h"
+#include "outbuf.h"
+
+
+/*
+ * Walks the trees once and keeps one record per distinct ACL (by content,
+ * ignoring owner and group), so memory use follows the number of distinct
+ * ACLs and not the number of objects. Everything else - trivial/deny
+ * counts, sizes, what -s/-m would change and per-principal counts - is
+ * derived from those records when the report is printed.
+ */
+
+#define INVENTORY_EXAMPLES   3
+#define INVENTORY_LIMIT      10
+#define INVENTORY_HSIZE      1024
+#define INVENTORY_SIZES      9     /* 1-2, 3-4, 5-8 ... 129-256, 257+ entries */
+
+typedef struct inventory_acl {
+  uint64_t hash;
+  GACL *ap;
+  int f_trivial;
+  int f_deny;
+  int f_sort;       /* Would be changed by -s */
+  int f_merge;      /* Would be changed by -m */
+  unsigned long objects;
+  unsigned long dirs;
+  int nex;
+  char *examples[INVENTORY_EXAMPLES];
+  struct inventory_acl *next;
+} INVENTORY_ACL;
+
+typedef struct inventory {
+  size_t hsize;
+  INVENTORY_ACL **htab;
+  size_t acls;
+  
+  unsigned long objects;
+  unsigned long files;
+  unsigned long dirs;
+  unsigned long noacl;
+} INVENTORY;
+
+typedef struct inventory_principal {
+  GACL_TAG_TYPE type;
+  uid_t ugid;
+  const char *name;
+  size_t acl;       /* Index of the distinct ACL the entry came from */
+  unsigned long aces;
+  unsigned long objects;
+} INVENTORY_PRINCIPAL;
+
+
+static unsigned int inventory_limit = INVENTORY_LIMIT;
+
+
+/* Only user:/group: entries have an id, unresolvable ones are told apart by name */
+static uid_t
+_inventory_ugid(GACL_ENTRY *ep) {
+  if (ep->tag.type != GACL_TAG_TYPE_USER && ep->tag.type != GACL_TAG_TYPE_GROUP)
+    return 0;
+  
+  return gacl_tag_ugid_np(&ep->tag);
+}
+
+
+static uint64_t
+_inventory_hash(GACL *ap) {
+  uint32_t k[5];
+  uint64_t h;
+  int i;
+
+  
+  k[0] = ap->type;
+  h = blob_hash(0, k, sizeof(k[0]));
+  
+  for (i = 0; i < ap->ac; i++) {
+    GACL_ENTRY *ep = &ap->av[i];
+    
+    k[0] = ep->tag.type;
+    k[1] = _inventory_ugid(ep);
+    k[2] = ep->perms;
+    k[3] = ep->flags;
+    k[4] = ep->type;
+    h = blob_hash(h, k, sizeof(k));
+    if (k[1] == (uint32_t) -1)
+      h = blob_hash(h, ep->tag.name, strlen(ep->tag.name));
+  }
+
+  return h;
+}
+
+
+static int
+_inventory_equal(GACL *a,
+		 GACL *b) {
+  int i;
+
+  
+  if (a->type != b->type || a->ac != b->ac)
+    return 0;
+  
+  for (i = 0; i < a->ac; i++) {
+    GACL_ENTRY *ae = &a->av[i];
+    GACL_ENTRY *be = &b->av[i];
+    uid_t id;
+    
+    if (ae->tag.type != be->tag.type || ae->perms != be->perms ||
+	ae->flags != be->flags || ae->type != be->type)
+      return 0;
+    
+    id = _inventory_ugid(ae);
+    if (id != _inventory_ugid(be))
+      return 0;
+    if (id == (uid_t) -1 && strcmp(ae->tag.name, be->tag.name) != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+
+/* Would 'op' (gacl_sort or gacl_merge) change the ACL? Failures count as no */
+static int
+_inventory_changes(GACL *ap,
+		   GACL *(*op)(GACL *ap)) {
+  GACL *nap;
+  int rc;
+
+  
+  nap = op(ap);
+  if (!nap)
+    return 0;
+
+  rc = !_inventory_equal(ap, nap);
+  gacl_free(nap);
+  return rc;
+}
+
+
+static int
+_inventory_grow(INVENTORY *ip) {
+  INVENTORY_ACL **htab, *xp, *next;
+  size_t i, hsize;
+
+  
+  hsize = ip->hsize ? ip->hsize * 2 : INVENTORY_HSIZE;
+  htab = calloc(hsize, sizeof(htab[0]));
+  if (!htab)
+    return -1;
+
+  for (i = 0; i < ip->hsize; i++)
+    for (xp = ip->htab[i]; xp; xp = next) {
+      next = xp->next;
+      xp->next = htab[xp->hash % hsize];
+      htab[xp->hash % hsize] = xp;
+    }
+  
+  free(ip->htab);
+  ip->htab = htab;
+  ip->hsize = hsize;
+  return 0;
+}
+
+
+/* Find the record for 'ap', adding one (with a copy of 'ap') if needed */
+static INVENTORY_ACL *
+_inventory_lookup(INVENTORY *ip,
+		  GACL *ap) {
+  INVENTORY_ACL *xp;
+  uint64_t h;
+  int i;
+  
+
+  if (ip->acls >= ip->hsize && _inventory_grow(ip) < 0)
+    return NULL;
+  
+  h = _inventory_hash(ap);
+  for (xp = ip->htab[h % ip->hsize]; xp; xp = xp->next)
+    if (xp->hash == h && _inventory_equal(xp->ap, ap))
+      return xp;
+
+  xp = calloc(1, sizeof(*xp));
+  if (!xp)
+    return NULL;
+  
+  xp->ap = gacl_dup(ap);
+  if (!xp->ap) {
+    free(xp);
+    return NULL;
+  }
+  
+  xp->hash = h;
+  if (gacl_is_trivial_np(ap, &xp->f_trivial) < 0)
+    xp->f_trivial = 0;
+  for (i = 0; i < ap->ac && !xp->f_deny; i++)
+    xp->f_deny = (ap->av[i].type == GACL_ENTRY_TYPE_DENY);
+  xp->f_sort = _inventory_changes(ap, gacl_sort);
+  xp->f_merge = _inventory_changes(ap, gacl_merge);
+
+  xp->next = ip->htab[h % ip->hsize];
+  ip->htab[h % ip->hsize] = xp;
+  ip->acls++;
+  return xp;
+}
+
+
+static void
+_inventory_free(INVENTORY *ip) {
+  INVENTORY_ACL *xp, *next;
+  size_t i;
+  int j;
+
+  
+  for (i = 0; i < ip->hsize; i++)
+    for (xp = ip->htab[i]; xp; xp = next) {
+      next = xp->next;
+      for (j = 0; j < xp->nex; j++)
+	free(xp->examples[j]);
+      gacl_free(xp->ap);
+      free(xp);
+    }
+  
+  free(ip->htab);
+  memset(ip, 0, sizeof(*ip));
+}
+
+
+static int
+walker_inventory(const char *path,
+		 const struct stat *sp,
+		 size_t base,
+		 size_t level,
+		 void *vp) {
+  INVENTORY *ip = (INVENTORY *) vp;
+  INVENTORY_ACL *xp;
+  gacl_t ap;
+  int rc;
+
+  
+  rc = get_acl(path, sp, &ap);
+  if (rc < 0)
+    return error(1, errno, "%s: Getting ACL", path);
+
+  ip->objects++;
+  if (S_ISDIR(sp->st_mode))
+    ip->dirs++;
+  else if (S_ISREG(sp->st_mode))
+    ip->files++;
+  
+  if (rc == 0) {
+    ip->noacl++;
+    return 0;
+  }
+
+  xp = _inventory_lookup(ip, ap);
+  gacl_free(ap);
+  if (!xp)
+    return error(1, errno, "%s: Adding ACL to inventory", path);
+  
+  xp->objects++;
+  if (S_ISDIR(sp->st_mode))
+    xp->dirs++;
+  if (xp->nex < INVENTORY_EXAMPLES) {
+    xp->examples[xp->nex] = strdup(path);
+    if (!xp->examples[xp->nex])
+      return error(1, errno, "%s: Adding ACL to inventory", path);
+    xp->nex++;
+  }
+  
+  return 0;
+}
+
+
+/* Most common first */
+static int
+_inventory_acl_compare(const void *va,
+		       const void *vb) {
+  const INVENTORY_ACL *a = * (const INVENTORY_ACL **) va;
+  const INVENTORY_ACL *b = * (const INVENTORY_ACL **) vb;
+
+  
+  if (a->objects != b->objects)
+    return a->objects > b->objects ? -1 : 1;
+  if (a->ap->ac != b->ap->ac)
+    return a->ap->ac < b->ap->ac ? -1 : 1;
+  return 0;
+}
+
+
+/* Groups entries for the same principal, in ACL order */
+static int
+_inventory_principal_compare(const void *va,
+			     const void *vb) {
+  const INVENTORY_PRINCIPAL *a = (const INVENTORY_PRINCIPAL *) va;
+  const INVENTORY_PRINCIPAL *b = (const INVENTORY_PRINCIPAL *) vb;
+  int v;
+
+  
+  if (a->type != b->type)
+    return a->type < b->type ? -1 : 1;
+  if (a->ugid != b->ugid)
+    return a->ugid < b->ugid ? -1 : 1;
+  if (a->ugid == (uid_t) -1 && (v = strcmp(a->name, b->name)) != 0)
+    return v;
+  if (a->acl != b->acl)
+    return a->acl < b->acl ? -1 : 1;
+  return 0;
+}
+
+
+/* Most ACEs first */
+static int
+_inventory_principal_count_compare(const void *va,
+				   const void *vb) {
+  const INVENTORY_PRINCIPAL *a = (const INVENTORY_PRINCIPAL *) va;
+  const INVENTORY_PRINCIPAL *b = (const INVENTORY_PRINCIPAL *) vb;
+
+  
+  if (a->aces != b->aces)
+    return a->aces > b->aces ? -1 : 1;
+  if (a->objects != b->objects)
+    return a->objects > b->objects ? -1 : 1;
+  return 0;
+}
+
+
+static const char *
+_inventory_principal_text(const INVENTORY_PRINCIPAL *pp,
+			  char *buf,
+			  size_t bufsize) {
+  char nbuf[256];
+  int rc;
+  
+  
+  switch (pp->type) {
+  case GACL_TAG_TYPE_USER_OBJ:
+    return GACL_TAG_TYPE_USER_OBJ_TEXT;
+  case GACL_TAG_TYPE_GROUP_OBJ:
+    return GACL_TAG_TYPE_GROUP_OBJ_TEXT;
+  case GACL_TAG_TYPE_EVERYONE:
+    return GACL_TAG_TYPE_EVERYONE_TEXT;
+  case GACL_TAG_TYPE_MASK:
+    return GACL_TAG_TYPE_MASK_TEXT;
+  case GACL_TAG_TYPE_OTHER:
+    return GACL_TAG_TYPE_OTHER_TEXT;
+  case GACL_TAG_TYPE_USER:
+  case GACL_TAG_TYPE_GROUP:
+    break;
+  default:
+    return "?";
+  }
+
+  rc = 0;
+  if (pp->ugid != (uid_t) -1)
+    rc = (pp->type == GACL_TAG_TYPE_USER ?
+	  gacl_uid_to_name_np(pp->ugid, nbuf, sizeof(nbuf)) :
+	  gacl_gid_to_name_np(pp->ugid, nbuf, sizeof(nbuf)));
+  
+  if (rc == 1)
+    snprintf(buf, bufsize, "%s%s (%u)",
+	     pp->type == GACL_TAG_TYPE_USER ? GACL_TAG_TYPE_USER_TEXT : GACL_TAG_TYPE_GROUP_TEXT,
+	     nbuf, (unsigned int) pp->ugid);
+  else if (pp->ugid != (uid_t) -1)
+    snprintf(buf, bufsize, "%s%u",
+	     pp->type == GACL_TAG_TYPE_USER ? GACL_TAG_TYPE_USER_TEXT : GACL_TAG_TYPE_GROUP_TEXT,
+	     (unsigned int) pp->ugid);
+  else
+    snprintf(buf, bufsize, "%s%s",
+	     pp->type == GACL_TAG_TYPE_USER ? GACL_TAG_TYPE_USER_TEXT : GACL_TAG_TYPE_GROUP_TEXT,
+	     pp->name);
+  return buf;
+}
+
+
+static int
+_inventory_print_principals(OUTBUF *ob,
+			    INVENTORY_ACL **v,
+			    size_t n) {
+  INVENTORY_PRINCIPAL *pv;
+  size_t i, pn, np;
+  int j;
+  char buf[300];
+  
+
+  pn = 0;
+  for (i = 0; i < n; i++)
+    pn += v[i]->ap->ac;
+  if (pn == 0)
+    return 0;
+  
+  pv = calloc(pn, sizeof(pv[0]));
+  if (!pv)
+    return -1;
+
+  pn = 0;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < v[i]->ap->ac; j++) {
+      GACL_ENTRY *ep = &v[i]->ap->av[j];
+
+      pv[pn].type = ep->tag.type;
+      pv[pn].ugid = _inventory_ugid(ep);
+      pv[pn].name = ep->tag.name;
+      pv[pn].acl = i;
+      pv[pn].aces = v[i]->objects;
+      pn++;
+    }
+  
+  qsort(pv, pn, sizeof(pv[0]), _inventory_principal_compare);
+
+  /* Fold each principal into its first slot */
+  np = 0;
+  for (i = 0; i < pn; i++) {
+    if (i > 0 &&
+	pv[i].type == pv[np-1].type && pv[i].ugid == pv[np-1].ugid &&
+	(pv[i].ugid != (uid_t) -1 || strcmp(pv[i].name, pv[np-1].name) == 0)) {
+      if (pv[i].acl != pv[i-1].acl)
+	pv[np-1].objects += v[pv[i].acl]->objects;
+      pv[np-1].aces += pv[i].aces;
+      continue;
+    }
+    
+    pv[np] = pv[i];
+    pv[np].objects = v[pv[i].acl]->objects;
+    np++;
+  }
+
+  qsort(pv, np, sizeof(pv[0]), _inventory_principal_count_compare);
+
+  outbuf_printf(ob, "\nPrincipals (top %lu of %lu):\n", (unsigned long) (np < inventory_limit ? np : inventory_limit), (unsigned long) np);
+  outbuf_printf(ob, "  %10s  %10s  %s\n", "ACEs", "Objects", "Principal");
+  for (i = 0; i < np && i < inventory_limit; i++)
+    outbuf_printf(ob, "  %10lu  %10lu  %s\n", pv[i].aces, pv[i].objects, _inventory_principal_text(&pv[i], buf, sizeof(buf)));
+  
+  free(pv);
+  return 0;
+}
+
+
+static int
+_inventory_print(OUTBUF *ob,
+		 INVENTORY *ip) {
+  INVENTORY_ACL **v, *xp;
+  unsigned long trivial, deny, sort, merge;
+  unsigned long sizes[INVENTORY_SIZES][2];
+  size_t i, n;
+  int j, b;
+  
+
+  v = calloc(ip->acls ? ip->acls : 1, sizeof(v[0]));
+  if (!v)
+    return -1;
+
+  n = 0;
+  for (i = 0; i < ip->hsize; i++)
+    for (xp = ip->htab[i]; xp; xp = xp->next)
+      v[n++] = xp;
+
+  trivial = deny = sort = merge = 0;
+  memset(sizes, 0, sizeof(sizes));
+  for (i = 0; i < n; i++) {
+    xp = v[i];
+    if (xp->f_trivial)
+      trivial += xp->objects;
+    if (xp->f_deny)
+      deny += xp->objects;
+    if (xp->f_sort)
+      sort += xp->objects;
+    if (xp->f_merge)
+      merge += xp->objects;
+    
+    for (b = 0, j = 2; j < xp->ap->ac && b < INVENTORY_SIZES-1; j <<= 1)
+      b++;
+    sizes[b][0] += xp->objects;
+    sizes[b][1]++;
+  }
+
+  outbuf_printf(ob, "Objects:               %10lu  (%lu files, %lu directories, %lu other)\n",
+		ip->objects, ip->files, ip->dirs, ip->objects - ip->files - ip->dirs);
+  outbuf_printf(ob, "  Without ACL:         %10lu\n", ip->noacl);
+  outbuf_printf(ob, "  Trivial ACL:         %10lu\n", trivial);
+  outbuf_printf(ob, "  Non-trivial ACL:     %10lu\n", ip->objects - ip->noacl - trivial);
+  outbuf_printf(ob, "  With DENY entries:   %10lu\n", deny);
+  outbuf_printf(ob, "  Changed by --sort:   %10lu\n", sort);
+  outbuf_printf(ob, "  Changed by --merge:  %10lu\n", merge);
+  outbuf_printf(ob, "Distinct ACLs:         %10lu\n", (unsigned long) n);
+
+  outbuf_printf(ob, "\nACL sizes:\n");
+  outbuf_printf(ob, "  %10s  %10s  %10s\n", "Entries", "Objects", "Distinct");
+  for (b = 0; b < INVENTORY_SIZES; b++) {
+    char buf[32];
+    
+    if (!sizes[b][1])
+      continue;
+    if (b == INVENTORY_SIZES-1)
+      snprintf(buf, sizeof(buf), "%d+", (1 << b) + 1);
+    else
+      snprintf(buf, sizeof(buf), "%d-%d", b ? (1 << b) + 1 : 1, 2 << b);
+    outbuf_printf(ob, "  %10s  %10lu  %10lu\n", buf, sizes[b][0], sizes[b][1]);
+  }
+
+  qsort(v, n, sizeof(v[0]), _inventory_acl_compare);
+
+  /* T = trivial, D = has DENY entries, s/m = changed by --sort/--merge */
+  outbuf_printf(ob, "\nACLs (top %lu of %lu):\n", (unsigned long) (n < inventory_limit ? n : inventory_limit), (unsigned long) n);
+  outbuf_printf(ob, "  %10s  %10s  %7s  %5s  %s\n", "Objects", "Dirs", "Entries", "Flags", "Example");
+  for (i = 0; i < n && i < inventory_limit; i++) {
+    xp = v[i];
+    outbuf_printf(ob, "  %10lu  %10lu  %7d  %c%c%c%c   %s\n",
+		  xp->objects, xp->dirs, xp->ap->ac,
+		  xp->f_trivial ? 'T' : '-',
+		  xp->f_deny ? 'D' : '-',
+		  xp->f_sort ? 's' : '-',
+		  xp->f_merge ? 'm' : '-',
+		  xp->examples[0]);
+    
+    if (config.f_verbose) {
+      char *text = gacl_to_text_np(xp->ap, NULL, GACL_TEXT_COMPACT);
+      
+      for (j = 1; j < xp->nex; j++)
+	outbuf_printf(ob, "  %10s  %10s  %7s  %5s  %s\n", "", "", "", "", xp->examples[j]);
+      if (text) {
+	outbuf_printf(ob, "  %10s  %10s  %7s  %5s  %s\n", "", "", "", "", text);
+	gacl_free(text);
+      }
+    }
+  }
+
+  if (_inventory_print_principals(ob, v, n) < 0) {
+    free(v);
+    return -1;
+  }
+  
+  free(v);
+  return 0;
+}
+
+
+static int
+inventoryopt_limit(const char *name,
+		   const char *vs,
+		   unsigned int type,
+		   const void *svp,
+		   void *dvp,
+		   const char *a0) {
+  inventory_limit = * (int *) svp;
+  return 0;
+}
+
+static OPTION inventory_options[] =
+  {
+   { "limit", 'L', OPTS_TYPE_UINT, inventoryopt_limit, NULL, "Number of ACLs and principals to list (default 10)" },
+   { NULL,    0,   0,              NULL,               NULL, NULL },
+  };
+
+
+static int
+inventory_cmd(int argc,
+	      char **argv) {
+  INVENTORY inv;
+  int rc, s_errno = 0;
+  
+
+  memset(&inv, 0, sizeof(inv));
+  rc = aclcmd_foreach(argc-1, argv+1, walker_inventory, &inv);
+  if (rc == 0) {
+    OUTBUF *ob = outbuf_open(stdout);
+    
+    if (!ob || _inventory_print(ob, &inv) < 0 || outbuf_flush(ob) < 0) {
+      s_errno = errno;
+      rc = -1;
+    }
+  }
+
+  _inventory_free(&inv);
+  inventory_limit = INVENTORY_LIMIT;
+  
+  if (s_errno)
+    return error(1, s_errno, "Generating inventory report");
+  return rc;
+}
+
+
+COMMAND inventory_command =
+  { "inventory-access", inventory_cmd, inventory_options, "<path>+", "Summarize the ACLs in use" };
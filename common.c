@@ -47,6 +47,8 @@
 
 #include "acltool.h"
 #include "common.h"
+#include "blobcache.h"
+#include "outbuf.h"
 
 
 #define GACL_CLEAN_BITS_INVALID   0x03
@@ -94,6 +96,489 @@ clean_acl(GACL *ap,
   return 0;
 }
 
+/*
+ * Raw ACL blob memoization.
+ *
+ * Most objects in a tree carry one of a handful of distinct ACLs. For commands
+ * where the resulting ACL only depends on the old ACL, the file type and the
+ * command arguments we remember the raw output blob (or that nothing needed to
+ * change) keyed on the raw input blob, so a cache hit costs one getxattr and
+ * at most one setxattr - no decoding, name lookups or encoding.
+ */
+typedef struct acl_memo {
+  BLOBCACHE *cache;
+  int enabled;
+  uint64_t fingerprint;
+  BLOBCACHE_STATS s0;
+  
+  /* Object currently going through the full (cache miss) path */
+  const char *path;
+  mode_t ftype;
+  
+  char *ibuf;
+  size_t isize;
+  ssize_t ilen;
+  
+  char *obuf;
+  size_t osize;
+} ACL_MEMO;
+
+static ACL_MEMO memo = { NULL, 0 };
+
+
+#define ACL_MEMO_MIN_BUFSIZE 8192
+#define ACL_MEMO_MAX_BUFSIZE (64*1024*1024)
+
+static int
+_acl_memo_grow(char **bufp,
+	       size_t *sizep,
+	       size_t size) {
+  char *nbuf;
+  size_t nsize;
+
+  
+  if (size <= *sizep)
+    return 0;
+
+  nsize = *sizep ? *sizep : ACL_MEMO_MIN_BUFSIZE;
+  while (nsize < size)
+    nsize <<= 1;
+  
+  nbuf = realloc(*bufp, nsize);
+  if (!nbuf)
+    return -1;
+  
+  *bufp = nbuf;
+  *sizep = nsize;
+  return 0;
+}
+
+
+/*
+ * Start memoizing for a command. The fingerprint covers the command name and
+ * the options that affect the resulting ACL, callers add their arguments with
+ * acl_memo_add() / acl_memo_add_acl().
+ */
+int
+acl_memo_begin(const char *name) {
+  int f[4];
+  
+  
+  memo.enabled = 0;
+  memo.path = NULL;
+  
+  /* set_acl() wants the decoded ACL for printing */
+  if (config.f_print)
+    return 0;
+  
+  if (!memo.cache) {
+    memo.cache = blobcache_create(0, 0);
+    if (!memo.cache)
+      return -1;
+  }
+  
+  memo.s0 = memo.cache->stats;
+
+  f[0] = config.f_sort;
+  f[1] = config.f_merge;
+  f[2] = config.f_force;
+  f[3] = config.f_relaxed;
+  
+  memo.fingerprint = blob_hash(0, name, strlen(name)+1);
+  memo.fingerprint = blob_hash(memo.fingerprint, f, sizeof(f));
+  
+  memo.enabled = 1;
+  return 1;
+}
+
+
+void
+acl_memo_add(const void *data,
+	     size_t len) {
+  memo.fingerprint = blob_hash(memo.fingerprint, &len, sizeof(len));
+  if (len > 0)
+    memo.fingerprint = blob_hash(memo.fingerprint, data, len);
+}
+
+
+static ssize_t
+_acl_encode(gacl_t ap,
+	    char **bufp,
+	    size_t *sizep) {
+  ssize_t len;
+
+  
+  if (_acl_memo_grow(bufp, sizep, ACL_MEMO_MIN_BUFSIZE) < 0)
+    return -1;
+  
+  while ((len = gacl_to_raw_np(ap, *bufp, *sizep)) < 0 && errno == ENOMEM) {
+    if (*sizep >= ACL_MEMO_MAX_BUFSIZE ||
+	_acl_memo_grow(bufp, sizep, *sizep*2) < 0)
+      return -1;
+  }
+
+  return len;
+}
+
+
+static ssize_t
+_acl_memo_encode(gacl_t ap) {
+  return _acl_encode(ap, &memo.obuf, &memo.osize);
+}
+
+
+void
+acl_memo_add_acl(gacl_t ap) {
+  ssize_t len;
+
+  
+  if (!memo.enabled)
+    return;
+  
+  len = _acl_memo_encode(ap);
+  if (len < 0) {
+    memo.enabled = 0;
+    return;
+  }
+  
+  acl_memo_add(memo.obuf, len);
+}
+
+
+void
+acl_memo_disable(void) {
+  memo.enabled = 0;
+  memo.path = NULL;
+}
+
+
+void
+acl_memo_end(void) {
+  BLOBCACHE_STATS d;
+  
+  
+  if (memo.enabled && config.f_verbose) {
+    d.lookups   = memo.cache->stats.lookups   - memo.s0.lookups;
+    d.hits      = memo.cache->stats.hits      - memo.s0.hits;
+    d.unchanged = memo.cache->stats.unchanged - memo.s0.unchanged;
+    d.misses    = memo.cache->stats.misses    - memo.s0.misses;
+    d.inserts   = memo.cache->stats.inserts   - memo.s0.inserts;
+    d.evictions = memo.cache->stats.evictions - memo.s0.evictions;
+    blobcache_print_stats(&d, stdout);
+  }
+  
+  acl_memo_disable();
+}
+
+
+static ssize_t
+_acl_read_raw(const char *path,
+	      int flags,
+	      char **bufp,
+	      size_t *sizep) {
+  ssize_t len;
+
+  
+  /* Read speculatively - only ask for the size if the buffer is too small */
+  if (*sizep == 0 && _acl_memo_grow(bufp, sizep, ACL_MEMO_MIN_BUFSIZE) < 0)
+    return -1;
+  
+  for (;;) {
+    if (*sizep > 0) {
+      len = vfs_acl_get_raw(path, GACL_TYPE_NFS4, *bufp, *sizep, flags);
+      if (len >= 0 || errno != ERANGE)
+	return len;
+    }
+    
+    len = vfs_acl_get_raw(path, GACL_TYPE_NFS4, NULL, 0, flags);
+    if (len < 0)
+      return -1;
+    
+    if (_acl_memo_grow(bufp, sizep, len+1) < 0)
+      return -1;
+  }
+}
+
+
+static ssize_t
+_acl_memo_read(const char *path,
+	       int flags) {
+  return _acl_read_raw(path, flags, &memo.ibuf, &memo.isize);
+}
+
+
+static int
+_acl_memo_pending(const char *path) {
+  return memo.enabled && memo.path && strcmp(memo.path, path) == 0;
+}
+
+
+static void
+_acl_memo_record(const char *path,
+		 const void *obuf,
+		 size_t olen) {
+  if (!_acl_memo_pending(path))
+    return;
+  
+  /* Failing to cache something is not an error */
+  (void) blobcache_insert(memo.cache, memo.ibuf, memo.ilen, memo.ftype, memo.fingerprint, obuf, olen);
+  memo.path = NULL;
+}
+
+
+/*
+ * Look up the object's raw ACL in the cache. Returns 1 if the object was
+ * completely handled, 0 if the caller should do the full processing (which
+ * will then be recorded by get_acl()/set_acl()/acl_memo_unchanged()).
+ */
+int
+acl_memo_lookup(const char *path,
+		const struct stat *sp) {
+  BLOBCACHE_ENTRY *ep;
+  int flags;
+  
+
+  memo.path = NULL;
+  if (!memo.enabled)
+    return 0;
+
+  flags = S_ISLNK(sp->st_mode) ? VFS_ACL_FLAG_NOFOLLOW : 0;
+  
+  memo.ilen = _acl_memo_read(path, flags);
+  if (memo.ilen < 0)
+    return 0;
+  
+  ep = blobcache_lookup(memo.cache, memo.ibuf, memo.ilen, sp->st_mode & S_IFMT, memo.fingerprint);
+  if (!ep) {
+    memo.path = path;
+    memo.ftype = sp->st_mode & S_IFMT;
+    return 0;
+  }
+
+  /* Known to need no change */
+  if (!ep->obuf) {
+    acl_stats.skipped++;
+    return 1;
+  }
+
+  if (!config.f_noupdate &&
+      vfs_acl_set_raw(path, GACL_TYPE_NFS4, ep->obuf, ep->olen, flags) < 0)
+    return error(1, errno, "%s: Setting ACL", path);
+
+  acl_stats.writes++;
+  if (config.f_verbose)
+    printf("%s: ACL Updated%s\n", path, (config.f_noupdate ? " (NOT)" : ""));
+  
+  return 1;
+}
+
+
+/* The full path decided that nothing needs to be done for this object */
+void
+acl_memo_unchanged(const char *path) {
+  _acl_memo_record(path, NULL, 0);
+}
+
+
+/*
+ * Raw blob pre-checks.
+ *
+ * Walkers that only care about some ACLs (non-trivial ones, ones with a
+ * certain ACE...) can ask acl_peek() first. It fetches the raw blob and
+ * evaluates a predicate on it without decoding anything. Unless the answer
+ * is FALSE the blob is kept, and the following get_acl() for the same path
+ * decodes it instead of fetching it again.
+ */
+static struct acl_peek {
+  const char *path;
+  char *buf;
+  size_t size;
+  ssize_t len;
+} peek = { NULL, NULL, 0, -1 };
+
+
+int
+acl_peek(const char *path,
+	 const struct stat *sp,
+	 const GACL_BLOB_PRED *pp) {
+  int rc;
+
+  
+  peek.path = NULL;
+  
+  peek.len = _acl_read_raw(path, S_ISLNK(sp->st_mode) ? VFS_ACL_FLAG_NOFOLLOW : 0,
+			   &peek.buf, &peek.size);
+  if (peek.len < 0)
+    /* Let get_acl() deal with (or report) it */
+    return GACL_BLOB_MAYBE;
+
+  rc = gacl_blob_pred_eval(pp, peek.buf, peek.len);
+  if (rc < 0)
+    return GACL_BLOB_MAYBE;
+  
+  if (rc != GACL_BLOB_FALSE)
+    peek.path = path;
+  return rc;
+}
+
+
+/* Forget a peeked blob that get_acl() won't be called for */
+void
+acl_peek_clear(void) {
+  peek.path = NULL;
+}
+
+
+/*
+ * The object's ACL in raw (system) form, read into '*bufp' (grown as
+ * needed). Returns the length or -1 (ENOSYS if raw ACLs are unsupported).
+ */
+ssize_t
+get_acl_raw(const char *path,
+	    const struct stat *sp,
+	    char **bufp,
+	    size_t *sizep) {
+  return _acl_read_raw(path, S_ISLNK(sp->st_mode) ? VFS_ACL_FLAG_NOFOLLOW : 0, bufp, sizep);
+}
+
+
+/*
+ * Write a raw ACL (as from get_acl_raw()) unless the object already has
+ * exactly that one. Returns 1 if written, 0 if unchanged and -1 if the
+ * caller should decode it and use set_acl() instead.
+ */
+int
+set_acl_raw(const char *path,
+	    const struct stat *sp,
+	    const void *blob,
+	    size_t blen) {
+  int flags;
+  ssize_t len;
+  
+
+  /* Like set_acl_patched() */
+  if (config.f_print || config.f_sort || config.f_merge || config.f_validate)
+    return -1;
+  
+  flags = S_ISLNK(sp->st_mode) ? VFS_ACL_FLAG_NOFOLLOW : 0;
+  
+  if (!config.f_force) {
+    peek.path = NULL;
+    len = _acl_read_raw(path, flags, &peek.buf, &peek.size);
+    if (len < 0 && errno == ENOSYS)
+      return -1;
+    if (len == (ssize_t) blen && memcmp(peek.buf, blob, blen) == 0) {
+      acl_stats.skipped++;
+      return 0;
+    }
+  }
+
+  if (!config.f_noupdate &&
+      vfs_acl_set_raw(path, GACL_TYPE_NFS4, blob, blen, flags) < 0) {
+    if (errno == ENOSYS)
+      return -1;
+    return error(1, errno, "%s: Setting ACL", path);
+  }
+  
+  acl_stats.writes++;
+  if (config.f_verbose)
+    printf("%s: ACL Updated%s\n", path, (config.f_noupdate ? " (NOT)" : ""));
+  
+  return 1;
+}
+
+
+static int
+_acl_peek_pending(const char *path) {
+  return peek.path && strcmp(peek.path, path) == 0;
+}
+
+
+ACL_STATS acl_stats;
+
+
+void
+acl_stats_reset(void) {
+  memset(&acl_stats, 0, sizeof(acl_stats));
+}
+
+
+void
+acl_stats_print(FILE *fp) {
+  if (acl_stats.writes + acl_stats.skipped == 0)
+    return;
+  
+  fprintf(fp, "ACL writes: %lu written, %lu skipped (%lu equivalent)",
+	  acl_stats.writes,
+	  acl_stats.skipped,
+	  acl_stats.equivalent);
+  if (acl_stats.invalid)
+    fprintf(fp, ", %lu invalid", acl_stats.invalid);
+  putc('\n', fp);
+}
+
+
+/*
+ * Check if writing 'nap' over 'oap' would be a no-op for the object.
+ *
+ * Besides identical ACLs this accepts ACLs that only differ in ways NFSv4
+ * evaluation can't tell apart (see gacl_equiv_np()) - unless the user asked
+ * for sorting or merging, in which case the entry order is the point.
+ */
+int
+acl_unchanged(gacl_t nap,
+	      gacl_t oap,
+	      const struct stat *sp) {
+  if (!oap || config.f_force)
+    return 0;
+  
+  if (gacl_match(nap, oap) == 1) {
+    acl_stats.skipped++;
+    return 1;
+  }
+
+  if (config.f_sort || config.f_merge)
+    return 0;
+
+  if (gacl_equiv_np(nap, oap, S_ISDIR(sp->st_mode) ? 0 : GACL_EQUIV_F_NODIR) == 1) {
+    acl_stats.skipped++;
+    acl_stats.equivalent++;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Check an ACL before it is written (see gacl_valid_np()) and tell the user
+ * what is wrong with it. Returns 0 if valid, -1 (with errno set) if not.
+ */
+int
+acl_validate(const char *path,
+	     gacl_t ap,
+	     mode_t mode) {
+  const char *why = NULL;
+  char buf[1024];
+  int pos = -1, s_errno;
+
+  
+  if (gacl_valid_np(ap, mode & S_IFMT, config.f_relaxed ? GACL_VALID_RELAXED : 0, &pos, &why) == 0)
+    return 0;
+
+  s_errno = errno;
+  acl_stats.invalid++;
+  
+  if (pos >= 0 && gacl_entry_to_text(&ap->av[pos], buf, sizeof(buf), GACL_TEXT_COMPACT) >= 0)
+    fprintf(stderr, "%s: Error: %s: ACL entry #%d (%s): %s\n", argv0, path, pos+1, buf, why);
+  else
+    fprintf(stderr, "%s: Error: %s: %s\n", argv0, path, why ? why : strerror(s_errno));
+
+  errno = s_errno;
+  return -1;
+}
+
+
 int
 get_acl(const char *path, 
 	const struct stat *sp,
@@ -109,7 +594,18 @@ get_acl(const char *path,
     sp = &sbuf;
   }
 
-  if (S_ISLNK(sp->st_mode)) {
+  if (_acl_memo_pending(path)) {
+    /* Already fetched by acl_memo_lookup() */
+    ap = gacl_from_raw_np(memo.ibuf, memo.ilen);
+    if (!ap)
+      return -1;
+  } else if (_acl_peek_pending(path)) {
+    /* Already fetched by acl_peek() */
+    peek.path = NULL;
+    ap = gacl_from_raw_np(peek.buf, peek.len);
+    if (!ap)
+      return -1;
+  } else if (S_ISLNK(sp->st_mode)) {
     ap = vfs_acl_get_link(path, GACL_TYPE_NFS4);
     if (!ap) {
       if (errno == ENOTSUP) /* Solaris does not support ACLs on symbolic links */
@@ -147,69 +643,108 @@ print_ace(gacl_t ap,
 }
 
 
-int
-set_acl(const char *path,
-	const struct stat *sp,
-	gacl_t nap,
-	gacl_t oap) {
-  int rc, s_errno;
-  gacl_t ap = nap;
-
+/*
+ * Normalize an ACL the way it will be written: strip/reject flags invalid
+ * for the file type, then sort and/or merge if requested. Returns 'ap' itself
+ * if nothing needed to be copied, NULL (with errno set) on failure.
+ */
+static gacl_t
+_acl_normalize(gacl_t ap,
+	       mode_t mode,
+	       const char **what) {
+  gacl_t nap = ap;
   
-  rc = clean_acl(ap, sp->st_mode, GACL_CLEAN_FAIL_INVALID);
-  if (rc)
-    return error(1, errno, "%s: Cleaning ACL", path);
+  
+  *what = "Cleaning ACL";
+  if (clean_acl(ap, mode, GACL_CLEAN_FAIL_INVALID))
+    return NULL;
   
   if (config.f_sort) {
-    gacl_t sap = gacl_sort(ap);
-
-    if (!sap) {
-      error(1, errno, "%s: Sorting ACL", path);
-      return -1;
-    }
-    ap = sap;
+    *what = "Sorting ACL";
+    nap = gacl_sort(ap);
+    if (!nap)
+      return NULL;
   }
 
   if (config.f_merge) {
-    gacl_t map = gacl_merge(ap);
-    
-    if (!map) {
-      s_errno = errno;
-      if (ap != nap)
-	gacl_free(ap);
-      error(1, s_errno, "%s: Merging ACL", path);
-      return -1;
+    gacl_t map;
+
+    *what = "Merging ACL";
+    map = gacl_merge(nap);
+    if (nap != ap) {
+      int s_errno = errno;
+      
+      gacl_free(nap);
+      errno = s_errno;
     }
-    if (ap != nap)
-      gacl_free(ap);
-    ap = map;
+    if (!map)
+      return NULL;
+    nap = map;
   }
 
+  return nap;
+}
+
+
+/*
+ * Write an already normalized ACL, using the pre-encoded 'blob' if given.
+ * 'f_checked' is set for ACLs already validated (templates).
+ */
+static int
+_set_acl(const char *path,
+	 const struct stat *sp,
+	 gacl_t ap,
+	 gacl_t oap,
+	 const void *blob,
+	 ssize_t blen,
+	 int f_checked) {
+  int rc;
+
+
   if (config.f_print > 1)
     print_acl(stdout, ap, path, sp, 0);
   
   /* Skip set operation if old and new acl is the same (and force flag not in use) */
-  if (oap && gacl_match(ap, oap) == 1 && !config.f_force) {
-    if (ap != nap)
-      gacl_free(ap);
+  if (acl_unchanged(ap, oap, sp)) {
+    acl_memo_unchanged(path);
     return 0;
   }
 
+  /* Already reported - treat like a skipped object */
+  if (config.f_validate && !f_checked && acl_validate(path, ap, sp->st_mode) < 0)
+    return 0;
+
+  /* Encode it ourself if the result should be memoized */
+  if (!blob && _acl_memo_pending(path)) {
+    blen = _acl_memo_encode(ap);
+    blob = memo.obuf;
+  }
+  if (!blob)
+    blen = -1;
+  
   rc = 0;
   if (!config.f_noupdate) {
-    if (S_ISLNK(sp->st_mode))
-      rc = gacl_set_link_np(path, GACL_TYPE_NFS4, ap);
-    else
-      rc = vfs_acl_set_file(path, GACL_TYPE_NFS4, ap);
+    if (blen >= 0) {
+      rc = vfs_acl_set_raw(path, GACL_TYPE_NFS4, blob, blen,
+			   S_ISLNK(sp->st_mode) ? VFS_ACL_FLAG_NOFOLLOW : 0);
+      if (rc < 0 && errno == ENOSYS)
+	blen = -1;
+    }
+    if (blen < 0) {
+      if (S_ISLNK(sp->st_mode))
+	rc = gacl_set_link_np(path, GACL_TYPE_NFS4, ap);
+      else
+	rc = vfs_acl_set_file(path, GACL_TYPE_NFS4, ap);
+    }
   }
 
-  if (rc < 0) {
-    s_errno = errno;
-    if (ap != nap)
-      gacl_free(ap);
-    error(1, s_errno, "%s: Setting ACL", path);
-    return rc;
-  }
+  if (rc < 0)
+    return error(1, errno, "%s: Setting ACL", path);
+
+  if (blen >= 0)
+    _acl_memo_record(path, blob, blen);
+
+  acl_stats.writes++;
 
   if (config.f_print == 1)
     print_acl(stdout, ap, path, sp, 0);
@@ -217,10 +752,118 @@ set_acl(const char *path,
   if (config.f_verbose)
     printf("%s: ACL Updated%s\n", path, (config.f_noupdate ? " (NOT)" : ""));
   
+  return 1;
+}
+
+
+int
+set_acl(const char *path,
+	const struct stat *sp,
+	gacl_t nap,
+	gacl_t oap) {
+  int rc;
+  gacl_t ap;
+  const char *what;
+
+  
+  ap = _acl_normalize(nap, sp->st_mode, &what);
+  if (!ap)
+    return error(1, errno, "%s: %s", path, what);
+
+  rc = _set_acl(path, sp, ap, oap, NULL, -1, 0);
+  
   if (ap != nap)
     gacl_free(ap);
 
-  return 1;
+  return rc;
+}
+
+
+/*
+ * ACL templates.
+ *
+ * Commands that write the same ACL to many objects (set-access, copy-access,
+ * inherit-access) normalize, validate and encode it once up front. The
+ * template is shared (refcounted) and must not be modified after creation.
+ *
+ * An invalid ACL fails the creation, except in validate-only mode where it
+ * has then been reported and the walk may go on checking everything else.
+ */
+ACL_TEMPLATE *
+acl_template_create(gacl_t ap,
+		    mode_t ftype) {
+  ACL_TEMPLATE *tp;
+  gacl_t dap, nap;
+  const char *what;
+  size_t bsize = 0;
+  int s_errno;
+
+
+  dap = gacl_dup(ap);
+  if (!dap)
+    return NULL;
+  
+  nap = _acl_normalize(dap, ftype, &what);
+  if (!nap)
+    goto Fail;
+  if (nap != dap)
+    gacl_free(dap);
+  dap = nap;
+
+  if (acl_validate(ftype == S_IFDIR ? "Directory ACL" : "File ACL", dap, ftype) < 0 &&
+      !config.f_validate)
+    goto Fail;
+
+  tp = calloc(1, sizeof(*tp));
+  if (!tp)
+    goto Fail;
+  
+  tp->refs = 1;
+  tp->ftype = ftype & S_IFMT;
+  tp->ap = dap;
+  
+  /* Not being able to pre-encode just means going the slow way */
+  tp->blen = _acl_encode(dap, &tp->blob, &bsize);
+  if (tp->blen < 0) {
+    free(tp->blob);
+    tp->blob = NULL;
+  }
+  
+  return tp;
+
+ Fail:
+  s_errno = errno;
+  gacl_free(dap);
+  errno = s_errno;
+  return NULL;
+}
+
+
+ACL_TEMPLATE *
+acl_template_ref(ACL_TEMPLATE *tp) {
+  if (tp)
+    tp->refs++;
+  return tp;
+}
+
+
+void
+acl_template_free(ACL_TEMPLATE *tp) {
+  if (!tp || --tp->refs > 0)
+    return;
+
+  gacl_free(tp->ap);
+  free(tp->blob);
+  free(tp);
+}
+
+
+int
+set_acl_template(const char *path,
+		 const struct stat *sp,
+		 ACL_TEMPLATE *tp,
+		 gacl_t oap) {
+  return _set_acl(path, sp, tp->ap, oap, tp->blob, tp->blen, 1);
 }
 
 
@@ -286,7 +929,7 @@ str2filetype(const char *str,
 
 
 static int
-primos_print_perms(FILE *fp,
+primos_print_perms(OUTBUF *ob,
 		   const char *s) {
   int c;
   int ns = 0;
@@ -296,17 +939,15 @@ primos_print_perms(FILE *fp,
     if (c == '-')
       ++ns;
     else
-      putc(c, fp);
+      outbuf_putc(ob, c);
   }
 
-  while (ns-- > 0)
-    putc(' ', fp);
-  return 0;
+  return outbuf_pad(ob, ' ', ns);
 }
 
 
 static int
-primos_print_flags(FILE *fp,
+primos_print_flags(OUTBUF *ob,
 		   const char *s) {
   int c;
   int ns = 0;
@@ -317,402 +958,672 @@ primos_print_flags(FILE *fp,
       ++ns;
     else {
       if (np++ == 0)
-	putc('(', fp);
-      putc(c, fp);
+	outbuf_putc(ob, '(');
+      outbuf_putc(ob, c);
     }
   }
 
-  if (np == 0)
-    ns += 2;
-  else
-    putc(')', fp);
-  while (ns-- > 0)
-    putc(' ', fp);
+  if (np == 0)
+    ns += 2;
+  else
+    outbuf_putc(ob, ')');
+  return outbuf_pad(ob, ' ', ns);
+}
+
+
+/*
+ * Time formatting is surprisingly expensive (time zone handling), and the
+ * objects in a listing often share timestamps, so the last result for each
+ * use ('slot') is remembered.
+ */
+#define PRINT_CTIME_SLOTS 4
+
+static struct print_time {
+  time_t t;        /* ctime: the time, minute format: start of the minute */
+  char buf[64];
+} print_ctimes[PRINT_CTIME_SLOTS], print_mtime;
+
+
+/* ctime() format */
+static const char *
+_print_ctime(int slot,
+	     time_t t) {
+  struct print_time *pt = &print_ctimes[slot];
+
+  if (pt->buf[0] && pt->t == t)
+    return pt->buf;
+  
+  if (!ctime_r(&t, pt->buf))
+    return "?\n";
+  pt->t = t;
+  return pt->buf;
+}
+
+
+/* "YYYY-MM-DD HH:MM", reused for the whole minute */
+static const char *
+_print_mtime(time_t t) {
+  struct print_time *pt = &print_mtime;
+  struct tm tmb;
+
+  if (pt->buf[0] && t >= pt->t && t < pt->t+60)
+    return pt->buf;
+  
+  if (!localtime_r(&t, &tmb))
+    return "?";
+  strftime(pt->buf, sizeof(pt->buf), "%Y-%m-%d %R", &tmb);
+  pt->t = t - tmb.tm_sec;
+  return pt->buf;
+}
+
+
+typedef struct print_ctx {
+  gacl_t a;
+  const char *path;
+  const struct stat *sp;
+  int cnt;
+  const char *us;   /* Owner name or uid, NULL if unknown */
+  const char *gs;   /* Group name or gid, NULL if unknown */
+  int u_found;      /* Owner/group names found */
+  int g_found;
+} PRINT_CTX;
+
+
+/* Append the ACL text straight into the output buffer */
+static int
+_print_text(OUTBUF *ob,
+	    gacl_t a,
+	    int flags) {
+  size_t need;
+  ssize_t n;
+
+  
+  if (!a) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  need = 256 + a->ac * 64;
+  for (;;) {
+    if (outbuf_reserve(ob, need) < 0)
+      return -1;
+    
+    n = gacl_to_text_buf_np(a, ob->buf + ob->len, ob->size - ob->len, flags);
+    if (n >= 0) {
+      ob->len += n;
+      return 0;
+    }
+    if (errno != ERANGE)
+      return -1;
+    
+    need = (ob->size - ob->len) * 2;
+  }
+}
+
+
+static int
+_print_text_failed(const PRINT_CTX *pc,
+		   int f_errno) {
+  if (f_errno)
+    fprintf(stderr, "%s: Error: %s: Unable to display ACL: %s\n", argv0, pc->path, strerror(errno));
+  else
+    fprintf(stderr, "%s: Error: %s: Unable to display ACL\n", argv0, pc->path);
+  return 1;
+}
+
+
+static void
+_print_file_header(OUTBUF *ob,
+		   const PRINT_CTX *pc) {
+  if (pc->cnt > 1)
+    outbuf_putc(ob, '\n');
+  outbuf_puts(ob, "# file: ");
+  outbuf_puts(ob, pc->path);
+  outbuf_putc(ob, '\n');
+}
+
+
+/* Comment for owner@/group@ & (verbose) user:/group: entries */
+static void
+_print_ace_comment(OUTBUF *ob,
+		   const PRINT_CTX *pc,
+		   gacl_entry_t ae,
+		   gacl_tag_t tt,
+		   const char *prefix) {
+  uid_t *idp;
+  
+  switch (tt) {
+  case GACL_TAG_TYPE_USER_OBJ:
+    if (pc->us) {
+      if (config.f_verbose)
+	outbuf_printf(ob, "%s%s (%d)", prefix, pc->us, pc->sp->st_uid);
+      else
+	outbuf_printf(ob, "%s%s", prefix, pc->us);
+    } else
+      outbuf_printf(ob, "%s(%d)", prefix, pc->sp->st_uid);
+    break;
+    
+  case GACL_TAG_TYPE_GROUP_OBJ:
+    if (pc->gs) {
+      if (config.f_verbose)
+	outbuf_printf(ob, "%s%s (%d)", prefix, pc->gs, pc->sp->st_gid);
+      else
+	outbuf_printf(ob, "%s%s", prefix, pc->gs);
+    } else
+      outbuf_printf(ob, "%s(%d)", prefix, pc->sp->st_gid);
+    break;
+    
+  case GACL_TAG_TYPE_USER:
+  case GACL_TAG_TYPE_GROUP:
+    if (config.f_verbose) {
+      idp = (uid_t *) gacl_get_qualifier(ae);
+      if (idp)
+	outbuf_printf(ob, "%s(%d)", prefix, *idp);
+    }
+    break;
+    
+  default:
+    break;
+  }
+}
+
+
+static int
+print_acl_default(OUTBUF *ob,
+		  const PRINT_CTX *pc) {
+  const struct stat *sp = pc->sp;
+
+  
+  _print_file_header(ob, pc);
+  
+  if (pc->us) {
+    if (config.f_verbose)
+      outbuf_printf(ob, "# owner: %s (%d)\n", pc->us, sp->st_uid);
+    else
+      outbuf_printf(ob, "# owner: %s\n", pc->us);
+  }
+  
+  if (pc->gs) {
+    if (config.f_verbose)
+      outbuf_printf(ob, "# group: %s (%d)\n", pc->gs, sp->st_gid);
+    else
+      outbuf_printf(ob, "# group: %s\n", pc->gs);
+  }
+  
+  if (config.f_verbose)
+    outbuf_printf(ob, "# type: %s\n", mode2typestr(sp->st_mode));
+  if (config.f_verbose > 2) {
+    outbuf_printf(ob, "# modified: %s", _print_ctime(0, sp->st_mtime));
+    outbuf_printf(ob, "# changed:  %s", _print_ctime(1, sp->st_ctime));
+    outbuf_printf(ob, "# accessed: %s", _print_ctime(2, sp->st_atime));
+#ifdef st_birthtime
+    if (sp->st_birthtime)
+      outbuf_printf(ob, "# created:  %s", _print_ctime(3, sp->st_birthtime));
+#endif
+    outbuf_printf(ob, "# size: %llu\n", (long long unsigned) sp->st_size);
+  }
+  
+  if (_print_text(ob, pc->a, (config.f_verbose ? (GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID|
+						  (config.f_verbose > 1 ? GACL_TEXT_VERBOSE_PERMS : 0)|
+						  (config.f_verbose > 2 ? GACL_TEXT_VERBOSE_FLAGS : 0)) : 0)) < 0)
+    return _print_text_failed(pc, 0);
+  
+  return 0;
+}
+
+
+static int
+print_acl_standard(OUTBUF *ob,
+		   const PRINT_CTX *pc) {
+  _print_file_header(ob, pc);
+  outbuf_printf(ob, "# owner: %s\n", pc->us ? pc->us : "(null)");
+  outbuf_printf(ob, "# group: %s\n", pc->gs ? pc->gs : "(null)");
+  
+  if (_print_text(ob, pc->a, GACL_TEXT_STANDARD|(config.f_verbose ? (GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID |
+								     (config.f_verbose > 1 ? GACL_TEXT_VERBOSE_PERMS : 0)) : 0)) < 0)
+    return _print_text_failed(pc, 0);
+  
+  return 0;
+}
+
+
+/* One-liner, CSV-style */
+static int
+print_acl_csv(OUTBUF *ob,
+	      const PRINT_CTX *pc) {
+  outbuf_puts(ob, pc->path);
+  outbuf_putc(ob, ';');
+  if (_print_text(ob, pc->a, GACL_TEXT_COMPACT) < 0)
+    return _print_text_failed(pc, 1);
+  outbuf_printf(ob, ";%d;%d;%s;%s\n", pc->sp->st_uid, pc->sp->st_gid,
+		pc->us ? pc->us : "-", pc->gs ? pc->gs : "-");
   return 0;
 }
 
 
-int
-print_acl(FILE *fp,
-	  gacl_t a,
-	  const char *path,
-	  const struct stat *sp,
-	  int cnt) {
-  gacl_entry_t ae;
-  int i, is_trivial, len;
-  uid_t *idp;
-  char *as = NULL;
-  char acebuf[2048], ubuf[64], gbuf[64], tbuf[80];
-  char *us = NULL;
-  char *gs = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
-  struct tm *tp;
+/* One-liner */
+static int
+print_acl_brief(OUTBUF *ob,
+		const PRINT_CTX *pc) {
+  size_t len = strlen(pc->path);
+
   
+  outbuf_put(ob, pc->path, len);
+  outbuf_pad(ob, ' ', (len < 24 ? 24-len : 0) + 2);
+  if (_print_text(ob, pc->a, GACL_TEXT_COMPACT) < 0)
+    return _print_text_failed(pc, 1);
+  outbuf_putc(ob, '\n');
+  return 0;
+}
 
-  if (strncmp(path, "./", 2) == 0)
-    path += 2;
 
-  if (sp) {
-    pp = getpwuid(sp->st_uid);
-    gp = getgrgid(sp->st_gid);
-  }
+static int
+print_acl_verbose(OUTBUF *ob,
+		  const PRINT_CTX *pc) {
+  gacl_entry_t ae;
+  char acebuf[2048];
+  int i;
 
-  if (a && a->owner[0])
-    us = s_dup(a->owner);
-  else {
-    if (!pp) {
-      if (sp->st_uid != -1) {
-	snprintf(ubuf, sizeof(ubuf), "%u", sp->st_uid);
-	us = s_dup(ubuf);
-      }
-    } else
-      us = s_dup(pp->pw_name);
-  }
   
-  if (a && a->group[0])
-    gs = s_dup(a->group);
-  else {
-    if (!gp) {
-      if (sp->st_gid != -1) {
-	snprintf(gbuf, sizeof(gbuf), "%u", sp->st_gid);
-	gs = s_dup(gbuf);
+  _print_file_header(ob, pc);
+  for (i = 0; _gacl_get_entry(pc->a, i, &ae) == 1; i++) {
+    char *cp;
+    int len;
+    gacl_tag_t tt;
+    
+    gacl_get_tag_type(ae, &tt);
+    ace2str(ae, acebuf, sizeof(acebuf));
+    
+    cp = strchr(acebuf, ':');
+    if (cp) {
+      len = cp-acebuf;
+      if (len > 0 && (tt == GACL_TAG_TYPE_USER || tt == GACL_TAG_TYPE_GROUP)) {
+	cp = strchr(cp+1, ':');
+	if (cp)
+	  len = cp-acebuf;
       }
     } else
-      gs = s_dup(gp->gr_name);
-  }
-
-#if 0
-  if (!a) {
-    if (cnt > 1)
-      putc('\n', fp);
-    fprintf(fp, "# file: %s\n", path);
-    if (us) {
-      if (config.f_verbose)
-	fprintf(fp, "# owner: %s (%d)\n", us, sp->st_uid);
-      else
-	fprintf(fp, "# owner: %s\n", us);
-    }
-    
-    if (gs) {
-      if (config.f_verbose)
-	fprintf(fp, "# group: %s (%d)\n", gs, sp->st_gid);
-      else
-	fprintf(fp, "# group: %s\n", gs);
-    }
+      len = 0;
     
-    if (config.f_verbose)
-      fprintf(fp, "# type: %s\n", mode2typestr(sp->st_mode));
-    if (config.f_verbose > 1) {
-      fprintf(fp, "# size: %llu\n", (long long unsigned) sp->st_size);
-      fprintf(fp, "# modified: %s", ctime(&sp->st_mtime));
-      fprintf(fp, "# changed:  %s", ctime(&sp->st_ctime));
-      fprintf(fp, "# accessed: %s", ctime(&sp->st_atime));
-#ifdef st_birthtime
-      if (sp->st_birthtime)
-	fprintf(fp, "# created:  %s", ctime(&sp->st_birthtime));
-#endif
-    }
-    goto End;
+    if (len < 18)
+      outbuf_pad(ob, ' ', 18-len);
+    outbuf_puts(ob, acebuf);
+    _print_ace_comment(ob, pc, ae, tt, "\t# ");
+    outbuf_putc(ob, '\n');
   }
-#endif
   
-  switch (config.f_style) {
-  case GACL_STYLE_DEFAULT:
-    as = gacl_to_text_np(a, NULL, (config.f_verbose ? (GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID|
-						       (config.f_verbose > 1 ? GACL_TEXT_VERBOSE_PERMS : 0)|
-						       (config.f_verbose > 2 ? GACL_TEXT_VERBOSE_FLAGS : 0)) : 0));
-    if (!as) {
-      fprintf(stderr, "%s: Error: %s: Unable to display ACL\n", argv0, path);
-      return 1;
-    }
-    
-    if (cnt > 1)
-      putc('\n', fp);
-    fprintf(fp, "# file: %s\n", path);
+  return 0;
+}
+
+
+static int
+print_acl_solaris(OUTBUF *ob,
+		  const PRINT_CTX *pc) {
+  const struct stat *sp = pc->sp;
+  int is_trivial = 0;
+
+  
+  gacl_is_trivial_np(pc->a, &is_trivial);
+  
+  if (pc->cnt > 1)
+    outbuf_putc(ob, '\n');
+  outbuf_printf(ob, "%s%s %2lu %8s %8s %8llu %16s %s\n",
+		mode2str(sp->st_mode), is_trivial ? " " : "+",
+		(unsigned long) sp->st_nlink,
+		pc->us ? pc->us : "(null)", pc->gs ? pc->gs : "(null)",
+		(unsigned long long) sp->st_size,
+		_print_mtime(sp->st_mtime), pc->path);
+  
+  if (_print_text(ob, pc->a, (config.f_verbose ? GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID : 0)) < 0)
+    return _print_text_failed(pc, 0);
+  
+  return 0;
+}
+
+
+static int
+print_acl_primos(OUTBUF *ob,
+		 const PRINT_CTX *pc) {
+  gacl_entry_t ae;
+  char acebuf[2048];
+  int i;
+
+  
+  if (pc->cnt > 1)
+    outbuf_putc(ob, '\n');
+  outbuf_printf(ob, "ACL protecting \"%s\":\n", pc->path);
+  
+  for (i = 0; _gacl_get_entry(pc->a, i, &ae) == 1; i++) {
+    char *perms, *flags, *type;
+    gacl_tag_t tt;
     
-    if (us) {
-      if (config.f_verbose)
-	fprintf(fp, "# owner: %s (%d)\n", us, sp->st_uid);
-      else
-	fprintf(fp, "# owner: %s\n", us);
-    }
+    gacl_get_tag_type(ae, &tt);
+    ace2str(ae, acebuf, sizeof(acebuf));
     
-    if (gs) {
-      if (config.f_verbose)
-	fprintf(fp, "# group: %s (%d)\n", gs, sp->st_gid);
-      else
-	fprintf(fp, "# group: %s\n", gs);
-    }
+    perms = strchr(acebuf, ':');
+    if (!perms)
+      return _print_text_failed(pc, 0);
     
-    if (config.f_verbose)
-      fprintf(fp, "# type: %s\n", mode2typestr(sp->st_mode));
-    if (config.f_verbose > 2) {
-      fprintf(fp, "# modified: %s", ctime(&sp->st_mtime));
-      fprintf(fp, "# changed:  %s", ctime(&sp->st_ctime));
-      fprintf(fp, "# accessed: %s", ctime(&sp->st_atime));
-#ifdef st_birthtime
-      if (sp->st_birthtime)
-	fprintf(fp, "# created:  %s", ctime(&sp->st_birthtime));
-#endif
-      fprintf(fp, "# size: %llu\n", (long long unsigned) sp->st_size);
-    }
+    if (tt == GACL_TAG_TYPE_USER || tt == GACL_TAG_TYPE_GROUP)
+      perms = strchr(++perms, ':');
+    *perms++ = '\0';
     
-    fputs(as, fp);
-    gacl_free(as);
-    break;
+    flags = strchr(perms, ':');
+    *flags++ = '\0';
     
-  case GACL_STYLE_STANDARD:
-    as = gacl_to_text_np(a, NULL, GACL_TEXT_STANDARD|(config.f_verbose ? (GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID |
-									  (config.f_verbose > 1 ? GACL_TEXT_VERBOSE_PERMS : 0)) : 0));
-    if (!as) {
-      fprintf(stderr, "%s: Error: %s: Unable to display ACL\n", argv0, path);
-      return 1;
-    }
+    type  = strchr(flags, ':');
+    *type++ = '\0';
     
-    if (cnt > 1)
-      putc('\n', fp);
-    fprintf(fp, "# file: %s\n", path);
-    fprintf(fp, "# owner: %s\n", us);
-    fprintf(fp, "# group: %s\n", gs);
-    fputs(as, fp);
-    gacl_free(as);
-    break;
+    outbuf_printf(ob, "\t%30s:  ", acebuf);
+    primos_print_perms(ob, perms);
+    outbuf_puts(ob, "  ");
+    primos_print_flags(ob, flags);
+    if (strcmp(type, "allow") != 0)
+      outbuf_printf(ob, "  %-5s", type);
+    _print_ace_comment(ob, pc, ae, tt, "  # ");
+    outbuf_putc(ob, '\n');
+  }
+  
+  return 0;
+}
+
+
+static int
+print_acl_samba(OUTBUF *ob,
+		const PRINT_CTX *pc) {
+  const struct stat *sp = pc->sp;
+  gacl_entry_t ae;
+  char acebuf[2048];
+  int i;
+
+  
+  if (pc->cnt > 1)
+    outbuf_putc(ob, '\n');
+  outbuf_printf(ob, "FILENAME:%s\n", pc->path);
+  outbuf_puts(ob, "REVISION:1\n");
+  outbuf_puts(ob, "CONTROL:SR|DP\n");
+  
+  if (pc->u_found)
+    outbuf_printf(ob, "OWNER:%s\n", pc->us);
+  else
+    outbuf_printf(ob, "OWNER:%d\n", sp->st_uid);
+  
+  if (pc->g_found)
+    outbuf_printf(ob, "GROUP:%s\n", pc->gs);
+  else
+    outbuf_printf(ob, "GROUP:%d\n", sp->st_gid);
+  
+  for (i = 0; _gacl_get_entry(pc->a, i, &ae) == 1; i++) {
+    char *cp;
     
-  case GACL_STYLE_CSV:
-    /* One-liner, CSV-style */
+    ace2str_samba(ae, acebuf, sizeof(acebuf), sp);
     
-    as = gacl_to_text_np(a, NULL, GACL_TEXT_COMPACT);
-    if (!as) {
-      fprintf(stderr, "%s: Error: %s: Unable to display ACL: %s\n", argv0, path, strerror(errno));
-      return 1;
+    cp = strrchr(acebuf, '\t');
+    if (cp) {
+      *cp++ = '\0';
+      outbuf_printf(ob, "%-60s\t# %s\n", acebuf, cp);
+    } else {
+      outbuf_puts(ob, acebuf);
+      outbuf_putc(ob, '\n');
     }
-    fprintf(fp, "%s;%s;%d;%d;%s;%s\n", path, as, sp->st_uid, sp->st_gid, us ? us : "-", gs ? gs : "-");
-    gacl_free(as);
-    break;
+  }
+  
+  return 0;
+}
 
-  case GACL_STYLE_BRIEF:
-    /* One-liner */
 
-    as = gacl_to_text_np(a, NULL, GACL_TEXT_COMPACT);
-    if (!as) {
-      fprintf(stderr, "%s: Error: %s: Unable to display ACL: %s\n", argv0, path, strerror(errno));
-      return 1;
-    }
-    
-    fprintf(fp, "%-24s  %s\n", path, as);
-    gacl_free(as);
-    break;
+static int
+print_acl_icacls(OUTBUF *ob,
+		 const PRINT_CTX *pc) {
+  gacl_entry_t ae;
+  char acebuf[2048];
+  size_t len = strlen(pc->path);
+  int i;
 
-  case GACL_STYLE_VERBOSE:
-    if (cnt > 1)
-      putc('\n', fp);
-    fprintf(fp, "# file: %s\n", path);
-    for (i = 0; gacl_get_entry(a, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
-      char *cp;
-      int len;
-      gacl_tag_t tt;
-
-      gacl_get_tag_type(ae, &tt);
-      ace2str(ae, acebuf, sizeof(acebuf));
-
-      cp = strchr(acebuf, ':');
-      if (cp) {
-	len = cp-acebuf;
-	if (len > 0 && (tt == GACL_TAG_TYPE_USER || tt == GACL_TAG_TYPE_GROUP)) {
-	  cp = strchr(cp+1, ':');
-	  if (cp)
-	    len = cp-acebuf;
-	}
-      } else
-	len = 0;
-
-      fprintf(fp, "%*s%s", (18-len), "", acebuf);
-      switch (tt) {
-      case GACL_TAG_TYPE_USER_OBJ:
-	if (us) {
-	  if (config.f_verbose)
-	    fprintf(fp, "\t# %s (%d)", us, sp->st_uid);
-	  else
-	    fprintf(fp, "\t# %s", us);
-	} else
-	  fprintf(fp, "\t# (%d)", sp->st_uid);
-	break;
+  
+  if (pc->cnt > 1)
+    outbuf_putc(ob, '\n');
+  outbuf_put(ob, pc->path, len);
+  
+  for (i = 0; _gacl_get_entry(pc->a, i, &ae) == 1; i++) {
+    ace2str_icacls(ae, acebuf, sizeof(acebuf), pc->sp);
+    outbuf_pad(ob, ' ', (i ? len : 0) + 1);
+    outbuf_puts(ob, acebuf);
+    outbuf_putc(ob, '\n');
+  }
+  
+  return 0;
+}
 
-      case GACL_TAG_TYPE_GROUP_OBJ:
-	if (gs) {
-	  if (config.f_verbose)
-	    fprintf(fp, "\t# %s (%d)", gs, sp->st_gid);
-	  else
-	    fprintf(fp, "\t# %s", gs);
-	} else
-	  fprintf(fp, "\t# (%d)", sp->st_gid);
-	break;
 
-      case GACL_TAG_TYPE_USER:
-      case GACL_TAG_TYPE_GROUP:
-	if (config.f_verbose) {
-	  idp = (uid_t *) gacl_get_qualifier(ae);
-	  if (idp)
-	    fprintf(fp, "\t# (%d)", *idp);
-	}
-	break;
+static const char *
+_json_tag_name(GACL_TAG_TYPE tt) {
+  switch (tt) {
+  case GACL_TAG_TYPE_USER_OBJ:
+    return GACL_TAG_TYPE_USER_OBJ_TEXT;
+  case GACL_TAG_TYPE_GROUP_OBJ:
+    return GACL_TAG_TYPE_GROUP_OBJ_TEXT;
+  case GACL_TAG_TYPE_EVERYONE:
+    return GACL_TAG_TYPE_EVERYONE_TEXT;
+  case GACL_TAG_TYPE_MASK:
+    return GACL_TAG_TYPE_MASK_TEXT;
+  case GACL_TAG_TYPE_OTHER:
+    return GACL_TAG_TYPE_OTHER_TEXT;
+  case GACL_TAG_TYPE_USER:
+    return "user";
+  case GACL_TAG_TYPE_GROUP:
+    return "group";
+  default:
+    return "unknown";
+  }
+}
 
-      default:
-	break;
-      }
-      putc('\n', fp);
-    }
-    break;
-    
-  case GACL_STYLE_SOLARIS:
-    tp = localtime(&sp->st_mtime);
-    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %R", tp);
+static const char *
+_json_entry_type_name(GACL_ENTRY_TYPE et) {
+  switch (et) {
+  case GACL_ENTRY_TYPE_ALLOW:
+    return "allow";
+  case GACL_ENTRY_TYPE_DENY:
+    return "deny";
+  case GACL_ENTRY_TYPE_AUDIT:
+    return "audit";
+  case GACL_ENTRY_TYPE_ALARM:
+    return "alarm";
+  default:
+    return "unknown";
+  }
+}
 
-    is_trivial = 0;
-    gacl_is_trivial_np(a, &is_trivial);
-    
-    if (cnt > 1)
-      putc('\n', fp);
-    fprintf(fp, "%s%s %2lu %8s %8s %8llu %16s %s\n",
-	   mode2str(sp->st_mode), is_trivial ? " " : "+",
-	   (unsigned long) sp->st_nlink,
-	   us, gs,
-	   (unsigned long long) sp->st_size,
-	   tbuf, path);
-	   
-    as = gacl_to_text_np(a, NULL, (config.f_verbose ? GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID : 0));
-    if (!as) {
-      fprintf(stderr, "%s: Error: %s: Unable to display ACL\n", argv0, path);
-      return 1;
-    }
 
-    fputs(as, fp);
-    gacl_free(as);
-    break;
+static void
+_json_id(OUTBUF *ob,
+	 const char *key,
+	 uid_t id) {
+  outbuf_puts(ob, key);
+  if (id == (uid_t) -1)
+    outbuf_puts(ob, "null");
+  else
+    outbuf_putu(ob, id);
+}
 
-  case GACL_STYLE_PRIMOS:
-    if (cnt > 1)
-      putc('\n', fp);
-    fprintf(fp, "ACL protecting \"%s\":\n", path);
-    
-    for (i = 0; gacl_get_entry(a, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
-      char *perms, *flags, *type;
-      gacl_tag_t tt;
+static void
+_json_name(OUTBUF *ob,
+	   const char *key,
+	   const char *name) {
+  outbuf_puts(ob, key);
+  if (name && *name)
+    outbuf_json_string(ob, name);
+  else
+    outbuf_puts(ob, "null");
+}
 
-      gacl_get_tag_type(ae, &tt);
-      ace2str(ae, acebuf, sizeof(acebuf));
 
-      perms = strchr(acebuf, ':');
-      if (!perms) {
-	fprintf(stderr, "%s: Error: %s: Unable to display ACL\n", argv0, path);
-	return 1;
-      }
-      
-      if (tt == GACL_TAG_TYPE_USER || tt == GACL_TAG_TYPE_GROUP)
-	perms = strchr(++perms, ':');
-      *perms++ = '\0';
+/* Room given to each entry's compact text */
+#define JSON_ACE_TEXT_MAX 2048
 
-      flags = strchr(perms, ':');
-      *flags++ = '\0';
-      
-      type  = strchr(flags, ':');
-      *type++ = '\0';
-
-      fprintf(fp, "\t%30s:  ", acebuf);
-      primos_print_perms(fp, perms);
-      fprintf(fp, "  ");
-      primos_print_flags(fp, flags);
-      if (strcmp(type, "allow") != 0)
-	fprintf(fp, "  %-5s", type);
-      switch (tt) {
-      case GACL_TAG_TYPE_USER_OBJ:
-	if (us) {
-	  if (config.f_verbose)
-	    fprintf(fp, "  # %s (%d)", us, sp->st_uid);
-	  else 
-	    fprintf(fp, "  # %s", us);
-	} else
-	  fprintf(fp, "  # (%d)", sp->st_uid);
-	break;
+/*
+ * One JSON object per line (NDJSON). Numeric masks are the raw GACL_PERMSET
+ * and GACL_FLAGSET bits, "text" is the compact form of the entry.
+ */
+static int
+print_acl_json(OUTBUF *ob,
+	       const PRINT_CTX *pc) {
+  static char *tbuf = NULL;
+  static size_t tsize = 0;
+  gacl_entry_t ae;
+  const char *tp;
+  size_t tlen;
+  ssize_t rc;
+  int i;
 
-      case GACL_TAG_TYPE_GROUP_OBJ:
-	if (gs) {
-	  if (config.f_verbose)
-	    fprintf(fp, "  # %s (%d)", gs, sp->st_gid);
-	  else
-	    fprintf(fp, "  # %s", gs);
-	} else
-	  fprintf(fp, "  # (%d)", sp->st_gid);
-	break;
+  
+  /*
+   * Output may be spilled mid-record, so format all entry texts (back to
+   * back in a scratch buffer) and fail before writing anything
+   */
+  tlen = 0;
+  for (i = 0; pc->a && _gacl_get_entry(pc->a, i, &ae) == 1; i++) {
+    if (_acl_memo_grow(&tbuf, &tsize, tlen+JSON_ACE_TEXT_MAX) < 0)
+      return _print_text_failed(pc, 1);
+    
+    rc = gacl_entry_to_text(ae, tbuf+tlen, JSON_ACE_TEXT_MAX, GACL_TEXT_COMPACT);
+    if (rc < 0)
+      return _print_text_failed(pc, 1);
+    tlen += rc+1;
+  }
+  
+  outbuf_puts(ob, "{\"path\":");
+  outbuf_json_string(ob, pc->path);
+  if (pc->sp) {
+    outbuf_puts(ob, ",\"type\":\"");
+    outbuf_puts(ob, mode2typename(pc->sp->st_mode));
+    outbuf_putc(ob, '"');
+    _json_id(ob, ",\"uid\":", pc->sp->st_uid);
+    _json_id(ob, ",\"gid\":", pc->sp->st_gid);
+  }
+  _json_name(ob, ",\"owner\":", (pc->a && pc->a->owner[0]) || pc->u_found ? pc->us : NULL);
+  _json_name(ob, ",\"group\":", (pc->a && pc->a->group[0]) || pc->g_found ? pc->gs : NULL);
 
-      case GACL_TAG_TYPE_USER:
-      case GACL_TAG_TYPE_GROUP:
-	if (config.f_verbose) {
-	  idp = (uid_t *) gacl_get_qualifier(ae);
-	  if (idp)
-	    fprintf(fp, "  # (%d)", *idp);
-	}
-	break;
+  if (!pc->a) {
+    outbuf_puts(ob, ",\"acl\":null}\n");
+    return 0;
+  }
+  
+  outbuf_puts(ob, ",\"acl\":[");
+  tp = tbuf;
+  for (i = 0; _gacl_get_entry(pc->a, i, &ae) == 1; i++) {
+    GACL_TAG_TYPE tt = ae->tag.type;
+    
+    outbuf_puts(ob, i ? ",{\"tag\":\"" : "{\"tag\":\"");
+    outbuf_puts(ob, _json_tag_name(tt));
+    outbuf_putc(ob, '"');
+    if (tt == GACL_TAG_TYPE_USER || tt == GACL_TAG_TYPE_GROUP) {
+      _json_id(ob, ",\"id\":", gacl_tag_ugid_np(&ae->tag));
+      _json_name(ob, ",\"name\":", ae->tag.name);
+    }
+    outbuf_puts(ob, ",\"perms\":");
+    outbuf_putu(ob, ae->perms);
+    outbuf_puts(ob, ",\"flags\":");
+    outbuf_putu(ob, ae->flags);
+    outbuf_puts(ob, ",\"type\":\"");
+    outbuf_puts(ob, _json_entry_type_name(ae->type));
+    outbuf_puts(ob, "\",\"text\":");
+    outbuf_json_string(ob, tp);
+    outbuf_putc(ob, '}');
+    tp += strlen(tp)+1;
+  }
+  outbuf_puts(ob, "]}\n");
+  
+  return 0;
+}
 
-      default:
-	break;
-      }
 
-      putc('\n', fp);
-    }
-    break;
-    
-  case GACL_STYLE_SAMBA:
-    if (cnt > 1)
-      putc('\n', fp);
-    fprintf(fp, "FILENAME:%s\n", path);
-    fprintf(fp, "REVISION:1\n");
-    fprintf(fp, "CONTROL:SR|DP\n");
-
-    if (pp)
-      fprintf(fp, "OWNER:%s\n", us);
-    else
-      fprintf(fp, "OWNER:%d\n", sp->st_uid);
+/* Formatters for the print styles */
+static struct print_style {
+  GACL_STYLE style;
+  int (*print)(OUTBUF *ob, const PRINT_CTX *pc);
+} print_styles[] =
+  {
+   { GACL_STYLE_DEFAULT,  print_acl_default },
+   { GACL_STYLE_STANDARD, print_acl_standard },
+   { GACL_STYLE_CSV,      print_acl_csv },
+   { GACL_STYLE_BRIEF,    print_acl_brief },
+   { GACL_STYLE_VERBOSE,  print_acl_verbose },
+   { GACL_STYLE_SOLARIS,  print_acl_solaris },
+   { GACL_STYLE_PRIMOS,   print_acl_primos },
+   { GACL_STYLE_SAMBA,    print_acl_samba },
+   { GACL_STYLE_ICACLS,   print_acl_icacls },
+   { GACL_STYLE_JSON,     print_acl_json },
+   { 0,                   NULL },
+  };
 
-    if (gp)
-      fprintf(fp, "GROUP:%s\n", gs);
-    else
-      fprintf(fp, "GROUP:%d\n", sp->st_gid);
-
-    for (i = 0; gacl_get_entry(a, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
-      char *cp;
-      ace2str_samba(ae, acebuf, sizeof(acebuf), sp);
-
-      cp = strrchr(acebuf, '\t');
-      if (*cp) {
-	*cp++ = '\0';
-	fprintf(fp, "%-60s\t# %s\n", acebuf, cp);
-      } else
-	fprintf(fp, "%s\n", acebuf);
-    }
-    break;
-    
-  case GACL_STYLE_ICACLS:
-    len = strlen(path);
 
-    if (cnt > 1)
-      putc('\n', fp);
-    fprintf(fp, "%s", path);
+/*
+ * Output goes to the stream's output buffer (see outbuf.h) and is passed on
+ * in one piece per object - or per buffer full, if the caller asked for
+ * batching with outbuf_mode().
+ */
+int
+print_acl(FILE *fp,
+	  gacl_t a,
+	  const char *path,
+	  const struct stat *sp,
+	  int cnt) {
+  PRINT_CTX pc;
+  OUTBUF *ob;
+  char ubuf[64], gbuf[64];
+  char unbuf[256], gnbuf[256];
+  int i, rc;
+  
 
-    for (i = 0; gacl_get_entry(a, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
-      ace2str_icacls(ae, acebuf, sizeof(acebuf), sp);
-      fprintf(fp, "%*s %s\n", i ? len : 0, "", acebuf);
-    }
-    break;
-    
-  default:
+  for (i = 0; print_styles[i].print && print_styles[i].style != config.f_style; i++)
+    ;
+  if (!print_styles[i].print)
     return -1;
+
+  ob = outbuf_open(fp);
+  if (!ob) {
+    fprintf(stderr, "%s: Error: %s: Unable to display ACL: %s\n", argv0, path, strerror(errno));
+    return 1;
+  }
+  
+  memset(&pc, 0, sizeof(pc));
+  pc.a = a;
+  pc.path = (path[0] == '.' && path[1] == '/') ? path+2 : path;
+  pc.sp = sp;
+  pc.cnt = cnt;
+  
+  if (sp) {
+    pc.u_found = (gacl_uid_to_name_np(sp->st_uid, unbuf, sizeof(unbuf)) == 1);
+    pc.g_found = (gacl_gid_to_name_np(sp->st_gid, gnbuf, sizeof(gnbuf)) == 1);
   }
 
-  free(us);
-  free(gs);
-  return 0;
+  if (a && a->owner[0])
+    pc.us = a->owner;
+  else if (pc.u_found)
+    pc.us = unbuf;
+  else if (sp->st_uid != -1) {
+    snprintf(ubuf, sizeof(ubuf), "%u", sp->st_uid);
+    pc.us = ubuf;
+  }
+  
+  if (a && a->group[0])
+    pc.gs = a->group;
+  else if (pc.g_found)
+    pc.gs = gnbuf;
+  else if (sp->st_gid != -1) {
+    snprintf(gbuf, sizeof(gbuf), "%u", sp->st_gid);
+    pc.gs = gbuf;
+  }
+
+  rc = print_styles[i].print(ob, &pc);
+  
+  if (outbuf_release(ob) < 0 && rc == 0) {
+    fprintf(stderr, "%s: Error: %s: Writing ACL: %s\n", argv0, pc.path, strerror(errno));
+    rc = 1;
+  }
+  
+  return rc;
 }
 
 
@@ -740,6 +1651,8 @@ str2style(const char *str,
     *sp = GACL_STYLE_SOLARIS;
   else if (strcmp(str, "primos") == 0)
     *sp = GACL_STYLE_PRIMOS;
+  else if (strcmp(str, "json") == 0)
+    *sp = GACL_STYLE_JSON;
   else
     return -1;
 
@@ -767,40 +1680,71 @@ style2str(GACL_STYLE s) {
     return "Solaris";
   case GACL_STYLE_PRIMOS:
     return "PRIMOS";
+  case GACL_STYLE_JSON:
+    return "JSON";
   }
 
   return NULL;
 }
 
+char *
+mode2typename(mode_t m) {
+  switch (m & S_IFMT) {
+  case S_IFIFO:
+    return "fifo";
+  case S_IFCHR:
+    return "char-device";
+  case S_IFBLK:
+    return "block-device";
+  case S_IFDIR:
+    return "directory";
+  case S_IFREG:
+    return "file";
+  case S_IFLNK:
+    return "link";
+  case S_IFSOCK:
+    return "socket";
+#ifdef S_IFWHT
+  case S_IFWHT:
+    return "whiteout";
+#endif
+  default:
+    return "unknown";
+  }
+}
+
 char *
 mode2typestr(mode_t m) {
+  if (config.f_verbose)
+    return mode2typename(m);
+  
   switch (m & S_IFMT) {
   case S_IFIFO:
-    return config.f_verbose ? "fifo" : "p";
+    return "p";
   case S_IFCHR:
-    return config.f_verbose ? "char-device" : "c";
+    return "c";
   case S_IFBLK:
-    return config.f_verbose ? "block-device" : "b";
+    return "b";
   case S_IFDIR:
-    return config.f_verbose ? "directory" : "d";
+    return "d";
   case S_IFREG:
-    return config.f_verbose ? "file" : "-";
+    return "-";
   case S_IFLNK:
-    return config.f_verbose ? "link" : "l";
+    return "l";
   case S_IFSOCK:
-    return config.f_verbose ? "socket" : "s";
+    return "s";
 #ifdef S_IFWHT
   case S_IFWHT:
-    return config.f_verbose ? "whiteout" : "w";
+    return "w";
 #endif
   default:
-    return config.f_verbose ? "unknown" : "?";
+    return "?";
   }
 }
 
 char *
 mode2str(mode_t m) {
-  static char buf[11];
+  static GACL_THREAD_LOCAL char buf[11];
 
   switch (m & S_IFMT) {
   case S_IFIFO:
@@ -880,3 +1824,89 @@ aclcmd_foreach(int argc,
 
   return rc;
 }
+
+
+/*
+ * Apply a blob patch program (see gacl_blob.h) to the object's raw ACL and
+ * write the result - for edits that don't need the ACL decoded. Returns 1
+ * if written, 0 if nothing needed to change and -1 if the caller should take
+ * the normal path instead (the blob is then kept for its get_acl()).
+ */
+static char *patch_buf = NULL;
+static size_t patch_size = 0;
+
+int
+set_acl_patched(const char *path,
+		const struct stat *sp,
+		GACL_BLOB_PATCH *pp) {
+  const char *ibuf;
+  ssize_t ilen, olen;
+  int flags, rc;
+  
+
+  /* Printing, sorting/merging and validation need the decoded ACL anyway */
+  if (config.f_print || config.f_sort || config.f_merge || config.f_validate)
+    return -1;
+
+  flags = S_ISLNK(sp->st_mode) ? VFS_ACL_FLAG_NOFOLLOW : 0;
+  
+  if (_acl_memo_pending(path)) {
+    ibuf = memo.ibuf;
+    ilen = memo.ilen;
+  } else {
+    peek.path = NULL;
+    peek.len = _acl_read_raw(path, flags, &peek.buf, &peek.size);
+    if (peek.len < 0)
+      return -1;
+    peek.path = path;
+    ibuf = peek.buf;
+    ilen = peek.len;
+  }
+  
+  olen = gacl_blob_patch_apply(pp, ibuf, ilen, sp->st_mode, &patch_buf, &patch_size);
+  if (olen < 0)
+    return -1;
+  peek.path = NULL;
+
+  if (!config.f_force) {
+    gacl_t oap, nap;
+    
+    if (olen == ilen && memcmp(patch_buf, ibuf, ilen) == 0) {
+      acl_stats.skipped++;
+      acl_memo_unchanged(path);
+      return 0;
+    }
+
+    /* Might still be equivalent - decide that like set_acl() does */
+    oap = gacl_from_raw_np(ibuf, ilen);
+    nap = oap ? gacl_from_raw_np(patch_buf, olen) : NULL;
+    if (!nap) {
+      if (oap)
+	gacl_free(oap);
+      return error(1, errno, "%s: Decoding ACL", path);
+    }
+    
+    gacl_blob_patch_resolve(pp, oap);
+    gacl_blob_patch_resolve(pp, nap);
+    rc = acl_unchanged(nap, oap, sp);
+    
+    gacl_free(oap);
+    gacl_free(nap);
+    if (rc) {
+      acl_memo_unchanged(path);
+      return 0;
+    }
+  }
+
+  if (!config.f_noupdate &&
+      vfs_acl_set_raw(path, GACL_TYPE_NFS4, patch_buf, olen, flags) < 0)
+    return error(1, errno, "%s: Setting ACL", path);
+
+  _acl_memo_record(path, patch_buf, olen);
+  acl_stats.writes++;
+  
+  if (config.f_verbose)
+    printf("%s: ACL Updated%s\n", path, (config.f_noupdate ? " (NOT)" : ""));
+
+  return 1;
+}
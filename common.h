@@ -45,9 +45,26 @@ typedef enum gacl_style
    GACL_STYLE_ICACLS   = 0x30,
    GACL_STYLE_SOLARIS  = 0x40,
    GACL_STYLE_PRIMOS   = 0x50,
+   GACL_STYLE_JSON     = 0x60,
   } GACL_STYLE;
 
 
+/* ACL write accounting (per command, reported with -v) */
+typedef struct acl_stats {
+  unsigned long writes;      /* ACLs written (or that would have been with -n) */
+  unsigned long skipped;     /* Writes avoided since nothing would change */
+  unsigned long equivalent;  /* ... of those, not identical but equivalent */
+  unsigned long invalid;     /* ACLs that failed validation (--validate-only) */
+} ACL_STATS;
+
+extern ACL_STATS acl_stats;
+
+
+extern int
+acl_validate(const char *path,
+	     gacl_t ap,
+	     mode_t mode);
+
 extern int
 get_acl(const char *path, 
 	const struct stat *sp,
@@ -64,6 +81,91 @@ set_acl(const char *path,
 	gacl_t ap,
 	gacl_t oap);
 
+/* Pre-normalized (and pre-encoded) ACL shared by many set_acl_template() calls */
+typedef struct acl_template {
+  unsigned int refs;
+  mode_t ftype;
+  gacl_t ap;
+  char *blob;
+  ssize_t blen;
+} ACL_TEMPLATE;
+
+extern ACL_TEMPLATE *
+acl_template_create(gacl_t ap,
+		    mode_t ftype);
+
+extern ACL_TEMPLATE *
+acl_template_ref(ACL_TEMPLATE *tp);
+
+extern void
+acl_template_free(ACL_TEMPLATE *tp);
+
+extern int
+set_acl_template(const char *path,
+		 const struct stat *sp,
+		 ACL_TEMPLATE *tp,
+		 gacl_t oap);
+
+/* Write the object's raw ACL patched by 'pp' - returns -1 if it can't be patched */
+extern int
+set_acl_patched(const char *path,
+		const struct stat *sp,
+		GACL_BLOB_PATCH *pp);
+
+extern int
+acl_unchanged(gacl_t nap,
+	      gacl_t oap,
+	      const struct stat *sp);
+
+extern void
+acl_stats_reset(void);
+
+extern void
+acl_stats_print(FILE *fp);
+
+extern int
+acl_memo_begin(const char *name);
+
+extern void
+acl_memo_add(const void *data,
+	     size_t len);
+
+extern void
+acl_memo_add_acl(gacl_t ap);
+
+extern int
+acl_memo_lookup(const char *path,
+		const struct stat *sp);
+
+extern void
+acl_memo_unchanged(const char *path);
+
+extern void
+acl_memo_disable(void);
+
+extern void
+acl_memo_end(void);
+
+extern int
+acl_peek(const char *path,
+	 const struct stat *sp,
+	 const GACL_BLOB_PRED *pp);
+
+extern void
+acl_peek_clear(void);
+
+extern ssize_t
+get_acl_raw(const char *path,
+	    const struct stat *sp,
+	    char **bufp,
+	    size_t *sizep);
+
+extern int
+set_acl_raw(const char *path,
+	    const struct stat *sp,
+	    const void *blob,
+	    size_t blen);
+
 extern int
 str2filetype(const char *str,
 	     mode_t *f_filetype);
@@ -100,4 +202,7 @@ aclcmd_foreach(int argc,
 extern char *
 mode2typestr(mode_t m);
 
+extern char *
+mode2typename(mode_t m);
+
 #endif
@@ -36,9 +36,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
-#include <pwd.h>
-#include <grp.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -47,6 +47,7 @@
 
 #include "vfs.h"
 #include "strings.h"
+#include "idcache.h"
 
 
 static struct gace_perm2c {
@@ -124,6 +125,46 @@ _gacl_alloc(GACL_MAGIC m,
 
 
 
+/*
+ * Resize an object allocated with _gacl_alloc() to 's' extra bytes. New
+ * space is zeroed, like _gacl_alloc() does.
+ */
+static void *
+_gacl_realloc(void *op,
+	      size_t os,
+	      size_t s) {
+  GACL_MAGIC *mp = (GACL_MAGIC *) op;
+  size_t hs;
+
+  
+  --mp;
+  switch (*mp) {
+  case GACL_MAGIC_ACL:
+    hs = sizeof(GACL_MAGIC) + sizeof(GACL);
+    break;
+    
+  case GACL_MAGIC_TEXT:
+  case GACL_MAGIC_QUALIFIER:
+    hs = sizeof(GACL_MAGIC);
+    break;
+    
+  default:
+    errno = EINVAL;
+    return NULL;
+  }
+
+  mp = (GACL_MAGIC *) realloc(mp, hs+s);
+  if (!mp)
+    return NULL;
+
+  if (s > os)
+    memset((char *) mp + hs + os, 0, s-os);
+  
+  return mp+1;
+}
+
+
+
 /*
  * Free a previously allocated object 
  */
@@ -376,38 +417,100 @@ _gacl_get_entry(GACL *ap,
     return -1;
   }
   
-  ap->ap = pos;
-
-  if (ap->ap >= ap->ac) {
+  if (pos >= ap->ac) {
     return 0;
   }
 
-  *epp = &ap->av[ap->ap++];
+  *epp = &ap->av[pos];
   return 1;
 }
 
 int
-gacl_get_entry(GACL *ap,
-	       int eid,
-	       GACL_ENTRY **epp) {
-  if (!ap || !(eid == GACL_FIRST_ENTRY || eid == GACL_NEXT_ENTRY)) {
+gacl_get_entry_r_np(GACL *ap,
+		    int eid,
+		    int *cursor,
+		    GACL_ENTRY **epp) {
+  if (!ap || !cursor || !(eid == GACL_FIRST_ENTRY || eid == GACL_NEXT_ENTRY)) {
     errno = EINVAL;
     return -1;
   }
 
   if (eid == GACL_FIRST_ENTRY)
-    ap->ap = 0;
+    *cursor = 0;
 
-  if (ap->ap >= ap->ac) {
+  if (*cursor >= ap->ac) {
     return 0;
   }
 
-  *epp = &ap->av[ap->ap++];
+  *epp = &ap->av[(*cursor)++];
   return 1;
 }
 
-/* If index < 0 or index > last -> append */
-/* TODO: Realloc() GACL if need to extent to make room for more GACL_ENTRYs */
+int
+gacl_get_entry(GACL *ap,
+	       int eid,
+	       GACL_ENTRY **epp) {
+  return gacl_get_entry_r_np(ap, eid, ap ? &ap->ap : NULL, epp);
+}
+
+
+/* Cached, see idcache.h */
+int
+gacl_uid_to_name_np(uid_t uid,
+		    char *name,
+		    size_t namesize) {
+  return idcache_uid_to_name(uid, name, namesize);
+}
+
+
+int
+gacl_gid_to_name_np(gid_t gid,
+		    char *name,
+		    size_t namesize) {
+  return idcache_gid_to_name(gid, name, namesize);
+}
+
+
+int
+gacl_name_to_uid_np(const char *name,
+		    uid_t *uidp) {
+  return idcache_name_to_uid(name, uidp);
+}
+
+
+int
+gacl_name_to_gid_np(const char *name,
+		    gid_t *gidp) {
+  return idcache_name_to_gid(name, gidp);
+}
+
+
+/*
+ * Decoders may leave user/group qualifiers unresolved (just the name) since
+ * many consumers only ever look at the name. Anything needing the numeric
+ * id gets it from here.
+ */
+uid_t
+gacl_tag_ugid_np(GACL_TAG *tp) {
+#ifdef GACL_RAW_NFS4
+  if (tp->flags & GACL_TAG_F_LAZY)
+    _gacl_resolve_tag(tp);
+#endif
+  return tp->ugid;
+}
+
+
+/* Same principal? Identical unresolved names are compared without lookups */
+static int
+_gacl_tag_id_equal(GACL_TAG *a,
+		   GACL_TAG *b) {
+  if ((a->flags & b->flags & GACL_TAG_F_LAZY) && strcmp(a->name, b->name) == 0)
+    return 1;
+  
+  return gacl_tag_ugid_np(a) == gacl_tag_ugid_np(b);
+}
+
+/* If index < 0 or index > last -> append. Grows (moves) the ACL if full */
 int
 gacl_create_entry_np(GACL **app,
 		     GACL_ENTRY **epp,
@@ -423,8 +526,13 @@ gacl_create_entry_np(GACL **app,
   
   ap = *app;
   if (ap->ac >= ap->as) {
-    errno = ENOMEM;
-    return -1;
+    int ns = ap->as > 0 ? ap->as*2 : GACL_DEFAULT_ENTRIES;
+    
+    ap = _gacl_realloc(ap, ap->as*sizeof(ap->av[0]), ns*sizeof(ap->av[0]));
+    if (!ap)
+      return -1;
+    ap->as = ns;
+    *app = ap;
   }
 
   if (index < 0 || index > ap->ac)
@@ -560,7 +668,7 @@ gacl_clean(GACL *ap) {
 
 
  RESTART:
-  for (i = 0; (rc = gacl_get_entry(ap, i ? GACL_NEXT_ENTRY : GACL_FIRST_ENTRY, &ep)) == 1; i++) {
+  for (i = 0; (rc = _gacl_get_entry(ap, i, &ep)) == 1; i++) {
     GACL_PERMSET *ps = NULL;
     GACL_FLAGSET *fs = NULL;
 
@@ -595,7 +703,6 @@ _gacl_entry_compare(const void *va,
   int v;
   int inherited_a, inherited_b;
   int inherit_only_a, inherit_only_b;
-  uid_t *qa, *qb;
   
 
   afs = bfs = NULL;
@@ -634,21 +741,8 @@ _gacl_entry_compare(const void *va,
 
   switch (ta) {
   case GACL_TAG_TYPE_USER:
-    qa = (uid_t *) gacl_get_qualifier(a);
-    qb = (uid_t *) gacl_get_qualifier(b);
-    v = (*qa-*qb);
-    gacl_free((void *) qa);
-    gacl_free((void *) qb);
-    if (v)
-      return v;
-    break;
-    
   case GACL_TAG_TYPE_GROUP:
-    qa = (uid_t *) gacl_get_qualifier(a);
-    qb = (uid_t *) gacl_get_qualifier(b);
-    v = (*qa-*qb);
-    gacl_free((void *) qa);
-    gacl_free((void *) qb);
+    v = (int) (gacl_tag_ugid_np(&a->tag) - gacl_tag_ugid_np(&b->tag));
     if (v)
       return v;
     break;
@@ -695,27 +789,174 @@ gacl_sort(GACL *ap) {
 
 
 
+/*
+ * Merge keys: entries compare equal in _gacl_entry_compare() if they are in
+ * the same class (explicit/inherited) and either one is inherit-only or they
+ * have the same tag, id and type.
+ */
+typedef struct gacl_merge_key {
+  int inherited;
+  GACL_TAG_TYPE tag;
+  uid_t id;
+  GACL_ENTRY_TYPE type;
+  int pos;
+} GACL_MERGE_KEY;
+
+
+static void
+_gacl_merge_key(GACL_ENTRY *ep,
+		int pos,
+		GACL_MERGE_KEY *kp) {
+  kp->inherited = (ep->flags & GACL_FLAG_INHERITED) ? 1 : 0;
+  kp->tag = ep->tag.type;
+  kp->id = (kp->tag == GACL_TAG_TYPE_USER || kp->tag == GACL_TAG_TYPE_GROUP ?
+	    gacl_tag_ugid_np(&ep->tag) : 0);
+  kp->type = ep->type;
+  kp->pos = pos;
+}
+
+
+static int
+_gacl_merge_key_compare(const void *va,
+			const void *vb) {
+  const GACL_MERGE_KEY *a = (const GACL_MERGE_KEY *) va;
+  const GACL_MERGE_KEY *b = (const GACL_MERGE_KEY *) vb;
+
+  
+  if (a->inherited != b->inherited)
+    return a->inherited - b->inherited;
+  if (a->tag != b->tag)
+    return a->tag < b->tag ? -1 : 1;
+  if (a->id != b->id)
+    return a->id < b->id ? -1 : 1;
+  if (a->type != b->type)
+    return a->type < b->type ? -1 : 1;
+  return a->pos - b->pos;
+}
+
+
+static int
+_gacl_merge_key_same(const GACL_MERGE_KEY *a,
+		     const GACL_MERGE_KEY *b) {
+  return (a->inherited == b->inherited && a->tag == b->tag &&
+	  a->id == b->id && a->type == b->type);
+}
+
+
+/* Next not yet merged position after 'i' in the increasing list v[*hp..end-1] */
+static int
+_gacl_merge_next(const int *v,
+		 int *hp,
+		 int end,
+		 int i,
+		 const char *merged) {
+  while (*hp < end && (v[*hp] <= i || merged[v[*hp]]))
+    ++*hp;
+  
+  return *hp < end ? v[*hp] : -1;
+}
+
+
+/*
+ * Merge each entry with every later entry comparing equal to it, in order.
+ * Done with per-key position lists instead of rescanning the ACL for each
+ * entry, so it scales to ACLs with thousands of entries.
+ */
 GACL *
 gacl_merge(GACL *ap) {
   GACL *nap;
-  int i, j, n;
+  GACL_MERGE_KEY *kv = NULL, k;
+  int *kpos = NULL, *khead = NULL, *kend = NULL, *cv = NULL;
+  int ce[2], ch[2], ioe[2], ioh[2];
+  char *merged = NULL;
+  int i, j, jj, c, n, lo, hi;
   
 
   nap = gacl_dup(ap);
   if (!nap)
     return NULL;
 
-  n = 0;
-  for (i = 0; i < nap->ac; i++) {
-  AGAIN:
-    for (j = i+1; j < nap->ac && _gacl_entry_compare(&nap->av[i], &nap->av[j]) != 0; j++)
-      ;
+  n = nap->ac;
+  if (n < 2)
+    return nap;
+  
+  kv = malloc(n * sizeof(kv[0]));
+  kpos = malloc(n * sizeof(kpos[0]));
+  khead = malloc(n * sizeof(khead[0]));
+  kend = malloc(n * sizeof(kend[0]));
+  cv = malloc(2 * n * sizeof(cv[0]));
+  merged = calloc(n, 1);
+  if (!kv || !kpos || !khead || !kend || !cv || !merged)
+    goto Fail;
 
-    if (j < nap->ac) {
-      /* Match found - merge ACE */
+  /* Positions grouped by key, each group in increasing order */
+  for (i = 0; i < n; i++)
+    _gacl_merge_key(&nap->av[i], i, &kv[i]);
+  qsort(kv, n, sizeof(kv[0]), _gacl_merge_key_compare);
+  for (i = n-1; i >= 0; i--) {
+    kpos[i] = kv[i].pos;
+    khead[i] = i;
+    kend[i] = (i+1 < n && _gacl_merge_key_same(&kv[i], &kv[i+1]) ? kend[i+1] : i+1);
+  }
+
+  /* Positions per class, and the inherit-only ones per class */
+  j = 0;
+  for (c = 0; c < 2; c++) {
+    ch[c] = j;
+    for (i = 0; i < n; i++)
+      if (((nap->av[i].flags & GACL_FLAG_INHERITED) ? 1 : 0) == c)
+	cv[j++] = i;
+    ce[c] = j;
+    
+    ioh[c] = j;
+    for (i = 0; i < n; i++)
+      if (((nap->av[i].flags & GACL_FLAG_INHERITED) ? 1 : 0) == c &&
+	  (nap->av[i].flags & GACL_FLAG_INHERIT_ONLY))
+	cv[j++] = i;
+    ioe[c] = j;
+  }
+  
+  for (i = 0; i < n; i++) {
+    if (merged[i])
+      continue;
+    
+    for (;;) {
+      GACL_ENTRY *ep = &nap->av[i];
       GACL_PERMSET *ps_a, *ps_b;
       GACL_FLAGSET *fs_a, *fs_b;
       
+      /* The entry's key changes as things are merged into it */
+      _gacl_merge_key(ep, -1, &k);
+      c = k.inherited;
+
+      if (ep->flags & GACL_FLAG_INHERIT_ONLY)
+	j = _gacl_merge_next(cv, &ch[c], ce[c], i, merged);
+      else {
+	j = _gacl_merge_next(cv, &ioh[c], ioe[c], i, merged);
+
+	/* Find the first key of the group, if any */
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+	  int mid = (lo+hi)/2;
+	  
+	  if (_gacl_merge_key_compare(&kv[mid], &k) < 0)
+	    lo = mid+1;
+	  else
+	    hi = mid;
+	}
+	
+	if (lo < n && _gacl_merge_key_same(&kv[lo], &k)) {
+	  jj = _gacl_merge_next(kpos, &khead[lo], kend[lo], i, merged);
+	  if (jj >= 0 && (j < 0 || jj < j))
+	    j = jj;
+	}
+      }
+
+      if (j < 0)
+	break;
+
+      /* Match found - merge ACE */
       if (gacl_get_permset(&nap->av[i], &ps_a) < 0 ||
 	  gacl_get_permset(&nap->av[j], &ps_b) < 0)
 	goto Fail;
@@ -737,18 +978,31 @@ gacl_merge(GACL *ap) {
       
       if (gacl_set_flagset_np(&nap->av[i], fs_a) < 0)
 	goto Fail;
-      
-      if (gacl_delete_entry_np(nap, j) < 0)
-	goto Fail;
 
-      ++n;
-      goto AGAIN;
+      merged[j] = 1;
     }
   }
 
+  for (i = j = 0; i < n; i++)
+    if (!merged[i])
+      nap->av[j++] = nap->av[i];
+  nap->ac = j;
+
+  free(kv);
+  free(kpos);
+  free(khead);
+  free(kend);
+  free(cv);
+  free(merged);
   return nap;
 
  Fail:
+  free(kv);
+  free(kpos);
+  free(khead);
+  free(kend);
+  free(cv);
+  free(merged);
   gacl_free(nap);
   return NULL;
 }
@@ -768,7 +1022,7 @@ gacl_is_trivial_np(GACL *ap,
   }
   
   tf = 1;
-  for (i = 0; (rc = gacl_get_entry(ap, i ? GACL_NEXT_ENTRY : GACL_FIRST_ENTRY, &ep)) == 1; i++) {
+  for (i = 0; (rc = _gacl_get_entry(ap, i, &ep)) == 1; i++) {
     t = GACL_TAG_TYPE_UNKNOWN;
     
     if (gacl_get_tag_type(ep, &t) < 0)
@@ -811,7 +1065,7 @@ gacl_strip_np(GACL *ap,
   if (!nap)
     return NULL;
   
-  for (i = 0; (rc = gacl_get_entry(ap, i ? GACL_NEXT_ENTRY : GACL_FIRST_ENTRY, &ep)) == 1; i++) {
+  for (i = 0; (rc = _gacl_get_entry(ap, i, &ep)) == 1; i++) {
     t = GACL_TAG_TYPE_UNKNOWN;
     
     if (gacl_get_tag_type(ep, &t) < 0)
@@ -833,121 +1087,115 @@ gacl_strip_np(GACL *ap,
 }
 
 
-int
-_gacl_entry_match(GACL_ENTRY *aep,
-		  GACL_ENTRY *mep,
-		  int how) {
-  GACL_TAG_TYPE att, mtt;
-  GACL_PERMSET *apsp, *mpsp;
-  GACL_FLAGSET *afsp, *mfsp;
-  GACL_ENTRY_TYPE aet, met;
-  
+/*
+ * The ACL a new file ('f_dir' = 0) or directory created below a directory
+ * with ACL 'ap' would get, following the NFSv4 inheritance rules:
+ *
+ * - Files get the FILE_INHERIT entries, with all inheritance flags cleared.
+ * - Directories get the DIRECTORY_INHERIT entries (with the inheritance
+ *   flags cleared if NO_PROPAGATE is set), and FILE_INHERIT-only entries
+ *   as INHERIT_ONLY so they reach files further down.
+ *
+ * All resulting entries are marked INHERITED. The result may be empty.
+ */
+GACL *
+gacl_inherit_np(GACL *ap,
+		int f_dir) {
+  GACL *nap;
+  GACL_ENTRY *ep, *nep;
+  int i;
   
-  if (!aep || !mep) {
-    errno = EINVAL;
-    return -1;
-  }
-
   
-  /* 1. ACE tag type (owner@, group@, everyone@, user:xx, group:xxx) */
-  if (gacl_get_tag_type(aep, &att) < 0)
-    return -1;
+  nap = gacl_init(ap->ac);
+  if (!nap)
+    return NULL;
+  nap->type = ap->type;
   
-  if (gacl_get_tag_type(mep, &mtt) < 0)
-    return -1;
-
-  if (att != mtt)
-    return 0;
-
-  if (att == GACL_TAG_TYPE_USER || att == GACL_TAG_TYPE_GROUP) {
-    uid_t *qa = (uid_t *) gacl_get_qualifier(aep);
-    uid_t *qb = (uid_t *) gacl_get_qualifier(mep);
+  for (i = 0; _gacl_get_entry(ap, i, &ep) == 1; i++) {
+    GACL_FLAGSET fs = ep->flags;
     
-    if ((!qa && qb) || (qa && !qb) || (*qa != *qb)) {
-      if (qa)
-	gacl_free(qa);
-      if (qb)
-	gacl_free(qb);
-      return 0;
+    if (f_dir) {
+      if (fs & GACL_FLAG_DIRECTORY_INHERIT) {
+	if (fs & GACL_FLAG_NO_PROPAGATE_INHERIT)
+	  fs &= ~(GACL_FLAG_FILE_INHERIT|GACL_FLAG_DIRECTORY_INHERIT|GACL_FLAG_NO_PROPAGATE_INHERIT|GACL_FLAG_INHERIT_ONLY);
+	else
+	  fs &= ~GACL_FLAG_INHERIT_ONLY;
+      } else if ((fs & GACL_FLAG_FILE_INHERIT) && !(fs & GACL_FLAG_NO_PROPAGATE_INHERIT))
+	fs |= GACL_FLAG_INHERIT_ONLY;
+      else
+	continue;
+    } else {
+      if (!(fs & GACL_FLAG_FILE_INHERIT))
+	continue;
+      fs &= ~(GACL_FLAG_FILE_INHERIT|GACL_FLAG_DIRECTORY_INHERIT|GACL_FLAG_NO_PROPAGATE_INHERIT|GACL_FLAG_INHERIT_ONLY);
+    }
+
+    if (gacl_create_entry_np(&nap, &nep, -1) < 0) {
+      gacl_free(nap);
+      return NULL;
     }
-    if (qa)
-      gacl_free(qa);
-    if (qb)
-      gacl_free(qb);
+    *nep = *ep;
+    nep->flags = fs | GACL_FLAG_INHERITED;
   }
-  
-  /* 2. ACE entry type (allow, deny, audit, alarm) */
-  if (gacl_get_entry_type_np(aep, &aet) < 0)
-    return -1;
-  
-  if (gacl_get_entry_type_np(mep, &met) < 0)
-    return -1;
-  
-  if (aet != met)
-    return 0;
 
-  
-  /* 3. ACE permissions */
-  if (gacl_get_permset(aep, &apsp) < 0)
-    return -1;
-  
-  if (gacl_get_permset(mep, &mpsp) < 0)
-    return -1;
+  return nap;
+}
 
+
+static int
+_gacl_bits_match(uint32_t a,
+		 uint32_t m,
+		 int how) {
   switch (how) {
   case 0:
   case '=':
   case '^':
-    if (*apsp != *mpsp)
-      return 0;
-    break;
+    return a == m;
     
-  case '+': /* Match if all permissions in B is set in A */
-    if ((*apsp & *mpsp) != *mpsp)
-      return 0;
-    break;
+  case '+': /* Match if all bits in M is set in A */
+    return (a & m) == m;
 
-  case '-': /* Match if all permissions in B is unset in A */
-    if ((*apsp & *mpsp) != 0)
-      return 0;
-    break;
+  case '-': /* Match if all bits in M is unset in A */
+    return (a & m) == 0;
 
   default:
     errno = EINVAL;
     return -1;
   }
-  
-  /* 4. ACE flags */
-  if (gacl_get_flagset_np(aep, &afsp) < 0)
-    return -1;
-  
-  if (gacl_get_flagset_np(mep, &mfsp) < 0)
-    return -1;
-  
-  switch (how) {
-  case 0:
-  case '=':
-  case '^':
-    if (*afsp != *mfsp)
-      return 0;
-    break;
+}
 
-  case '+':
-    if ((*afsp & *mfsp) != *mfsp)
-      return 0;
-    break;
 
-  case '-':
-    if ((*afsp & *mfsp) != 0)
-      return 0;
-    break;
+int
+_gacl_entry_match(GACL_ENTRY *aep,
+		  GACL_ENTRY *mep,
+		  int how) {
+  int rc;
 
-  default:
+  
+  if (!aep || !mep) {
     errno = EINVAL;
     return -1;
   }
+
+  /* 1. ACE tag type (owner@, group@, everyone@, user:xx, group:xxx) */
+  if (aep->tag.type != mep->tag.type)
+    return 0;
+
+  if ((aep->tag.type == GACL_TAG_TYPE_USER || aep->tag.type == GACL_TAG_TYPE_GROUP) &&
+      !_gacl_tag_id_equal(&aep->tag, &mep->tag))
+    return 0;
   
-  return 1;
+  /* 2. ACE entry type (allow, deny, audit, alarm) */
+  if (aep->type != mep->type)
+    return 0;
+
+  /* 3. ACE permissions */
+  rc = _gacl_bits_match(aep->perms, mep->perms, how);
+  if (rc != 1)
+    return rc;
+  
+  /* 4. ACE flags */
+  return _gacl_bits_match(aep->flags, mep->flags, how);
 }
 
 int
@@ -960,23 +1208,19 @@ gacl_entry_match(GACL_ENTRY *aep,
 int
 gacl_match(GACL *ap,
 	   GACL *mp) {
-  GACL_ENTRY *aep, *mep;
-  int p, arc, mrc;
+  int p;
 
   
   if (ap->ac != mp->ac)
     return 0;
 
-  if (ap->type != mp->type)
+  /* ACLs built from text or mode bits have no type yet */
+  if (ap->type != mp->type && ap->type != GACL_TYPE_NONE && mp->type != GACL_TYPE_NONE)
     return 0;
   
-  p = GACL_FIRST_ENTRY;
-  while ((arc = gacl_get_entry(ap, p, &aep)) == 1 && (mrc = gacl_get_entry(mp, p, &mep)) == 1) {
-    int rc;
-
-    p = GACL_NEXT_ENTRY;
-
-    rc = gacl_entry_match(aep, mep);
+  for (p = 0; p < ap->ac; p++) {
+    int rc = gacl_entry_match(&ap->av[p], &mp->av[p]);
+    
     if (rc != 1)
       return rc;
   }
@@ -985,24 +1229,157 @@ gacl_match(GACL *ap,
 }
 
 
+/* Sort key for entries inside a run of commuting entries */
+static int
+_gacl_equiv_compare(const void *va,
+		    const void *vb) {
+  const GACL_ENTRY *a = (const GACL_ENTRY *) va;
+  const GACL_ENTRY *b = (const GACL_ENTRY *) vb;
+
+  
+  if (a->type != b->type)
+    return a->type < b->type ? -1 : 1;
+  if (a->tag.type != b->tag.type)
+    return a->tag.type < b->tag.type ? -1 : 1;
+  if (a->tag.ugid != b->tag.ugid)
+    return a->tag.ugid < b->tag.ugid ? -1 : 1;
+  if (a->tag.ugid == (uid_t) -1) {
+    int v = strcmp(a->tag.name, b->tag.name);
+    if (v)
+      return v;
+  }
+  if (a->flags != b->flags)
+    return a->flags < b->flags ? -1 : 1;
+  return 0;
+}
+
+
+/*
+ * Reduce an ACL to a canonical entry vector:
+ *
+ * - Unknown permission/flag bits are dropped, and for non-directories all
+ *   flags but INHERITED (like clean_acl() with GACL_CLEAN_FILTER_INVALID).
+ * - Entries granting/denying nothing are dropped (they never match).
+ * - Inside each run of entries where no ALLOW<->DENY transition occurs the
+ *   evaluation order does not matter, so the run is sorted and entries for
+ *   the same principal, type and flags are merged.
+ *
+ * Returns the number of entries left in 'v' (which must hold ap->ac entries).
+ */
+static int
+_gacl_canonicalize(GACL *ap,
+		   GACL_ENTRY *v,
+		   int flags) {
+  int i, n, r, e, w;
+  GACL_ENTRY_TYPE rt;
 
+  
+  n = 0;
+  for (i = 0; i < ap->ac; i++) {
+    GACL_ENTRY *ep = &v[n];
+
+    (void) gacl_tag_ugid_np(&ap->av[i].tag);
+    *ep = ap->av[i];
+    ep->perms &= GACL_PERM_NFS4_BITS;
+    ep->flags &= (GACL_FLAG_OI|GACL_FLAG_CI|GACL_FLAG_NP|GACL_FLAG_IO|
+		  GACL_FLAG_SA|GACL_FLAG_FA|GACL_FLAG_ID);
+    if (flags & GACL_EQUIV_F_NODIR)
+      ep->flags &= GACL_FLAG_INHERITED;
+    
+    if (ep->tag.type != GACL_TAG_TYPE_USER && ep->tag.type != GACL_TAG_TYPE_GROUP)
+      ep->tag.ugid = 0;
+    if (ep->tag.ugid != (uid_t) -1)
+      ep->tag.name[0] = '\0';
+    
+    if (ep->perms)
+      ++n;
+  }
 
-GACL *
-gacl_get_file(const char *path,
-	      GACL_TYPE type) {
-  return _gacl_get_fd_file(-1, path, type, 0);
-}
+  w = 0;
+  for (r = 0; r < n; r = e) {
+    /* Find the end of this run */
+    rt = GACL_ENTRY_TYPE_UNDEFINED;
+    for (e = r; e < n; e++) {
+      if (v[e].type != GACL_ENTRY_TYPE_ALLOW && v[e].type != GACL_ENTRY_TYPE_DENY)
+	continue;
+      if (rt != GACL_ENTRY_TYPE_UNDEFINED && v[e].type != rt)
+	break;
+      rt = v[e].type;
+    }
+    
+    qsort(&v[r], e-r, sizeof(v[0]), _gacl_equiv_compare);
 
+    /* Merge duplicates (w <= r, so nothing unread is overwritten) */
+    v[w] = v[r];
+    for (i = r+1; i < e; i++)
+      if (_gacl_equiv_compare(&v[w], &v[i]) == 0)
+	v[w].perms |= v[i].perms;
+      else
+	v[++w] = v[i];
+    ++w;
+  }
 
-GACL *
-gacl_get_link_np(const char *path,
-		 GACL_TYPE type) {
-  return _gacl_get_fd_file(-1, path, type, GACL_F_SYMLINK_NOFOLLOW);
+  return w;
 }
 
 
-GACL *
-gacl_get_fd_np(int fd,
+/*
+ * Check if two ACLs grant the same access and produce the same inherited
+ * ACLs, even if they are not identical entry by entry.
+ * Returns 1 if equivalent, 0 if not and -1 on error.
+ */
+int
+gacl_equiv_np(GACL *ap,
+	      GACL *bp,
+	      int flags) {
+  GACL_ENTRY *av, *bv;
+  int i, an, bn, rc;
+
+  
+  if (!ap || !bp) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  /* ACLs built from text or mode bits have no type yet */
+  if (ap->type != bp->type && ap->type != GACL_TYPE_NONE && bp->type != GACL_TYPE_NONE)
+    return 0;
+
+  av = malloc((ap->ac+bp->ac+1) * sizeof(*av));
+  if (!av)
+    return -1;
+  bv = av+ap->ac;
+
+  an = _gacl_canonicalize(ap, av, flags);
+  bn = _gacl_canonicalize(bp, bv, flags);
+
+  rc = (an == bn);
+  for (i = 0; rc && i < an; i++)
+    rc = (_gacl_equiv_compare(&av[i], &bv[i]) == 0 && av[i].perms == bv[i].perms);
+
+  free(av);
+  return rc;
+}
+
+
+
+
+GACL *
+gacl_get_file(const char *path,
+	      GACL_TYPE type) {
+  return _gacl_get_fd_file(-1, path, type, 0);
+}
+
+
+GACL *
+gacl_get_link_np(const char *path,
+		 GACL_TYPE type) {
+  return _gacl_get_fd_file(-1, path, type, GACL_F_SYMLINK_NOFOLLOW);
+}
+
+
+GACL *
+gacl_get_fd_np(int fd,
 	       GACL_TYPE type) {
   return _gacl_get_fd_file(fd, NULL, type, 0);
 }
@@ -1043,6 +1420,91 @@ gacl_set_fd(int fd,
 }
 
 
+/*
+ * Raw ACLs - the OS-native binary encoding (XDR NFSv4 ACL xattrs on Linux).
+ * Fails with ENOSYS on platforms where there is no such thing.
+ */
+ssize_t
+gacl_get_raw_file_np(const char *path,
+		     GACL_TYPE type,
+		     void *buf,
+		     size_t bufsize) {
+#ifdef GACL_RAW_NFS4
+  return _gacl_get_raw_fd_file(-1, path, type, buf, bufsize, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+ssize_t
+gacl_get_raw_link_np(const char *path,
+		     GACL_TYPE type,
+		     void *buf,
+		     size_t bufsize) {
+#ifdef GACL_RAW_NFS4
+  return _gacl_get_raw_fd_file(-1, path, type, buf, bufsize, GACL_F_SYMLINK_NOFOLLOW);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+int
+gacl_set_raw_file_np(const char *path,
+		     GACL_TYPE type,
+		     const void *buf,
+		     size_t bufsize) {
+#ifdef GACL_RAW_NFS4
+  return _gacl_set_raw_fd_file(-1, path, type, buf, bufsize, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+int
+gacl_set_raw_link_np(const char *path,
+		     GACL_TYPE type,
+		     const void *buf,
+		     size_t bufsize) {
+#ifdef GACL_RAW_NFS4
+  return _gacl_set_raw_fd_file(-1, path, type, buf, bufsize, GACL_F_SYMLINK_NOFOLLOW);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+GACL *
+gacl_from_raw_np(const void *buf,
+		 size_t bufsize) {
+#ifdef GACL_RAW_NFS4
+  return _gacl_from_raw(buf, bufsize);
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
+
+ssize_t
+gacl_to_raw_np(GACL *ap,
+	       void *buf,
+	       size_t bufsize) {
+#ifdef GACL_RAW_NFS4
+  return _gacl_to_raw(ap, buf, bufsize);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
 int
 _gacl_get_tag(GACL_ENTRY *ep,
 	      GACL_TAG *etp) {
@@ -1066,6 +1528,7 @@ _gacl_set_tag(GACL_ENTRY *ep,
 
   ep->tag.type = etp->type;
   ep->tag.ugid = etp->ugid;
+  ep->tag.flags = etp->flags;
 
   if (s_cpy(ep->tag.name, sizeof(ep->tag.name), etp->name) < 0)
     return -1;
@@ -1074,101 +1537,80 @@ _gacl_set_tag(GACL_ENTRY *ep,
 }
 
 
+/* Span helpers for the parser - input is never copied or modified */
+#define GACL_SPAN_IS(cp, len, s) ((len) == sizeof(s)-1 && memcmp((cp), (s), sizeof(s)-1) == 0)
+
+/* Same as sscanf(cp, "%d", ip) == 1, but stops at 'end' */
+static int
+_gacl_span_int(const char *cp,
+	       const char *end,
+	       int *ip) {
+  int neg = 0;
+  unsigned int v = 0;
+
+  
+  while (cp < end && isspace((unsigned char) *cp))
+    ++cp;
+  if (cp < end && (*cp == '-' || *cp == '+'))
+    neg = (*cp++ == '-');
+  if (cp >= end || !isdigit((unsigned char) *cp))
+    return 0;
+  
+  while (cp < end && isdigit((unsigned char) *cp))
+    v = v * 10 + (*cp++ - '0');
+  
+  *ip = neg ? -(int) v : (int) v;
+  return 1;
+}
+
+
 /* 
  * Get ACE tag (user:xxx, group:xxx, owner@, group@, everyone@ )
  *
  * Format: 
  * [{user|group}:]<name>[:]
  */
-int
-_gacl_entry_tag_from_text(GACL_ENTRY *ep,
-			  char **bufp,
-			  int flags) {
-  struct passwd *pp;
-  struct group *gp;
-  char *np, *cp = *bufp;
-  GACL_TAG *etp = &ep->tag;
+static int
+_gacl_tag_from_span(GACL_TAG *etp,
+		    const char **cpp,
+		    const char *end,
+		    int flags) {
+  uid_t uid;
+  gid_t gid;
+  int rc, is_user, is_group, id;
+  const char *np, *cp = *cpp;
   size_t len;
   
   
-  if (strncmp(cp, "user:", 5) == 0 || strncmp(cp, "u:", 2) == 0) {
-    etp->type = GACL_TAG_TYPE_USER;
+  etp->flags = 0;
 
-    cp = strchr(cp, ':')+1;
+  np = memchr(cp, ':', end-cp);
+  len = np ? np-cp : 0;
+  
+  is_user = (len == 1 && *cp == 'u') || GACL_SPAN_IS(cp, len, "user");
+  is_group = (len == 1 && *cp == 'g') || GACL_SPAN_IS(cp, len, "group");
+  
+  if (is_user || is_group) {
+    etp->type = is_user ? GACL_TAG_TYPE_USER : GACL_TAG_TYPE_GROUP;
     
     /* Locate end of tag */
-    np = cp;
-    while (*np && *np != ':')
-      ++np;
+    cp = np+1;
+    np = memchr(cp, ':', end-cp);
+    if (!np)
+      np = end;
     
-    if (sscanf(cp, "%d", &etp->ugid) == 1) {
-      
-      pp = getpwuid(etp->ugid);
-      if (pp) {
-	if (s_cpy(etp->name, sizeof(etp->name), pp->pw_name) < 0)
-	  return -1;
-      } else {
-	if (flags & GACL_TEXT_RELAXED) {
-	  int rc = snprintf(etp->name, sizeof(etp->name), "user:%d", etp->ugid);
-
-	  if (rc < 0)
-	    return -1;
-	  if (rc >= sizeof(etp->name)) {
-	    errno = ENOMEM;
-	    return -1;
-	  }
-	} else {
-	  errno = EINVAL;
-	  return -1;
-	}
-      }
+    if (_gacl_span_int(cp, np, &id)) {
+      etp->ugid = id;
       
-    } else {
-      len = np-cp;
-      
-      if (s_ncpy(etp->name, sizeof(etp->name), cp, len) < 0)
+      if (is_group)
+	rc = idcache_gid_to_name(etp->ugid, etp->name, sizeof(etp->name));
+      else
+	rc = idcache_uid_to_name(etp->ugid, etp->name, sizeof(etp->name));
+      if (rc < 0)
 	return -1;
-      
-      if ((pp = getpwnam(etp->name)) != NULL)
-	etp->ugid = pp->pw_uid;
-      else {
-	if (flags & GACL_TEXT_RELAXED)	
-	  etp->ugid = -1;
-	else {
-	  errno = EINVAL;
-	  return -1;
-	}
-      }
-      
-    } 
-    
-    if (*np)
-      ++np;
-    
-    *bufp = np;
-    return 0;
-  }
-
-  if (strncmp(cp, "group:", 6) == 0 || strncmp(cp, "g:", 2) == 0) {
-    etp->type = GACL_TAG_TYPE_GROUP;
-    
-    cp = strchr(cp, ':')+1;
-    
-    /* Locate end of tag */
-    np = cp;
-    while (*np && *np != ':')
-      ++np;
-    
-    if (sscanf(cp, "%d", &etp->ugid) == 1) {
-      
-      gp = getgrgid(etp->ugid);
-      if (gp) {
-	if (s_cpy(etp->name, sizeof(etp->name), gp->gr_name) < 0)
-	  return -1;
-      } else {
+      if (rc == 0) {
 	if (flags & GACL_TEXT_RELAXED) {
-	  int rc = snprintf(etp->name, sizeof(etp->name), "group:%d", etp->ugid);
-
+	  rc = snprintf(etp->name, sizeof(etp->name), "%s:%d", is_user ? "user" : "group", etp->ugid);
 	  if (rc < 0)
 	    return -1;
 	  if (rc >= sizeof(etp->name)) {
@@ -1182,14 +1624,16 @@ _gacl_entry_tag_from_text(GACL_ENTRY *ep,
       }
       
     } else {
-      len = np-cp;
-
-      if (s_ncpy(etp->name, sizeof(etp->name), cp, len) < 0)
+      if (s_ncpy(etp->name, sizeof(etp->name), cp, np-cp) < 0)
 	return -1;
       
-      if ((gp = getgrnam(etp->name)) != NULL)
-	etp->ugid = gp->gr_gid;
-      else {
+      if (is_group)
+	rc = idcache_name_to_gid(etp->name, (gid_t *) &etp->ugid);
+      else
+	rc = idcache_name_to_uid(etp->name, &etp->ugid);
+      if (rc < 0)
+	return -1;
+      if (rc == 0) {
 	if (flags & GACL_TEXT_RELAXED)	
 	  etp->ugid = -1;
 	else {
@@ -1197,80 +1641,72 @@ _gacl_entry_tag_from_text(GACL_ENTRY *ep,
 	  return -1;
 	}
       }
-      
-    }
-    
-    if (*np)
-      ++np;
+    } 
     
-    *bufp = np;
+    *cpp = (np < end ? np+1 : np);
     return 0;
   }
 
-
   /* Locate end of tag */
-  np = strchr(cp, ':');
   if (!np) {
     errno = EINVAL;
     return -1;
   }
 
-  len = np-cp;
-		
   if (s_ncpy(etp->name, sizeof(etp->name), cp, len) < 0)
     return -1;
 
-  if (np)
-    ++np;
+  *cpp = np+1;
   
-  if (strcmp(etp->name, "owner@") == 0) {
-    etp->type = GACL_TAG_TYPE_USER_OBJ;
-    etp->ugid = -1;
-
-    *bufp = np;
-    return 0;
-  }
-
-  if (strcmp(etp->name, "group@") == 0) {
-    etp->type = GACL_TAG_TYPE_GROUP_OBJ;
-    etp->ugid = -1;
-    
-    *bufp = np;
-    return 0;
+  etp->ugid = -1;
+  switch (len) {
+  case 6:
+    if (memcmp(cp, "owner@", 6) == 0) {
+      etp->type = GACL_TAG_TYPE_USER_OBJ;
+      return 0;
+    }
+    if (memcmp(cp, "group@", 6) == 0) {
+      etp->type = GACL_TAG_TYPE_GROUP_OBJ;
+      return 0;
+    }
+    break;
+  case 9:
+    if (memcmp(cp, "everyone@", 9) == 0) {
+      etp->type = GACL_TAG_TYPE_EVERYONE;
+      return 0;
+    }
+    break;
   }
 
-  if (strcmp(etp->name, "everyone@") == 0) {
-    etp->type = GACL_TAG_TYPE_EVERYONE;
-    etp->ugid = -1;
-
-    *bufp = np;
-    return 0;
-  } 
-
   /* 
    * Attempt to autodetect user/group - must be unique 
    * user/group name or uid/gid to work!
    */
-  etp->ugid = -1;
-  if (sscanf(etp->name, "%d", &etp->ugid) == 1) {
-    pp = getpwuid(etp->ugid);
-    gp = getgrgid(etp->ugid);
+  if (_gacl_span_int(cp, np, &id)) {
+    char tbuf[256];
+    
+    etp->ugid = id;
+    uid = gid = etp->ugid;
+    if ((is_user = idcache_uid_to_name(uid, tbuf, sizeof(tbuf))) < 0 ||
+	(is_group = idcache_gid_to_name(gid, tbuf, sizeof(tbuf))) < 0)
+      return -1;
   } else {
-    pp = getpwnam(etp->name);
-    gp = getgrnam(etp->name);
+    if ((is_user = idcache_name_to_uid(etp->name, &uid)) < 0 ||
+	(is_group = idcache_name_to_gid(etp->name, &gid)) < 0)
+      return -1;
   }
   
-  if (pp && gp) {
+  if (is_user && is_group) {
     errno = EINVAL;
     return -1;
   }
   
-  if (pp) {
+  if (is_user) {
     etp->type = GACL_TAG_TYPE_USER;
-    etp->ugid = pp->pw_uid;
-  } else if (gp) {
+    etp->ugid = uid;
+  } else if (is_group) {
     etp->type = GACL_TAG_TYPE_GROUP;
-    etp->ugid = gp->gr_gid;
+    etp->ugid = gid;
   } else {
     if (flags & GACL_TEXT_RELAXED)
       etp->type = GACL_TAG_TYPE_UNKNOWN;
@@ -1280,7 +1716,6 @@ _gacl_entry_tag_from_text(GACL_ENTRY *ep,
     }
   }
 
-  *bufp = np;
   return 0;
 }
 
@@ -1330,7 +1765,7 @@ gacl_get_qualifier(GACL_ENTRY *ep) {
     if (!idp)
       return NULL;
 
-    *idp = ep->tag.ugid;
+    *idp = gacl_tag_ugid_np(&ep->tag);
     return (void *) idp;
 
   default:
@@ -1351,6 +1786,7 @@ gacl_set_qualifier(GACL_ENTRY *ep,
   case GACL_TAG_TYPE_USER:
   case GACL_TAG_TYPE_GROUP:
     ep->tag.ugid = * (uid_t *) qp;
+    ep->tag.flags &= ~GACL_TAG_F_LAZY;
     return 0;
 
   default:
@@ -1532,119 +1968,295 @@ gacl_set_entry_type_np(GACL_ENTRY *ep,
 
 
 
-ssize_t
-gacl_entry_tag_to_text(GACL_ENTRY *ep,
-		       char *buf,
-		       size_t bufsize,
-		       int flags) {
-  GACL_TAG_TYPE et;
+/*
+ * Text output is appended to a GACL_TEXTBUF - either a growable
+ * GACL_MAGIC_TEXT object or a fixed caller buffer (which fails with ERANGE
+ * when full). One byte is always kept free for the terminating NUL.
+ */
+typedef struct gacl_textbuf {
+  char *buf;
+  size_t len;
+  size_t size;
+  int f_grow;
+} GACL_TEXTBUF;
 
 
-  et = GACL_TAG_TYPE_UNKNOWN;
+static void
+_gacl_tb_init(GACL_TEXTBUF *tb,
+	      char *buf,
+	      size_t bufsize) {
+  tb->buf = buf;
+  tb->len = 0;
+  tb->size = bufsize;
+  tb->f_grow = 0;
+}
+
+static int
+_gacl_tb_grow(GACL_TEXTBUF *tb,
+	      size_t n) {
+  size_t nsize;
+  char *nbuf;
+
+
+  if (!tb->f_grow) {
+    errno = ERANGE;
+    return -1;
+  }
+
+  nsize = tb->size;
+  while (tb->len + n >= nsize)
+    nsize *= 2;
   
-  if (gacl_get_tag_type(ep, &et) < 0)
+  nbuf = _gacl_realloc(tb->buf, tb->size, nsize);
+  if (!nbuf)
     return -1;
+  
+  tb->buf = nbuf;
+  tb->size = nsize;
+  return 0;
+}
 
-  if (et == GACL_TAG_TYPE_USER) {
-    return snprintf(buf, bufsize, "user:%s", ep->tag.name);
-  } else if (et == GACL_TAG_TYPE_GROUP) {
-    return snprintf(buf, bufsize, "group:%s", ep->tag.name);
-  } else
-    return snprintf(buf, bufsize, "%s", ep->tag.name);
+static inline int
+_gacl_tb_put(GACL_TEXTBUF *tb,
+	     const char *s,
+	     size_t n) {
+  if (tb->len + n >= tb->size && _gacl_tb_grow(tb, n) < 0)
+    return -1;
   
-  errno = EINVAL;
-  return -1;
+  memcpy(tb->buf + tb->len, s, n);
+  tb->len += n;
+  return 0;
 }
 
+static inline int
+_gacl_tb_putc(GACL_TEXTBUF *tb,
+	      char c) {
+  if (tb->len + 1 >= tb->size && _gacl_tb_grow(tb, 1) < 0)
+    return -1;
+  
+  tb->buf[tb->len++] = c;
+  return 0;
+}
 
-ssize_t
-gacl_entry_permset_to_text(GACL_ENTRY *ep,
-			   char *buf,
-			   size_t bufsize,
-			   int flags) {
-  GACL_PERMSET *epsp = NULL;
-  GACL_PERM p;
-  int a, n;
+static inline int
+_gacl_tb_puts(GACL_TEXTBUF *tb,
+	      const char *s) {
+  return _gacl_tb_put(tb, s, strlen(s));
+}
 
-  
-  if (gacl_get_permset(ep, &epsp) < 0)
+static int
+_gacl_tb_pad(GACL_TEXTBUF *tb,
+	     size_t n) {
+  if (tb->len + n >= tb->size && _gacl_tb_grow(tb, n) < 0)
     return -1;
+  
+  memset(tb->buf + tb->len, ' ', n);
+  tb->len += n;
+  return 0;
+}
 
-  n = 0;
-  for (p = 0; bufsize > 1 && gace_p2c[p].c; p++) {
-    a = gacl_get_perm_np(epsp, gace_p2c[p].p);
-    if (a < 0) {
-      *buf = 0;
-      return -1;
-    }
-    if (a || !(flags & GACL_TEXT_COMPACT)) {
-      *buf++ = (a ? gace_p2c[p].c : '-');
-      bufsize--;
-      n++;
-    }
-  }
-  *buf = '\0';
+/* Same output as printf("%d") */
+static int
+_gacl_tb_putint(GACL_TEXTBUF *tb,
+		int v) {
+  char tmp[16], *cp = tmp + sizeof(tmp);
+  unsigned int u = (v < 0 ? -(unsigned int) v : (unsigned int) v);
+
+  
+  do {
+    *--cp = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (v < 0)
+    *--cp = '-';
+
+  return _gacl_tb_put(tb, cp, tmp + sizeof(tmp) - cp);
+}
 
-  return n;
+/* NUL-terminate and return the text length, or -1 if 'rc' is an error */
+static ssize_t
+_gacl_tb_end(GACL_TEXTBUF *tb,
+	     int rc) {
+  if (tb->size > 0)
+    tb->buf[tb->len] = '\0';
+  
+  return rc < 0 ? -1 : (ssize_t) tb->len;
 }
 
 
-ssize_t
-gacl_entry_flagset_to_text(GACL_ENTRY *ep,
-			   char *buf,
-			   size_t bufsize,
-			   int flags) {
-  GACL_FLAGSET *efsp = NULL;
-  GACL_FLAG f;
-  int a, n;
+/*
+ * Byte-indexed permission/flag text tables, so a permset is printed with
+ * four lookups and two copies instead of a loop over gace_p2c per ACE.
+ *
+ * gace_ppos maps each permset byte to the gace_p2c positions (bit 'i' set
+ * = character 'i' shown) and gace_ptext maps each byte of that position
+ * mask to its fixed-width ("rw-----") and compact ("rw") text. All defined
+ * permissions live in the low 16 bits, and all defined flags in the low 8.
+ */
+#define GACE_PERM_CHARS (sizeof(gace_p2c)/sizeof(gace_p2c[0])-1)
+#define GACE_FLAG_CHARS (sizeof(gace_f2c)/sizeof(gace_f2c[0])-1)
 
-  
-  if (gacl_get_flagset_np(ep, &efsp) < 0)
-    return -1;
+typedef struct gace_text {
+  char full[8];
+  char compact[8];
+  unsigned char clen;
+} GACE_TEXT;
 
-  n = 0;
-  for (f = 0; bufsize > 1 && gace_f2c[f].c; f++) {
-    a = gacl_get_flag_np(efsp, gace_f2c[f].f);
-    if (a < 0)
-      return -1;
-    if (a || !(flags & GACL_TEXT_COMPACT)) {
-      *buf++ = (a ? gace_f2c[f].c : '-');
-      bufsize--;
-      n++;
+static pthread_once_t gace_tab_once = PTHREAD_ONCE_INIT;
+static uint16_t gace_ppos[2][256];
+static GACE_TEXT gace_ptext[2][256];
+static GACE_TEXT gace_ftext[256];
+
+/* Parser: character -> permission/flag bit, 0 for '-' and -1 if invalid */
+static int32_t gace_pchar[256];
+static int32_t gace_fchar[256];
+
+static char *gace_t2s[] = { "allow", "deny", "audit", "alarm" };
+
+
+static void
+_gace_tab_init(void) {
+  int b, v, i, n;
+
+
+  for (b = 0; b < 2; b++)
+    for (v = 0; v < 256; v++) {
+      for (i = 0; i < GACE_PERM_CHARS; i++)
+	if (((GACL_PERMSET) v << (8*b)) & gace_p2c[i].p)
+	  gace_ppos[b][v] |= 1 << i;
+
+      n = 0;
+      for (i = 0; i < 8 && 8*b+i < GACE_PERM_CHARS; i++) {
+	if (v & (1 << i)) {
+	  gace_ptext[b][v].full[i] = gace_p2c[8*b+i].c;
+	  gace_ptext[b][v].compact[n++] = gace_p2c[8*b+i].c;
+	} else
+	  gace_ptext[b][v].full[i] = '-';
+      }
+      gace_ptext[b][v].clen = n;
+    }
+
+  for (v = 0; v < 256; v++) {
+    n = 0;
+    for (i = 0; i < GACE_FLAG_CHARS; i++) {
+      if (v & gace_f2c[i].f) {
+	gace_ftext[v].full[i] = gace_f2c[i].c;
+	gace_ftext[v].compact[n++] = gace_f2c[i].c;
+      } else
+	gace_ftext[v].full[i] = '-';
     }
+    gace_ftext[v].clen = n;
   }
-  *buf = '\0';
 
-  return n;
+  for (v = 0; v < 256; v++)
+    gace_pchar[v] = gace_fchar[v] = -1;
+  gace_pchar['-'] = gace_fchar['-'] = 0;
+  for (i = 0; i < GACE_PERM_CHARS; i++)
+    gace_pchar[(unsigned char) gace_p2c[i].c] = gace_p2c[i].p;
+  for (i = 0; i < GACE_FLAG_CHARS; i++)
+    gace_fchar[(unsigned char) gace_f2c[i].c] = gace_f2c[i].f;
 }
 
 
-ssize_t
-gacl_entry_type_to_text(GACL_ENTRY *ep,
-			char *buf,
-			size_t bufsize,
+static int
+_gacl_perms_append_text(GACL_TEXTBUF *tb,
+			GACL_PERMSET perms,
 			int flags) {
-  GACL_ENTRY_TYPE et = GACL_ENTRY_TYPE_UNDEFINED;
+  unsigned int pos;
+  GACE_TEXT *lo, *hi;
 
   
-  if (gacl_get_entry_type_np(ep, &et) < 0)
-    return -1;
+  pthread_once(&gace_tab_once, _gace_tab_init);
+
+  pos = gace_ppos[0][perms & 0xff] | gace_ppos[1][(perms >> 8) & 0xff];
+  lo = &gace_ptext[0][pos & 0xff];
+  hi = &gace_ptext[1][pos >> 8];
   
-  switch (et) {
-  case GACL_ENTRY_TYPE_UNDEFINED:
+  if (flags & GACL_TEXT_COMPACT) {
+    if (_gacl_tb_put(tb, lo->compact, lo->clen) < 0)
+      return -1;
+    return _gacl_tb_put(tb, hi->compact, hi->clen);
+  }
+
+  if (_gacl_tb_put(tb, lo->full, 8) < 0)
+    return -1;
+  return _gacl_tb_put(tb, hi->full, GACE_PERM_CHARS-8);
+}
+
+
+static int
+_gacl_flags_append_text(GACL_TEXTBUF *tb,
+			GACL_FLAGSET fs,
+			int flags) {
+  GACE_TEXT *tp;
+
+  
+  pthread_once(&gace_tab_once, _gace_tab_init);
+
+  tp = &gace_ftext[fs & 0xff];
+  if (flags & GACL_TEXT_COMPACT)
+    return _gacl_tb_put(tb, tp->compact, tp->clen);
+  
+  return _gacl_tb_put(tb, tp->full, GACE_FLAG_CHARS);
+}
+
+
+static int
+_gacl_type_append_text(GACL_TEXTBUF *tb,
+		       GACL_ENTRY_TYPE et) {
+  if (et == GACL_ENTRY_TYPE_UNDEFINED)
     return 0;
-  case GACL_ENTRY_TYPE_ALLOW:
-    return snprintf(buf, bufsize, "allow");
-  case GACL_ENTRY_TYPE_DENY:
-    return snprintf(buf, bufsize, "deny");
-  case GACL_ENTRY_TYPE_ALARM:
-    return snprintf(buf, bufsize, "alarm");
-  case GACL_ENTRY_TYPE_AUDIT:
-    return snprintf(buf, bufsize, "audit");
+  
+  if (et < 0 || (size_t) et >= sizeof(gace_t2s)/sizeof(gace_t2s[0])) {
+    errno = EINVAL;
+    return -1;
   }
 
-  errno = EINVAL;
-  return -1;
+  return _gacl_tb_puts(tb, gace_t2s[et]);
+}
+
+
+/*
+ * Append the tag, space-padded on the left so that the text up to and
+ * including the user/group name ends at column 'tagwidth' (if non-zero).
+ */
+static int
+_gacl_tag_append_text(GACL_TEXTBUF *tb,
+		      GACL_TAG *tp,
+		      int tagwidth) {
+  const char *pfx;
+  size_t plen, nlen, tlen;
+  char *cp;
+
+  
+  switch (tp->type) {
+  case GACL_TAG_TYPE_USER:
+    pfx = GACL_TAG_TYPE_USER_TEXT;
+    plen = sizeof(GACL_TAG_TYPE_USER_TEXT)-1;
+    break;
+  case GACL_TAG_TYPE_GROUP:
+    pfx = GACL_TAG_TYPE_GROUP_TEXT;
+    plen = sizeof(GACL_TAG_TYPE_GROUP_TEXT)-1;
+    break;
+  default:
+    pfx = NULL;
+    plen = 0;
+  }
+  
+  nlen = strlen(tp->name);
+  
+  if (tagwidth > 0) {
+    /* Aligned on the first ':' after the name (or a ':' in it) */
+    cp = memchr(tp->name, ':', nlen);
+    tlen = plen + (cp ? (size_t) (cp - tp->name) : nlen);
+    if (tagwidth > tlen && _gacl_tb_pad(tb, tagwidth - tlen) < 0)
+      return -1;
+  }
+
+  if (pfx && _gacl_tb_put(tb, pfx, plen) < 0)
+    return -1;
+  
+  return _gacl_tb_put(tb, tp->name, nlen);
 }
 
 
@@ -1674,30 +2286,26 @@ static struct perms_to_verbose {
    { 0, NULL },
   };
 
-static ssize_t
-_gacl_entry_perms_to_verbose_text(GACL_PERMSET perms,
-				  char *buf,
-				  size_t bufsize) {
-  int rc, i, first = 1;
-  ssize_t len = 0;
+static int
+_gacl_perms_append_verbose_text(GACL_TEXTBUF *tb,
+				GACL_PERMSET perms) {
+  int i, first = 1;
+
   
-  buf[0] = '\0';
   if (!perms)
-    return snprintf(buf, bufsize, "empty_set");
+    return _gacl_tb_puts(tb, "empty_set");
   
   for (i = 0; p2vs[i].s; i++) {
     if ((perms & p2vs[i].p) == p2vs[i].p) {
-      rc = snprintf(buf, bufsize, "%s%s", first ? "" : "+", p2vs[i].s);
-      if (rc < 0)
+      if (!first && _gacl_tb_putc(tb, '+') < 0)
+	return -1;
+      if (_gacl_tb_puts(tb, p2vs[i].s) < 0)
 	return -1;
-      buf += rc;
-      bufsize -= rc;
       first = 0;
       perms &= ~p2vs[i].p;
-      len += rc;
     } 
   }
-  return len;
+  return 0;
 }
 
 
@@ -1717,187 +2325,185 @@ static struct flags_to_verbose {
   };
 
 
-static ssize_t
-_gacl_entry_flags_to_verbose_text(GACL_FLAGSET flags,
-				  char *buf,
-				  size_t bufsize) {
-  int rc, i, first = 1;
-  ssize_t len = 0;
+/* Appends 'prefix' first, but only if there is at least one flag to show */
+static int
+_gacl_flags_append_verbose_text(GACL_TEXTBUF *tb,
+				GACL_FLAGSET flags,
+				const char *prefix) {
+  int i, first = 1;
 
-  buf[0] = '\0';
+  
   for (i = 0; f2vs[i].s; i++) {
     if ((flags & f2vs[i].f) == f2vs[i].f) {
-      rc = snprintf(buf, bufsize, "%s%s", first ? "" : "+", f2vs[i].s);
-      if (rc < 0)
+      if (_gacl_tb_puts(tb, first ? prefix : "+") < 0)
+	return -1;
+      if (_gacl_tb_puts(tb, f2vs[i].s) < 0)
 	return -1;
-      buf += rc;
-      bufsize -= rc;
       first = 0;
       flags &= ~f2vs[i].f;
-      len += rc;
     } 
   }
-  return len;
+  return first ? 0 : 1;
 }
 
 
-ssize_t
-gacl_entry_to_text(GACL_ENTRY *ep,
-		   char *buf,
-		   size_t bufsize,
-		   int flags) {
-  char *bp;
-  ssize_t rc;
-  GACL_FLAGSET *efsp;
-  int f_comment = 0;
-  
-  bp = buf;
-  
-  rc = gacl_entry_tag_to_text(ep, bp, bufsize, flags);
-  if (rc < 0) {
-    puts("A");
-    return -1;
-  }
-  bp += rc;
-  bufsize -= rc;
-
-  if (bufsize <= 1) {
-    puts("B");
-    return -1;
-  }
+/* Append one ACE in text form, see _gacl_tag_append_text() for 'tagwidth' */
+static int
+_gacl_entry_append_text(GACL_TEXTBUF *tb,
+			GACL_ENTRY *ep,
+			int flags,
+			int tagwidth) {
+  int f_comment = 0, f_full = !(flags & GACL_TEXT_COMPACT);
+  int rc;
   
-  *bp++ = ':';
-  *bp = '\0';
-  bufsize--;
 
-  rc = gacl_entry_permset_to_text(ep, bp, bufsize, flags);
-  if (rc < 0) {
-    puts("C");
+  if (_gacl_tag_append_text(tb, &ep->tag, tagwidth) < 0 ||
+      _gacl_tb_putc(tb, ':') < 0 ||
+      _gacl_perms_append_text(tb, ep->perms, flags) < 0)
     return -1;
-  }
-  bp += rc;
-  bufsize -= rc;
 
-  if ((ep->flags && ep->type != GACL_ENTRY_TYPE_ALLOW) ||
-      !(flags & GACL_TEXT_COMPACT) ||
-      (gacl_get_flagset_np(ep, &efsp) == 0 && !gacl_empty_flagset(efsp))) {
-    if (bufsize <= 1) {
-      puts("D");
+  if (ep->type != GACL_ENTRY_TYPE_ALLOW || f_full ||
+      !gacl_empty_flagset(&ep->flags)) {
+    if (_gacl_tb_putc(tb, ':') < 0 ||
+	_gacl_flags_append_text(tb, ep->flags, flags) < 0)
       return -1;
-    }
     
-    *bp++ = ':';
-    *bp = '\0';
-    bufsize--;
-    
-    rc = gacl_entry_flagset_to_text(ep, bp, bufsize, flags);
-    if (rc < 0) {
-      puts("E");
-      return -1;
-    }
-    
-    bp += rc;
-    bufsize -= rc;
-    
-    if (bufsize <= 1)
-      return -1;
-    
-    if ((ep->flags && ep->type != GACL_ENTRY_TYPE_ALLOW) || !(flags & GACL_TEXT_COMPACT)) {
-      *bp++ = ':';
-      *bp = '\0';
-      bufsize--;
+    if (ep->type != GACL_ENTRY_TYPE_ALLOW || f_full) {
+      if (_gacl_tb_putc(tb, ':') < 0)
+	return -1;
       
-      if (ep->type != GACL_ENTRY_TYPE_ALLOW || !(flags & GACL_TEXT_COMPACT)) {
-	rc = gacl_entry_type_to_text(ep, bp, bufsize, flags);
-	if (rc < 0) {
-	  puts("F");
-	  return -1;
-	}
-	
-	bp += rc;
-	bufsize -= rc;
-      }
+      if ((ep->type != GACL_ENTRY_TYPE_ALLOW || f_full) &&
+	  _gacl_type_append_text(tb, ep->type) < 0)
+	return -1;
     }
   }
   
   if (flags & GACL_TEXT_APPEND_ID) {
-    GACL_TAG_TYPE et;
-    
-    if (gacl_get_tag_type(ep, &et) < 0)
-      return -1;
-
-    rc = 0;
-    switch (et) {
+    switch (ep->tag.type) {
     case GACL_TAG_TYPE_USER:
-      rc = snprintf(bp, bufsize, "\t# uid=%d", ep->tag.ugid);
+      if (_gacl_tb_puts(tb, "\t# uid=") < 0 ||
+	  _gacl_tb_putint(tb, gacl_tag_ugid_np(&ep->tag)) < 0)
+	return -1;
       f_comment++;
       break;
     case GACL_TAG_TYPE_GROUP:
-      rc = snprintf(bp, bufsize, "\t# gid=%d", ep->tag.ugid);
+      if (_gacl_tb_puts(tb, "\t# gid=") < 0 ||
+	  _gacl_tb_putint(tb, gacl_tag_ugid_np(&ep->tag)) < 0)
+	return -1;
       f_comment++;
       break;
     default:
       break;
     }
-    if (rc < 0)
-      return -1;
-    bp += rc;
-    bufsize -= rc;
   }
 
   if (flags & GACL_TEXT_VERBOSE_PERMS) {
-    char vbuf[2048];
-
-    rc = _gacl_entry_perms_to_verbose_text(ep->perms, vbuf, sizeof(vbuf));
-    if (rc < 0)
+    if (_gacl_tb_puts(tb, f_comment ? ", perms=" : "\t# perms=") < 0 ||
+	_gacl_perms_append_verbose_text(tb, ep->perms) < 0)
       return -1;
-    
-    if (!f_comment)
-      rc = snprintf(bp, bufsize, "\t#");
-    else 
-      rc = snprintf(bp, bufsize, ",");
-      
-    if (rc < 0)
-      return -1;
-    bp += rc;
-    bufsize -= rc;
     f_comment = 1;
-
-    rc = snprintf(bp, bufsize, " perms=%s", vbuf);
-    if (rc < 0)
-      return -1;
-    bp += rc;
-    bufsize -= rc;
   }
 
   if (flags & GACL_TEXT_VERBOSE_FLAGS) {
-    char vbuf[2048];
-
-    rc = _gacl_entry_flags_to_verbose_text(ep->flags, vbuf, sizeof(vbuf));
+    rc = _gacl_flags_append_verbose_text(tb, ep->flags, f_comment ? ", flags=" : "\t# flags=");
     if (rc < 0)
       return -1;
-    
-    if (vbuf[0]) {
-      if (!f_comment)
-	rc = snprintf(bp, bufsize, "\t#");
-      else 
-	rc = snprintf(bp, bufsize, ",");
-      
-      if (rc < 0)
-	return -1;
-      bp += rc;
-      bufsize -= rc;
+    if (rc > 0)
       f_comment = 1;
-      
-      rc = snprintf(bp, bufsize, " flags=%s", vbuf);
-      if (rc < 0)
-	return -1;
-      bp += rc;
-      bufsize -= rc;
-    }
   }
 
-  return bp-buf;
+  return 0;
+}
+
+
+ssize_t
+gacl_entry_tag_to_text(GACL_ENTRY *ep,
+		       char *buf,
+		       size_t bufsize,
+		       int flags) {
+  GACL_TEXTBUF tb;
+
+  
+  if (!ep) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  _gacl_tb_init(&tb, buf, bufsize);
+  return _gacl_tb_end(&tb, _gacl_tag_append_text(&tb, &ep->tag, 0));
+}
+
+
+ssize_t
+gacl_entry_permset_to_text(GACL_ENTRY *ep,
+			   char *buf,
+			   size_t bufsize,
+			   int flags) {
+  GACL_TEXTBUF tb;
+
+  
+  if (!ep) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  _gacl_tb_init(&tb, buf, bufsize);
+  return _gacl_tb_end(&tb, _gacl_perms_append_text(&tb, ep->perms, flags));
+}
+
+
+ssize_t
+gacl_entry_flagset_to_text(GACL_ENTRY *ep,
+			   char *buf,
+			   size_t bufsize,
+			   int flags) {
+  GACL_TEXTBUF tb;
+
+  
+  if (!ep) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  _gacl_tb_init(&tb, buf, bufsize);
+  return _gacl_tb_end(&tb, _gacl_flags_append_text(&tb, ep->flags, flags));
+}
+
+
+ssize_t
+gacl_entry_type_to_text(GACL_ENTRY *ep,
+			char *buf,
+			size_t bufsize,
+			int flags) {
+  GACL_TEXTBUF tb;
+
+  
+  if (!ep) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  _gacl_tb_init(&tb, buf, bufsize);
+  return _gacl_tb_end(&tb, _gacl_type_append_text(&tb, ep->type));
+}
+
+
+/* Returns the text length, or -1 (errno ERANGE) if 'buf' was too small */
+ssize_t
+gacl_entry_to_text(GACL_ENTRY *ep,
+		   char *buf,
+		   size_t bufsize,
+		   int flags) {
+  GACL_TEXTBUF tb;
+
+  
+  if (!ep) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  _gacl_tb_init(&tb, buf, bufsize);
+  return _gacl_tb_end(&tb, _gacl_entry_append_text(&tb, ep, flags, 0));
 }
 
 int
@@ -1943,67 +2549,81 @@ _gacl_max_tagwidth(GACL *ap) {
 }
 
 
-char *
-gacl_to_text_np(GACL *ap,
-		ssize_t *bsp,
-		int flags) {
-  char *buf, *bp;
-  size_t bufsize = 2048;
+static int
+_gacl_append_text(GACL_TEXTBUF *tb,
+		  GACL *ap,
+		  int flags) {
   int i, rc;
   GACL_ENTRY *ep;
+  int f_compact = (flags & GACL_TEXT_COMPACT);
   int tagwidth = ((flags & GACL_TEXT_STANDARD) ? 18 : _gacl_max_tagwidth(ap)+8);
 
   
-  bp = buf = _gacl_alloc(GACL_MAGIC_TEXT, bufsize);
-  if (!buf)
-    return NULL;
+  for (i = 0; (rc = _gacl_get_entry(ap, i, &ep)) == 1; i++) {
+    if (f_compact) {
+      if ((i > 0 && _gacl_tb_putc(tb, ',') < 0) ||
+	  _gacl_entry_append_text(tb, ep, flags, 0) < 0)
+	return -1;
+    } else {
+      if (_gacl_entry_append_text(tb, ep, flags, tagwidth) < 0 ||
+	  _gacl_tb_putc(tb, '\n') < 0)
+	return -1;
+    }
+  }
+  
+  return rc;
+}
 
-  for (i = 0;
-       bufsize > 1 && ((rc = gacl_get_entry(ap, i ? GACL_NEXT_ENTRY : GACL_FIRST_ENTRY, &ep)) == 1);
-       i++) {
-    char es[1024], *cp;
-    ssize_t rc, len;
-    GACL_TAG_TYPE et = GACL_TAG_TYPE_UNKNOWN;
-    
-    if (gacl_get_tag_type(ep, &et) < 0)
-      goto Fail;
-    
-    rc = gacl_entry_to_text(ep, es, sizeof(es), flags|GACL_TEXT_STANDARD);
-    if (rc < 0)
-      goto Fail;
 
-    cp = strchr(es, ':');
-    if (cp) {
-      len = cp-es;
-      if (len > 0 && (et == GACL_TAG_TYPE_USER || et == GACL_TAG_TYPE_GROUP)) {
-	cp = strchr(cp+1, ':');
-	if (cp)
-	  len = cp-es;
-      }
-    } else
-      len = 0;
-
-    if (flags & GACL_TEXT_COMPACT) 
-      rc = snprintf(bp, bufsize, "%s%s", (i > 0 ? "," : ""), es);
-    else
-      if (tagwidth > len)
-	rc = snprintf(bp, bufsize, "%*s%s\n", (int) (tagwidth-len), "", es);
-      else
-	rc = snprintf(bp, bufsize, "%s\n", es);
-    if (rc < 0)
-      goto Fail;
+/*
+ * Format into a caller buffer, for callers that keep their own output
+ * buffers. Returns the length, or -1 with errno ERANGE if it doesn't fit.
+ */
+ssize_t
+gacl_to_text_buf_np(GACL *ap,
+		    char *buf,
+		    size_t bufsize,
+		    int flags) {
+  GACL_TEXTBUF tb;
 
-    bp += rc;
-    bufsize -= rc;
+  
+  if (bufsize == 0) {
+    errno = ERANGE;
+    return -1;
   }
+  
+  _gacl_tb_init(&tb, buf, bufsize);
+  if (_gacl_append_text(&tb, ap, flags) < 0)
+    return -1;
+  
+  _gacl_tb_end(&tb, 0);
+  return tb.len;
+}
 
+
+char *
+gacl_to_text_np(GACL *ap,
+		ssize_t *bsp,
+		int flags) {
+  GACL_TEXTBUF tb;
+
+  
+  _gacl_tb_init(&tb, _gacl_alloc(GACL_MAGIC_TEXT, 2048), 2048);
+  if (!tb.buf)
+    return NULL;
+  tb.f_grow = 1;
+
+  if (_gacl_append_text(&tb, ap, flags) < 0)
+    goto Fail;
+
+  _gacl_tb_end(&tb, 0);
   if (bsp)
-    *bsp = (bp-buf);
+    *bsp = tb.len;
   
-  return buf;
+  return tb.buf;
 
  Fail:
-  gacl_free(buf);
+  gacl_free(tb.buf);
   return NULL;
 }
 
@@ -2094,88 +2714,92 @@ gacl_delete_fd_np(int fd,
 
 
 
-int
-_gacl_permset_from_text(const char *buf,
-			GACL_PERMSET *psp,
-			int flags) {
-  int i;
-  char c;
+/* Permission set (or one of the named sets) in [cp, end) */
+static int
+_gacl_permset_from_span(const char *cp,
+			const char *end,
+			GACL_PERMSET *psp) {
+  size_t len = end-cp;
+  int32_t p;
   GACL_PERMSET nps = 0;
 
+  
+  if (!len)
+    return 0;
 
-  if (!buf) {
-    errno = EINVAL;
-    return -1;
+  switch (*cp) {
+  case 'a':
+    if (GACL_SPAN_IS(cp, len, "all"))
+      goto Set;
+    break;
+  case 'f':
+    if (GACL_SPAN_IS(cp, len, "full_set"))
+      goto Set;
+    break;
+  case 'm':
+    if (GACL_SPAN_IS(cp, len, "modify_set") || GACL_SPAN_IS(cp, len, "modify")) {
+      nps = GACL_PERM_MODIFY_SET;
+      goto End;
+    }
+    break;
+  case 'w':
+    if (GACL_SPAN_IS(cp, len, "write_set") || GACL_SPAN_IS(cp, len, "write")) {
+      nps = GACL_PERM_WRITE_SET;
+      goto End;
+    }
+    break;
+  case 'r':
+    if (GACL_SPAN_IS(cp, len, "read_set") || GACL_SPAN_IS(cp, len, "read")) {
+      nps = GACL_PERM_READ_SET;
+      goto End;
+    }
+    break;
+  case 'e':
+  case 'n':
+    /* XXX: Remove 'none', but handle the magic 'none' case for edit-access */
+    if (GACL_SPAN_IS(cp, len, "empty_set") || GACL_SPAN_IS(cp, len, "empty") ||
+	GACL_SPAN_IS(cp, len, "none"))
+      goto End;
+    break;
   }
 
-  if (!*buf)
-    return 0;
-
-  if (strcmp(buf, "full_set") == 0 ||
-      strcmp(buf, "all") == 0)
-    nps = GACL_PERM_FULL_SET;
-  else if (strcmp(buf, "modify_set") == 0 ||
-	   strcmp(buf, "modify") == 0)
-    nps = GACL_PERM_MODIFY_SET;
-  else if (strcmp(buf, "write_set") == 0 ||
-	   strcmp(buf, "write") == 0)
-    nps = GACL_PERM_WRITE_SET;
-  else if (strcmp(buf, "read_set") == 0 ||
-	   strcmp(buf, "read") == 0)
-    nps = GACL_PERM_READ_SET;
-  else if (strcmp(buf, "empty_set") == 0 ||
-	   strcmp(buf, "empty") == 0 ||
-	   strcmp(buf, "none") == 0) /* XXX: Remove, but handle the magic 'none' case for edit-access */
-    nps = 0;
-  else {
-    while ((c = *buf++) != '\0') {
-      if (c == '-')
-	continue;
-      for (i = 0; gace_p2c[i].c && gace_p2c[i].c != c; i++)
-	;
-      if (!gace_p2c[i].c) {
-	errno = EINVAL;
-	return -1;
-      }
-      
-      nps |= gace_p2c[i].p;
+  while (cp < end) {
+    p = gace_pchar[(unsigned char) *cp++];
+    if (p < 0) {
+      errno = EINVAL;
+      return -1;
     }
-    
+    nps |= p;
   }
+  goto End;
 
+ Set:
+  nps = GACL_PERM_FULL_SET;
+ End:
   *psp = nps;
   return 1;
 }
 
 
-int
-_gacl_flagset_from_text(const char *buf,
-			GACL_FLAGSET *fsp,
-			int flags) {
-  int i;
-  char c;
+/* Flag set in [cp, end) */
+static int
+_gacl_flagset_from_span(const char *cp,
+			const char *end,
+			GACL_FLAGSET *fsp) {
+  int32_t f;
   GACL_FLAGSET nfs = 0;
 
 
-  if (!buf) {
-    errno = EINVAL;
-    return -1;
-  }
-
-  if (!*buf)
+  if (cp == end)
     return 0;
 
-  while ((c = *buf++) != '\0') {
-    if (c == '-')
-      continue;
-    for (i = 0; gace_f2c[i].c && gace_f2c[i].c != c; i++)
-      ;
-    if (!gace_f2c[i].c) {
+  while (cp < end) {
+    f = gace_fchar[(unsigned char) *cp++];
+    if (f < 0) {
       errno = EINVAL;
       return -1;
     }
-
-    nfs |= gace_f2c[i].f;
+    nfs |= f;
   }
 
   *fsp = nfs;
@@ -2183,67 +2807,88 @@ _gacl_flagset_from_text(const char *buf,
 }
 
 
+/* Entry type in [cp, end), -1 if it isn't one */
+static int
+_gacl_type_from_span(const char *cp,
+		     const char *end,
+		     GACL_ENTRY_TYPE *etp) {
+  size_t len = end-cp;
+
+  
+  switch (len) {
+  case 4:
+    if (memcmp(cp, "deny", 4) == 0) {
+      *etp = GACL_ENTRY_TYPE_DENY;
+      return 0;
+    }
+    break;
+  case 5:
+    if (memcmp(cp, "allow", 5) == 0) {
+      *etp = GACL_ENTRY_TYPE_ALLOW;
+      return 0;
+    }
+    if (memcmp(cp, "audit", 5) == 0) {
+      *etp = GACL_ENTRY_TYPE_AUDIT;
+      return 0;
+    }
+    if (memcmp(cp, "alarm", 5) == 0) {
+      *etp = GACL_ENTRY_TYPE_ALARM;
+      return 0;
+    }
+    break;
+  }
+  
+  return -1;
+}
+
 
+/*
+ * Parse one ACE from the 'len' bytes at 'cp' in a single pass:
+ *
+ * <tag>:<perms>[:<flags>][:<type>]
+ */
 int
-_gacl_entry_from_text(char *cp,
+_gacl_entry_from_span(const char *cp,
+		      size_t len,
 		      GACL_ENTRY *ep,
 		      int flags) {
-  char *np;
+  const char *np, *end = cp+len;
+  GACL_ENTRY_TYPE et;
   int f_none;
 
   
-  /* 1. Get tag */
+  pthread_once(&gace_tab_once, _gace_tab_init);
   
-  if (_gacl_entry_tag_from_text(ep, &cp, flags) < 0)
+  /* 1. Get tag */
+  if (_gacl_tag_from_span(&ep->tag, &cp, end, flags) < 0)
     return -1;
 
-  if (!cp)
-    return -1;
-  
   /* 2. Get permset */
-  np = strchr(cp, ':');
-  if (np)
-    *np++ = '\0';
+  np = memchr(cp, ':', end-cp);
+  if (!np)
+    np = end;
   
-  f_none = (strcmp(cp, "none") == 0);
-
-  if (_gacl_permset_from_text(cp, &ep->perms, flags) < 0)
+  f_none = GACL_SPAN_IS(cp, np-cp, "none");
+  
+  if (_gacl_permset_from_span(cp, np, &ep->perms) < 0)
     return -1;
-  cp = np;
+  cp = (np < end ? np+1 : NULL);
 
-
-  /* 3. Get flagset */
-  if (cp && (strcmp(cp, "allow") != 0 &&
-	     strcmp(cp, "deny") != 0 &&
-	     strcmp(cp, "audit") != 0 &&
-	     strcmp(cp, "alarm") != 0)) {
-    np = strchr(cp, ':');
-    if (np)
-      *np++ = '\0';
-    /* Parse flags in cp */
-    if (_gacl_flagset_from_text(cp, &ep->flags, flags) < 0)
+  /* 3. Get flagset, unless all that's left is the type */
+  if (cp && _gacl_type_from_span(cp, end, &et) < 0) {
+    np = memchr(cp, ':', end-cp);
+    if (!np)
+      np = end;
+    
+    if (_gacl_flagset_from_span(cp, np, &ep->flags) < 0)
       return -1;
-  } else {
+    cp = (np < end ? np+1 : NULL);
+  } else
     ep->flags = 0;
-  }
 
-  cp = np;
   /* 4. Get type (allow, deny, alarm, audit) */
   if (cp) {
-    np = strchr(cp, ':');
-    if (np) {
-      errno = EINVAL;
-      return -1;
-    }
-    if (strcmp(cp, "allow") == 0) 
-      ep->type = GACL_ENTRY_TYPE_ALLOW;
-    else if (strcmp(cp, "deny") == 0)
-      ep->type = GACL_ENTRY_TYPE_DENY;
-    else if (strcmp(cp, "audit") == 0)
-      ep->type = GACL_ENTRY_TYPE_AUDIT;
-    else if (strcmp(cp, "alarm") == 0)
-      ep->type = GACL_ENTRY_TYPE_ALARM;
-    else {
+    if (_gacl_type_from_span(cp, end, &ep->type) < 0) {
       errno = EINVAL;
       return -1;
     }
@@ -2259,6 +2904,19 @@ _gacl_entry_from_text(char *cp,
 }
 
 
+int
+_gacl_entry_from_text(const char *cp,
+		      GACL_ENTRY *ep,
+		      int flags) {
+  if (!cp) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  return _gacl_entry_from_span(cp, strlen(cp), ep, flags);
+}
+
+
 int
 gacl_entry_from_text(char *cp,
 		     GACL_ENTRY *ep) {
@@ -2266,11 +2924,17 @@ gacl_entry_from_text(char *cp,
 }
 
 
+/* ACEs are separated by commas or whitespace */
+static inline int
+_gacl_text_is_sep(char c) {
+  return c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
 GACL *
 gacl_from_text(const char *buf) {
   GACL *ap;
-  char *bp, *tbuf, *es;
-  const char *cp;
+  const char *cp, *es;
   int ne = 0;
 
   
@@ -2286,31 +2950,29 @@ gacl_from_text(const char *buf) {
   if (*buf)
     ++ne;
   
-  bp = tbuf = strdup(buf);
-
   ap = gacl_init(ne);
-  if (!ap) {
-    free(tbuf);
+  if (!ap)
     return NULL;
-  }
 
-  while ((es = strsep(&bp, ", \t\n\r")) != NULL) {
+  for (es = buf;; es = cp+1) {
     GACL_ENTRY *ep;
 
+    for (cp = es; *cp && !_gacl_text_is_sep(*cp); ++cp)
+      ;
+    
     if (gacl_create_entry_np(&ap, &ep, -1) < 0)
       goto Fail;
 
-    if (gacl_entry_from_text(es, ep) < 0)
+    if (_gacl_entry_from_span(es, cp-es, ep, 0) < 0)
       goto Fail;
+
+    if (!*cp)
+      break;
   }
 
-  free(tbuf);
   return ap;
 
  Fail:
-  if (tbuf)
-    free(tbuf);
-  
   gacl_free(ap);
   errno = EINVAL;
   return NULL;
@@ -2334,34 +2996,166 @@ gacl_delete_def_link_np(const char *path) {
 }
 
 
+/*
+ * Check that an NFSv4 ACL is one a server would accept, without any
+ * round trip. 'ftype' is the S_IFMT type of the object it is for, or 0 if
+ * not known (skips the directory-only flag check). On failure, the index of
+ * the offending entry (-1 for the ACL as a whole) and a description are
+ * returned via 'posp' and 'whyp', and errno is set (ENOTDIR for inheritance
+ * flags on a non-directory, else EINVAL).
+ */
 int
-gacl_valid(GACL *ap) {
-  errno = ENOSYS;
+gacl_valid_np(GACL *ap,
+	      mode_t ftype,
+	      int flags,
+	      int *posp,
+	      const char **whyp) {
+  GACL_ENTRY *ep;
+  const char *why = NULL;
+  int i, ec = EINVAL;
+  
+  
+  if (!ap || ap->ac < 0 || ap->ac > ap->as) {
+    i = -1;
+    why = "Invalid ACL";
+    goto Fail;
+  }
+  
+  for (i = 0; i < ap->ac; i++) {
+    ep = &ap->av[i];
+    
+    switch (ep->tag.type) {
+    case GACL_TAG_TYPE_USER_OBJ:
+    case GACL_TAG_TYPE_GROUP_OBJ:
+    case GACL_TAG_TYPE_EVERYONE:
+      break;
+
+    case GACL_TAG_TYPE_USER:
+    case GACL_TAG_TYPE_GROUP:
+      /* Unresolved names come from an existing ACL, so the server knows them */
+      if (!(flags & GACL_VALID_RELAXED) && !(ep->tag.flags & GACL_TAG_F_LAZY) &&
+	  ep->tag.ugid == (uid_t) -1) {
+	why = (ep->tag.type == GACL_TAG_TYPE_USER ? "Unknown user" : "Unknown group");
+	goto Fail;
+      }
+      break;
+      
+    default:
+      why = "Tag type not supported by NFSv4";
+      goto Fail;
+    }
+
+    switch (ep->type) {
+    case GACL_ENTRY_TYPE_ALLOW:
+    case GACL_ENTRY_TYPE_AUDIT:
+    case GACL_ENTRY_TYPE_ALARM:
+      break;
+      
+    case GACL_ENTRY_TYPE_DENY:
+      if (!ep->perms) {
+	why = "Deny entry without permissions";
+	goto Fail;
+      }
+      break;
+      
+    default:
+      why = "Invalid entry type";
+      goto Fail;
+    }
+    
+    if (ep->perms & ~GACL_PERM_NFS4_BITS) {
+      why = "Undefined permission bits";
+      goto Fail;
+    }
+    
+    if (ep->flags & ~GACL_FLAG_BITS) {
+      why = "Undefined flag bits";
+      goto Fail;
+    }
+
+    if ((ep->flags & (GACL_FLAG_INHERIT_ONLY|GACL_FLAG_NO_PROPAGATE_INHERIT)) &&
+	!(ep->flags & (GACL_FLAG_FILE_INHERIT|GACL_FLAG_DIRECTORY_INHERIT))) {
+      why = ((ep->flags & GACL_FLAG_INHERIT_ONLY) ?
+	     "Inherit-only without file or directory inherit" :
+	     "No-propagate without file or directory inherit");
+      goto Fail;
+    }
+    
+    /* Same rule as clean_acl() */
+    if (ftype && !S_ISDIR(ftype) && (ep->flags & ~GACL_FLAG_INHERITED)) {
+      why = "Inheritance flags on a non-directory";
+      ec = ENOTDIR;
+      goto Fail;
+    }
+  }
+
+  return 0;
+
+ Fail:
+  if (posp)
+    *posp = i;
+  if (whyp)
+    *whyp = why;
+  errno = ec;
   return -1;
 }
 
+
+int
+gacl_valid(GACL *ap) {
+  return gacl_valid_np(ap, 0, 0, NULL, NULL);
+}
+
+
+static int
+_gacl_valid_stat(const struct stat *sp,
+		 GACL_TYPE type,
+		 GACL *ap) {
+  if (type != GACL_TYPE_NFS4) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  return gacl_valid_np(ap, sp->st_mode & S_IFMT, 0, NULL, NULL);
+}
+
 int
 gacl_valid_fd_np(int fd, 
-		 GACL_ENTRY_TYPE type, 
+		 GACL_TYPE type, 
 		 GACL *ap) {
-  errno = ENOSYS;
-  return -1;
+  struct stat sb;
+
+  
+  if (fstat(fd, &sb) < 0)
+    return -1;
+  
+  return _gacl_valid_stat(&sb, type, ap);
 }
 
 int
 gacl_valid_file_np(const char *path,
-		   GACL_ENTRY_TYPE type,
+		   GACL_TYPE type,
 		   GACL *ap) {
-  errno = ENOSYS;
-  return -1;
+  struct stat sb;
+
+  
+  if (vfs_stat(path, &sb) < 0)
+    return -1;
+  
+  return _gacl_valid_stat(&sb, type, ap);
 }
 
 int
 gacl_valid_link_np(const char *path,
-		   GACL_ENTRY_TYPE type,
+		   GACL_TYPE type,
 		   GACL *ap) {
-  errno = ENOSYS;
-  return -1;
+  struct stat sb;
+
+  
+  if (vfs_lstat(path, &sb) < 0)
+    return -1;
+  
+  return _gacl_valid_stat(&sb, type, ap);
 }
 
 int
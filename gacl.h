@@ -37,6 +37,15 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+/* Per-thread storage for scratch buffers that are returned to the caller */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define GACL_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define GACL_THREAD_LOCAL __thread
+#else
+#define GACL_THREAD_LOCAL
+#endif
+
 #define GACL_MAGIC_BASE 0x1532f2d0
 
 typedef enum gacl_magic {
@@ -87,8 +96,12 @@ typedef struct gacl_entry_tag {
   GACL_TAG_TYPE type;
   uid_t ugid;
   char name[256];
+  int flags;
 } GACL_TAG;
 
+/* 'ugid' not yet looked up - resolve it from 'name' via gacl_tag_ugid_np() */
+#define GACL_TAG_F_LAZY 0x0001
+
 
 typedef uint32_t GACL_PERM;
 typedef uint32_t GACL_PERMSET;
@@ -158,7 +171,7 @@ typedef uint16_t GACL_FLAGSET;
 #define	GACL_FLAG_BITS \
   (GACL_FLAG_FILE_INHERIT |       \
    GACL_FLAG_DIRECTORY_INHERIT |  \
-   GACL_FLAG_NO_PROPAGATE_INHERIT \
+   GACL_FLAG_NO_PROPAGATE_INHERIT | \
    GACL_FLAG_INHERIT_ONLY |       \
    GACL_FLAG_SUCCESSFUL_ACCESS |  \
    GACL_FLAG_FAILED_ACCESS |      \
@@ -228,6 +241,16 @@ extern int
 gacl_match(GACL *ap,
 	   GACL *mp);
 
+#define GACL_EQUIV_F_NODIR 0x0001 /* Normalize flags as for a non-directory */
+
+extern int
+gacl_equiv_np(GACL *ap,
+	      GACL *bp,
+	      int flags);
+
+extern GACL *
+_gacl_from_mode(mode_t mode);
+
 extern int
 _gacl_entry_match(GACL_ENTRY *aep,
 		  GACL_ENTRY *mep,
@@ -251,6 +274,10 @@ extern GACL *
 gacl_strip_np(GACL *ap,
 	      int recalculate_mask);
 
+extern GACL *
+gacl_inherit_np(GACL *ap,
+		int f_dir);
+
 extern int
 gacl_init_entry(GACL_ENTRY *ep);
 
@@ -288,16 +315,52 @@ _gacl_entries(GACL *ap);
 #define GACL_FIRST_ENTRY 0
 #define GACL_NEXT_ENTRY  1
 
+/* Random access - does not touch the ACL's own cursor */
 extern int
 _gacl_get_entry(GACL *ap,
 		int pos,
 		GACL_ENTRY **epp);
 
+/* Uses a cursor stored in the ACL - not safe on ACLs shared between threads */
 extern int
 gacl_get_entry(GACL *ap,
 	       int eid,
 	       GACL_ENTRY **epp);
 
+/* Like gacl_get_entry() but with a caller-owned cursor */
+extern int
+gacl_get_entry_r_np(GACL *ap,
+		    int eid,
+		    int *cursor,
+		    GACL_ENTRY **epp);
+
+
+/*
+ * Reentrant, cached (see idcache.h) user/group lookups.
+ * Return 1 if found, 0 if not and -1 on error.
+ */
+extern int
+gacl_uid_to_name_np(uid_t uid,
+		    char *buf,
+		    size_t bufsize);
+
+extern int
+gacl_gid_to_name_np(gid_t gid,
+		    char *buf,
+		    size_t bufsize);
+
+extern int
+gacl_name_to_uid_np(const char *name,
+		    uid_t *uidp);
+
+extern int
+gacl_name_to_gid_np(const char *name,
+		    gid_t *gidp);
+
+/* The uid/gid of a user/group tag, resolving it first if needed */
+extern uid_t
+gacl_tag_ugid_np(GACL_TAG *tp);
+
 
 extern GACL *
 gacl_get_file(const char *path,
@@ -335,6 +398,41 @@ extern int
 gacl_set_fd(int fd,
 	    GACL *ap);
 
+
+/* Raw OS-native ACL blobs (NFSv4 XDR on Linux) - ENOSYS where not available */
+extern ssize_t
+gacl_get_raw_file_np(const char *path,
+		     GACL_TYPE type,
+		     void *buf,
+		     size_t bufsize);
+
+extern ssize_t
+gacl_get_raw_link_np(const char *path,
+		     GACL_TYPE type,
+		     void *buf,
+		     size_t bufsize);
+
+extern int
+gacl_set_raw_file_np(const char *path,
+		     GACL_TYPE type,
+		     const void *buf,
+		     size_t bufsize);
+
+extern int
+gacl_set_raw_link_np(const char *path,
+		     GACL_TYPE type,
+		     const void *buf,
+		     size_t bufsize);
+
+extern GACL *
+gacl_from_raw_np(const void *buf,
+		 size_t bufsize);
+
+extern ssize_t
+gacl_to_raw_np(GACL *ap,
+	       void *buf,
+	       size_t bufsize);
+
 extern int
 gacl_set_tag_type(GACL_ENTRY *ep,
 		  GACL_TAG_TYPE et);
@@ -474,12 +572,24 @@ extern char *
 gacl_to_text(GACL *ap,
 	     ssize_t *bsp);
 
+extern ssize_t
+gacl_to_text_buf_np(GACL *ap,
+		    char *buf,
+		    size_t bufsize,
+		    int flags);
+
 
 
 #define GACL_TEXT_RELAXED  0x0001 /* Do not verify user/group names */
 
 extern int
-_gacl_entry_from_text(char *cp,
+_gacl_entry_from_span(const char *cp,
+		      size_t len,
+		      GACL_ENTRY *ep,
+		      int flags);
+
+extern int
+_gacl_entry_from_text(const char *cp,
 		      GACL_ENTRY *ep,
 		      int flags);
 
@@ -509,6 +619,34 @@ extern int
 gacl_delete_def_link_np(const char *path);
 
 
+#define GACL_VALID_RELAXED 0x0001 /* Accept unknown user/group principals */
+
+extern int
+gacl_valid_np(GACL *ap,
+	      mode_t ftype,
+	      int flags,
+	      int *posp,
+	      const char **whyp);
+
+extern int
+gacl_valid(GACL *ap);
+
+extern int
+gacl_valid_fd_np(int fd,
+		 GACL_TYPE type,
+		 GACL *ap);
+
+extern int
+gacl_valid_file_np(const char *path,
+		   GACL_TYPE type,
+		   GACL *ap);
+
+extern int
+gacl_valid_link_np(const char *path,
+		   GACL_TYPE type,
+		   GACL *ap);
+
+
 typedef GACL *acl_t;
 typedef GACL_ENTRY *acl_entry_t;
 typedef GACL_TAG_TYPE acl_tag_t;
@@ -0,0 +1,542 @@
+/*
+ * gacl_batch.c - Struct-of-arrays ACE batches and vectorized match kernels
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "gacl.h"
+#include "gacl_batch.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define GACL_KERN_SSE2 1
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__) && (__GNUC__ >= 5 || defined(__clang__))
+#include <immintrin.h>
+#define GACL_KERN_AVX2 1
+#define GACL_KERN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+
+
+/* ---------- Scalar kernels ---------- */
+
+static void
+_kern_equal_scalar(uint32_t *sel,
+		   const uint32_t *col,
+		   uint32_t v,
+		   size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    sel[i] &= -(uint32_t) (col[i] == v);
+}
+
+static void
+_kern_all_set_scalar(uint32_t *sel,
+		     const uint32_t *col,
+		     uint32_t mask,
+		     size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    sel[i] &= -(uint32_t) ((col[i] & mask) == mask);
+}
+
+static void
+_kern_none_set_scalar(uint32_t *sel,
+		      const uint32_t *col,
+		      uint32_t mask,
+		      size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    sel[i] &= -(uint32_t) ((col[i] & mask) == 0);
+}
+
+static void
+_kern_member_scalar(uint32_t *sel,
+		    const uint32_t *col,
+		    const uint32_t *set,
+		    size_t nset,
+		    size_t n) {
+  size_t i, j;
+
+  for (i = 0; i < n; i++) {
+    uint32_t m = 0;
+    
+    for (j = 0; j < nset; j++)
+      m |= -(uint32_t) (col[i] == set[j]);
+    sel[i] &= m;
+  }
+}
+
+
+/* ---------- SSE2 kernels (4 lanes) ---------- */
+
+#ifdef GACL_KERN_SSE2
+static void
+_kern_equal_sse2(uint32_t *sel,
+		 const uint32_t *col,
+		 uint32_t v,
+		 size_t n) {
+  __m128i vv = _mm_set1_epi32((int) v);
+  size_t i;
+
+  for (i = 0; i+4 <= n; i += 4) {
+    __m128i c = _mm_loadu_si128((const __m128i *) (col+i));
+    __m128i s = _mm_loadu_si128((const __m128i *) (sel+i));
+    
+    _mm_storeu_si128((__m128i *) (sel+i), _mm_and_si128(s, _mm_cmpeq_epi32(c, vv)));
+  }
+  _kern_equal_scalar(sel+i, col+i, v, n-i);
+}
+
+static void
+_kern_all_set_sse2(uint32_t *sel,
+		   const uint32_t *col,
+		   uint32_t mask,
+		   size_t n) {
+  __m128i vm = _mm_set1_epi32((int) mask);
+  size_t i;
+
+  for (i = 0; i+4 <= n; i += 4) {
+    __m128i c = _mm_loadu_si128((const __m128i *) (col+i));
+    __m128i s = _mm_loadu_si128((const __m128i *) (sel+i));
+    
+    c = _mm_cmpeq_epi32(_mm_and_si128(c, vm), vm);
+    _mm_storeu_si128((__m128i *) (sel+i), _mm_and_si128(s, c));
+  }
+  _kern_all_set_scalar(sel+i, col+i, mask, n-i);
+}
+
+static void
+_kern_none_set_sse2(uint32_t *sel,
+		    const uint32_t *col,
+		    uint32_t mask,
+		    size_t n) {
+  __m128i vm = _mm_set1_epi32((int) mask);
+  __m128i vz = _mm_setzero_si128();
+  size_t i;
+
+  for (i = 0; i+4 <= n; i += 4) {
+    __m128i c = _mm_loadu_si128((const __m128i *) (col+i));
+    __m128i s = _mm_loadu_si128((const __m128i *) (sel+i));
+    
+    c = _mm_cmpeq_epi32(_mm_and_si128(c, vm), vz);
+    _mm_storeu_si128((__m128i *) (sel+i), _mm_and_si128(s, c));
+  }
+  _kern_none_set_scalar(sel+i, col+i, mask, n-i);
+}
+
+static void
+_kern_member_sse2(uint32_t *sel,
+		  const uint32_t *col,
+		  const uint32_t *set,
+		  size_t nset,
+		  size_t n) {
+  size_t i, j;
+
+  for (i = 0; i+4 <= n; i += 4) {
+    __m128i c = _mm_loadu_si128((const __m128i *) (col+i));
+    __m128i m = _mm_setzero_si128();
+
+    for (j = 0; j < nset; j++)
+      m = _mm_or_si128(m, _mm_cmpeq_epi32(c, _mm_set1_epi32((int) set[j])));
+    
+    _mm_storeu_si128((__m128i *) (sel+i),
+		     _mm_and_si128(_mm_loadu_si128((const __m128i *) (sel+i)), m));
+  }
+  _kern_member_scalar(sel+i, col+i, set, nset, n-i);
+}
+#endif
+
+
+/* ---------- AVX2 kernels (8 lanes, selected at runtime) ---------- */
+
+#ifdef GACL_KERN_AVX2
+GACL_KERN_TARGET_AVX2 static void
+_kern_equal_avx2(uint32_t *sel,
+		 const uint32_t *col,
+		 uint32_t v,
+		 size_t n) {
+  __m256i vv = _mm256_set1_epi32((int) v);
+  size_t i;
+
+  for (i = 0; i+8 <= n; i += 8) {
+    __m256i c = _mm256_loadu_si256((const __m256i *) (col+i));
+    __m256i s = _mm256_loadu_si256((const __m256i *) (sel+i));
+    
+    _mm256_storeu_si256((__m256i *) (sel+i), _mm256_and_si256(s, _mm256_cmpeq_epi32(c, vv)));
+  }
+  _kern_equal_scalar(sel+i, col+i, v, n-i);
+}
+
+GACL_KERN_TARGET_AVX2 static void
+_kern_all_set_avx2(uint32_t *sel,
+		   const uint32_t *col,
+		   uint32_t mask,
+		   size_t n) {
+  __m256i vm = _mm256_set1_epi32((int) mask);
+  size_t i;
+
+  for (i = 0; i+8 <= n; i += 8) {
+    __m256i c = _mm256_loadu_si256((const __m256i *) (col+i));
+    __m256i s = _mm256_loadu_si256((const __m256i *) (sel+i));
+    
+    c = _mm256_cmpeq_epi32(_mm256_and_si256(c, vm), vm);
+    _mm256_storeu_si256((__m256i *) (sel+i), _mm256_and_si256(s, c));
+  }
+  _kern_all_set_scalar(sel+i, col+i, mask, n-i);
+}
+
+GACL_KERN_TARGET_AVX2 static void
+_kern_none_set_avx2(uint32_t *sel,
+		    const uint32_t *col,
+		    uint32_t mask,
+		    size_t n) {
+  __m256i vm = _mm256_set1_epi32((int) mask);
+  __m256i vz = _mm256_setzero_si256();
+  size_t i;
+
+  for (i = 0; i+8 <= n; i += 8) {
+    __m256i c = _mm256_loadu_si256((const __m256i *) (col+i));
+    __m256i s = _mm256_loadu_si256((const __m256i *) (sel+i));
+    
+    c = _mm256_cmpeq_epi32(_mm256_and_si256(c, vm), vz);
+    _mm256_storeu_si256((__m256i *) (sel+i), _mm256_and_si256(s, c));
+  }
+  _kern_none_set_scalar(sel+i, col+i, mask, n-i);
+}
+
+GACL_KERN_TARGET_AVX2 static void
+_kern_member_avx2(uint32_t *sel,
+		  const uint32_t *col,
+		  const uint32_t *set,
+		  size_t nset,
+		  size_t n) {
+  size_t i, j;
+
+  for (i = 0; i+8 <= n; i += 8) {
+    __m256i c = _mm256_loadu_si256((const __m256i *) (col+i));
+    __m256i m = _mm256_setzero_si256();
+
+    for (j = 0; j < nset; j++)
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi32(c, _mm256_set1_epi32((int) set[j])));
+    
+    _mm256_storeu_si256((__m256i *) (sel+i),
+			_mm256_and_si256(_mm256_loadu_si256((const __m256i *) (sel+i)), m));
+  }
+  _kern_member_scalar(sel+i, col+i, set, nset, n-i);
+}
+#endif
+
+
+
+static struct gacl_kernels {
+  const char *name;
+  void (*equal)(uint32_t *, const uint32_t *, uint32_t, size_t);
+  void (*all_set)(uint32_t *, const uint32_t *, uint32_t, size_t);
+  void (*none_set)(uint32_t *, const uint32_t *, uint32_t, size_t);
+  void (*member)(uint32_t *, const uint32_t *, const uint32_t *, size_t, size_t);
+} kernels[] =
+  {
+#ifdef GACL_KERN_AVX2
+   { "avx2",   _kern_equal_avx2,   _kern_all_set_avx2,   _kern_none_set_avx2,   _kern_member_avx2 },
+#endif
+#ifdef GACL_KERN_SSE2
+   { "sse2",   _kern_equal_sse2,   _kern_all_set_sse2,   _kern_none_set_sse2,   _kern_member_sse2 },
+#endif
+   { "scalar", _kern_equal_scalar, _kern_all_set_scalar, _kern_none_set_scalar, _kern_member_scalar },
+  };
+
+static struct gacl_kernels *kp = NULL;
+
+
+static struct gacl_kernels *
+_gacl_kernels(void) {
+  if (kp)
+    return kp;
+
+  kp = &kernels[0];
+#ifdef GACL_KERN_AVX2
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("avx2"))
+    kp = &kernels[1];
+#endif
+  
+  return kp;
+}
+
+
+const char *
+gacl_kern_impl(void) {
+  return _gacl_kernels()->name;
+}
+
+void
+gacl_kern_equal(uint32_t *sel,
+		const uint32_t *col,
+		uint32_t v,
+		size_t n) {
+  _gacl_kernels()->equal(sel, col, v, n);
+}
+
+void
+gacl_kern_all_set(uint32_t *sel,
+		  const uint32_t *col,
+		  uint32_t mask,
+		  size_t n) {
+  _gacl_kernels()->all_set(sel, col, mask, n);
+}
+
+void
+gacl_kern_none_set(uint32_t *sel,
+		   const uint32_t *col,
+		   uint32_t mask,
+		   size_t n) {
+  _gacl_kernels()->none_set(sel, col, mask, n);
+}
+
+void
+gacl_kern_member(uint32_t *sel,
+		 const uint32_t *col,
+		 const uint32_t *set,
+		 size_t nset,
+		 size_t n) {
+  _gacl_kernels()->member(sel, col, set, nset, n);
+}
+
+size_t
+gacl_kern_count(const uint32_t *sel,
+		size_t n) {
+  size_t i, c = 0;
+
+  for (i = 0; i < n; i++)
+    c += (sel[i] != 0);
+  
+  return c;
+}
+
+
+
+void
+gacl_batch_init(GACL_BATCH *bp) {
+  memset(bp, 0, sizeof(*bp));
+}
+
+
+void
+gacl_batch_clear(GACL_BATCH *bp) {
+  bp->n = 0;
+  bp->nacl = 0;
+}
+
+
+void
+gacl_batch_free(GACL_BATCH *bp) {
+  free(bp->tag);
+  free(bp->id);
+  free(bp->perms);
+  free(bp->flags);
+  free(bp->type);
+  free(bp->acl);
+  free(bp->sel);
+  gacl_batch_init(bp);
+}
+
+
+static int
+_gacl_batch_grow(GACL_BATCH *bp,
+		 size_t size) {
+  uint32_t **colv[7];
+  size_t nsize;
+  int i;
+  
+
+  if (size <= bp->size)
+    return 0;
+
+  nsize = bp->size ? bp->size : 64;
+  while (nsize < size)
+    nsize <<= 1;
+
+  colv[0] = &bp->tag;
+  colv[1] = &bp->id;
+  colv[2] = &bp->perms;
+  colv[3] = &bp->flags;
+  colv[4] = &bp->type;
+  colv[5] = &bp->acl;
+  colv[6] = &bp->sel;
+  
+  for (i = 0; i < 7; i++) {
+    uint32_t *ncol = realloc(*colv[i], nsize * sizeof(uint32_t));
+    
+    if (!ncol)
+      return -1;
+    *colv[i] = ncol;
+  }
+
+  bp->size = nsize;
+  return 0;
+}
+
+
+/* Append all ACEs of an ACL, returns the ACL index in the batch */
+int
+gacl_batch_add(GACL_BATCH *bp,
+	       GACL *ap) {
+  size_t i, n;
+
+
+  if (!bp || !ap) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  if (_gacl_batch_grow(bp, bp->n + ap->ac) < 0)
+    return -1;
+
+  n = bp->n;
+  for (i = 0; i < ap->ac; i++, n++) {
+    GACL_ENTRY *ep = &ap->av[i];
+    
+    bp->tag[n]   = ep->tag.type;
+    bp->id[n]    = gacl_tag_ugid_np(&ep->tag);
+    bp->perms[n] = ep->perms;
+    bp->flags[n] = ep->flags;
+    bp->type[n]  = ep->type;
+    bp->acl[n]   = bp->nacl;
+  }
+  
+  bp->n = n;
+  return bp->nacl++;
+}
+
+
+static void
+_gacl_batch_bits(uint32_t *sel,
+		 const uint32_t *col,
+		 uint32_t v,
+		 int how,
+		 size_t n) {
+  switch (how) {
+  case GACL_BATCH_IGNORE:
+    break;
+  case GACL_BATCH_ALL:
+    gacl_kern_all_set(sel, col, v, n);
+    break;
+  case GACL_BATCH_NONE:
+    gacl_kern_none_set(sel, col, v, n);
+    break;
+  default:
+    gacl_kern_equal(sel, col, v, n);
+  }
+}
+
+
+/*
+ * Select the ACEs matching the pattern entry: same tag (and uid/gid for
+ * user: and group:), same entry type, and permissions and flags matched
+ * according to 'phow' and 'fhow'. Returns the number of selected ACEs.
+ */
+size_t
+gacl_batch_select(GACL_BATCH *bp,
+		  const GACL_ENTRY *mep,
+		  int phow,
+		  int fhow) {
+  size_t n = bp->n;
+
+  
+  if (n == 0)
+    return 0;
+  
+  memset(bp->sel, 0xff, n * sizeof(bp->sel[0]));
+
+  gacl_kern_equal(bp->sel, bp->tag, mep->tag.type, n);
+  if (mep->tag.type == GACL_TAG_TYPE_USER || mep->tag.type == GACL_TAG_TYPE_GROUP) {
+    GACL_TAG mt = mep->tag;
+    
+    gacl_kern_equal(bp->sel, bp->id, gacl_tag_ugid_np(&mt), n);
+  }
+  gacl_kern_equal(bp->sel, bp->type, (uint32_t) mep->type, n);
+
+  _gacl_batch_bits(bp->sel, bp->perms, mep->perms, phow, n);
+  _gacl_batch_bits(bp->sel, bp->flags, mep->flags, fhow, n);
+
+  return gacl_kern_count(bp->sel, n);
+}
+
+
+/* 
+ * Does any ACE in the batch match any entry in the pattern ACL (using
+ * _gacl_entry_match() semantics)?
+ */
+int
+gacl_batch_match_any(GACL_BATCH *bp,
+		     GACL *mp,
+		     int how) {
+  int i;
+
+  
+  if (how == 0 || how == '^')
+    how = GACL_BATCH_EQUAL;
+  
+  for (i = 0; i < mp->ac; i++)
+    if (gacl_batch_select(bp, &mp->av[i], how, how) > 0)
+      return 1;
+
+  return 0;
+}
+
+
+/* Mark the ACLs that have at least one selected ACE */
+size_t
+gacl_batch_acl_hits(GACL_BATCH *bp,
+		    unsigned char *hits) {
+  size_t i, nh = 0;
+
+  
+  for (i = 0; i < bp->n; i++)
+    if (bp->sel[i] && !hits[bp->acl[i]]) {
+      hits[bp->acl[i]] = 1;
+      ++nh;
+    }
+
+  return nh;
+}
@@ -0,0 +1,136 @@
+/*
+ * gacl_batch.h - Struct-of-arrays ACE batches and vectorized match kernels
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef GACL_BATCH_H
+#define GACL_BATCH_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "gacl.h"
+
+/*
+ * A batch holds the ACEs of one or more ACLs as parallel arrays, so that
+ * matching a set of patterns against them is a few passes of the kernels
+ * below over each column instead of getter calls per ACE.
+ *
+ * All columns are 32 bits wide so the same kernels work on all of them.
+ */
+typedef struct gacl_batch {
+  size_t n;          /* Number of ACEs */
+  size_t size;       /* Allocated ACE slots */
+  size_t nacl;       /* Number of ACLs added */
+  
+  uint32_t *tag;     /* GACL_TAG_TYPE */
+  uint32_t *id;      /* uid/gid for user: and group: entries */
+  uint32_t *perms;   /* GACL_PERMSET */
+  uint32_t *flags;   /* GACL_FLAGSET */
+  uint32_t *type;    /* GACL_ENTRY_TYPE */
+  uint32_t *acl;     /* Which ACL the ACE belongs to */
+
+  uint32_t *sel;     /* Selection vector - all ones = selected */
+} GACL_BATCH;
+
+
+/* How to match a permission or flag column */
+#define GACL_BATCH_IGNORE 0
+#define GACL_BATCH_EQUAL  '='
+#define GACL_BATCH_ALL    '+'   /* All bits in the pattern set */
+#define GACL_BATCH_NONE   '-'   /* No bits in the pattern set */
+
+
+extern void
+gacl_batch_init(GACL_BATCH *bp);
+
+extern void
+gacl_batch_clear(GACL_BATCH *bp);
+
+extern void
+gacl_batch_free(GACL_BATCH *bp);
+
+extern int
+gacl_batch_add(GACL_BATCH *bp,
+	       GACL *ap);
+
+extern size_t
+gacl_batch_select(GACL_BATCH *bp,
+		  const GACL_ENTRY *mep,
+		  int phow,
+		  int fhow);
+
+extern int
+gacl_batch_match_any(GACL_BATCH *bp,
+		     GACL *mp,
+		     int how);
+
+extern size_t
+gacl_batch_acl_hits(GACL_BATCH *bp,
+		    unsigned char *hits);
+
+
+/*
+ * Kernels. Each one ANDs its predicate into the selection vector.
+ */
+extern void
+gacl_kern_equal(uint32_t *sel,
+		const uint32_t *col,
+		uint32_t v,
+		size_t n);
+
+extern void
+gacl_kern_all_set(uint32_t *sel,
+		  const uint32_t *col,
+		  uint32_t mask,
+		  size_t n);
+
+extern void
+gacl_kern_none_set(uint32_t *sel,
+		   const uint32_t *col,
+		   uint32_t mask,
+		   size_t n);
+
+extern void
+gacl_kern_member(uint32_t *sel,
+		 const uint32_t *col,
+		 const uint32_t *set,
+		 size_t nset,
+		 size_t n);
+
+extern size_t
+gacl_kern_count(const uint32_t *sel,
+		size_t n);
+
+extern const char *
+gacl_kern_impl(void);
+
+#endif
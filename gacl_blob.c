@@ -0,0 +1,742 @@
+/*
+ * gacl_blob.c - Read-only views of raw NFSv4 ACL blobs, and predicates on them
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "gacl.h"
+#include "gacl_impl.h"
+#include "gacl_blob.h"
+#include "nfs4.h"
+
+
+struct gacl_blob_who {
+  GACL_BLOB_WHO *next;
+  int is_group;
+  uid_t id;
+  int canonical;            /* Written back unchanged by the encoder */
+  size_t len;
+  char who[1];
+};
+
+struct gacl_blob_xace {
+  GACL_BLOB_ACE a;
+  GACL_TAG_TYPE tag;
+  GACL_ENTRY_TYPE type;
+  GACL_FLAGSET flags;
+  uid_t id;
+  GACL_BLOB_WHO *who;       /* New who-string (renamed) */
+  int deleted;
+};
+
+
+#ifdef GACL_RAW_NFS4
+
+static inline uint32_t
+_blob_get32(const unsigned char *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+
+int
+gacl_blob_open(GACL_BLOB *bp,
+	       const void *buf,
+	       size_t bufsize) {
+  bp->p = (const unsigned char *) buf;
+  bp->endp = bp->p+bufsize;
+  
+  if (bufsize < 4) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  bp->n = _blob_get32(bp->p);
+  bp->i = 0;
+  bp->p += 4;
+
+  /* Each ACE takes at least 16 bytes */
+  if (bp->n > (bp->endp-bp->p)/16) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* Same checks (and leniency) as the decoder in gacl_impl.c */
+int
+gacl_blob_next(GACL_BLOB *bp,
+	       GACL_BLOB_ACE *aep) {
+  uint32_t pad;
+
+  
+  if (bp->i >= bp->n)
+    return 0;
+  
+  if (bp->endp-bp->p < 16)
+    goto Invalid;
+
+  aep->type   = _blob_get32(bp->p);
+  aep->flags  = _blob_get32(bp->p+4);
+  aep->mask   = _blob_get32(bp->p+8);
+  aep->wholen = _blob_get32(bp->p+12);
+  bp->p += 16;
+
+  if (aep->type > NFS4_ACE_SYSTEM_ALARM_ACE_TYPE ||
+      aep->wholen > bp->endp-bp->p)
+    goto Invalid;
+  
+  aep->who = (const char *) bp->p;
+  bp->p += aep->wholen;
+
+  /* The decoder has to fit user: and group: names into a GACL_TAG */
+  if (aep->wholen >= sizeof(((GACL_TAG *) 0)->name)) {
+    switch (gacl_blob_ace_tag(aep)) {
+    case GACL_TAG_TYPE_USER:
+    case GACL_TAG_TYPE_GROUP:
+      goto Invalid;
+    default:
+      break;
+    }
+  }
+  
+  pad = (4 - (aep->wholen & 3)) & 3;
+  bp->p = (bp->endp-bp->p < pad ? bp->endp : bp->p+pad);
+
+  bp->i++;
+  return 1;
+
+ Invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+
+GACL_TAG_TYPE
+gacl_blob_ace_tag(const GACL_BLOB_ACE *aep) {
+  return _nfs4_who_tag(aep->flags, (const unsigned char *) aep->who, aep->wholen);
+}
+
+
+int
+gacl_blob_pred_init(GACL_BLOB_PRED *pp,
+		    int kind,
+		    GACL *mp) {
+  int i;
+
+  
+  pp->kind = kind;
+  pp->n = 0;
+  pp->v = NULL;
+
+  switch (kind) {
+  case GACL_BLOB_P_NONTRIVIAL:
+  case GACL_BLOB_P_DENY:
+    return 0;
+
+  case GACL_BLOB_P_MATCH:
+    if (!mp)
+      break;
+    
+    pp->v = malloc((mp->ac ? mp->ac : 1) * sizeof(pp->v[0]));
+    if (!pp->v)
+      return -1;
+    
+    for (i = 0; i < mp->ac; i++) {
+      GACL_ENTRY *ep = &mp->av[i];
+      GACL_BLOB_PMATCH *pm = &pp->v[pp->n];
+      
+      switch (ep->type) {
+      case GACL_ENTRY_TYPE_ALLOW:
+	pm->type = NFS4_ACE_ACCESS_ALLOWED_ACE_TYPE;
+	break;
+      case GACL_ENTRY_TYPE_DENY:
+	pm->type = NFS4_ACE_ACCESS_DENIED_ACE_TYPE;
+	break;
+      case GACL_ENTRY_TYPE_AUDIT:
+	pm->type = NFS4_ACE_SYSTEM_AUDIT_ACE_TYPE;
+	break;
+      case GACL_ENTRY_TYPE_ALARM:
+	pm->type = NFS4_ACE_SYSTEM_ALARM_ACE_TYPE;
+	break;
+      default:
+	/* Can never match a stored ACE */
+	continue;
+      }
+      
+      pm->tag   = ep->tag.type;
+      pm->perms = ep->perms;
+      pm->flags = ep->flags;
+      pp->n++;
+    }
+    return 0;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+
+void
+gacl_blob_pred_free(GACL_BLOB_PRED *pp) {
+  free(pp->v);
+  pp->v = NULL;
+  pp->n = 0;
+}
+
+
+static int
+_blob_match(const GACL_BLOB_PRED *pp,
+	    const GACL_BLOB_ACE *aep) {
+  GACL_TAG_TYPE tt = gacl_blob_ace_tag(aep);
+  GACL_PERMSET perms = _nfs4_perms_to_gacl(aep->mask);
+  GACL_FLAGSET flags = _nfs4_flags_to_gacl(aep->flags);
+  int i, rc = GACL_BLOB_FALSE;
+  
+
+  for (i = 0; i < pp->n; i++) {
+    const GACL_BLOB_PMATCH *pm = &pp->v[i];
+    
+    if (pm->type != aep->type || pm->tag != tt ||
+	pm->perms != perms || pm->flags != flags)
+      continue;
+
+    /* The blob can't tell if the who-string is the same user or group */
+    if (tt != GACL_TAG_TYPE_USER && tt != GACL_TAG_TYPE_GROUP)
+      return GACL_BLOB_TRUE;
+    rc = GACL_BLOB_MAYBE;
+  }
+  
+  return rc;
+}
+
+
+int
+gacl_blob_pred_eval(const GACL_BLOB_PRED *pp,
+		    const void *buf,
+		    size_t bufsize) {
+  GACL_BLOB b;
+  GACL_BLOB_ACE a;
+  int rc, res = GACL_BLOB_FALSE;
+  
+
+  if (gacl_blob_open(&b, buf, bufsize) < 0)
+    return -1;
+
+  while ((rc = gacl_blob_next(&b, &a)) == 1) {
+    switch (pp->kind) {
+    case GACL_BLOB_P_NONTRIVIAL:
+      switch (gacl_blob_ace_tag(&a)) {
+      case GACL_TAG_TYPE_USER:
+      case GACL_TAG_TYPE_GROUP:
+	return GACL_BLOB_TRUE;
+      default:
+	break;
+      }
+      break;
+
+    case GACL_BLOB_P_DENY:
+      if (a.type == NFS4_ACE_ACCESS_DENIED_ACE_TYPE)
+	return GACL_BLOB_TRUE;
+      break;
+
+    case GACL_BLOB_P_MATCH:
+      switch (_blob_match(pp, &a)) {
+      case GACL_BLOB_TRUE:
+	return GACL_BLOB_TRUE;
+      case GACL_BLOB_MAYBE:
+	res = GACL_BLOB_MAYBE;
+	break;
+      }
+      break;
+
+    default:
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  
+  return rc < 0 ? -1 : res;
+}
+
+
+/* The user:/group: who-string of an ACE, and what it resolved to */
+static unsigned int
+_blob_who_hash(int is_group,
+	       const char *who,
+	       size_t len) {
+  unsigned int h = 2166136261U ^ (unsigned int) is_group;
+
+  while (len-- > 0)
+    h = (h ^ (unsigned char) *who++) * 16777619U;
+  return h % GACL_BLOB_WHO_HSIZE;
+}
+
+
+static GACL_BLOB_WHO *
+_blob_who_find(GACL_BLOB_PATCH *pp,
+	       int is_group,
+	       const char *who,
+	       size_t len) {
+  GACL_BLOB_WHO *wp;
+
+  
+  for (wp = pp->wtab[_blob_who_hash(is_group, who, len)]; wp; wp = wp->next)
+    if (wp->is_group == is_group && wp->len == len && memcmp(wp->who, who, len) == 0)
+      return wp;
+  return NULL;
+}
+
+
+static GACL_BLOB_WHO *
+_blob_who_add(GACL_BLOB_PATCH *pp,
+	      int is_group,
+	      const char *who,
+	      size_t len,
+	      uid_t id,
+	      int canonical) {
+  GACL_BLOB_WHO *wp;
+  unsigned int h = _blob_who_hash(is_group, who, len);
+
+  
+  wp = malloc(sizeof(*wp)+len);
+  if (!wp)
+    return NULL;
+
+  wp->is_group = is_group;
+  wp->id = id;
+  wp->canonical = canonical;
+  wp->len = len;
+  memcpy(wp->who, who, len);
+  
+  wp->next = pp->wtab[h];
+  pp->wtab[h] = wp;
+  return wp;
+}
+
+
+/* Look up a who-string from a blob, resolving it the same way the decoder's lazy tags are */
+static GACL_BLOB_WHO *
+_blob_who_lookup(GACL_BLOB_PATCH *pp,
+		 int is_group,
+		 const char *who,
+		 size_t len) {
+  GACL_BLOB_WHO *wp;
+  GACL_TAG t;
+  uid_t id;
+  char pbuf[512];
+  ssize_t plen;
+  
+  
+  wp = _blob_who_find(pp, is_group, who, len);
+  if (wp)
+    return wp;
+
+  memset(&t, 0, sizeof(t));
+  t.type = (is_group ? GACL_TAG_TYPE_GROUP : GACL_TAG_TYPE_USER);
+  t.ugid = -1;
+  t.flags = GACL_TAG_F_LAZY;
+  memcpy(t.name, who, len);
+  t.name[len] = '\0';
+  
+  id = gacl_tag_ugid_np(&t);
+  if (id == (uid_t) -1)
+    return _blob_who_add(pp, is_group, who, len, id, 0);
+
+  /* Only a who-string the encoder would write back unchanged can be kept */
+  plen = _nfs4_principal(id, is_group, pbuf, sizeof(pbuf));
+  return _blob_who_add(pp, is_group, who, len, id,
+		       plen == (ssize_t) len && memcmp(pbuf, who, len) == 0);
+}
+
+
+/* The who-string the encoder writes for an id */
+static GACL_BLOB_WHO *
+_blob_who_id(GACL_BLOB_PATCH *pp,
+	     int is_group,
+	     uid_t id) {
+  GACL_BLOB_WHO *wp;
+  char pbuf[512];
+  ssize_t plen;
+
+  
+  plen = _nfs4_principal(id, is_group, pbuf, sizeof(pbuf));
+  if (plen < 0)
+    return NULL;
+  if ((size_t) plen >= sizeof(((GACL_TAG *) 0)->name)) {
+    errno = ENOTSUP;
+    return NULL;
+  }
+  
+  wp = _blob_who_find(pp, is_group, pbuf, plen);
+  if (wp && wp->id == id)
+    return wp;
+  
+  return _blob_who_add(pp, is_group, pbuf, plen, id, 1);
+}
+
+
+static GACL_ENTRY_TYPE
+_blob_type_to_gacl(uint32_t type) {
+  switch (type) {
+  case NFS4_ACE_ACCESS_ALLOWED_ACE_TYPE:
+    return GACL_ENTRY_TYPE_ALLOW;
+  case NFS4_ACE_ACCESS_DENIED_ACE_TYPE:
+    return GACL_ENTRY_TYPE_DENY;
+  case NFS4_ACE_SYSTEM_AUDIT_ACE_TYPE:
+    return GACL_ENTRY_TYPE_AUDIT;
+  case NFS4_ACE_SYSTEM_ALARM_ACE_TYPE:
+    return GACL_ENTRY_TYPE_ALARM;
+  }
+  return GACL_ENTRY_TYPE_UNDEFINED;
+}
+
+
+static inline void
+_blob_put32(unsigned char *p,
+	    uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+
+static int
+_blob_op_match(const GACL_BLOB_OP *op,
+	       const GACL_BLOB_XACE *xp) {
+  if (xp->tag != op->tag)
+    return 0;
+  
+  if ((xp->tag == GACL_TAG_TYPE_USER || xp->tag == GACL_TAG_TYPE_GROUP) &&
+      xp->id != op->id)
+    return 0;
+  
+  if (op->op == GACL_BLOB_OP_RENAME)
+    return 1;
+  
+  return xp->type == op->type && xp->flags == op->flags;
+}
+
+
+ssize_t
+gacl_blob_patch_apply(GACL_BLOB_PATCH *pp,
+		      const void *ibuf,
+		      size_t ilen,
+		      mode_t mode,
+		      char **obufp,
+		      size_t *osizep) {
+  GACL_BLOB b;
+  GACL_BLOB_XACE *xp;
+  GACL_BLOB_WHO *wp;
+  int i, j, rc, nm;
+  size_t len, pad;
+  unsigned char *op;
+  
+  
+  if (gacl_blob_open(&b, ibuf, ilen) < 0)
+    return -1;
+
+  if (b.n > pp->as) {
+    xp = realloc(pp->av, b.n * sizeof(pp->av[0]));
+    if (!xp)
+      return -1;
+    pp->av = xp;
+    pp->as = b.n;
+  }
+
+  /* Load the ACEs, refusing anything the encoder wouldn't reproduce */
+  len = 4;
+  for (i = 0; (rc = gacl_blob_next(&b, &pp->av[i].a)) == 1; i++) {
+    xp = &pp->av[i];
+
+    xp->tag = gacl_blob_ace_tag(&xp->a);
+    xp->type = _blob_type_to_gacl(xp->a.type);
+    xp->flags = _nfs4_flags_to_gacl(xp->a.flags);
+    xp->id = -1;
+    xp->who = NULL;
+    xp->deleted = 0;
+
+    pad = (4 - (xp->a.wholen & 3)) & 3;
+    len += 16 + xp->a.wholen + pad;
+    if (len > ilen)
+      goto NotSup;
+    while (pad-- > 0)
+      if (xp->a.who[xp->a.wholen+pad] != '\0')
+	goto NotSup;
+
+    if (_nfs4_perms_from_gacl(_nfs4_perms_to_gacl(xp->a.mask)) != xp->a.mask ||
+	(_nfs4_flags_from_gacl(xp->flags) |
+	 (xp->tag == GACL_TAG_TYPE_GROUP || xp->tag == GACL_TAG_TYPE_GROUP_OBJ ?
+	  NFS4_ACE_IDENTIFIER_GROUP : 0)) != xp->a.flags)
+      goto NotSup;
+
+    if (xp->tag == GACL_TAG_TYPE_USER || xp->tag == GACL_TAG_TYPE_GROUP) {
+      wp = _blob_who_lookup(pp, xp->tag == GACL_TAG_TYPE_GROUP, xp->a.who, xp->a.wholen);
+      if (!wp)
+	return -1;
+      if (!wp->canonical)
+	goto NotSup;
+      xp->id = wp->id;
+    }
+  }
+  if (rc < 0)
+    return -1;
+  if (len != ilen)
+    goto NotSup;
+
+  /* Run the ops */
+  for (j = 0; j < pp->n; j++) {
+    GACL_BLOB_OP *opp = &pp->v[j];
+
+    if (opp->ftypes && !(mode & opp->ftypes))
+      continue;
+    
+    nm = 0;
+    for (i = 0; i < b.n; i++) {
+      xp = &pp->av[i];
+      if (xp->deleted || !_blob_op_match(opp, xp))
+	continue;
+      
+      switch (opp->op) {
+      case GACL_BLOB_OP_MASK:
+	xp->a.mask = _nfs4_perms_from_gacl(opp->perms);
+	break;
+	
+      case GACL_BLOB_OP_DELETE:
+	xp->deleted = 1;
+	break;
+	
+      case GACL_BLOB_OP_RENAME:
+	wp = _blob_who_id(pp, xp->tag == GACL_TAG_TYPE_GROUP, opp->new_id);
+	if (!wp)
+	  return -1;
+	xp->id = opp->new_id;
+	xp->who = wp;
+	break;
+      }
+      nm++;
+    }
+
+    /* The normal path would add an ACE instead */
+    if (opp->op == GACL_BLOB_OP_MASK && nm == 0)
+      goto NotSup;
+  }
+
+  /* Non-directories can't have inheritance flags - the normal path cleans them */
+  len = 4;
+  nm = 0;
+  for (i = 0; i < b.n; i++) {
+    xp = &pp->av[i];
+    if (xp->deleted)
+      continue;
+    
+    if (!S_ISDIR(mode) && (xp->flags & ~GACL_FLAG_INHERITED))
+      goto NotSup;
+    
+    if (xp->who) {
+      xp->a.who = xp->who->who;
+      xp->a.wholen = xp->who->len;
+    }
+    len += 16 + ((xp->a.wholen + 3) & ~3);
+    nm++;
+  }
+
+  if (len > *osizep) {
+    op = realloc(*obufp, len);
+    if (!op)
+      return -1;
+    *obufp = (char *) op;
+    *osizep = len;
+  }
+
+  op = (unsigned char *) *obufp;
+  _blob_put32(op, nm);
+  op += 4;
+  for (i = 0; i < b.n; i++) {
+    xp = &pp->av[i];
+    if (xp->deleted)
+      continue;
+
+    _blob_put32(op,    xp->a.type);
+    _blob_put32(op+4,  xp->a.flags);
+    _blob_put32(op+8,  xp->a.mask);
+    _blob_put32(op+12, xp->a.wholen);
+    op += 16;
+    
+    memcpy(op, xp->a.who, xp->a.wholen);
+    op += xp->a.wholen;
+    for (pad = (4 - (xp->a.wholen & 3)) & 3; pad > 0; pad--)
+      *op++ = '\0';
+  }
+
+  return len;
+
+ NotSup:
+  errno = ENOTSUP;
+  return -1;
+}
+
+
+void
+gacl_blob_patch_resolve(GACL_BLOB_PATCH *pp,
+			GACL *ap) {
+  GACL_BLOB_WHO *wp;
+  GACL_TAG *tp;
+  int i;
+
+  
+  for (i = 0; i < ap->ac; i++) {
+    tp = &ap->av[i].tag;
+    
+    if (!(tp->flags & GACL_TAG_F_LAZY) ||
+	(tp->type != GACL_TAG_TYPE_USER && tp->type != GACL_TAG_TYPE_GROUP))
+      continue;
+
+    wp = _blob_who_find(pp, tp->type == GACL_TAG_TYPE_GROUP, tp->name, strlen(tp->name));
+    if (wp && wp->id != (uid_t) -1) {
+      tp->ugid = wp->id;
+      tp->flags &= ~GACL_TAG_F_LAZY;
+    }
+  }
+}
+
+
+#else
+
+int
+gacl_blob_open(GACL_BLOB *bp,
+	       const void *buf,
+	       size_t bufsize) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+gacl_blob_next(GACL_BLOB *bp,
+	       GACL_BLOB_ACE *aep) {
+  errno = ENOSYS;
+  return -1;
+}
+
+GACL_TAG_TYPE
+gacl_blob_ace_tag(const GACL_BLOB_ACE *aep) {
+  return GACL_TAG_TYPE_UNKNOWN;
+}
+
+int
+gacl_blob_pred_init(GACL_BLOB_PRED *pp,
+		    int kind,
+		    GACL *mp) {
+  pp->kind = kind;
+  pp->n = 0;
+  pp->v = NULL;
+  return 0;
+}
+
+void
+gacl_blob_pred_free(GACL_BLOB_PRED *pp) {
+}
+
+/* No raw blobs - always let the caller decide the normal way */
+int
+gacl_blob_pred_eval(const GACL_BLOB_PRED *pp,
+		    const void *buf,
+		    size_t bufsize) {
+  return GACL_BLOB_MAYBE;
+}
+
+ssize_t
+gacl_blob_patch_apply(GACL_BLOB_PATCH *pp,
+		      const void *ibuf,
+		      size_t ilen,
+		      mode_t mode,
+		      char **obufp,
+		      size_t *osizep) {
+  errno = ENOSYS;
+  return -1;
+}
+
+void
+gacl_blob_patch_resolve(GACL_BLOB_PATCH *pp,
+			GACL *ap) {
+}
+
+#endif
+
+
+void
+gacl_blob_patch_init(GACL_BLOB_PATCH *pp) {
+  memset(pp, 0, sizeof(*pp));
+}
+
+
+void
+gacl_blob_patch_free(GACL_BLOB_PATCH *pp) {
+  GACL_BLOB_WHO *wp, *nwp;
+  int i;
+
+  
+  for (i = 0; i < GACL_BLOB_WHO_HSIZE; i++) {
+    for (wp = pp->wtab[i]; wp; wp = nwp) {
+      nwp = wp->next;
+      free(wp);
+    }
+  }
+  free(pp->v);
+  free(pp->av);
+  memset(pp, 0, sizeof(*pp));
+}
+
+
+int
+gacl_blob_patch_add(GACL_BLOB_PATCH *pp,
+		    const GACL_BLOB_OP *op) {
+  if (pp->n >= pp->size) {
+    GACL_BLOB_OP *nv = realloc(pp->v, (pp->size + 8) * sizeof(pp->v[0]));
+    
+    if (!nv)
+      return -1;
+    pp->v = nv;
+    pp->size += 8;
+  }
+
+  pp->v[pp->n++] = *op;
+  return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * gacl_blob.h - Read-only views of raw NFSv4 ACL blobs, and predicates on them
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef GACL_BLOB_H
+#define GACL_BLOB_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "gacl.h"
+
+/*
+ * A view of a raw (XDR encoded) NFSv4 ACL as stored in the system.nfs4_acl
+ * xattr. Iterating over it only checks lengths - no GACL is built and no
+ * names are looked up, so simple questions about an ACL can be answered
+ * straight from the getxattr() buffer.
+ *
+ * Only available where ACLs are stored raw (GACL_RAW_NFS4), elsewhere
+ * gacl_blob_open() fails with ENOSYS.
+ */
+typedef struct gacl_blob {
+  const unsigned char *p;
+  const unsigned char *endp;
+  uint32_t n;       /* Number of ACEs */
+  uint32_t i;       /* Next ACE */
+} GACL_BLOB;
+
+typedef struct gacl_blob_ace {
+  uint32_t type;    /* NFSv4 ACE type */
+  uint32_t flags;   /* NFSv4 ACE flags */
+  uint32_t mask;    /* NFSv4 access mask */
+  const char *who;  /* Not NUL terminated */
+  uint32_t wholen;
+} GACL_BLOB_ACE;
+
+
+extern int
+gacl_blob_open(GACL_BLOB *bp,
+	       const void *buf,
+	       size_t bufsize);
+
+/* Returns 1 and the next ACE, 0 at the end and -1 (EINVAL) if malformed */
+extern int
+gacl_blob_next(GACL_BLOB *bp,
+	       GACL_BLOB_ACE *aep);
+
+/* The tag type the ACE decodes to (user: and group: are not told apart further) */
+extern GACL_TAG_TYPE
+gacl_blob_ace_tag(const GACL_BLOB_ACE *aep);
+
+
+/*
+ * Compiled predicates over raw blobs. Evaluating one gives TRUE or FALSE
+ * when the blob alone is enough to tell, and MAYBE when the answer depends
+ * on who a user:/group: who-string resolves to - then the caller has to
+ * decode the ACL and do it the normal way.
+ */
+#define GACL_BLOB_FALSE 0
+#define GACL_BLOB_TRUE  1
+#define GACL_BLOB_MAYBE 2
+
+#define GACL_BLOB_P_NONTRIVIAL 1  /* Any user:/group: ACE */
+#define GACL_BLOB_P_DENY       2  /* Any deny ACE */
+#define GACL_BLOB_P_MATCH      3  /* Any ACE matching any of the entries of an ACL (exactly) */
+
+typedef struct gacl_blob_pmatch {
+  uint32_t type;            /* NFSv4 ACE type */
+  GACL_TAG_TYPE tag;
+  GACL_PERMSET perms;
+  GACL_FLAGSET flags;
+} GACL_BLOB_PMATCH;
+
+typedef struct gacl_blob_pred {
+  int kind;
+  int n;
+  GACL_BLOB_PMATCH *v;
+} GACL_BLOB_PRED;
+
+
+extern int
+gacl_blob_pred_init(GACL_BLOB_PRED *pp,
+		    int kind,
+		    GACL *mp);
+
+extern void
+gacl_blob_pred_free(GACL_BLOB_PRED *pp);
+
+/* Returns GACL_BLOB_TRUE/FALSE/MAYBE, or -1 if the blob is malformed */
+extern int
+gacl_blob_pred_eval(const GACL_BLOB_PRED *pp,
+		    const void *buf,
+		    size_t bufsize);
+
+
+/*
+ * Patch programs - changes that can be done directly on the blob: setting
+ * the mask of, or deleting, ACEs matching a tag/type/flags pattern, and
+ * renaming user:/group: principals.
+ *
+ * A patch is only applied to blobs that the normal path (decode, change,
+ * encode) would reproduce byte for byte - i.e. all bits known and all
+ * user:/group: who-strings in the form the encoder writes them. Everything
+ * else is refused so the caller takes the normal path, so results are
+ * always identical.
+ */
+#define GACL_BLOB_OP_MASK   1  /* Set the mask of matching ACEs (at least one must match) */
+#define GACL_BLOB_OP_DELETE 2  /* Delete matching ACEs */
+#define GACL_BLOB_OP_RENAME 3  /* Change the principal of user:/group: ACEs */
+
+typedef struct gacl_blob_op {
+  int op;
+  mode_t ftypes;            /* Only for these file types (0 = all) */
+
+  /* Match - MASK and DELETE compare everything, RENAME only tag & id */
+  GACL_TAG_TYPE tag;
+  uid_t id;
+  GACL_ENTRY_TYPE type;
+  GACL_FLAGSET flags;
+
+  /* Change */
+  GACL_PERMSET perms;       /* MASK */
+  uid_t new_id;             /* RENAME */
+} GACL_BLOB_OP;
+
+typedef struct gacl_blob_xace GACL_BLOB_XACE;
+typedef struct gacl_blob_who GACL_BLOB_WHO;
+
+#define GACL_BLOB_WHO_HSIZE 256
+
+typedef struct gacl_blob_patch {
+  int n;
+  int size;
+  GACL_BLOB_OP *v;
+
+  /* Scratch space for the ACEs being patched */
+  GACL_BLOB_XACE *av;
+  size_t as;
+
+  /* who-string -> id lookups done so far */
+  GACL_BLOB_WHO *wtab[GACL_BLOB_WHO_HSIZE];
+} GACL_BLOB_PATCH;
+
+
+extern void
+gacl_blob_patch_init(GACL_BLOB_PATCH *pp);
+
+extern void
+gacl_blob_patch_free(GACL_BLOB_PATCH *pp);
+
+extern int
+gacl_blob_patch_add(GACL_BLOB_PATCH *pp,
+		    const GACL_BLOB_OP *op);
+
+/*
+ * Patch 'ibuf' for an object of type 'mode' into '*obufp' (grown as needed).
+ * Returns the new length, or -1 if the patch can't be applied (errno ENOTSUP)
+ * or on errors.
+ */
+extern ssize_t
+gacl_blob_patch_apply(GACL_BLOB_PATCH *pp,
+		      const void *ibuf,
+		      size_t ilen,
+		      mode_t mode,
+		      char **obufp,
+		      size_t *osizep);
+
+/* Resolve the user:/group: tags of a decoded ACL from the lookups done */
+extern void
+gacl_blob_patch_resolve(GACL_BLOB_PATCH *pp,
+			GACL *ap);
+
+#endif
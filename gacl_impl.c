@@ -47,6 +47,7 @@
 
 #include "vfs.h"
 #include "strings.h"
+#include "idcache.h"
 
 
 
@@ -55,6 +56,7 @@
 #ifdef __linux__
 #include <arpa/inet.h>
 #include <sys/xattr.h>
+#include <pthread.h>
 #include "nfs4.h"
 
 #define ACL_NFS4_XATTR "system.nfs4_acl"
@@ -77,19 +79,18 @@
  */
 
 
-static char *
-_nfs4_id_domain(void) {
-  static char *saved_domain = NULL;
+static pthread_once_t nfs4_id_domain_once = PTHREAD_ONCE_INIT;
+static char *nfs4_id_domain = NULL;
+
+static void
+_nfs4_id_domain_init(void) {
   FILE *fp;
   char buf[256];
 
 
-  if (saved_domain)
-    return saved_domain;
-
   fp = fopen("/etc/idmapd.conf","r");
   if (!fp)
-    return NULL;
+    return;
 
   while (fgets(buf, sizeof(buf), fp)) {
     char *bp, *t;
@@ -104,86 +105,58 @@ _nfs4_id_domain(void) {
       if (!t || strcmp(t, "=") != 0)
 	continue;
       t = strsep(&bp, " \t\n");
-      if (!t) {
-	fclose(fp);
-	return NULL;
-      }
+      if (!t)
+	break;
 	
-      saved_domain = strdup(t);
+      nfs4_id_domain = strdup(t);
       break;
     }
   }
 
   fclose(fp);
-  return saved_domain;
 }
 
-/* This code is a bit of a hack */
+/* Falls back to the domain recorded in the identity map, if one is used */
+static const char *
+_nfs4_id_domain(void) {
+  pthread_once(&nfs4_id_domain_once, _nfs4_id_domain_init);
+  return nfs4_id_domain ? nfs4_id_domain : idcache_map_domain();
+}
+
+/* user@domain, or a plain number */
 static int
 _nfs4_id_to_uid(char *buf,
 		uid_t *uidp) {
-  struct passwd *pp;
-  int i;
-  char *idd = NULL;
-
-
-  /* First we try a direct lookup (user@realm) - it might work... */
-  pp = getpwnam(buf);
-  if (pp) {
-    *uidp = pp->pw_uid;
-    return 1;
-  }
+  const char *idd;
+  char *cp;
+  
   
   idd = _nfs4_id_domain();
+  if (idcache_principal_to_uid(buf, idd, uidp) == 1)
+    return 1;
 
-  for (i = 0; buf[i] && buf[i] != '@'; i++)
-    ;
-  
-  if (buf[i] && (!idd || strcmp(idd, buf+i) == 0)) {
-    buf[i] = '\0';
-    pp = getpwnam(buf);
-    buf[i] = '@';
-    if (pp) {
-      *uidp = pp->pw_uid;
-      return 1;
-    }
-  } else if (sscanf(buf, "%d", uidp) == 1)
+  cp = strchr(buf, '@');
+  if ((!cp || (idd && strcmp(idd, cp+1) != 0)) && sscanf(buf, "%d", uidp) == 1)
     return 1;
   
   return 0;
 }
 
 
-/* This code is a bit of a hack */
+/* user@domain, or a plain number */
 static int
 _nfs4_id_to_gid(char *buf,
 		gid_t *gidp) {
-  struct group *gp;
-  int i;
-  char *idd = NULL;
-
-
-  /* First try a direct lookup (group@realm) - might work */
-  gp = getgrnam(buf);
-  if (gp) {
-    *gidp = gp->gr_gid;
-    return 1;
-  }
+  const char *idd;
+  char *cp;
+  
   
   idd = _nfs4_id_domain();
+  if (idcache_principal_to_gid(buf, idd, gidp) == 1)
+    return 1;
 
-  for (i = 0; buf[i] && buf[i] != '@'; i++)
-    ;
-
-  if (buf[i] && (!idd || strcmp(idd, buf+1) == 0)) {
-    buf[i] = '\0';
-    gp = getgrnam(buf);
-    buf[i] = '@';
-    if (gp) {
-      *gidp = gp->gr_gid;
-      return 1;
-    }
-  } else if (sscanf(buf, "%d", gidp) == 1)
+  cp = strchr(buf, '@');
+  if ((!cp || (idd && strcmp(idd, cp+1) != 0)) && sscanf(buf, "%d", gidp) == 1)
     return 1;
   
   return 0;
@@ -231,18 +204,142 @@ static struct permtab {
   };
 
 
+/*
+ * Byte-indexed NFSv4 <-> GACL permission/flag translation tables, so a 32 bit
+ * mask is translated with four lookups instead of a loop over permtab/flagtab.
+ * Where all bits coincide (the flags, currently) translation is skipped.
+ */
+static pthread_once_t nfs4_bits_once = PTHREAD_ONCE_INIT;
+static GACL_PERMSET nfs4_perm_map[4][256];
+static GACL_FLAGSET nfs4_flag_map[4][256];
+static u_int32_t gacl_perm_map[4][256];
+static u_int32_t gacl_flag_map[4][256];
+static u_int32_t nfs4_flag_mask = 0;
+static int nfs4_perm_identity = 1;
+static int nfs4_flag_identity = 1;
+
+static void
+_nfs4_bits_init(void) {
+  int b, v, j;
+
+
+  for (j = 0; j < sizeof(permtab)/sizeof(permtab[0]); j++)
+    if (permtab[j].g != permtab[j].s)
+      nfs4_perm_identity = 0;
+  for (j = 0; j < sizeof(flagtab)/sizeof(flagtab[0]); j++) {
+    if (flagtab[j].g != flagtab[j].s)
+      nfs4_flag_identity = 0;
+    nfs4_flag_mask |= flagtab[j].s;
+  }
+  
+  for (b = 0; b < 4; b++)
+    for (v = 0; v < 256; v++) {
+      u_int32_t s = (u_int32_t) v << (8*b);
+      
+      for (j = 0; j < sizeof(permtab)/sizeof(permtab[0]); j++) {
+	if (s & permtab[j].s)
+	  nfs4_perm_map[b][v] |= permtab[j].g;
+	if (s & permtab[j].g)
+	  gacl_perm_map[b][v] |= permtab[j].s;
+      }
+      
+      for (j = 0; j < sizeof(flagtab)/sizeof(flagtab[0]); j++) {
+	if (s & flagtab[j].s)
+	  nfs4_flag_map[b][v] |= flagtab[j].g;
+	if (s & flagtab[j].g)
+	  gacl_flag_map[b][v] |= flagtab[j].s;
+      }
+    }
+}
+
+#define NFS4_MAP32(map, s) \
+  ((map)[0][(s) & 0xff] | (map)[1][((s) >> 8) & 0xff] | \
+   (map)[2][((s) >> 16) & 0xff] | (map)[3][(s) >> 24])
+
+
+/* Big-endian 32 bit load - the buffer need not be aligned */
+static inline u_int32_t
+_xdr_get32(const unsigned char *p) {
+  return ((u_int32_t) p[0] << 24) | ((u_int32_t) p[1] << 16) | ((u_int32_t) p[2] << 8) | p[3];
+}
+
+static inline int
+_xdr_ideq(const unsigned char *cp,
+	  u_int32_t idlen,
+	  const char *s,
+	  size_t slen) {
+  return idlen == slen && memcmp(cp, s, slen) == 0;
+}
+
+
+/* NFSv4 ACE mask/flags <-> GACL permissions/flags */
+GACL_PERMSET
+_nfs4_perms_to_gacl(u_int32_t s_perms) {
+  pthread_once(&nfs4_bits_once, _nfs4_bits_init);
+  return nfs4_perm_identity ? s_perms : NFS4_MAP32(nfs4_perm_map, s_perms);
+}
+
+GACL_FLAGSET
+_nfs4_flags_to_gacl(u_int32_t s_flags) {
+  pthread_once(&nfs4_bits_once, _nfs4_bits_init);
+  return nfs4_flag_identity ? (s_flags & nfs4_flag_mask) : NFS4_MAP32(nfs4_flag_map, s_flags);
+}
+
+u_int32_t
+_nfs4_perms_from_gacl(GACL_PERMSET perms) {
+  pthread_once(&nfs4_bits_once, _nfs4_bits_init);
+  return nfs4_perm_identity ? perms : NFS4_MAP32(gacl_perm_map, perms);
+}
+
+/* Without NFS4_ACE_IDENTIFIER_GROUP - that depends on the tag */
+u_int32_t
+_nfs4_flags_from_gacl(GACL_FLAGSET flags) {
+  pthread_once(&nfs4_bits_once, _nfs4_bits_init);
+  return nfs4_flag_identity ? (flags & nfs4_flag_mask) : NFS4_MAP32(gacl_flag_map, (u_int32_t) flags);
+}
+
+
+/* What kind of tag an ACE with these flags and who-string decodes to */
+GACL_TAG_TYPE
+_nfs4_who_tag(u_int32_t s_flags,
+	      const unsigned char *cp,
+	      u_int32_t idlen) {
+  if (s_flags & NFS4_ACE_IDENTIFIER_GROUP)
+    return _xdr_ideq(cp, idlen, "GROUP@", 6) ? GACL_TAG_TYPE_GROUP_OBJ : GACL_TAG_TYPE_GROUP;
+  
+  if (_xdr_ideq(cp, idlen, "OWNER@", 6))
+    return GACL_TAG_TYPE_USER_OBJ;
+  if (_xdr_ideq(cp, idlen, "EVERYONE@", 9))
+    return GACL_TAG_TYPE_EVERYONE;
+  return GACL_TAG_TYPE_USER;
+}
+
+
+/*
+ * Decode an NFSv4 ACL xattr (see the format above). All lengths are checked
+ * against the buffer, which is only read (never copied or modified).
+ */
 GACL *
 _gacl_init_from_nfs4(const char *buf,
 		     size_t bufsize) {
-  int i, j;
-  u_int32_t *vp, s_flags, s_perms, na;
-  char *cp;
-  GACL *ap;
+  const unsigned char *p = (const unsigned char *) buf;
+  const unsigned char *endp = p+bufsize;
+  const unsigned char *cp;
+  u_int32_t i, na, s_type, s_flags, s_perms, idlen, pad;
+  GACL *ap = NULL;
+  GACL_ENTRY *ep;
 
   
-  vp = (u_int32_t *) buf;
-  na = ntohl(*vp++);
+  if (bufsize < 4)
+    goto Invalid;
+  
+  na = _xdr_get32(p);
+  p += 4;
 
+  /* Each ACE takes at least 16 bytes - don't trust the count blindly */
+  if (na > (endp-p)/16)
+    goto Invalid;
+  
   ap = gacl_init(na);
   if (!ap)
     return NULL;
@@ -250,15 +347,27 @@ _gacl_init_from_nfs4(const char *buf,
   ap->type = GACL_TYPE_NFS4;
   
   for (i = 0; i < na; i++) {
-    u_int32_t idlen;
-    GACL_ENTRY *ep;
+    if (endp-p < 16)
+      goto Invalid;
     
-    if (gacl_create_entry_np(&ap, &ep, i) < 0) {
-      gacl_free(ap);
-      return NULL;
-    }
-
-    switch (ntohl(*vp++)) {
+    s_type  = _xdr_get32(p);
+    s_flags = _xdr_get32(p+4);
+    s_perms = _xdr_get32(p+8);
+    idlen   = _xdr_get32(p+12);
+    p += 16;
+    
+    if (idlen > endp-p)
+      goto Invalid;
+    cp = p;
+    p += idlen;
+
+    /* Be lenient with missing padding after the last ACE */
+    pad = (4 - (idlen & 3)) & 3;
+    p = (endp-p < pad ? endp : p+pad);
+    
+    ep = &ap->av[ap->ac];
+    
+    switch (s_type) {
     case NFS4_ACE_ACCESS_ALLOWED_ACE_TYPE:
       ep->type = GACL_ENTRY_TYPE_ALLOW;
       break;
@@ -272,80 +381,93 @@ _gacl_init_from_nfs4(const char *buf,
       ep->type = GACL_ENTRY_TYPE_ALARM;
       break;
     default:
-      errno = EINVAL;
-      return NULL;
+      goto Invalid;
     }
 
-    s_flags = ntohl(*vp++);
-    
-    ep->flags = 0;
-    for (j = 0; j < sizeof(flagtab)/sizeof(flagtab[0]); j++)
-      if (s_flags & flagtab[j].s)
-	ep->flags |= flagtab[j].g;
-
-    
-    s_perms = ntohl(*vp++);
-    ep->perms = 0;
-    for (j = 0; j < sizeof(permtab)/sizeof(permtab[0]); j++)
-      if (s_perms & permtab[j].s)
-	ep->perms |= permtab[j].g;
-    
-    idlen = ntohl(*vp++);
-    cp = (char *) vp;
-
+    ep->flags = _nfs4_flags_to_gacl(s_flags);
+    ep->perms = _nfs4_perms_to_gacl(s_perms);
+    ep->tag.ugid = -1;
 
-    if (s_flags & NFS4_ACE_IDENTIFIER_GROUP) {
-      if (strncmp(cp, "GROUP@", idlen) == 0) {
-	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), "group@") < 0)
-	  return NULL;
-	
-	ep->tag.type = GACL_TAG_TYPE_GROUP_OBJ;
-	ep->tag.ugid = -1;
-      } else {
-	ep->tag.ugid = -1;
-	if (idlen >= sizeof(ep->tag.name)) {
-	  errno = EINVAL;
-	  return NULL;
-	}
-	if (s_ncpy(ep->tag.name, sizeof(ep->tag.name), cp, idlen) < 0)
-	  return NULL;
-	
-	(void) _nfs4_id_to_gid(ep->tag.name, &ep->tag.ugid);
-	ep->tag.type = GACL_TAG_TYPE_GROUP;
-      }
-    } else {
-      if (strncmp(cp, "OWNER@", idlen) == 0) {
-	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), "owner@") < 0)
-	  return NULL;
-	
-	ep->tag.type = GACL_TAG_TYPE_USER_OBJ;
-	ep->tag.ugid = -1;
-      } else if (strncmp(cp, "EVERYONE@", idlen) == 0) {
-	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), "everyone@") < 0)
-	  return NULL;
-	
-	ep->tag.type = GACL_TAG_TYPE_EVERYONE;
-	ep->tag.ugid = -1;
-      } else {
-	ep->tag.ugid = -1;
-	if (idlen >= sizeof(ep->tag.name)) {
-	  errno = EINVAL;
-	  return NULL;
-	}
-	if (s_ncpy(ep->tag.name, sizeof(ep->tag.name), cp, idlen) < 0)
-	  return NULL;
-	
-	ep->tag.type = GACL_TAG_TYPE_USER;
-	(void) _nfs4_id_to_uid(ep->tag.name, &ep->tag.ugid);
-      }
+    ep->tag.type = _nfs4_who_tag(s_flags, cp, idlen);
+    switch (ep->tag.type) {
+    case GACL_TAG_TYPE_USER_OBJ:
+      strcpy(ep->tag.name, "owner@");
+      break;
+    case GACL_TAG_TYPE_GROUP_OBJ:
+      strcpy(ep->tag.name, "group@");
+      break;
+    case GACL_TAG_TYPE_EVERYONE:
+      strcpy(ep->tag.name, "everyone@");
+      break;
+    default:
+      if (idlen >= sizeof(ep->tag.name))
+	goto Invalid;
+      memcpy(ep->tag.name, cp, idlen);
+      ep->tag.name[idlen] = '\0';
+      ep->tag.flags = GACL_TAG_F_LAZY;
     }
 
-    vp += idlen / sizeof(u_int32_t);
-    if (idlen % sizeof(u_int32_t))
-      vp++;
+    ap->ac++;
   }
 
   return ap;
+
+ Invalid:
+  if (ap)
+    gacl_free(ap);
+  errno = EINVAL;
+  return NULL;
+}
+
+
+/*
+ * The decoder keeps the who-strings as is - they are only looked up when
+ * someone needs the numeric id.
+ */
+void
+_gacl_resolve_tag(GACL_TAG *tp) {
+  tp->ugid = -1;
+  
+  if (tp->type == GACL_TAG_TYPE_GROUP)
+    (void) _nfs4_id_to_gid(tp->name, (gid_t *) &tp->ugid);
+  else if (tp->type == GACL_TAG_TYPE_USER)
+    (void) _nfs4_id_to_uid(tp->name, &tp->ugid);
+  
+  tp->flags &= ~GACL_TAG_F_LAZY;
+}
+
+
+/*
+ * Per-thread read buffer, grown to fit the largest ACL seen so far. Almost
+ * all reads then take a single getxattr() call - the size is only queried
+ * if the speculative read fails with ERANGE.
+ */
+#define NFS4_RBUF_MINSIZE 4096
+#define NFS4_RBUF_MAXSIZE (64*1024*1024) /* Sanity limit only */
+
+static GACL_THREAD_LOCAL char *nfs4_rbuf = NULL;
+static GACL_THREAD_LOCAL size_t nfs4_rsize = 0;
+
+static int
+_nfs4_rbuf_grow(size_t size) {
+  size_t nsize = nfs4_rsize ? nfs4_rsize : NFS4_RBUF_MINSIZE;
+  char *nbuf;
+
+  
+  while (nsize < size)
+    nsize *= 2;
+  if (nsize > NFS4_RBUF_MAXSIZE) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  nbuf = realloc(nfs4_rbuf, nsize);
+  if (!nbuf)
+    return -1;
+  
+  nfs4_rbuf = nbuf;
+  nfs4_rsize = nsize;
+  return 0;
 }
 
 
@@ -354,194 +476,261 @@ _gacl_get_fd_file(int fd,
 		  const char *path,
 		  GACL_TYPE type,
 		  int flags) {
-  char *buf;
-  ssize_t bufsize, rc;
+  ssize_t rc;
 
   
-  if (path) {
-    if (flags & GACL_F_SYMLINK_NOFOLLOW) {
-    
-      bufsize = lgetxattr(path, ACL_NFS4_XATTR, NULL, 0);
-      if (bufsize < 0)
-	return NULL;
-
-      buf = malloc(bufsize);
-      if (!buf)
-	return NULL;
+  if (!nfs4_rbuf && _nfs4_rbuf_grow(NFS4_RBUF_MINSIZE) < 0)
+    return NULL;
 
-      rc = lgetxattr(path, ACL_NFS4_XATTR, buf, bufsize);
-      if (rc < 0) {
-	free(buf);
-	return NULL;
-      }
-    } else {
-      
-      bufsize = getxattr(path, ACL_NFS4_XATTR, NULL, 0);
-      if (bufsize < 0)
-	return NULL;
-      
-      buf = malloc(bufsize);
-      if (!buf)
-	return NULL;
-      
-      rc = getxattr(path, ACL_NFS4_XATTR, buf, bufsize);
-      if (rc < 0) {
-	free(buf);
-	return NULL;
-      }
-      
-    }
-  } else {
+  while ((rc = _gacl_get_raw_fd_file(fd, path, type, nfs4_rbuf, nfs4_rsize, flags)) < 0) {
+    ssize_t size;
     
-    bufsize = fgetxattr(fd, ACL_NFS4_XATTR, NULL, 0);
-    if (bufsize < 0)
+    if (errno != ERANGE)
       return NULL;
     
-    buf = malloc(bufsize);
-    if (!buf)
+    /* Too small - ask for the current size and retry (it may change under us) */
+    size = _gacl_get_raw_fd_file(fd, path, type, NULL, 0, flags);
+    if (size < 0)
       return NULL;
     
-    rc = fgetxattr(fd, ACL_NFS4_XATTR, buf, bufsize);
-    if (rc < 0) {
-      free(buf);
+    if (_nfs4_rbuf_grow(size > nfs4_rsize ? size : nfs4_rsize+1) < 0)
       return NULL;
-    }
+  }
+  
+  return _gacl_init_from_nfs4(nfs4_rbuf, rc);
+}
+
+
+/*
+ * Get the raw NFSv4 ACL xattr. With bufsize == 0 returns the needed size.
+ */
+ssize_t
+_gacl_get_raw_fd_file(int fd,
+		      const char *path,
+		      GACL_TYPE type,
+		      void *buf,
+		      size_t bufsize,
+		      int flags) {
+  if (path) {
+    if (flags & GACL_F_SYMLINK_NOFOLLOW)
+      return lgetxattr(path, ACL_NFS4_XATTR, buf, bufsize);
     
+    return getxattr(path, ACL_NFS4_XATTR, buf, bufsize);
   }
+  
+  return fgetxattr(fd, ACL_NFS4_XATTR, buf, bufsize);
+}
+
 
+int
+_gacl_set_raw_fd_file(int fd,
+		      const char *path,
+		      GACL_TYPE type,
+		      const void *buf,
+		      size_t bufsize,
+		      int flags) {
+  if (path) {
+    if (flags & GACL_F_SYMLINK_NOFOLLOW)
+      return lsetxattr(path, ACL_NFS4_XATTR, buf, bufsize, 0);
+    
+    return setxattr(path, ACL_NFS4_XATTR, buf, bufsize, 0);
+  }
+  
+  return fsetxattr(fd, ACL_NFS4_XATTR, buf, bufsize, 0);
+}
+
+
+GACL *
+_gacl_from_raw(const void *buf,
+	       size_t bufsize) {
   return _gacl_init_from_nfs4(buf, bufsize);
 }
 
 
+/*
+ * uid/gid -> "name@domain" cache for the encoder, so writing the same ACL to
+ * lots of objects doesn't redo the NSS lookups and formatting every time.
+ * Direct mapped - a colliding id just replaces the old slot.
+ */
+#define NFS4_PTAB_SIZE 1024
+
+typedef struct nfs4_principal {
+  char *str;
+  u_int32_t len;
+  uid_t id;
+  int is_group;
+} NFS4_PRINCIPAL;
+
+static NFS4_PRINCIPAL nfs4_ptab[NFS4_PTAB_SIZE];
+static pthread_mutex_t nfs4_ptab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Format the NFSv4 principal string for a user/group id into 'buf' */
+ssize_t
+_nfs4_principal(uid_t id,
+		int is_group,
+		char *buf,
+		size_t bufsize) {
+  NFS4_PRINCIPAL *pp = &nfs4_ptab[((id << 1) | (is_group ? 1 : 0)) % NFS4_PTAB_SIZE];
+  char nbuf[256], *str;
+  const char *idd;
+  ssize_t len;
+  int rc;
+
+
+  pthread_mutex_lock(&nfs4_ptab_lock);
+  if (pp->str && pp->id == id && pp->is_group == is_group) {
+    len = pp->len;
+    if (len < bufsize)
+      memcpy(buf, pp->str, len+1);
+    pthread_mutex_unlock(&nfs4_ptab_lock);
+    if (len >= bufsize) {
+      errno = ENOMEM;
+      return -1;
+    }
+    return len;
+  }
+  pthread_mutex_unlock(&nfs4_ptab_lock);
+
+  if (is_group)
+    rc = gacl_gid_to_name_np(id, nbuf, sizeof(nbuf));
+  else
+    rc = gacl_uid_to_name_np(id, nbuf, sizeof(nbuf));
+  
+  if (rc == 1) {
+    idd = _nfs4_id_domain();
+    len = snprintf(buf, bufsize, "%s@%s", nbuf, idd ? idd : "");
+  } else
+    len = snprintf(buf, bufsize, "%u", id);
+  
+  if (len < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (len >= bufsize) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  /* Failing to cache it is not an error */
+  str = strdup(buf);
+  if (str) {
+    pthread_mutex_lock(&nfs4_ptab_lock);
+    free(pp->str);
+    pp->str = str;
+    pp->len = len;
+    pp->id = id;
+    pp->is_group = is_group;
+    pthread_mutex_unlock(&nfs4_ptab_lock);
+  }
+  
+  return len;
+}
+
 
 static ssize_t 
 _gacl_to_nfs4(GACL *ap, 
 	      char *buf, 
 	      size_t bufsize) {
-  u_int32_t *vp, *endp, s_flags, s_perms;
-  size_t buflen, vlen;
-  int i, j, rc;
+  u_int32_t *vp, *endp, s_flags, s_perms, idlen;
+  size_t vlen;
+  ssize_t len;
+  int i;
+  char tbuf[512];
 
 
   vp = (u_int32_t *) buf;
-  buflen = bufsize/sizeof(u_int32_t);
-  endp = vp+buflen;
+  endp = vp+bufsize/sizeof(u_int32_t);
 
+  if (vp >= endp) {
+    errno = ENOMEM;
+    return -1;
+  }
+  
   /* Number of ACEs */
   *vp++ = htonl(ap->ac);
 
   for (i = 0; i < ap->ac; i++) {
-    char *idname;
-    u_int32_t idlen;
-    struct passwd *pp;
-    struct group *gp;
-    char *idd;
-    char tbuf[256];
+    const char *idname;
     GACL_ENTRY *ep = &ap->av[i];
 
-    if (vp >= endp) {
+    /* Type, flags, perms & idlen */
+    if (endp-vp < 4) {
       errno = ENOMEM;
       return -1;
     }
 
     switch (ep->type) {
     case GACL_ENTRY_TYPE_ALLOW:
-      *vp++ = htonl(NFS4_ACE_ACCESS_ALLOWED_ACE_TYPE);
+      vp[0] = htonl(NFS4_ACE_ACCESS_ALLOWED_ACE_TYPE);
       break;
     case GACL_ENTRY_TYPE_DENY:
-      *vp++ = htonl(NFS4_ACE_ACCESS_DENIED_ACE_TYPE);
+      vp[0] = htonl(NFS4_ACE_ACCESS_DENIED_ACE_TYPE);
       break;
     case GACL_ENTRY_TYPE_AUDIT:
-      *vp++ = htonl(NFS4_ACE_SYSTEM_AUDIT_ACE_TYPE);
+      vp[0] = htonl(NFS4_ACE_SYSTEM_AUDIT_ACE_TYPE);
       break;
     case GACL_ENTRY_TYPE_ALARM:
-      *vp++ = htonl(NFS4_ACE_SYSTEM_ALARM_ACE_TYPE);
+      vp[0] = htonl(NFS4_ACE_SYSTEM_ALARM_ACE_TYPE);
       break;
     default:
       errno = EINVAL;
       return -1;
     }
     
-    if (vp >= endp) {
-      errno = ENOMEM;
-      return -1;
-    }
-
-    s_flags = 0;
-    for (j = 0; j < sizeof(flagtab)/sizeof(flagtab[0]); j++)
-      if (ep->flags & flagtab[j].g)
-	s_flags |= flagtab[j].s;
-
+    s_flags = _nfs4_flags_from_gacl(ep->flags);
     s_flags |= (ep->tag.type == GACL_TAG_TYPE_GROUP ||
 		ep->tag.type == GACL_TAG_TYPE_GROUP_OBJ ? 
 		NFS4_ACE_IDENTIFIER_GROUP : 0);
+    vp[1] = htonl(s_flags); 
 
-    *vp++ = htonl(s_flags); 
-    
-    if (vp >= endp) {
-      errno = ENOMEM;
-      return -1;
-    }
-
-    s_perms = 0;
-    for (j = 0; j < sizeof(permtab)/sizeof(permtab[0]); j++)
-      if (ep->perms & permtab[j].g)
-	s_perms |= permtab[j].s;
-    
-    *vp++ = htonl(s_perms);
-
+    s_perms = _nfs4_perms_from_gacl(ep->perms);
+    vp[2] = htonl(s_perms);
     
     switch (ep->tag.type) {
     case GACL_TAG_TYPE_USER_OBJ:
       idname = "OWNER@";
+      idlen = 6;
       break;
     case GACL_TAG_TYPE_GROUP_OBJ:
       idname = "GROUP@";
+      idlen = 6;
       break;
     case GACL_TAG_TYPE_EVERYONE:
       idname = "EVERYONE@";
+      idlen = 9;
       break;
     case GACL_TAG_TYPE_USER:
-      pp = getpwuid(ep->tag.ugid);
-      if (pp) {
-	idd = _nfs4_id_domain();
-	rc = snprintf(tbuf, sizeof(tbuf), "%s@%s", pp->pw_name, idd ? idd : "");
-      } else
-	rc = snprintf(tbuf, sizeof(tbuf), "%u", ep->tag.ugid);
-      if (rc < 0) {
-	errno = EINVAL;
-	return -1;
-      }
-      idname = tbuf;
-      break;
     case GACL_TAG_TYPE_GROUP:
-      gp = getgrgid(ep->tag.ugid);
-      if (gp) {
-	idd = _nfs4_id_domain();
-	rc = snprintf(tbuf, sizeof(tbuf), "%s@%s", gp->gr_name, idd ? idd : "");
-      } else
-	rc = snprintf(tbuf, sizeof(tbuf), "%u", ep->tag.ugid);
-      if (rc < 0) {
-	errno = EINVAL;
-	return -1;
+      /* Unresolved - write back the who-string we read */
+      if (ep->tag.flags & GACL_TAG_F_LAZY) {
+	idname = ep->tag.name;
+	idlen = strlen(idname);
+	break;
       }
+      len = _nfs4_principal(ep->tag.ugid, ep->tag.type == GACL_TAG_TYPE_GROUP, tbuf, sizeof(tbuf));
+      if (len < 0)
+	return -1;
       idname = tbuf;
+      idlen = len;
       break;
     default:
       errno = EINVAL;
       return -1;
     }
 
-    idlen = strlen(idname);
-    vlen = idlen / sizeof(u_int32_t);
-    if (idlen % sizeof(u_int32_t))
-      ++vlen;
-
-    if (vp+vlen >= endp) {
+    vp[3] = htonl(idlen);
+    vp += 4;
+    
+    vlen = (idlen+sizeof(u_int32_t)-1) / sizeof(u_int32_t);
+    if (endp-vp < vlen) {
       errno = ENOMEM;
       return -1;
     }
-    *vp++ = htonl(idlen);
+    
+    /* Zero the padding so identical ACLs always encode identically */
+    if (vlen > 0)
+      vp[vlen-1] = 0;
     memcpy(vp, idname, idlen);
     vp += vlen;
   }
@@ -550,43 +739,169 @@ _gacl_to_nfs4(GACL *ap,
 }
 
 
-int
-_gacl_set_fd_file(int fd,
-		  const char *path,
-		  GACL_TYPE type,
-		  GACL *ap,
-		  int flags) {
-  char buf[8192];
-  ssize_t bufsize, rc;
+/*
+ * Per-thread encode buffer. It also remembers what ACL it holds the encoding
+ * of, so writing the same ACL again (set-access -r & friends) reuses the
+ * previous blob without reencoding it.
+ */
+#define NFS4_WKEY_WORDS 5
 
+static GACL_THREAD_LOCAL char *nfs4_wbuf = NULL;
+static GACL_THREAD_LOCAL size_t nfs4_wsize = 0;
+static GACL_THREAD_LOCAL ssize_t nfs4_wlen = -1;
+static GACL_THREAD_LOCAL u_int32_t *nfs4_wkey = NULL;
+static GACL_THREAD_LOCAL int nfs4_wkey_n = 0;
+static GACL_THREAD_LOCAL int nfs4_wkey_size = 0;
 
-  bufsize = _gacl_to_nfs4(ap, buf, sizeof(buf));
-  if (bufsize < 0)
-    return -1;
+/*
+ * The key has no room for names - so no unresolved principals (encoding
+ * those is cheap anyway). Their ids (-1) would match any other unresolved
+ * name.
+ */
+static int
+_nfs4_wkey_usable(GACL_ENTRY *ep) {
+  if (ep->tag.flags & GACL_TAG_F_LAZY)
+    return 0;
+  
+  return !((ep->tag.type == GACL_TAG_TYPE_USER || ep->tag.type == GACL_TAG_TYPE_GROUP) &&
+	   ep->tag.ugid == (uid_t) -1);
+}
 
-  if (path) {
-    if (flags & GACL_F_SYMLINK_NOFOLLOW) {
+
+static int
+_nfs4_wkey_match(GACL *ap) {
+  u_int32_t *kp = nfs4_wkey;
+  int i;
+
+  
+  if (nfs4_wlen < 0 || nfs4_wkey_n != ap->ac)
+    return 0;
+
+  for (i = 0; i < ap->ac; i++, kp += NFS4_WKEY_WORDS) {
+    GACL_ENTRY *ep = &ap->av[i];
+
+    if (!_nfs4_wkey_usable(ep))
+      return 0;
+    if (kp[0] != ep->type || kp[1] != ep->flags || kp[2] != ep->perms ||
+	kp[3] != ep->tag.type || kp[4] != ep->tag.ugid)
+      return 0;
+  }
+  
+  return 1;
+}
+
+
+static void
+_nfs4_wkey_save(GACL *ap) {
+  u_int32_t *kp;
+  int i;
+
+  
+  if (ap->ac > nfs4_wkey_size) {
+    u_int32_t *nkey = realloc(nfs4_wkey, ap->ac * NFS4_WKEY_WORDS * sizeof(u_int32_t));
     
-      rc = lsetxattr(path, ACL_NFS4_XATTR, buf, bufsize, 0);
-      if (rc < 0)
+    if (!nkey) {
+      /* Just don't remember it */
+      nfs4_wlen = -1;
+      return;
+    }
+    nfs4_wkey = nkey;
+    nfs4_wkey_size = ap->ac;
+  }
+  
+  kp = nfs4_wkey;
+  for (i = 0; i < ap->ac; i++, kp += NFS4_WKEY_WORDS) {
+    GACL_ENTRY *ep = &ap->av[i];
+    
+    if (!_nfs4_wkey_usable(ep)) {
+      nfs4_wlen = -1;
+      return;
+    }
+    
+    kp[0] = ep->type;
+    kp[1] = ep->flags;
+    kp[2] = ep->perms;
+    kp[3] = ep->tag.type;
+    kp[4] = ep->tag.ugid;
+  }
+  nfs4_wkey_n = ap->ac;
+}
+
+
+/* Encode into the per-thread buffer, returns the length */
+static ssize_t
+_nfs4_encode(GACL *ap) {
+  ssize_t len;
+
+  
+  if (_nfs4_wkey_match(ap))
+    return nfs4_wlen;
+  
+  nfs4_wlen = -1;
+  for (;;) {
+    if (nfs4_wsize > 0) {
+      len = _gacl_to_nfs4(ap, nfs4_wbuf, nfs4_wsize);
+      if (len >= 0)
+	break;
+      if (errno != ENOMEM)
 	return -1;
+    }
 
+    if (nfs4_wsize >= NFS4_RBUF_MAXSIZE) {
+      errno = E2BIG;
+      return -1;
     } else {
+      size_t nsize = nfs4_wsize ? nfs4_wsize*2 : NFS4_RBUF_MINSIZE;
+      char *nbuf = realloc(nfs4_wbuf, nsize);
       
-      rc = setxattr(path, ACL_NFS4_XATTR, buf, bufsize, 0);
-      if (rc < 0)
+      if (!nbuf)
 	return -1;
-      
+      nfs4_wbuf = nbuf;
+      nfs4_wsize = nsize;
     }
-  } else {
-    
-    rc = fsetxattr(fd, ACL_NFS4_XATTR, buf, bufsize, 0);
-    if (rc < 0)
-      return -1;
-    
   }
 
-  return rc;
+  nfs4_wlen = len;
+  _nfs4_wkey_save(ap);
+  return len;
+}
+
+
+ssize_t
+_gacl_to_raw(GACL *ap,
+	     void *buf,
+	     size_t bufsize) {
+  ssize_t len;
+
+  
+  len = _nfs4_encode(ap);
+  if (len < 0)
+    return -1;
+  
+  if (len > bufsize) {
+    errno = ENOMEM;
+    return -1;
+  }
+  
+  memcpy(buf, nfs4_wbuf, len);
+  return len;
+}
+
+
+int
+_gacl_set_fd_file(int fd,
+		  const char *path,
+		  GACL_TYPE type,
+		  GACL *ap,
+		  int flags) {
+  ssize_t len;
+
+
+  len = _nfs4_encode(ap);
+  if (len < 0)
+    return -1;
+
+  return _gacl_set_raw_fd_file(fd, path, type, nfs4_wbuf, len, flags);
 }
 #endif
 
@@ -621,8 +936,6 @@ _gacl_set_fd_file(int fd,
 static int
 _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
 			   freebsd_acl_entry_t oep) {
-  struct passwd *pp;
-  struct group *gp;
 
 
   /* XXX TODO: Translate ae_tag - tag.type*/
@@ -650,11 +963,7 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
     break;
     
   case GACL_TAG_TYPE_USER:
-    pp = getpwuid(nep->tag.ugid);
-    if (pp) {
-      if (s_cpy(nep->tag.name, sizeof(nep->tag.name), pp->pw_name) < 0)
-	return -1;
-    } else {
+    if (gacl_uid_to_name_np(nep->tag.ugid, nep->tag.name, sizeof(nep->tag.name)) <= 0) {
       int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
       
       if (rc < 0)
@@ -667,11 +976,7 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
     break;
     
   case GACL_TAG_TYPE_GROUP:
-    gp = getgrgid(nep->tag.ugid);
-    if (gp) {
-      if (s_cpy(nep->tag.name, sizeof(nep->tag.name), gp->gr_name) < 0)
-	return -1;
-    } else {
+    if (gacl_gid_to_name_np(nep->tag.ugid, nep->tag.name, sizeof(nep->tag.name)) <= 0) {
       int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
 
       if (rc < 0)
@@ -819,7 +1124,7 @@ _gacl_set_fd_file(int fd,
   
   nap = acl_init(ap->ac);
 
-  for (i = 0; (rc = gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &oep)) == 1; i++) {
+  for (i = 0; (rc = _gacl_get_entry(ap, i, &oep)) == 1; i++) {
     freebsd_acl_entry_t nep;
 
     if (acl_create_entry_np(&nap, &nep, i) < 0)
@@ -981,8 +1286,6 @@ _gacl_entry_to_ace(GACL_ENTRY *ep,
 static int
 _gacl_entry_from_ace(GACL_ENTRY *ep,
 		     ace_t *ap) {
-  struct passwd *pp;
-  struct group *gp;
   int i;
   
   
@@ -1017,11 +1320,7 @@ _gacl_entry_from_ace(GACL_ENTRY *ep,
     if (ap->a_flags & ACE_IDENTIFIER_GROUP) {
       ep->tag.type = GACL_TAG_TYPE_GROUP;
       ep->tag.ugid = ap->a_who;
-      gp = getgrgid(ap->a_who);
-      if (gp) {
-	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), gp->gr_name) < 0)
-	  return -1;
-      } else {
+      if (gacl_gid_to_name_np(ap->a_who, ep->tag.name, sizeof(ep->tag.name)) <= 0) {
 	int rc = snprintf(ep->tag.name, sizeof(ep->tag.name), "%d", ap->a_who);
 
 	if (rc < 0)
@@ -1034,11 +1333,7 @@ _gacl_entry_from_ace(GACL_ENTRY *ep,
     } else {
       ep->tag.type = GACL_TAG_TYPE_USER;
       ep->tag.ugid = ap->a_who;
-      pp = getpwuid(ap->a_who);
-      if (pp) {
-	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), pp->pw_name) < 0)
-	  return -1;
-      } else {
+      if (gacl_uid_to_name_np(ap->a_who, ep->tag.name, sizeof(ep->tag.name)) <= 0) {
 	int rc = snprintf(ep->tag.name, sizeof(ep->tag.name), "%d", ap->a_who);
 
 	if (rc < 0)
@@ -1317,8 +1612,6 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
   macos_acl_tag_t at;
   macos_acl_permset_t ops;
   macos_acl_flagset_t ofs;
-  struct passwd *pp;
-  struct group *gp;
 
   
   if (acl_get_tag_type(oep, &at) < 0)
@@ -1339,11 +1632,7 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
     switch (ugtype) {
     case ID_TYPE_UID:
       nep->tag.type = GACL_TAG_TYPE_USER;
-      pp = getpwuid(nep->tag.ugid);
-      if (pp) {
-	if (s_cpy(nep->tag.name, sizeof(nep->tag.name), pp->pw_name) < 0)
-	  return -1;
-      } else {
+      if (gacl_uid_to_name_np(nep->tag.ugid, nep->tag.name, sizeof(nep->tag.name)) <= 0) {
 	int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
 
 	if (rc < 0)
@@ -1357,11 +1646,7 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
       
     case ID_TYPE_GID:
       nep->tag.type = GACL_TAG_TYPE_GROUP;
-      gp = getgrgid(nep->tag.ugid);
-      if (gp) {
-	if (s_cpy(nep->tag.name, sizeof(nep->tag.name), gp->gr_name) < 0)
-	  return -1;
-      } else {
+      if (gacl_gid_to_name_np(nep->tag.ugid, nep->tag.name, sizeof(nep->tag.name)) <= 0) {
 	int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
 
 	if (rc < 0)
@@ -1571,7 +1856,7 @@ _gacl_set_fd_file(int fd,
   if (!nap)
     return -1;
 
-  for (i = 0; (rc = gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &oep)) == 1; i++) {
+  for (i = 0; (rc = _gacl_get_entry(ap, i, &oep)) == 1; i++) {
     macos_acl_entry_t nep;
 
     if (acl_create_entry_np(&nap, &nep, i) < 0)
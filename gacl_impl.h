@@ -97,6 +97,9 @@
 #define GACL_FREEBSD_EMULATION 1
 #define GACL_SOLARIS_EMULATION 1
 
+/* ACLs are stored as raw XDR-encoded NFSv4 ACLs in an extended attribute */
+#define GACL_RAW_NFS4 1
+
 /* ---------------------------------------- Linux - END ---------------------------------------- */
 
 
@@ -151,4 +154,63 @@ _gacl_set_fd_file(int fd,
 		  GACL *ap,
 		  int flags);
 
+#ifdef GACL_RAW_NFS4
+/*
+ * The OS interfaces for raw (OS-native encoding) ACLs
+ */
+ssize_t
+_gacl_get_raw_fd_file(int fd,
+		      const char *path,
+		      GACL_TYPE type,
+		      void *buf,
+		      size_t bufsize,
+		      int flags);
+
+int
+_gacl_set_raw_fd_file(int fd,
+		      const char *path,
+		      GACL_TYPE type,
+		      const void *buf,
+		      size_t bufsize,
+		      int flags);
+
+GACL *
+_gacl_from_raw(const void *buf,
+	       size_t bufsize);
+
+ssize_t
+_gacl_to_raw(GACL *ap,
+	     void *buf,
+	     size_t bufsize);
+
+void
+_gacl_resolve_tag(GACL_TAG *tp);
+
+/*
+ * Helpers shared with the raw blob view (gacl_blob.c)
+ */
+GACL_PERMSET
+_nfs4_perms_to_gacl(u_int32_t s_perms);
+
+GACL_FLAGSET
+_nfs4_flags_to_gacl(u_int32_t s_flags);
+
+u_int32_t
+_nfs4_perms_from_gacl(GACL_PERMSET perms);
+
+u_int32_t
+_nfs4_flags_from_gacl(GACL_FLAGSET flags);
+
+ssize_t
+_nfs4_principal(uid_t id,
+		int is_group,
+		char *buf,
+		size_t bufsize);
+
+GACL_TAG_TYPE
+_nfs4_who_tag(u_int32_t s_flags,
+	      const unsigned char *cp,
+	      u_int32_t idlen);
+#endif
+
 #endif
@@ -0,0 +1,1021 @@
+/*
+ * idcache.c - Cached user/group name lookups
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+/* Solaris needs this for the POSIX getpwuid_r() & friends */
+#ifdef __sun
+#define _POSIX_PTHREAD_SEMANTICS 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pwd.h>
+#include <grp.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "idcache.h"
+#include "strings.h"
+
+
+/* Scratch space for the getpw*_r()/getgr*_r() calls, grown on ERANGE */
+#define IDCACHE_NSS_BUFSIZE    4096
+#define IDCACHE_NSS_MAXBUFSIZE (1024*1024)
+
+/* Frees the old buffer, also when giving up */
+static int
+_idcache_nss_grow(char **bufp,
+		  size_t *sizep,
+		  char *sbuf) {
+  if (*bufp != sbuf)
+    free(*bufp);
+  *bufp = NULL;
+  
+  if (*sizep >= IDCACHE_NSS_MAXBUFSIZE) {
+    errno = ERANGE;
+    return -1;
+  }
+  
+  *sizep *= 2;
+  *bufp = malloc(*sizep);
+  return *bufp ? 0 : -1;
+}
+
+
+/*
+ * Not finding the entry is 0 or one of these, depending on the OS. Other
+ * errors (NSS backend down and such) must not be cached as negatives.
+ */
+static int
+_idcache_nss_failed(int rc) {
+  switch (rc) {
+  case 0:
+  case ENOENT:
+  case ESRCH:
+  case EBADF:
+  case EPERM:
+    return 0;
+  }
+  
+  errno = rc;
+  return 1;
+}
+
+
+static int
+_idcache_nss_uid_to_name(uid_t uid,
+			 char *name,
+			 size_t namesize) {
+  struct passwd pbuf, *pp = NULL;
+  char sbuf[IDCACHE_NSS_BUFSIZE], *buf = sbuf;
+  size_t bufsize = sizeof(sbuf);
+  int rc;
+
+  
+  while ((rc = getpwuid_r(uid, &pbuf, buf, bufsize, &pp)) == ERANGE)
+    if (_idcache_nss_grow(&buf, &bufsize, sbuf) < 0)
+      return -1;
+  
+  if (pp)
+    rc = s_cpy(name, namesize, pp->pw_name) < 0 ? -1 : 1;
+  else
+    rc = _idcache_nss_failed(rc) ? -1 : 0;
+  
+  if (buf != sbuf)
+    free(buf);
+  return rc;
+}
+
+
+static int
+_idcache_nss_gid_to_name(gid_t gid,
+			 char *name,
+			 size_t namesize) {
+  struct group gbuf, *gp = NULL;
+  char sbuf[IDCACHE_NSS_BUFSIZE], *buf = sbuf;
+  size_t bufsize = sizeof(sbuf);
+  int rc;
+
+  
+  while ((rc = getgrgid_r(gid, &gbuf, buf, bufsize, &gp)) == ERANGE)
+    if (_idcache_nss_grow(&buf, &bufsize, sbuf) < 0)
+      return -1;
+  
+  if (gp)
+    rc = s_cpy(name, namesize, gp->gr_name) < 0 ? -1 : 1;
+  else
+    rc = _idcache_nss_failed(rc) ? -1 : 0;
+  
+  if (buf != sbuf)
+    free(buf);
+  return rc;
+}
+
+
+static int
+_idcache_nss_name_to_uid(const char *name,
+			 uid_t *uidp) {
+  struct passwd pbuf, *pp = NULL;
+  char sbuf[IDCACHE_NSS_BUFSIZE], *buf = sbuf;
+  size_t bufsize = sizeof(sbuf);
+  int rc;
+
+  
+  while ((rc = getpwnam_r(name, &pbuf, buf, bufsize, &pp)) == ERANGE)
+    if (_idcache_nss_grow(&buf, &bufsize, sbuf) < 0)
+      return -1;
+  
+  if (pp) {
+    *uidp = pp->pw_uid;
+    rc = 1;
+  } else
+    rc = _idcache_nss_failed(rc) ? -1 : 0;
+  
+  if (buf != sbuf)
+    free(buf);
+  return rc;
+}
+
+
+static int
+_idcache_nss_name_to_gid(const char *name,
+			 gid_t *gidp) {
+  struct group gbuf, *gp = NULL;
+  char sbuf[IDCACHE_NSS_BUFSIZE], *buf = sbuf;
+  size_t bufsize = sizeof(sbuf);
+  int rc;
+
+  
+  while ((rc = getgrnam_r(name, &gbuf, buf, bufsize, &gp)) == ERANGE)
+    if (_idcache_nss_grow(&buf, &bufsize, sbuf) < 0)
+      return -1;
+  
+  if (gp) {
+    *gidp = gp->gr_gid;
+    rc = 1;
+  } else
+    rc = _idcache_nss_failed(rc) ? -1 : 0;
+  
+  if (buf != sbuf)
+    free(buf);
+  return rc;
+}
+
+
+/*
+ * Identity map files (see identity-snapshot).
+ *
+ * A snapshot of the passwd/group namespace that replaces NSS completely once
+ * loaded. The file is mmap()ed as is: a header, four tables of (id, name
+ * offset) pairs - users and groups sorted by id and by name - and a string
+ * pool. Lookups are binary searches. Written in host byte order; a map
+ * from a host with another byte order is rejected.
+ */
+#define IDMAP_MAGIC     "ACLIDMAP"
+#define IDMAP_VERSION   1
+#define IDMAP_BYTEORDER 0x01020304
+
+#define IDMAP_UID   0
+#define IDMAP_UNAME 1
+#define IDMAP_GID   2
+#define IDMAP_GNAME 3
+
+typedef struct idmap_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t n[4];      /* Entries in each table */
+  uint32_t domain;    /* NFSv4 domain (string offset), 0 = none */
+  uint32_t strsize;
+  int64_t created;
+} IDMAP_HEADER;
+
+typedef struct idmap_entry {
+  uint32_t id;
+  uint32_t name;      /* String offset */
+} IDMAP_ENTRY;
+
+static struct idmap {
+  void *base;
+  size_t size;
+  const IDMAP_HEADER *hp;
+  const IDMAP_ENTRY *tab[4];
+  const char *strs;
+} idmap = { NULL, 0, NULL, { NULL }, NULL };
+
+
+static const IDMAP_ENTRY *
+_idmap_by_id(int t,
+	     uint32_t id) {
+  const IDMAP_ENTRY *v = idmap.tab[t];
+  size_t lo = 0, hi = idmap.hp->n[t];
+
+  
+  while (lo < hi) {
+    size_t mid = lo + (hi-lo)/2;
+
+    if (v[mid].id == id)
+      return &v[mid];
+    if (v[mid].id < id)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  
+  return NULL;
+}
+
+
+static const IDMAP_ENTRY *
+_idmap_by_name(int t,
+	       const char *name) {
+  const IDMAP_ENTRY *v = idmap.tab[t];
+  size_t lo = 0, hi = idmap.hp->n[t];
+
+  
+  while (lo < hi) {
+    size_t mid = lo + (hi-lo)/2;
+    int d = strcmp(idmap.strs + v[mid].name, name);
+
+    if (d == 0)
+      return &v[mid];
+    if (d < 0)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  
+  return NULL;
+}
+
+
+static int
+_idmap_id_to_name(int is_group,
+		  uid_t id,
+		  char *name,
+		  size_t namesize) {
+  const IDMAP_ENTRY *ep = _idmap_by_id(is_group ? IDMAP_GID : IDMAP_UID, id);
+
+  if (!ep)
+    return 0;
+  
+  return s_cpy(name, namesize, idmap.strs + ep->name) < 0 ? -1 : 1;
+}
+
+
+static int
+_idmap_name_to_id(int is_group,
+		  const char *name,
+		  uid_t *idp) {
+  const IDMAP_ENTRY *ep = _idmap_by_name(is_group ? IDMAP_GNAME : IDMAP_UNAME, name);
+
+  if (!ep)
+    return 0;
+  
+  *idp = ep->id;
+  return 1;
+}
+
+
+/* Check that everything in the map is within bounds */
+static int
+_idmap_check(const void *base,
+	     size_t size) {
+  const IDMAP_HEADER *hp = (const IDMAP_HEADER *) base;
+  const IDMAP_ENTRY *v;
+  const char *strs;
+  uint64_t total;
+  uint32_t i, j;
+
+  
+  if (size < sizeof(*hp) ||
+      memcmp(hp->magic, IDMAP_MAGIC, sizeof(hp->magic)) != 0 ||
+      hp->version != IDMAP_VERSION ||
+      hp->byteorder != IDMAP_BYTEORDER ||
+      hp->strsize == 0)
+    return -1;
+
+  total = sizeof(*hp) + hp->strsize;
+  for (i = 0; i < 4; i++)
+    total += (uint64_t) hp->n[i] * sizeof(IDMAP_ENTRY);
+  if (total != size)
+    return -1;
+
+  strs = (const char *) base + size - hp->strsize;
+  if (strs[hp->strsize-1] != '\0' || hp->domain >= hp->strsize)
+    return -1;
+
+  v = (const IDMAP_ENTRY *) (hp+1);
+  for (i = 0; i < 4; i++)
+    for (j = 0; j < hp->n[i]; j++, v++)
+      if (v->name >= hp->strsize)
+	return -1;
+
+  return 0;
+}
+
+
+/*
+ * Use the identity map in 'path' instead of NSS from now on. Anything
+ * already cached is dropped.
+ */
+int
+idcache_map_load(const char *path) {
+  struct stat sb;
+  void *base;
+  int fd, i;
+  size_t off;
+
+  
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &sb) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return -1;
+
+  if (_idmap_check(base, sb.st_size) < 0) {
+    munmap(base, sb.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  idcache_map_unload();
+  
+  idmap.base = base;
+  idmap.size = sb.st_size;
+  idmap.hp = (const IDMAP_HEADER *) base;
+  off = sizeof(IDMAP_HEADER);
+  for (i = 0; i < 4; i++) {
+    idmap.tab[i] = (const IDMAP_ENTRY *) ((const char *) base + off);
+    off += idmap.hp->n[i] * sizeof(IDMAP_ENTRY);
+  }
+  idmap.strs = (const char *) base + off;
+  
+  idcache_flush();
+  return 0;
+}
+
+
+/* Go back to using NSS */
+void
+idcache_map_unload(void) {
+  if (!idmap.base)
+    return;
+
+  munmap(idmap.base, idmap.size);
+  memset(&idmap, 0, sizeof(idmap));
+  idcache_flush();
+}
+
+
+/* NFSv4 domain recorded in the loaded map, if any */
+const char *
+idcache_map_domain(void) {
+  if (!idmap.base || !idmap.hp->domain)
+    return NULL;
+  
+  return idmap.strs + idmap.hp->domain;
+}
+
+
+typedef struct idmap_rec {
+  uint32_t id;
+  uint32_t seq;       /* Enumeration order - the first of any duplicates wins */
+  uint32_t name;
+} IDMAP_REC;
+
+static const char *idmap_sort_strs;
+
+static int
+_idmap_rec_cmp_id(const void *a,
+		  const void *b) {
+  const IDMAP_REC *ra = (const IDMAP_REC *) a;
+  const IDMAP_REC *rb = (const IDMAP_REC *) b;
+
+  if (ra->id != rb->id)
+    return ra->id < rb->id ? -1 : 1;
+  return ra->seq < rb->seq ? -1 : (ra->seq > rb->seq);
+}
+
+
+static int
+_idmap_rec_cmp_name(const void *a,
+		    const void *b) {
+  const IDMAP_REC *ra = (const IDMAP_REC *) a;
+  const IDMAP_REC *rb = (const IDMAP_REC *) b;
+  int d;
+
+  d = strcmp(idmap_sort_strs + ra->name, idmap_sort_strs + rb->name);
+  if (d)
+    return d;
+  return ra->seq < rb->seq ? -1 : (ra->seq > rb->seq);
+}
+
+
+/* Sort 'v' with 'cmp' and write it out, keeping only the first of equal keys */
+static uint32_t
+_idmap_write_table(FILE *fp,
+		   IDMAP_REC *v,
+		   uint32_t n,
+		   int by_name,
+		   const char *strs) {
+  IDMAP_ENTRY e;
+  uint32_t i, nw = 0;
+
+  
+  idmap_sort_strs = strs;
+  qsort(v, n, sizeof(*v), by_name ? _idmap_rec_cmp_name : _idmap_rec_cmp_id);
+  
+  for (i = 0; i < n; i++) {
+    if (i > 0 && (by_name ?
+		  strcmp(strs + v[i].name, strs + v[i-1].name) == 0 :
+		  v[i].id == v[i-1].id))
+      continue;
+
+    e.id = v[i].id;
+    e.name = v[i].name;
+    if (fwrite(&e, sizeof(e), 1, fp) != 1)
+      return (uint32_t) -1;
+    nw++;
+  }
+
+  return nw;
+}
+
+
+typedef struct idmap_build {
+  char *strs;
+  size_t strsize;
+  size_t strlen;
+  IDMAP_REC *v[2];    /* Users, groups */
+  uint32_t n[2];
+  size_t size[2];
+} IDMAP_BUILD;
+
+
+static int
+_idmap_add_str(IDMAP_BUILD *bp,
+	       const char *str,
+	       uint32_t *offp) {
+  size_t len = strlen(str)+1;
+
+  
+  if (bp->strlen + len > bp->strsize) {
+    size_t nsize = bp->strsize ? bp->strsize*2 : 65536;
+    char *nstrs;
+
+    while (bp->strlen + len > nsize)
+      nsize *= 2;
+    if (nsize > UINT32_MAX) {
+      errno = E2BIG;
+      return -1;
+    }
+    nstrs = realloc(bp->strs, nsize);
+    if (!nstrs)
+      return -1;
+    bp->strs = nstrs;
+    bp->strsize = nsize;
+  }
+
+  memcpy(bp->strs + bp->strlen, str, len);
+  *offp = bp->strlen;
+  bp->strlen += len;
+  return 0;
+}
+
+
+static int
+_idmap_add_rec(IDMAP_BUILD *bp,
+	       int is_group,
+	       uint32_t id,
+	       const char *name) {
+  IDMAP_REC *rp;
+
+  
+  if (bp->n[is_group] >= bp->size[is_group]) {
+    size_t nsize = bp->size[is_group] ? bp->size[is_group]*2 : 1024;
+    IDMAP_REC *nv = realloc(bp->v[is_group], nsize * sizeof(*nv));
+
+    if (!nv)
+      return -1;
+    bp->v[is_group] = nv;
+    bp->size[is_group] = nsize;
+  }
+
+  rp = &bp->v[is_group][bp->n[is_group]];
+  rp->id = id;
+  rp->seq = bp->n[is_group];
+  if (_idmap_add_str(bp, name, &rp->name) < 0)
+    return -1;
+  
+  bp->n[is_group]++;
+  return 0;
+}
+
+
+/*
+ * Enumerate the passwd and group databases into a new map file. It is
+ * written next to 'path' and renamed into place, so processes using the
+ * old one are not disturbed. Returns 0 and the number of users/groups.
+ */
+int
+idcache_map_write(const char *path,
+		  const char *domain,
+		  unsigned long *nusers,
+		  unsigned long *ngroups) {
+  IDMAP_BUILD b;
+  IDMAP_HEADER h;
+  struct passwd *pp;
+  struct group *gp;
+  char *tmp = NULL;
+  FILE *fp = NULL;
+  int i, fd, s_errno, f_tmp = 0;
+  uint32_t nw;
+  mode_t um;
+
+  
+  memset(&b, 0, sizeof(b));
+  memset(&h, 0, sizeof(h));
+  
+  if (_idmap_add_str(&b, "", &h.domain) < 0)
+    goto Fail;
+  if (domain && *domain && _idmap_add_str(&b, domain, &h.domain) < 0)
+    goto Fail;
+
+  setpwent();
+  while ((pp = getpwent()) != NULL)
+    if (_idmap_add_rec(&b, 0, pp->pw_uid, pp->pw_name) < 0) {
+      endpwent();
+      goto Fail;
+    }
+  endpwent();
+  
+  setgrent();
+  while ((gp = getgrent()) != NULL)
+    if (_idmap_add_rec(&b, 1, gp->gr_gid, gp->gr_name) < 0) {
+      endgrent();
+      goto Fail;
+    }
+  endgrent();
+
+  /* A unique name next to the target, so concurrent runs don't collide */
+  tmp = s_dupcat(path, ".XXXXXX", NULL);
+  if (!tmp)
+    goto Fail;
+  
+  fd = mkstemp(tmp);
+  if (fd < 0)
+    goto Fail;
+  f_tmp = 1;
+
+  /* mkstemp() creates it 0600, give it the mode fopen() would have */
+  um = umask(0);
+  (void) umask(um);
+  if (fchmod(fd, 0666 & ~um) < 0 || !(fp = fdopen(fd, "w"))) {
+    s_errno = errno;
+    close(fd);
+    errno = s_errno;
+    goto Fail;
+  }
+
+  /* Header first as a placeholder, the table sizes are known afterwards */
+  if (fwrite(&h, sizeof(h), 1, fp) != 1)
+    goto Fail;
+
+  for (i = 0; i < 4; i++) {
+    nw = _idmap_write_table(fp, b.v[i/2], b.n[i/2], i & 1, b.strs);
+    if (nw == (uint32_t) -1)
+      goto Fail;
+    h.n[i] = nw;
+  }
+  
+  if (fwrite(b.strs, 1, b.strlen, fp) != b.strlen)
+    goto Fail;
+
+  memcpy(h.magic, IDMAP_MAGIC, sizeof(h.magic));
+  h.version = IDMAP_VERSION;
+  h.byteorder = IDMAP_BYTEORDER;
+  h.strsize = b.strlen;
+  h.created = time(NULL);
+  
+  if (fseek(fp, 0, SEEK_SET) < 0 ||
+      fwrite(&h, sizeof(h), 1, fp) != 1)
+    goto Fail;
+  
+  if (fclose(fp) != 0) {
+    fp = NULL;
+    goto Fail;
+  }
+  fp = NULL;
+  
+  if (rename(tmp, path) < 0)
+    goto Fail;
+
+  if (nusers)
+    *nusers = h.n[IDMAP_UID];
+  if (ngroups)
+    *ngroups = h.n[IDMAP_GID];
+  
+  free(tmp);
+  free(b.strs);
+  free(b.v[0]);
+  free(b.v[1]);
+  return 0;
+
+ Fail:
+  s_errno = errno;
+  if (fp)
+    fclose(fp);
+  if (f_tmp)
+    unlink(tmp);
+  free(tmp);
+  free(b.strs);
+  free(b.v[0]);
+  free(b.v[1]);
+  errno = s_errno;
+  return -1;
+}
+
+
+/*
+ * Chained hash table keyed on (op, id) for id->name and (op, name) for
+ * name->id lookups. When full it is simply emptied - the working set of
+ * principals in a tree is normally far smaller than the limit.
+ */
+#define IDCACHE_BUCKETS 4096
+
+#define IDCACHE_UID2NAME 1
+#define IDCACHE_GID2NAME 2
+#define IDCACHE_NAME2UID 3
+#define IDCACHE_NAME2GID 4
+
+#define IDCACHE_BYNAME(op) ((op) == IDCACHE_NAME2UID || (op) == IDCACHE_NAME2GID)
+
+typedef struct idcache_entry {
+  struct idcache_entry *next;
+  int op;
+  int found;
+  uid_t id;
+  time_t expires;  /* 0 = never */
+  char name[];
+} IDCACHE_ENTRY;
+
+static struct idcache {
+  IDCACHE_ENTRY *htab[IDCACHE_BUCKETS];
+  size_t entries;
+  size_t maxentries;
+  time_t ttl;
+  IDCACHE_STATS stats;
+  pthread_mutex_t lock;
+} idcache = { { NULL }, 0, IDCACHE_DEFAULT_ENTRIES, 0, { 0 }, PTHREAD_MUTEX_INITIALIZER };
+
+
+static unsigned int
+_idcache_hash(int op,
+	      uid_t id,
+	      const char *name) {
+  u_int32_t h = op;
+
+  if (IDCACHE_BYNAME(op))
+    while (*name)
+      h = h * 31 + (unsigned char) *name++;
+  else
+    h = h * 31 + id;
+
+  h *= 2654435761U;
+  return (h ^ (h >> 16)) % IDCACHE_BUCKETS;
+}
+
+
+/* Must be called with the lock held */
+static void
+_idcache_clear(void) {
+  IDCACHE_ENTRY *ep, *next;
+  size_t i;
+
+  
+  for (i = 0; i < IDCACHE_BUCKETS; i++) {
+    for (ep = idcache.htab[i]; ep; ep = next) {
+      next = ep->next;
+      free(ep);
+    }
+    idcache.htab[i] = NULL;
+  }
+  idcache.entries = 0;
+}
+
+
+/*
+ * Returns 1/0 (found/not found) if cached, -1 if not. Copies the name to
+ * 'buf' (id lookups) or the id to '*idp' (name lookups).
+ */
+static int
+_idcache_get(int op,
+	     uid_t id,
+	     const char *name,
+	     uid_t *idp,
+	     char *buf,
+	     size_t bufsize) {
+  IDCACHE_ENTRY *ep, **epp;
+  int rc = -1;
+
+  
+  pthread_mutex_lock(&idcache.lock);
+  idcache.stats.lookups++;
+  
+  for (epp = &idcache.htab[_idcache_hash(op, id, name)]; (ep = *epp) != NULL; epp = &ep->next) {
+    if (ep->op != op)
+      continue;
+    
+    if (IDCACHE_BYNAME(op) ? strcmp(ep->name, name) != 0 : ep->id != id)
+      continue;
+
+    if (ep->expires && ep->expires <= time(NULL)) {
+      *epp = ep->next;
+      free(ep);
+      idcache.entries--;
+      idcache.stats.expired++;
+      break;
+    }
+    
+    if (ep->found) {
+      if (IDCACHE_BYNAME(op))
+	*idp = ep->id;
+      else if (s_cpy(buf, bufsize, ep->name) < 0)
+	break;
+      idcache.stats.hits++;
+    } else
+      idcache.stats.negative++;
+    
+    rc = ep->found;
+    break;
+  }
+  
+  if (rc < 0)
+    idcache.stats.misses++;
+  pthread_mutex_unlock(&idcache.lock);
+  
+  return rc;
+}
+
+
+/* Failing to cache something is not an error */
+static void
+_idcache_put(int op,
+	     uid_t id,
+	     const char *name,
+	     int found) {
+  IDCACHE_ENTRY *ep;
+  size_t len = strlen(name);
+  unsigned int h;
+
+  
+  ep = malloc(sizeof(*ep) + len + 1);
+  if (!ep)
+    return;
+  
+  ep->op = op;
+  ep->found = found;
+  ep->id = id;
+  memcpy(ep->name, name, len+1);
+
+  h = _idcache_hash(op, id, name);
+  pthread_mutex_lock(&idcache.lock);
+  ep->expires = idcache.ttl ? time(NULL) + idcache.ttl : 0;
+  if (idcache.entries >= idcache.maxentries) {
+    idcache.stats.evictions += idcache.entries;
+    _idcache_clear();
+  }
+  ep->next = idcache.htab[h];
+  idcache.htab[h] = ep;
+  idcache.entries++;
+  pthread_mutex_unlock(&idcache.lock);
+}
+
+
+static int
+_idcache_id_to_name(int is_group,
+		    uid_t id,
+		    char *name,
+		    size_t namesize) {
+  int op = is_group ? IDCACHE_GID2NAME : IDCACHE_UID2NAME;
+  char nbuf[256];
+  int rc;
+
+  
+  rc = _idcache_get(op, id, NULL, NULL, name, namesize);
+  if (rc >= 0)
+    return rc;
+  
+  if (idmap.base)
+    rc = _idmap_id_to_name(is_group, id, nbuf, sizeof(nbuf));
+  else if (is_group)
+    rc = _idcache_nss_gid_to_name(id, nbuf, sizeof(nbuf));
+  else
+    rc = _idcache_nss_uid_to_name(id, nbuf, sizeof(nbuf));
+  if (rc < 0)
+    return -1;
+  
+  _idcache_put(op, id, rc ? nbuf : "", rc);
+  
+  if (rc && s_cpy(name, namesize, nbuf) < 0)
+    return -1;
+  return rc;
+}
+
+
+static int
+_idcache_name_to_id(int is_group,
+		    const char *name,
+		    uid_t *idp) {
+  int op = is_group ? IDCACHE_NAME2GID : IDCACHE_NAME2UID;
+  uid_t id = -1;
+  int rc;
+
+  
+  rc = _idcache_get(op, 0, name, idp, NULL, 0);
+  if (rc >= 0)
+    return rc;
+  
+  if (idmap.base)
+    rc = _idmap_name_to_id(is_group, name, &id);
+  else if (is_group)
+    rc = _idcache_nss_name_to_gid(name, (gid_t *) &id);
+  else
+    rc = _idcache_nss_name_to_uid(name, &id);
+  if (rc < 0)
+    return -1;
+
+  _idcache_put(op, id, name, rc);
+
+  if (rc)
+    *idp = id;
+  return rc;
+}
+
+
+static int
+_idcache_principal_to_id(int is_group,
+			 const char *name,
+			 const char *domain,
+			 uid_t *idp) {
+  const char *cp;
+  char nbuf[256];
+  size_t len;
+  int rc;
+
+  
+  /* A direct lookup first - NSS might know the qualified name */
+  rc = _idcache_name_to_id(is_group, name, idp);
+  if (rc != 0)
+    return rc;
+
+  /* DOMAIN\name */
+  cp = strchr(name, '\\');
+  if (cp)
+    return _idcache_name_to_id(is_group, cp+1, idp);
+  
+  /* name@domain */
+  cp = strchr(name, '@');
+  if (!cp || cp == name || (domain && strcmp(cp+1, domain) != 0))
+    return 0;
+  
+  len = cp-name;
+  if (len >= sizeof(nbuf))
+    return 0;
+  
+  memcpy(nbuf, name, len);
+  nbuf[len] = '\0';
+  return _idcache_name_to_id(is_group, nbuf, idp);
+}
+
+
+int
+idcache_uid_to_name(uid_t uid,
+		    char *name,
+		    size_t namesize) {
+  return _idcache_id_to_name(0, uid, name, namesize);
+}
+
+
+int
+idcache_gid_to_name(gid_t gid,
+		    char *name,
+		    size_t namesize) {
+  return _idcache_id_to_name(1, gid, name, namesize);
+}
+
+
+int
+idcache_name_to_uid(const char *name,
+		    uid_t *uidp) {
+  return _idcache_name_to_id(0, name, uidp);
+}
+
+
+int
+idcache_name_to_gid(const char *name,
+		    gid_t *gidp) {
+  return _idcache_name_to_id(1, name, (uid_t *) gidp);
+}
+
+
+int
+idcache_principal_to_uid(const char *name,
+			 const char *domain,
+			 uid_t *uidp) {
+  return _idcache_principal_to_id(0, name, domain, uidp);
+}
+
+
+int
+idcache_principal_to_gid(const char *name,
+			 const char *domain,
+			 gid_t *gidp) {
+  return _idcache_principal_to_id(1, name, domain, (uid_t *) gidp);
+}
+
+
+/* Only affects entries added from now on */
+void
+idcache_set_ttl(time_t ttl) {
+  pthread_mutex_lock(&idcache.lock);
+  idcache.ttl = ttl;
+  pthread_mutex_unlock(&idcache.lock);
+}
+
+
+void
+idcache_flush(void) {
+  pthread_mutex_lock(&idcache.lock);
+  _idcache_clear();
+  pthread_mutex_unlock(&idcache.lock);
+}
+
+
+void
+idcache_get_stats(IDCACHE_STATS *sp) {
+  pthread_mutex_lock(&idcache.lock);
+  *sp = idcache.stats;
+  pthread_mutex_unlock(&idcache.lock);
+}
+
+
+void
+idcache_print_stats(IDCACHE_STATS *sp,
+		    FILE *fp) {
+  fprintf(fp, "ID cache: %lu lookups, %lu hits (%.1f%%, %lu negative), %lu misses, %lu expired, %lu evictions\n",
+	  sp->lookups,
+	  sp->hits + sp->negative,
+	  sp->lookups ? (100.0 * (sp->hits + sp->negative)) / sp->lookups : 0.0,
+	  sp->negative,
+	  sp->misses,
+	  sp->expired,
+	  sp->evictions);
+}
@@ -0,0 +1,126 @@
+/*
+ * idcache.h - Cached user/group name lookups
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef IDCACHE_H
+#define IDCACHE_H 1
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*
+ * Process-wide cache of the uid/gid <-> name lookups done via NSS.
+ *
+ * Lookups that found nothing are cached too. Entries live forever unless a
+ * TTL (in seconds) is set with idcache_set_ttl(). All functions return 1 if
+ * found, 0 if not and -1 on error, like the gacl_*_to_*_np() ones.
+ */
+
+#define IDCACHE_DEFAULT_ENTRIES 65536
+
+typedef struct idcache_stats {
+  unsigned long lookups;
+  unsigned long hits;
+  unsigned long negative;   /* Hits on cached "not found" entries */
+  unsigned long misses;     /* Had to ask NSS */
+  unsigned long expired;
+  unsigned long evictions;
+} IDCACHE_STATS;
+
+
+extern int
+idcache_uid_to_name(uid_t uid,
+		    char *name,
+		    size_t namesize);
+
+extern int
+idcache_gid_to_name(gid_t gid,
+		    char *name,
+		    size_t namesize);
+
+extern int
+idcache_name_to_uid(const char *name,
+		    uid_t *uidp);
+
+extern int
+idcache_name_to_gid(const char *name,
+		    gid_t *gidp);
+
+/*
+ * Like idcache_name_to_uid/gid() but also accepts the "DOMAIN\name" and
+ * "name@domain" forms. If 'domain' is given only that "@domain" is stripped.
+ */
+extern int
+idcache_principal_to_uid(const char *name,
+			 const char *domain,
+			 uid_t *uidp);
+
+extern int
+idcache_principal_to_gid(const char *name,
+			 const char *domain,
+			 gid_t *gidp);
+
+extern void
+idcache_set_ttl(time_t ttl);
+
+/*
+ * Identity map files: a snapshot of the passwd/group databases that, once
+ * loaded, is used instead of NSS for all lookups.
+ */
+extern int
+idcache_map_write(const char *path,
+		  const char *domain,
+		  unsigned long *nusers,
+		  unsigned long *ngroups);
+
+extern int
+idcache_map_load(const char *path);
+
+extern void
+idcache_map_unload(void);
+
+extern const char *
+idcache_map_domain(void);
+
+extern void
+idcache_flush(void);
+
+extern void
+idcache_get_stats(IDCACHE_STATS *sp);
+
+extern void
+idcache_print_stats(IDCACHE_STATS *sp,
+		    FILE *fp);
+
+#endif
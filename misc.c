@@ -190,7 +190,7 @@ char *
 permset2str(gacl_permset_t psp,
 	    char *buf,
 	    size_t bufsize) {
-  static char sbuf[64];
+  static GACL_THREAD_LOCAL char sbuf[64];
   int i, a;
 
   
@@ -217,7 +217,7 @@ static char *
 permset2str_samba(gacl_permset_t psp,
 		  char *buf,
 		  size_t bufsize) {
-  static char sbuf[64];
+  static GACL_THREAD_LOCAL char sbuf[64];
   int i, a, n;
 
   
@@ -249,7 +249,7 @@ static char *
 permset2str_icacls(gacl_permset_t psp,
 		   char *buf,
 		   size_t bufsize) {
-  static char sbuf[64];
+  static GACL_THREAD_LOCAL char sbuf[64];
   int i, a, n;
 
   
@@ -284,7 +284,7 @@ char *
 flagset2str(gacl_flagset_t fsp,
 	    char *buf,
 	    size_t bufsize) {
-  static char sbuf[64];
+  static GACL_THREAD_LOCAL char sbuf[64];
   int i, a;
 
   
@@ -312,7 +312,7 @@ static char *
 flagset2str_samba(gacl_flagset_t fsp,
 		  char *buf,
 		  size_t bufsize) {
-  static char sbuf[64];
+  static GACL_THREAD_LOCAL char sbuf[64];
   int i, a, n;
 
   
@@ -344,7 +344,7 @@ static char *
 flagset2str_icacls(gacl_flagset_t fsp,
 		   char *buf,
 		   size_t bufsize) {
-  static char sbuf[64];
+  static GACL_THREAD_LOCAL char sbuf[64];
   int i, a;
 
   
@@ -400,16 +400,17 @@ ace2str_samba(gacl_entry_t ae,
 	      char *rbuf,
 	      size_t rsize,
 	      const struct stat *sp) {
-  static char buf[256];
+  static GACL_THREAD_LOCAL char buf[256];
   char *res;
   gacl_tag_t at;
   gacl_permset_t aps;
   gacl_flagset_t afs;
   gacl_entry_type_t aet;
   void *qp = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
-  int rc;
+  char nbuf[256];
+  uid_t uid;
+  gid_t gid;
+  int rc, is_other;
   
 
   if (!rbuf) {
@@ -428,13 +429,12 @@ ace2str_samba(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    pp = getpwuid(*(uid_t *) qp);
-    if (pp) {
-      gp = getgrnam(pp->pw_name);
-      rc = snprintf(res, rsize, "ACL:%s%s:", pp->pw_name, gp ? "(user)" : "");
+    if (gacl_uid_to_name_np(*(uid_t *) qp, nbuf, sizeof(nbuf)) == 1) {
+      is_other = (gacl_name_to_gid_np(nbuf, &gid) == 1);
+      rc = snprintf(res, rsize, "ACL:%s%s:", nbuf, is_other ? "(user)" : "");
     } else {
-      gp = getgrgid(*(gid_t *) qp);
-      rc = snprintf(res, rsize, "ACL:%u%s:", * (uid_t *) qp, gp ? "(user)" : "");
+      is_other = (gacl_gid_to_name_np(*(gid_t *) qp, nbuf, sizeof(nbuf)) == 1);
+      rc = snprintf(res, rsize, "ACL:%u%s:", * (uid_t *) qp, is_other ? "(user)" : "");
     }
     gacl_free(qp);
     break;
@@ -444,32 +444,29 @@ ace2str_samba(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    gp = getgrgid(*(gid_t *) qp);
-    if (gp) { 
-      pp = getpwnam(gp->gr_name);
-      rc = snprintf(res, rsize, "ACL:%s%s:", gp->gr_name, pp ? "(group)" : "");
+    if (gacl_gid_to_name_np(*(gid_t *) qp, nbuf, sizeof(nbuf)) == 1) {
+      is_other = (gacl_name_to_uid_np(nbuf, &uid) == 1);
+      rc = snprintf(res, rsize, "ACL:%s%s:", nbuf, is_other ? "(group)" : "");
     } else {
-      pp = getpwuid(*(uid_t *) qp);
-      rc = snprintf(res, rsize, "ACL:%u%s:", * (gid_t *) qp, pp ? "(group)" : "");
+      is_other = (gacl_uid_to_name_np(*(uid_t *) qp, nbuf, sizeof(nbuf)) == 1);
+      rc = snprintf(res, rsize, "ACL:%u%s:", * (gid_t *) qp, is_other ? "(group)" : "");
     }
     gacl_free(qp);
     break;
     
   case GACL_TAG_TYPE_USER_OBJ:
-    pp = getpwuid(sp->st_uid);
-    if (pp)
-      rc = snprintf(res, rsize, "ACL:%s:", pp->pw_name);
+    if (gacl_uid_to_name_np(sp->st_uid, nbuf, sizeof(nbuf)) == 1)
+      rc = snprintf(res, rsize, "ACL:%s:", nbuf);
     else
       rc = snprintf(res, rsize, "ACL:%u:", sp->st_uid);
     break;
     
   case GACL_TAG_TYPE_GROUP_OBJ:
-    gp = getgrgid(sp->st_gid);
-    if (gp) {
-      if (getpwnam(gp->gr_name))
-	rc = snprintf(res, rsize, "ACL:GROUP=%s:", gp->gr_name);
+    if (gacl_gid_to_name_np(sp->st_gid, nbuf, sizeof(nbuf)) == 1) {
+      if (gacl_name_to_uid_np(nbuf, &uid) == 1)
+	rc = snprintf(res, rsize, "ACL:GROUP=%s:", nbuf);
       else
-	rc = snprintf(res, rsize, "ACL:%s:", gp->gr_name);
+	rc = snprintf(res, rsize, "ACL:%s:", nbuf);
     } else
       rc = snprintf(res, rsize, "ACL:GID=%u:", sp->st_gid);
     break;
@@ -561,7 +558,7 @@ ace2str_icacls(gacl_entry_t ae,
 	      char *rbuf,
 	      size_t rsize,
 	      const struct stat *sp) {
-  static char buf[256];
+  static GACL_THREAD_LOCAL char buf[256];
   char *res;
   gacl_tag_t at;
   gacl_permset_t aps;
@@ -570,8 +567,8 @@ ace2str_icacls(gacl_entry_t ae,
   gacl_entry_type_t aet;
 #endif
   void *qp = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
+  char nbuf[256];
+  uid_t uid;
   int rc;
   
 
@@ -591,9 +588,8 @@ ace2str_icacls(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    pp = getpwuid(*(uid_t *) qp);
-    if (pp)
-      rc = snprintf(res, rsize, "%s:", pp->pw_name);
+    if (gacl_uid_to_name_np(*(uid_t *) qp, nbuf, sizeof(nbuf)) == 1)
+      rc = snprintf(res, rsize, "%s:", nbuf);
     else
       rc = snprintf(res, rsize, "%u:", * (uid_t *) qp);
     gacl_free(qp);
@@ -604,32 +600,29 @@ ace2str_icacls(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    gp = getgrgid(*(gid_t *) qp);
-    if (gp) {
-      if (getpwnam(gp->gr_name))
-	rc = snprintf(res, rsize, "GROUP=%s:", gp->gr_name);
+    if (gacl_gid_to_name_np(*(gid_t *) qp, nbuf, sizeof(nbuf)) == 1) {
+      if (gacl_name_to_uid_np(nbuf, &uid) == 1)
+	rc = snprintf(res, rsize, "GROUP=%s:", nbuf);
       else
-	rc = snprintf(res, rsize, "%s:", gp->gr_name);
+	rc = snprintf(res, rsize, "%s:", nbuf);
     } else
       rc = snprintf(res, rsize, "GID=%u:", * (gid_t *) qp);
     gacl_free(qp);
     break;
     
   case GACL_TAG_TYPE_USER_OBJ:
-    pp = getpwuid(sp->st_uid);
-    if (pp)
-      rc = snprintf(res, rsize, "%s:", pp->pw_name);
+    if (gacl_uid_to_name_np(sp->st_uid, nbuf, sizeof(nbuf)) == 1)
+      rc = snprintf(res, rsize, "%s:", nbuf);
     else
       rc = snprintf(res, rsize, "%u:", sp->st_uid);
     break;
     
   case GACL_TAG_TYPE_GROUP_OBJ:
-    gp = getgrgid(sp->st_gid);
-    if (gp) {
-      if (getpwnam(gp->gr_name))
-	rc = snprintf(res, rsize, "GROUP=%s:", gp->gr_name);
+    if (gacl_gid_to_name_np(sp->st_gid, nbuf, sizeof(nbuf)) == 1) {
+      if (gacl_name_to_uid_np(nbuf, &uid) == 1)
+	rc = snprintf(res, rsize, "GROUP=%s:", nbuf);
       else
-	rc = snprintf(res, rsize, "%s:", gp->gr_name);
+	rc = snprintf(res, rsize, "%s:", nbuf);
     } else
       rc = snprintf(res, rsize, "GID=%u:", sp->st_gid);
     break;
@@ -709,15 +702,14 @@ char *
 ace2str(gacl_entry_t ae,
 	char *rbuf,
 	size_t rsize) {
-  static char buf[256];
+  static GACL_THREAD_LOCAL char buf[256];
   char *res;
   gacl_tag_t at;
   gacl_permset_t aps;
   gacl_flagset_t afs;
   gacl_entry_type_t aet;
   void *qp = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
+  char nbuf[256];
   int rc;
   
 
@@ -737,9 +729,8 @@ ace2str(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    pp = getpwuid(*(uid_t *) qp);
-    if (pp)
-      rc = snprintf(res, rsize, "u:%s", pp->pw_name);
+    if (gacl_uid_to_name_np(*(uid_t *) qp, nbuf, sizeof(nbuf)) == 1)
+      rc = snprintf(res, rsize, "u:%s", nbuf);
     else
       rc = snprintf(res, rsize, "u:%u", * (uid_t *) qp);
     gacl_free(qp);
@@ -750,9 +741,8 @@ ace2str(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    gp = getgrgid(*(gid_t *) qp);
-    if (gp)
-      rc = snprintf(res, rsize, "g:%s", gp->gr_name);
+    if (gacl_gid_to_name_np(*(gid_t *) qp, nbuf, sizeof(nbuf)) == 1)
+      rc = snprintf(res, rsize, "g:%s", nbuf);
     else
       rc = snprintf(res, rsize, "g:%u", * (gid_t *) qp);
     gacl_free(qp);
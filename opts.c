@@ -159,7 +159,7 @@ opts_parse_argv(int argc,
   va_list ap;
 
 
-  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+  for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
     if (argv[i][1] == '-') {
       /* Long option (--xploit) */
       if (!argv[i][2]) {
@@ -205,11 +205,6 @@ opts_parse_argv(int argc,
     } else {
       /* Short option (-x) */
 
-      if (!argv[i][1]) {
-	++i;
-	goto EndArg;
-      }
-      
       for (j = 1; argv[i][j]; j++) {
 	op = NULL;
 	nm = 0;
@@ -0,0 +1,762 @@
+/*
+ * outbuf.c - Buffered (optionally asynchronous) output
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include "outbuf.h"
+
+
+#define OUTBUF_MAX_STREAMS 8
+
+static OUTBUF *outbufs[OUTBUF_MAX_STREAMS];
+static int outbuf_atexit = 0;
+
+
+static int
+_outbuf_write(int fd,
+	      const char *buf,
+	      size_t len) {
+  ssize_t n;
+
+  
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  
+  return 0;
+}
+
+
+/* How far the compressor should push its output */
+#define OUTBUF_ZF_NONE   0
+#define OUTBUF_ZF_FLUSH  1
+#define OUTBUF_ZF_END    2
+
+static int
+_outbuf_zwrite(OUTBUF *ob,
+	       const char *buf,
+	       size_t len,
+	       int how) {
+  switch (ob->zmethod) {
+  case OUTBUF_Z_NONE:
+    return _outbuf_write(ob->ofd, buf, len);
+
+#ifdef HAVE_LIBZ
+  case OUTBUF_Z_GZIP: {
+    z_stream *zp = (z_stream *) ob->zs;
+    int rc;
+
+    zp->next_in = (Bytef *) buf;
+    zp->avail_in = len;
+    do {
+      zp->next_out = (Bytef *) ob->zbuf;
+      zp->avail_out = ob->zsize;
+      rc = deflate(zp, how == OUTBUF_ZF_END ? Z_FINISH : how == OUTBUF_ZF_FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+      if (rc == Z_STREAM_ERROR) {
+	errno = EIO;
+	return -1;
+      }
+      if (_outbuf_write(ob->ofd, ob->zbuf, ob->zsize - zp->avail_out) < 0)
+	return -1;
+    } while (zp->avail_out == 0);
+    return 0;
+  }
+#endif
+    
+#ifdef HAVE_LIBZSTD
+  case OUTBUF_Z_ZSTD: {
+    ZSTD_inBuffer in = { buf, len, 0 };
+    ZSTD_outBuffer out;
+    size_t rem;
+
+    for (;;) {
+      out.dst = ob->zbuf;
+      out.size = ob->zsize;
+      out.pos = 0;
+      rem = ZSTD_compressStream2((ZSTD_CCtx *) ob->zs, &out, &in,
+				 how == OUTBUF_ZF_END ? ZSTD_e_end : how == OUTBUF_ZF_FLUSH ? ZSTD_e_flush : ZSTD_e_continue);
+      if (ZSTD_isError(rem)) {
+	errno = EIO;
+	return -1;
+      }
+      if (_outbuf_write(ob->ofd, ob->zbuf, out.pos) < 0)
+	return -1;
+      if (how == OUTBUF_ZF_NONE ? in.pos == in.size : rem == 0)
+	return 0;
+    }
+  }
+#endif
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+
+/* Write out data from the buffer. 'f_record' if it ends at a record boundary */
+static int
+_outbuf_emit(OUTBUF *ob,
+	     const char *buf,
+	     size_t len,
+	     int f_record) {
+  int how = OUTBUF_ZF_NONE;
+  
+  
+  if (!ob->f_output)
+    return _outbuf_write(fileno(ob->fp), buf, len);
+
+  ob->zpending += len;
+  if (f_record && ob->zpending >= OUTBUF_SIZE/2) {
+    how = OUTBUF_ZF_FLUSH;
+    ob->zpending = 0;
+  }
+  
+  return _outbuf_zwrite(ob, buf, len, how);
+}
+
+
+static void *
+_outbuf_writer(void *vp) {
+  OUTBUF *ob = (OUTBUF *) vp;
+  int rc;
+
+  
+  pthread_mutex_lock(&ob->mtx);
+  for (;;) {
+    while (!ob->f_busy && !ob->f_stop)
+      pthread_cond_wait(&ob->cv, &ob->mtx);
+    if (!ob->f_busy)
+      break;
+    
+    pthread_mutex_unlock(&ob->mtx);
+    rc = _outbuf_emit(ob, ob->wbuf, ob->wlen, ob->w_record);
+    pthread_mutex_lock(&ob->mtx);
+    
+    if (rc < 0 && !ob->w_errno)
+      ob->w_errno = errno;
+    ob->wlen = 0;
+    ob->f_busy = 0;
+    pthread_cond_broadcast(&ob->cv);
+  }
+  pthread_mutex_unlock(&ob->mtx);
+  
+  return NULL;
+}
+
+
+/* Wait for the writer thread to finish the buffer it has */
+static int
+_outbuf_wait(OUTBUF *ob) {
+  int ec;
+
+  
+  pthread_mutex_lock(&ob->mtx);
+  while (ob->f_busy)
+    pthread_cond_wait(&ob->cv, &ob->mtx);
+  ec = ob->w_errno;
+  ob->w_errno = 0;
+  pthread_mutex_unlock(&ob->mtx);
+
+  if (ec) {
+    errno = ec;
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Get rid of the buffered data - without waiting for the writer thread */
+static int
+_outbuf_spill(OUTBUF *ob,
+	      int f_record) {
+  char *tbuf;
+  size_t tsize;
+  int rc = 0;
+
+  
+  if (ob->len == 0)
+    return 0;
+  
+  switch (ob->mode) {
+  case OUTBUF_SYNC:
+    if (ob->f_output)
+      rc = _outbuf_emit(ob, ob->buf, ob->len, f_record);
+    else if (fwrite(ob->buf, 1, ob->len, ob->fp) != ob->len)
+      rc = -1;
+    break;
+
+  case OUTBUF_BATCH:
+    rc = _outbuf_emit(ob, ob->buf, ob->len, f_record);
+    break;
+
+  case OUTBUF_ASYNC:
+    /* Swap buffers with the writer */
+    rc = _outbuf_wait(ob);
+    if (rc < 0)
+      break;
+    
+    pthread_mutex_lock(&ob->mtx);
+    tbuf = ob->wbuf;
+    tsize = ob->wsize;
+    ob->wbuf = ob->buf;
+    ob->wsize = ob->size;
+    ob->wlen = ob->len;
+    ob->w_record = f_record;
+    ob->buf = tbuf;
+    ob->size = tsize;
+    ob->f_busy = 1;
+    pthread_cond_signal(&ob->cv);
+    pthread_mutex_unlock(&ob->mtx);
+    break;
+  }
+
+  ob->len = 0;
+  return rc;
+}
+
+
+/* Everything buffered has been passed to the stream (or written) */
+int
+outbuf_flush(OUTBUF *ob) {
+  if (_outbuf_spill(ob, 1) < 0)
+    return -1;
+
+  if (ob->mode == OUTBUF_ASYNC)
+    return _outbuf_wait(ob);
+  
+  return 0;
+}
+
+
+void
+outbuf_flush_all(void) {
+  int i;
+
+  
+  for (i = 0; i < OUTBUF_MAX_STREAMS; i++)
+    if (outbufs[i]) {
+      (void) outbuf_mode(outbufs[i]->fp, OUTBUF_SYNC);
+      if (outbufs[i]->f_output)
+	(void) outbuf_output(outbufs[i]->fp, NULL);
+      fflush(outbufs[i]->fp);
+    }
+}
+
+
+/* The output buffer for 'fp', allocated on first use */
+OUTBUF *
+outbuf_open(FILE *fp) {
+  OUTBUF *ob;
+  int i, fi = -1;
+
+  
+  for (i = 0; i < OUTBUF_MAX_STREAMS; i++) {
+    if (outbufs[i] && outbufs[i]->fp == fp)
+      return outbufs[i];
+    if (!outbufs[i] && fi < 0)
+      fi = i;
+  }
+
+  if (fi < 0) {
+    errno = EMFILE;
+    return NULL;
+  }
+  
+  ob = calloc(1, sizeof(*ob));
+  if (!ob)
+    return NULL;
+
+  ob->buf = malloc(OUTBUF_SIZE);
+  if (!ob->buf) {
+    free(ob);
+    return NULL;
+  }
+  
+  ob->fp = fp;
+  ob->mode = OUTBUF_SYNC;
+  ob->size = OUTBUF_SIZE;
+  pthread_mutex_init(&ob->mtx, NULL);
+  pthread_cond_init(&ob->cv, NULL);
+
+  /* Whatever is still buffered must not get lost on exit() */
+  if (!outbuf_atexit++)
+    atexit(outbuf_flush_all);
+  
+  outbufs[fi] = ob;
+  return ob;
+}
+
+
+int
+outbuf_mode(FILE *fp,
+	    int mode) {
+  OUTBUF *ob;
+  int rc;
+
+  
+  ob = outbuf_open(fp);
+  if (!ob)
+    return -1;
+
+  if (mode == OUTBUF_BATCH && ob->f_output && ob->zmethod != OUTBUF_Z_NONE)
+    mode = OUTBUF_ASYNC;
+  
+  if (ob->mode == mode)
+    return 0;
+  
+  rc = outbuf_flush(ob);
+  
+  if (ob->mode == OUTBUF_ASYNC) {
+    pthread_mutex_lock(&ob->mtx);
+    ob->f_stop = 1;
+    pthread_cond_signal(&ob->cv);
+    pthread_mutex_unlock(&ob->mtx);
+    pthread_join(ob->writer, NULL);
+    ob->f_stop = 0;
+  }
+  
+  /* Buffered stdio data must go first when bypassing stdio */
+  if (mode != OUTBUF_SYNC)
+    fflush(fp);
+  
+  ob->mode = mode;
+  if (mode == OUTBUF_ASYNC) {
+    if (!ob->wbuf) {
+      ob->wbuf = malloc(OUTBUF_SIZE);
+      ob->wsize = OUTBUF_SIZE;
+    }
+    
+    /* Fall back to writing ourself */
+    if (!ob->wbuf || pthread_create(&ob->writer, NULL, _outbuf_writer, ob) != 0)
+      ob->mode = OUTBUF_BATCH;
+  }
+
+  return rc;
+}
+
+
+static int
+_outbuf_output_close(OUTBUF *ob) {
+  int rc = 0;
+
+  
+  if (ob->zmethod != OUTBUF_Z_NONE && ob->ofd >= 0)
+    rc = _outbuf_zwrite(ob, "", 0, OUTBUF_ZF_END);
+  
+  switch (ob->zmethod) {
+#ifdef HAVE_LIBZ
+  case OUTBUF_Z_GZIP:
+    deflateEnd((z_stream *) ob->zs);
+    free(ob->zs);
+    break;
+#endif
+#ifdef HAVE_LIBZSTD
+  case OUTBUF_Z_ZSTD:
+    ZSTD_freeCCtx((ZSTD_CCtx *) ob->zs);
+    break;
+#endif
+  }
+  
+  if (ob->ofd >= 0 && close(ob->ofd) < 0)
+    rc = -1;
+
+  free(ob->zbuf);
+  ob->zbuf = NULL;
+  ob->zs = NULL;
+  ob->f_output = 0;
+  return rc;
+}
+
+
+static int
+_outbuf_output_open(OUTBUF *ob,
+		    const char *path) {
+  const char *ext = strrchr(path, '.');
+  int method = OUTBUF_Z_NONE;
+  void *zs = NULL;
+  int fd;
+  
+
+  if (ext && strcmp(ext, ".gz") == 0)
+    method = OUTBUF_Z_GZIP;
+  else if (ext && strcmp(ext, ".zst") == 0)
+    method = OUTBUF_Z_ZSTD;
+
+  switch (method) {
+  case OUTBUF_Z_NONE:
+    break;
+    
+#ifdef HAVE_LIBZ
+  case OUTBUF_Z_GZIP:
+    zs = calloc(1, sizeof(z_stream));
+    if (!zs)
+      return -1;
+    /* 15+16 = 32K window, gzip header */
+    if (deflateInit2((z_stream *) zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      free(zs);
+      errno = ENOMEM;
+      return -1;
+    }
+    break;
+#endif
+    
+#ifdef HAVE_LIBZSTD
+  case OUTBUF_Z_ZSTD:
+    zs = ZSTD_createCCtx();
+    if (!zs) {
+      errno = ENOMEM;
+      return -1;
+    }
+    break;
+#endif
+
+  default:
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  ob->zmethod = method;
+  ob->zs = zs;
+  ob->zsize = OUTBUF_SIZE;
+  ob->zbuf = malloc(ob->zsize);
+  ob->zpending = 0;
+  ob->ofd = -1;
+  ob->f_output = 1;
+  
+  fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (!ob->zbuf || fd < 0) {
+    int s_errno = errno;
+
+    if (fd >= 0)
+      close(fd);
+    (void) _outbuf_output_close(ob);
+    errno = s_errno;
+    return -1;
+  }
+
+  ob->ofd = fd;
+  return 0;
+}
+
+
+/*
+ * Send the output for 'fp' to the file 'path' from now on - or, with a
+ * NULL 'path', finish and close the current output file.
+ */
+int
+outbuf_output(FILE *fp,
+	      const char *path) {
+  OUTBUF *ob;
+  int rc;
+
+  
+  ob = outbuf_open(fp);
+  if (!ob)
+    return -1;
+
+  rc = outbuf_mode(fp, OUTBUF_SYNC);
+  if (ob->f_output && _outbuf_output_close(ob) < 0)
+    rc = -1;
+
+  if (path && _outbuf_output_open(ob, path) < 0)
+    rc = -1;
+
+  return rc;
+}
+
+
+/* Make room for 'n' more bytes */
+int
+outbuf_reserve(OUTBUF *ob,
+	       size_t n) {
+  size_t nsize;
+  char *nbuf;
+
+  
+  if (ob->len + n <= ob->size)
+    return 0;
+  
+  if (_outbuf_spill(ob, 0) < 0)
+    return -1;
+
+  if (n <= ob->size)
+    return 0;
+
+  for (nsize = ob->size; nsize < n; nsize *= 2)
+    ;
+  nbuf = realloc(ob->buf, nsize);
+  if (!nbuf)
+    return -1;
+  
+  ob->buf = nbuf;
+  ob->size = nsize;
+  return 0;
+}
+
+
+int
+outbuf_put(OUTBUF *ob,
+	   const char *s,
+	   size_t n) {
+  if (outbuf_reserve(ob, n) < 0)
+    return -1;
+  
+  memcpy(ob->buf + ob->len, s, n);
+  ob->len += n;
+  return 0;
+}
+
+
+int
+outbuf_puts(OUTBUF *ob,
+	    const char *s) {
+  return outbuf_put(ob, s, strlen(s));
+}
+
+
+int
+outbuf_putc(OUTBUF *ob,
+	    int c) {
+  if (ob->len >= ob->size && outbuf_reserve(ob, 1) < 0)
+    return -1;
+
+  ob->buf[ob->len++] = c;
+  return 0;
+}
+
+
+int
+outbuf_pad(OUTBUF *ob,
+	   int c,
+	   size_t n) {
+  if (outbuf_reserve(ob, n) < 0)
+    return -1;
+  
+  memset(ob->buf + ob->len, c, n);
+  ob->len += n;
+  return 0;
+}
+
+
+int
+outbuf_printf(OUTBUF *ob,
+	      const char *fmt,
+	      ...) {
+  va_list ap;
+  int n;
+
+  
+  va_start(ap, fmt);
+  n = vsnprintf(ob->buf + ob->len, ob->size - ob->len, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return -1;
+
+  if (ob->len + n >= ob->size) {
+    /* Didn't fit (vsnprintf wants room for a NUL too) */
+    if (outbuf_reserve(ob, n+1) < 0)
+      return -1;
+    
+    va_start(ap, fmt);
+    n = vsnprintf(ob->buf + ob->len, ob->size - ob->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return -1;
+  }
+
+  ob->len += n;
+  return n;
+}
+
+
+int
+outbuf_putu(OUTBUF *ob,
+	    unsigned long long v) {
+  char tmp[24];
+  int n = sizeof(tmp);
+
+  
+  do {
+    tmp[--n] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+
+  return outbuf_put(ob, tmp+n, sizeof(tmp)-n);
+}
+
+
+/* Length of the valid UTF-8 sequence at 's', 0 if invalid */
+static int
+_outbuf_utf8_len(const unsigned char *s) {
+  unsigned char c = s[0];
+  
+  if (c >= 0xC2 && c <= 0xDF)
+    return (s[1] & 0xC0) == 0x80 ? 2 : 0;
+  
+  if (c >= 0xE0 && c <= 0xEF) {
+    if ((c == 0xE0 && s[1] < 0xA0) ||   /* Overlong */
+	(c == 0xED && s[1] > 0x9F))     /* Surrogates */
+      return 0;
+    return ((s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80) ? 3 : 0;
+  }
+  
+  if (c >= 0xF0 && c <= 0xF4) {
+    if ((c == 0xF0 && s[1] < 0x90) ||
+	(c == 0xF4 && s[1] > 0x8F))
+      return 0;
+    return ((s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80 && (s[3] & 0xC0) == 0x80) ? 4 : 0;
+  }
+  
+  return 0;
+}
+
+
+/*
+ * Append 's' as a quoted JSON string. Filenames needn't be valid UTF-8 -
+ * bytes that aren't part of a valid sequence are written as lone
+ * surrogates \udc80-\udcff ("surrogateescape"), so they survive a round
+ * trip through for example Python.
+ */
+int
+outbuf_json_string(OUTBUF *ob,
+		   const char *s) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *cp = (const unsigned char *) s;
+  const unsigned char *run;
+  char esc[8];
+  int n;
+
+  
+  if (outbuf_putc(ob, '"') < 0)
+    return -1;
+
+  while (*cp) {
+    /* Copy runs of plain characters in one go */
+    for (run = cp; *cp >= 0x20 && *cp < 0x80 && *cp != '"' && *cp != '\\'; cp++)
+      ;
+    if (cp > run && outbuf_put(ob, (const char *) run, cp-run) < 0)
+      return -1;
+    if (!*cp)
+      break;
+
+    if (*cp >= 0x80) {
+      n = _outbuf_utf8_len(cp);
+      if (n > 0) {
+	if (outbuf_put(ob, (const char *) cp, n) < 0)
+	  return -1;
+	cp += n;
+	continue;
+      }
+      memcpy(esc, "\\udc", 4);
+    } else {
+      esc[0] = '\\';
+      switch (*cp) {
+      case '"':
+      case '\\':
+	esc[1] = *cp;
+	n = 2;
+	break;
+      case '\b':
+	esc[1] = 'b';
+	n = 2;
+	break;
+      case '\f':
+	esc[1] = 'f';
+	n = 2;
+	break;
+      case '\n':
+	esc[1] = 'n';
+	n = 2;
+	break;
+      case '\r':
+	esc[1] = 'r';
+	n = 2;
+	break;
+      case '\t':
+	esc[1] = 't';
+	n = 2;
+	break;
+      default:
+	memcpy(esc, "\\u00", 4);
+	n = 0;
+      }
+    }
+    
+    if (n == 0) {
+      esc[4] = hex[*cp >> 4];
+      esc[5] = hex[*cp & 15];
+      n = 6;
+    }
+    if (outbuf_put(ob, esc, n) < 0)
+      return -1;
+    cp++;
+  }
+
+  return outbuf_putc(ob, '"');
+}
+
+
+/*
+ * A record (for example one object's ACL) is complete. Passes it on at once
+ * in OUTBUF_SYNC mode, else once the buffer is getting full.
+ */
+int
+outbuf_release(OUTBUF *ob) {
+  if (ob->mode == OUTBUF_SYNC || ob->len >= ob->size/2)
+    return _outbuf_spill(ob, 1);
+  
+  return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * outbuf.h - Buffered (optionally asynchronous) output
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OUTBUF_H
+#define OUTBUF_H 1
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Output is formatted into a large per-stream buffer that is reused for
+ * the whole run, instead of many small stdio calls per object.
+ *
+ * OUTBUF_SYNC   - each record (see outbuf_release()) is handed to stdio as
+ *                 one write, so it interleaves correctly with other output
+ * OUTBUF_BATCH  - records are collected until the buffer is full
+ * OUTBUF_ASYNC  - like OUTBUF_BATCH, but full buffers are written by a
+ *                 writer thread while the next one is filled
+ *
+ * Nothing else may write to the stream while batching, until outbuf_mode()
+ * has switched it back to OUTBUF_SYNC.
+ *
+ * With outbuf_output() the data goes to a file instead, compressed if the
+ * name ends with .gz (zlib) or .zst (zstd). The compressor is flushed at a
+ * record boundary about every half buffer, so an interrupted file can still
+ * be read up to a recent complete line. OUTBUF_BATCH is then run as
+ * OUTBUF_ASYNC, so compression is done by the writer thread.
+ */
+#define OUTBUF_SYNC  0
+#define OUTBUF_BATCH 1
+#define OUTBUF_ASYNC 2
+
+#define OUTBUF_Z_NONE 0
+#define OUTBUF_Z_GZIP 1
+#define OUTBUF_Z_ZSTD 2
+
+#define OUTBUF_SIZE  (256*1024)
+
+typedef struct outbuf {
+  FILE *fp;
+  int mode;
+  
+  char *buf;             /* Being filled */
+  size_t len;
+  size_t size;
+
+  /* Writer thread (OUTBUF_ASYNC) */
+  pthread_t writer;
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  char *wbuf;            /* Being written */
+  size_t wlen;
+  size_t wsize;
+  int w_record;          /* wbuf ends at a record boundary */
+  int f_busy;
+  int f_stop;
+  int w_errno;
+
+  /* Output file (outbuf_output()) */
+  int f_output;
+  int ofd;
+  int zmethod;
+  void *zs;              /* Compressor state */
+  char *zbuf;
+  size_t zsize;
+  size_t zpending;       /* Bytes compressed since the last flush */
+} OUTBUF;
+
+
+extern OUTBUF *
+outbuf_open(FILE *fp);
+
+extern int
+outbuf_mode(FILE *fp,
+	    int mode);
+
+extern int
+outbuf_output(FILE *fp,
+	      const char *path);
+
+extern int
+outbuf_reserve(OUTBUF *ob,
+	       size_t n);
+
+extern int
+outbuf_put(OUTBUF *ob,
+	   const char *s,
+	   size_t n);
+
+extern int
+outbuf_puts(OUTBUF *ob,
+	    const char *s);
+
+extern int
+outbuf_putc(OUTBUF *ob,
+	    int c);
+
+extern int
+outbuf_pad(OUTBUF *ob,
+	   int c,
+	   size_t n);
+
+extern int
+outbuf_printf(OUTBUF *ob,
+	      const char *fmt,
+	      ...);
+
+extern int
+outbuf_putu(OUTBUF *ob,
+	    unsigned long long v);
+
+extern int
+outbuf_json_string(OUTBUF *ob,
+		   const char *s);
+
+extern int
+outbuf_release(OUTBUF *ob);
+
+extern int
+outbuf_flush(OUTBUF *ob);
+
+extern void
+outbuf_flush_all(void);
+
+#endif
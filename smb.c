@@ -45,6 +45,7 @@
 #include "vfs.h"
 #include "smb.h"
 #include "strings.h"
+#include "idcache.h"
 
 #if HAVE_LIBSMBCLIENT
 #include <libsmbclient.h>
@@ -127,20 +128,18 @@ _smb_init(void) {
 static int
 _smb_name_to_uid(const char *name,
 		 uid_t *uidp) {
-  struct passwd *pp;
+  int found;
   const char *dp;
 
 
-  pp = getpwnam(name);
-  if (!pp) {
+  /* XXX: Verify that WORKGROUP is "our" */
+  found = (idcache_principal_to_uid(name, NULL, uidp) == 1);
+  if (!found) {
     dp = strchr(name, '\\');
-    if (dp) {
-      /* XXX: Verify that WORKGROUP is "our" */
+    if (dp)
       name = dp+1;
-      pp = getpwnam(name);
-    }
 
-    if (!pp) {
+    if (!found) {
       char *cp, *nbuf;
       int fixflag = 0;
       
@@ -155,15 +154,15 @@ _smb_name_to_uid(const char *name,
 	}
       
       if (fixflag)
-	pp = getpwnam(nbuf);
+	found = (idcache_name_to_uid(nbuf, uidp) == 1);
       
-      if (!pp) {
+      if (!found) {
 	for (cp = nbuf; *cp; cp++)
 	  if (isupper(*cp))
 	    *cp = tolower(*cp);
 	
-	pp = getpwnam(nbuf);
-	if (!pp) {
+	found = (idcache_name_to_uid(nbuf, uidp) == 1);
+	if (!found) {
 	  free(nbuf);
 	  return -1;
 	}
@@ -171,7 +170,6 @@ _smb_name_to_uid(const char *name,
     }
   }
   
-  *uidp = pp->pw_uid;
   return 0;
 }
 
@@ -179,19 +177,17 @@ _smb_name_to_uid(const char *name,
 static int
 _smb_name_to_gid(const char *name,
 		 gid_t *gidp) {
-  struct group *gp;
+  int found;
   const char *dp;
 
   
-  gp = getgrnam(name);
-  if (!gp) {
+  /* XXX: Verify that WORKGROUP is "our" */
+  found = (idcache_principal_to_gid(name, NULL, gidp) == 1);
+  if (!found) {
     dp = strchr(name, '\\');
-    if (dp) {
-      /* XXX: Verify that WORKGROUP is "our" */
+    if (dp)
       name = dp+1;
-      gp = getgrnam(name);
-    }
-    if (!gp) {
+    if (!found) {
       char *cp, *nbuf;
       int fixflag = 0;
       
@@ -206,15 +202,15 @@ _smb_name_to_gid(const char *name,
 	}
 
       if (fixflag)
-	gp = getgrnam(nbuf);
+	found = (idcache_name_to_gid(nbuf, gidp) == 1);
       
-      if (!gp) {
+      if (!found) {
 	for (cp = nbuf; *cp; cp++)
 	  if (isupper(*cp))
 	    *cp = tolower(*cp);
 	
-	gp = getgrnam(nbuf);
-	if (!gp) {
+	found = (idcache_name_to_gid(nbuf, gidp) == 1);
+	if (!found) {
 	  free(nbuf);
 	  return -1;
 	}
@@ -222,7 +218,6 @@ _smb_name_to_gid(const char *name,
     }
   }
 
-  *gidp = gp->gr_gid;
   return 0;
 }
 
@@ -507,9 +502,45 @@ static struct flagtab {
 
 #define SMB_TAG_TYPE_EVERYONE_TEXT "\\Everyone"
 
+#define SMB_SECATTR_MINSIZE 32768
+#define SMB_SECATTR_MAXSIZE (64*1024*1024)
+
+/* Get the security descriptor text, growing the buffer until it fits */
+static char *
+_smb_get_secattr(const char *path) {
+  char *buf = NULL, *nbuf;
+  size_t bufsize = SMB_SECATTR_MINSIZE;
+
+
+  for (;;) {
+    nbuf = realloc(buf, bufsize);
+    if (!nbuf)
+      goto Fail;
+    buf = nbuf;
+    
+    if (smb_getxattr(path, SECATTR, buf, bufsize) < 0) {
+      if (errno != ERANGE)
+	goto Fail;
+    } else if (memchr(buf, '\0', bufsize))
+      return buf;
+
+    /* Too small (or filled without a terminating NUL) */
+    if (bufsize >= SMB_SECATTR_MAXSIZE) {
+      errno = E2BIG;
+      goto Fail;
+    }
+    bufsize *= 2;
+  }
+
+ Fail:
+  free(buf);
+  return NULL;
+}
+
+
 GACL *
 smb_acl_get_file(const char *path) {
-  char buf[32768], *bp, *cp;
+  char *buf, *bp, *cp;
   GACL *ap;
   int n_ace;
   int i, n;
@@ -518,7 +549,8 @@ smb_acl_get_file(const char *path) {
   char *s_group;
 
   
-  if (smb_getxattr(path, SECATTR, buf, sizeof(buf)) < 0)
+  buf = _smb_get_secattr(path);
+  if (!buf)
     return NULL;
 #if 0
   fprintf(stderr, "getxattr(\"%s\", \"%s\") -> '%s'\n",
@@ -530,8 +562,10 @@ smb_acl_get_file(const char *path) {
       ++n_ace;
   
   ap = gacl_init(n_ace);
-  if (!ap)
+  if (!ap) {
+    free(buf);
     return NULL;
+  }
 		 
   bp = buf;
 
@@ -661,9 +695,11 @@ smb_acl_get_file(const char *path) {
     gacl_set_permset(ep, &ps);
   }
 
+  free(buf);
   return ap;
   
  Fail:
+  free(buf);
   gacl_free(ap);
   errno = EINVAL;
   return NULL;
@@ -821,7 +857,7 @@ smb_acl_set_file(const char *path,
 #endif
   
   for (i = 0; i < ap->ac; i++) {
-    char ebuf[256];
+    char ebuf[512];
     if (smb_gacl_entry_to_text(&ap->av[i], ebuf, sizeof(ebuf), ap->owner, ap->group) < 0)
       goto Fail;
 
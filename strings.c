@@ -243,7 +243,7 @@ slist_add(SLIST *sp,
 	  char *s) {
 
   if (sp->c >= sp->s) {
-    char **nv = realloc(sp->v, sizeof(char *) * sp->s + 256);
+    char **nv = realloc(sp->v, sizeof(char *) * (sp->s + 256));
     if (!nv)
       return -1;
 
@@ -272,7 +272,7 @@ slist_join(SLIST *sp,
 	   const char *delim) {
   size_t dlen, tlen;
   int i;
-  char *buf;
+  char *buf, *bp;
   
 
   if (sp->c == 0)
@@ -289,12 +289,19 @@ slist_join(SLIST *sp,
   if (!buf)
     return NULL;
 
-  s_cpy(buf, tlen, sp->v[0]);
-  for (i = 1; i < sp->c; i++) {
-    if (delim)
-      s_cat(buf, tlen, delim);
-    s_cat(buf, tlen, sp->v[i]);
+  /* Append at the end instead of s_cat() - keeps long lists linear */
+  bp = buf;
+  for (i = 0; i < sp->c; i++) {
+    size_t len = strlen(sp->v[i]);
+    
+    if (i > 0 && dlen > 0) {
+      memcpy(bp, delim, dlen);
+      bp += dlen;
+    }
+    memcpy(bp, sp->v[i], len);
+    bp += len;
   }
+  *bp = '\0';
 
   return buf;
 }
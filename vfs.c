@@ -244,6 +244,39 @@ vfs_lstat(const char *path,
 }
 
 
+/*
+ * Like vfs_lstat() but follows symbolic links. SMB has no client-side
+ * links so smb_lstat() (smbc_stat) already does the right thing there.
+ */
+int
+vfs_stat(const char *path,
+	 struct stat *sp) {
+#if HAVE_LIBSMBCLIENT
+  char buf[2048];
+#endif
+
+  memset(sp, 0, sizeof(*sp));
+  switch (vfs_get_type(path)) {
+#if HAVE_LIBSMBCLIENT
+  case VFS_TYPE_SMB:
+    if (!vfs_fullpath(path, buf, sizeof(buf)))
+      return -1;
+    
+    return smb_lstat(buf, sp);
+#endif
+    
+  case VFS_TYPE_SYS:
+    if (!path || !*path)
+      path = ".";
+    return stat(path, sp);
+
+  default:
+    errno = ENOSYS;
+    return -1;
+  }
+}
+
+
 int
 vfs_statvfs(const char *path,
 	    struct statvfs *sp) {
@@ -752,3 +785,40 @@ vfs_acl_set_file(const char *path,
 }
 
 
+/* Raw ACL blobs - only supported for local files (not SMB) */
+ssize_t
+vfs_acl_get_raw(const char *path,
+		GACL_TYPE type,
+		void *buf,
+		size_t bufsize,
+		int flags) {
+  switch (vfs_get_type(path)) {
+  case VFS_TYPE_SYS:
+    if (flags & VFS_ACL_FLAG_NOFOLLOW)
+      return gacl_get_raw_link_np(path, type, buf, bufsize);
+    return gacl_get_raw_file_np(path, type, buf, bufsize);
+
+  default:
+    errno = ENOSYS;
+    return -1;
+  }
+}
+
+
+int
+vfs_acl_set_raw(const char *path,
+		GACL_TYPE type,
+		const void *buf,
+		size_t bufsize,
+		int flags) {
+  switch (vfs_get_type(path)) {
+  case VFS_TYPE_SYS:
+    if (flags & VFS_ACL_FLAG_NOFOLLOW)
+      return gacl_set_raw_link_np(path, type, buf, bufsize);
+    return gacl_set_raw_file_np(path, type, buf, bufsize);
+
+  default:
+    errno = ENOSYS;
+    return -1;
+  }
+}
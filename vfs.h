@@ -71,6 +71,10 @@ extern int
 vfs_lstat(const char *path,
 	  struct stat *sp);
 
+extern int
+vfs_stat(const char *path,
+	 struct stat *sp);
+
 extern int
 vfs_statvfs(const char *path,
 	    struct statvfs *sp);
@@ -97,6 +101,22 @@ vfs_acl_set_file(const char *path,
 		 GACL_TYPE type,
 		 GACL *ap);
 
+#define VFS_ACL_FLAG_NOFOLLOW      0x0001
+
+extern ssize_t
+vfs_acl_get_raw(const char *path,
+		GACL_TYPE type,
+		void *buf,
+		size_t bufsize,
+		int flags);
+
+extern int
+vfs_acl_set_raw(const char *path,
+		GACL_TYPE type,
+		const void *buf,
+		size_t bufsize,
+		int flags);
+
 
 #if defined(__APPLE__)
 #include <sys/xattr.h>